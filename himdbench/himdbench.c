@@ -0,0 +1,1135 @@
+/*
+ *   himdbench.c - generate synthetic HiMD images and benchmark libhimd on them
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+
+#define BLOCKSIZE 16384
+#define MAX_BLOCKS 0x10000
+
+#define MP3_FRAME_SIZE 417	/* MPEG-1 layer III, 128 kbps, 44.1 kHz */
+#define MP3_FRAMES_PER_BLOCK (HIMD_AUDIO_SIZE / MP3_FRAME_SIZE)
+
+void usage(char * cmdname)
+{
+  printf("Usage: %s <command>, where <command> is either of:\n\n\
+          generate <DIR> [options]  - write a synthetic HiMD image to DIR\n\
+              --tracks N       number of tracks (default 100)\n\
+              --blocks N       blocks per track (default 32)\n\
+              --fragments N    fragments per track (default 1)\n\
+              --gap N          free blocks after each fragment (default 0)\n\
+              --codecs LIST    comma separated list of lpcm, at3, at3p and\n\
+                               mp3, assigned to the tracks in turn\n\
+                               (default lpcm,at3,at3p,mp3)\n\
+              --pattern P      fragment placement: contiguous, interleaved\n\
+                               or random (default contiguous)\n\
+              --seed N         seed for keys, audio data and placement\n\
+          run <DIR> [options]       - benchmark libhimd on the image in DIR\n\
+              --repeat N       iterations of the index benchmarks (default 20)\n\
+              --import N       blocks written by the MP3 import benchmark\n\
+                               (default 64, 0 disables it)\n\
+          seek <DIR> [options]      - generate an image with interleaved\n\
+                                      tracks in DIR and compare the seek\n\
+                                      distance of play order and schedule\n\
+                                      order; takes the generate options,\n\
+                                      with 4 fragments per track and the\n\
+                                      interleaved pattern as defaults\n\
+          allocs <DIR>              - check that reading the tracks of the\n\
+                                      image in DIR from arena streams does\n\
+                                      not allocate (glibc only)\n\n\
+run, seek and allocs print one JSON object per line and benchmark.\n", cmdname);
+}
+
+/* ---- image generator ---- */
+
+enum bench_codec { BENCH_LPCM, BENCH_AT3, BENCH_AT3P, BENCH_MP3 };
+
+static const char * const codecnames[] = {"lpcm", "at3", "at3p", "mp3"};
+
+enum bench_pattern { PATTERN_CONTIGUOUS, PATTERN_INTERLEAVED, PATTERN_RANDOM };
+
+struct genparams {
+    unsigned int tracks;
+    unsigned int blocks;
+    unsigned int fragments;
+    unsigned int gap;
+    enum bench_codec codecs[16];
+    unsigned int codeccount;
+    enum bench_pattern pattern;
+    guint32 seed;
+};
+
+/* one fragment of a generated track */
+struct genfrag {
+    unsigned int track;
+    unsigned int idx;		/* position in the fragment chain of the track */
+    unsigned int firstblock;
+    unsigned int blocks;
+};
+
+static void put_be16(unsigned char * p, unsigned int val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static void put_be32(unsigned char * p, unsigned int val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void random_bytes(GRand * rand, unsigned char * p, size_t len)
+{
+    size_t i;
+    for(i = 0; i + 4 <= len; i += 4)
+        put_be32(p + i, g_rand_int(rand));
+    for(; i < len; i++)
+        p[i] = g_rand_int(rand);
+}
+
+static void set_codec(struct sony_codecinfo * ci, enum bench_codec codec)
+{
+    memset(ci, 0, sizeof *ci);
+    switch(codec)
+    {
+        case BENCH_LPCM:
+            ci->codec_id = CODEC_LPCM;
+            break;
+        case BENCH_AT3:
+            /* 132 kbps, 44.1 kHz */
+            ci->codec_id = CODEC_ATRAC3;
+            ci->codecinfo[1] = 1 << 5;
+            ci->codecinfo[2] = 384 / 8;
+            break;
+        case BENCH_AT3P:
+            /* 256 kbps, 44.1 kHz */
+            ci->codec_id = CODEC_ATRAC3PLUS_OR_MPEG;
+            ci->codecinfo[1] = 1 << 5;
+            ci->codecinfo[2] = 1488 / 8 - 1;
+            break;
+        case BENCH_MP3:
+            /* MPEG-1 layer III, 128 kbps, 44.1 kHz, as writemp3 stores it */
+            ci->codec_id = CODEC_ATRAC3PLUS_OR_MPEG;
+            ci->codecinfo[0] = 3;
+            ci->codecinfo[2] = 0x80;
+            ci->codecinfo[3] = (3 << 6) | (1 << 4) | 9;
+            break;
+    }
+}
+
+static unsigned int frames_per_block(const struct sony_codecinfo * ci)
+{
+    if(sony_codecinfo_is_mpeg(ci))
+        return MP3_FRAMES_PER_BLOCK;
+    if(sony_codecinfo_is_lpcm(ci))
+        return HIMD_AUDIO_SIZE / SONY_VIRTUAL_LPCM_FRAMESIZE;
+    return 0x3FBF / sony_codecinfo_bytesperframe(ci);
+}
+
+static int parse_codecs(struct genparams * p, const char * list)
+{
+    gchar ** names = g_strsplit(list, ",", -1);
+    int i, c, ok = 1;
+
+    p->codeccount = 0;
+    for(i = 0; names[i] && ok; i++)
+    {
+        for(c = 0; c < (int)G_N_ELEMENTS(codecnames); c++)
+            if(g_ascii_strcasecmp(names[i], codecnames[c]) == 0)
+                break;
+        if(c == (int)G_N_ELEMENTS(codecnames) || p->codeccount == G_N_ELEMENTS(p->codecs))
+            ok = 0;
+        else
+            p->codecs[p->codeccount++] = c;
+    }
+    g_strfreev(names);
+    return ok && p->codeccount > 0;
+}
+
+/* Places the fragments of all tracks in ATDATA according to the pattern.
+   Returns the number of blocks ATDATA needs. */
+static unsigned int place_fragments(const struct genparams * p, struct genfrag * frags, GRand * rand)
+{
+    unsigned int count = p->tracks * p->fragments;
+    unsigned int i, block;
+
+    for(i = 0; i < count; i++)
+    {
+        struct genfrag * f = &frags[i];
+        if(p->pattern == PATTERN_CONTIGUOUS)
+        {
+            f->track = i / p->fragments;
+            f->idx = i % p->fragments;
+        }
+        else
+        {
+            f->track = i % p->tracks;
+            f->idx = i / p->tracks;
+        }
+        /* the first fragments of a track take the remaining blocks */
+        f->blocks = p->blocks / p->fragments + (f->idx < p->blocks % p->fragments);
+    }
+
+    if(p->pattern == PATTERN_RANDOM)
+        for(i = count - 1; i > 0; i--)
+        {
+            unsigned int j = g_rand_int_range(rand, 0, i + 1);
+            struct genfrag tmp = frags[i];
+            frags[i] = frags[j];
+            frags[j] = tmp;
+        }
+
+    for(i = 0, block = 0; i < count; i++)
+    {
+        frags[i].firstblock = block;
+        block += frags[i].blocks + p->gap;
+    }
+    return block;
+}
+
+static void add_string(unsigned char * tif, unsigned int idx, int type, const char * text)
+{
+    unsigned char * chunk = tif + 0x40000 + 0x10 * idx;
+    chunk[0] = HIMD_ENCODING_LATIN1;
+    memcpy(chunk + 1, text, MIN(strlen(text), 13));
+    put_be16(chunk + 14, type << 12);
+}
+
+/* Builds the track index. Tracks, fragments and strings are allocated
+   from slot 1 upwards, the remaining slots are chained into the free
+   lists. */
+static unsigned char * build_tif(const struct genparams * p, const struct genfrag * frags, GRand * rand)
+{
+    unsigned char * tif = g_malloc0(HIMD_TIFFILE_SIZE);
+    unsigned int * fragslot = g_new(unsigned int, p->tracks * p->fragments);
+    unsigned int count = p->tracks * p->fragments;
+    unsigned int i, t;
+    char text[16];
+
+    memcpy(tif, "TIF ", 4);
+    put_be16(tif + 0x100, p->tracks);
+
+    /* fragment slots are numbered in physical order, chained per track */
+    for(i = 0; i < count; i++)
+        fragslot[frags[i].track * p->fragments + frags[i].idx] = i + 1;
+
+    for(t = 0; t < p->tracks; t++)
+    {
+        unsigned char * trk = tif + 0x8000 + 0x50 * (t + 1);
+        struct sony_codecinfo ci;
+        unsigned int fpb;
+
+        set_codec(&ci, p->codecs[t % p->codeccount]);
+        fpb = frames_per_block(&ci);
+
+        put_be16(tif + 0x102 + 2 * t, t + 1);
+
+        if(!sony_codecinfo_is_mpeg(&ci))
+        {
+            put_be32(trk + 4, 0x00010012);
+            random_bytes(rand, trk + 16, 8);
+        }
+        put_be16(trk + 8, 3 * t + 1);
+        put_be16(trk + 10, 3 * t + 2);
+        put_be16(trk + 12, 3 * t + 3);
+        trk[14] = t % 99 + 1;
+        trk[32] = ci.codec_id;
+        memcpy(trk + 33, ci.codecinfo, 3);
+        memcpy(trk + 44, ci.codecinfo + 3, 2);
+        put_be16(trk + 36, fragslot[t * p->fragments]);
+        put_be16(trk + 38, t + 1);
+        put_be16(trk + 40, sony_codecinfo_seconds(&ci, p->blocks * fpb));
+        trk[42] = 0x10;
+        trk[43] = 1;
+        trk[48] = 2;
+        trk[49] = 3;
+        random_bytes(rand, trk + 52, 16);
+        trk[76] = 1;
+        trk[78] = 0x40;
+
+        g_snprintf(text, sizeof text, "Track %04u", t + 1);
+        add_string(tif, 3 * t + 1, STRING_TYPE_TITLE, text);
+        g_snprintf(text, sizeof text, "Artist %03u", t % 1000);
+        add_string(tif, 3 * t + 2, STRING_TYPE_ARTIST, text);
+        g_snprintf(text, sizeof text, "Album %03u", (t / 10) % 1000);
+        add_string(tif, 3 * t + 3, STRING_TYPE_ALBUM, text);
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        const struct genfrag * f = &frags[i];
+        unsigned char * frag = tif + 0x30000 + 0x10 * (i + 1);
+        struct sony_codecinfo ci;
+        unsigned int next = 0;
+
+        set_codec(&ci, p->codecs[f->track % p->codeccount]);
+        if(f->idx + 1 < p->fragments)
+            next = fragslot[f->track * p->fragments + f->idx + 1];
+
+        if(!sony_codecinfo_is_mpeg(&ci))
+            random_bytes(rand, frag, 8);
+        put_be16(frag + 8, f->firstblock);
+        put_be16(frag + 10, f->firstblock + f->blocks - 1);
+        frag[12] = 0;
+        /* inclusive for ATRAC and LPCM, exclusive for MPEG */
+        frag[13] = sony_codecinfo_is_mpeg(&ci) ? MP3_FRAMES_PER_BLOCK : frames_per_block(&ci) - 1;
+        put_be16(frag + 14, next);
+    }
+
+    /* free lists, headed by slot 0 */
+    put_be16(tif + 0x8000 + 38, p->tracks + 1);
+    for(i = p->tracks + 1; i < HIMD_LAST_TRACK; i++)
+        put_be16(tif + 0x8000 + 0x50 * i + 38, i + 1);
+    put_be16(tif + 0x30000 + 14, count + 1);
+    for(i = count + 1; i < HIMD_LAST_FRAGMENT; i++)
+        put_be16(tif + 0x30000 + 0x10 * i + 14, i + 1);
+    put_be16(tif + 0x40000 + 14, 3 * p->tracks + 1);
+    for(i = 3 * p->tracks + 1; i < HIMD_LAST_STRING; i++)
+        put_be16(tif + 0x40000 + 0x10 * i + 14, i + 1);
+
+    g_free(fragslot);
+    return tif;
+}
+
+static int write_file(const char * dir, const char * name, const void * data, gsize len)
+{
+    GError * error = NULL;
+    char * path = g_build_filename(dir, name, NULL);
+    int ret = 0;
+
+    if(!g_file_set_contents(path, data, len, &error))
+    {
+        fprintf(stderr, "Can't write %s: %s\n", path, error->message);
+        g_error_free(error);
+        ret = -1;
+    }
+    g_free(path);
+    return ret;
+}
+
+/* Creates ATDATA01.HMA as a sparse file of the given size */
+static int create_atdata(const char * dir, unsigned int blocks)
+{
+    char * path = g_build_filename(dir, "ATDATA01.HMA", NULL);
+    FILE * f = g_fopen(path, "wb");
+    int ret = 0;
+
+    if(!f || fseek(f, (long)blocks * BLOCKSIZE - 1, SEEK_SET) < 0 ||
+       fputc(0, f) == EOF || fclose(f) != 0)
+    {
+        fprintf(stderr, "Can't create %s: %s\n", path, g_strerror(errno));
+        ret = -1;
+    }
+    g_free(path);
+    return ret;
+}
+
+static void fill_mp3_block(unsigned char * block, const mp3key key, GRand * rand)
+{
+    unsigned int i, len = MP3_FRAMES_PER_BLOCK * MP3_FRAME_SIZE;
+    unsigned char * audio = block + 0x20;
+
+    memcpy(block, "SMPA", 4);
+    put_be16(block + 4, MP3_FRAMES_PER_BLOCK);
+    put_be16(block + 6, 3);
+    put_be16(block + 8, len);
+    random_bytes(rand, audio, len);
+    for(i = 0; i < MP3_FRAMES_PER_BLOCK; i++)
+    {
+        unsigned char * frame = audio + i * MP3_FRAME_SIZE;
+        frame[0] = 0xFF;
+        frame[1] = 0xFB;
+        frame[2] = 0x90;
+        frame[3] = 0x00;
+    }
+    for(i = 0; i < (len & ~7U); i++)
+        audio[i] ^= key[i & 3];
+}
+
+static void fill_nonmp3_block(unsigned char * block, const struct sony_codecinfo * ci, GRand * rand)
+{
+    if(sony_codecinfo_is_lpcm(ci))
+        memcpy(block, "LPCM", 4);
+    else if(sony_codecinfo_is_at3(ci))
+        memcpy(block, "A3D ", 4);
+    else
+        memcpy(block, "ATX ", 4);
+    put_be16(block + 4, frames_per_block(ci));
+    put_be16(block + 6, 3);
+    /* the audio data is noise, so it might as well be encrypted */
+    random_bytes(rand, block + 16, 16 + HIMD_AUDIO_SIZE);
+}
+
+/* Sets the serial number and the trailer the way himd_writestream_write
+   does, so the blocks pass himd_verify. */
+static void finish_block(unsigned char * block, unsigned int serial, const unsigned char * contentid)
+{
+    put_be32(block + 12, serial);
+    memcpy(block + 16368, block, 4);
+    memcpy(block + 16374, block + 6, 2);
+    memcpy(block + 16376, contentid + 16, 4);
+    put_be32(block + 16380, serial);
+}
+
+/* blocks of the track before its fragment idx, see place_fragments */
+static unsigned int blocks_before(const struct genparams * p, unsigned int idx)
+{
+    return idx * (p->blocks / p->fragments) + MIN(idx, p->blocks % p->fragments);
+}
+
+/* Writes the audio blocks of all fragments. The image is opened with
+   libhimd for this, so the MP3 keys are derived the same way the reader
+   will derive them. */
+static int write_audio(const char * root, const struct genparams * p,
+                       const struct genfrag * frags, GRand * rand)
+{
+    struct himd h;
+    struct himderrinfo status;
+    unsigned char block[BLOCKSIZE];
+    unsigned int i, b, count = p->tracks * p->fragments;
+    FILE * atdata;
+    int ret = 0;
+
+    if(himd_open(&h, root, &status) < 0)
+    {
+        fprintf(stderr, "Can't open generated image: %s\n", status.statusmsg);
+        return -1;
+    }
+    atdata = himd_open_file(&h, "ATDATA", HIMD_READ_WRITE);
+    if(!atdata)
+    {
+        fprintf(stderr, "Can't open ATDATA: %s\n", g_strerror(errno));
+        himd_close(&h);
+        return -1;
+    }
+
+    for(i = 0; i < count && ret == 0; i++)
+    {
+        const struct genfrag * f = &frags[i];
+        struct sony_codecinfo ci;
+        struct trackinfo t;
+        unsigned int serial = blocks_before(p, f->idx);
+        mp3key key;
+
+        set_codec(&ci, p->codecs[f->track % p->codeccount]);
+        if(himd_get_track_info(&h, f->track + 1, &t, &status) < 0)
+        {
+            fprintf(stderr, "Can't read generated track: %s\n", status.statusmsg);
+            ret = -1;
+            break;
+        }
+        if(sony_codecinfo_is_mpeg(&ci) &&
+           himd_obtain_mp3key(&h, f->track + 1, &key, &status) < 0)
+        {
+            fprintf(stderr, "Can't obtain MP3 key: %s\n", status.statusmsg);
+            ret = -1;
+            break;
+        }
+
+        if(fseek(atdata, (long)f->firstblock * BLOCKSIZE, SEEK_SET) < 0)
+            ret = -1;
+        for(b = 0; b < f->blocks && ret == 0; b++)
+        {
+            memset(block, 0, sizeof block);
+            if(sony_codecinfo_is_mpeg(&ci))
+                fill_mp3_block(block, key, rand);
+            else
+                fill_nonmp3_block(block, &ci, rand);
+            finish_block(block, serial + b, t.contentid);
+            if(fwrite(block, BLOCKSIZE, 1, atdata) != 1)
+                ret = -1;
+        }
+        if(ret < 0)
+            fprintf(stderr, "Can't write audio block: %s\n", g_strerror(errno));
+    }
+
+    if(fclose(atdata) != 0 && ret == 0)
+    {
+        fprintf(stderr, "Can't write audio block: %s\n", g_strerror(errno));
+        ret = -1;
+    }
+    himd_close(&h);
+    return ret;
+}
+
+static int parse_uint(const char * arg, unsigned int * out)
+{
+    char * end;
+    unsigned long val = strtoul(arg, &end, 0);
+    if(*arg == '\0' || *end != '\0')
+        return 0;
+    *out = val;
+    return 1;
+}
+
+static const struct genparams default_params = {
+    100, 32, 1, 0, {BENCH_LPCM, BENCH_AT3, BENCH_AT3P, BENCH_MP3}, 4, PATTERN_CONTIGUOUS, 1
+};
+
+/* parses the generate options, argv[0] is the first option */
+static int parse_genparams(struct genparams * p, int argc, char ** argv)
+{
+    int i;
+
+    for(i = 0; i + 1 < argc; i += 2)
+    {
+        int ok;
+        if(strcmp(argv[i], "--tracks") == 0)
+            ok = parse_uint(argv[i+1], &p->tracks);
+        else if(strcmp(argv[i], "--blocks") == 0)
+            ok = parse_uint(argv[i+1], &p->blocks);
+        else if(strcmp(argv[i], "--fragments") == 0)
+            ok = parse_uint(argv[i+1], &p->fragments);
+        else if(strcmp(argv[i], "--gap") == 0)
+            ok = parse_uint(argv[i+1], &p->gap);
+        else if(strcmp(argv[i], "--seed") == 0)
+            ok = parse_uint(argv[i+1], &p->seed);
+        else if(strcmp(argv[i], "--codecs") == 0)
+            ok = parse_codecs(p, argv[i+1]);
+        else if(strcmp(argv[i], "--pattern") == 0)
+        {
+            ok = 1;
+            if(strcmp(argv[i+1], "contiguous") == 0)
+                p->pattern = PATTERN_CONTIGUOUS;
+            else if(strcmp(argv[i+1], "interleaved") == 0)
+                p->pattern = PATTERN_INTERLEAVED;
+            else if(strcmp(argv[i+1], "random") == 0)
+                p->pattern = PATTERN_RANDOM;
+            else
+                ok = 0;
+        }
+        else
+            ok = 0;
+        if(!ok)
+        {
+            fprintf(stderr, "Invalid option %s %s\n", argv[i], argv[i+1]);
+            return -1;
+        }
+    }
+    if(i < argc)
+    {
+        fprintf(stderr, "Option %s needs a value\n", argv[i]);
+        return -1;
+    }
+
+    /* three single chunk strings per track */
+    if(p->tracks < 1 || p->tracks > HIMD_LAST_TRACK - 1 ||
+       3 * p->tracks > HIMD_LAST_STRING - 1)
+    {
+        fprintf(stderr, "Track count must be between 1 and %d\n", (HIMD_LAST_STRING - 1) / 3);
+        return -1;
+    }
+    if(p->fragments < 1 || p->blocks < p->fragments)
+    {
+        fprintf(stderr, "Each track needs at least one block per fragment\n");
+        return -1;
+    }
+    if(p->tracks * p->fragments > HIMD_LAST_FRAGMENT - 1)
+    {
+        fprintf(stderr, "%u fragments don't fit into the track index, the maximum is %d\n",
+                p->tracks * p->fragments, HIMD_LAST_FRAGMENT - 1);
+        return -1;
+    }
+    if((guint64)p->tracks * (p->blocks + p->fragments * p->gap) >= MAX_BLOCKS)
+    {
+        fprintf(stderr, "The image would need more than %d blocks\n", MAX_BLOCKS - 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int generate_image(const char * root, const struct genparams * p)
+{
+    struct genfrag * frags;
+    unsigned char * tif;
+    unsigned char mclist[0x8000];
+    unsigned int atblocks;
+    char * dir;
+    GRand * rand;
+    int ret = 0;
+
+    dir = g_build_filename(root, "HMDHIFI", NULL);
+    if(g_mkdir_with_parents(dir, 0755) < 0)
+    {
+        fprintf(stderr, "Can't create %s: %s\n", dir, g_strerror(errno));
+        g_free(dir);
+        return -1;
+    }
+
+    rand = g_rand_new_with_seed(p->seed);
+    frags = g_new(struct genfrag, p->tracks * p->fragments);
+    atblocks = place_fragments(p, frags, rand);
+    tif = build_tif(p, frags, rand);
+
+    memset(mclist, 0, sizeof mclist);
+    memcpy(mclist, "MLST", 4);
+    random_bytes(rand, mclist + 0x40, 16);
+
+    if(write_file(dir, "TRKIDX01.HMA", tif, HIMD_TIFFILE_SIZE) < 0 ||
+       write_file(dir, "_RKIDX01.HMA", tif, HIMD_TIFFILE_SIZE) < 0 ||
+       write_file(dir, "MCLIST01.HMA", mclist, sizeof mclist) < 0 ||
+       create_atdata(dir, atblocks) < 0 ||
+       write_audio(root, p, frags, rand) < 0)
+        ret = -1;
+    else
+        printf("Wrote %u tracks in %u fragments, %u of %u blocks used\n",
+               p->tracks, p->tracks * p->fragments, p->tracks * p->blocks, atblocks);
+
+    g_free(tif);
+    g_free(frags);
+    g_rand_free(rand);
+    g_free(dir);
+    return ret;
+}
+
+static int bench_generate(int argc, char ** argv)
+{
+    struct genparams p = default_params;
+
+    if(parse_genparams(&p, argc - 1, argv + 1) < 0 || generate_image(argv[0], &p) < 0)
+        return 1;
+    return 0;
+}
+
+/* ---- benchmarks ---- */
+
+struct benchresult {
+    const char * name;
+    unsigned int iterations;
+    gint64 usec;
+    guint64 bytes;
+    const char * error;
+};
+
+static void print_result(const struct benchresult * r)
+{
+    printf("{\"bench\":\"%s\",\"iterations\":%u,\"usec\":%" G_GINT64_FORMAT
+           ",\"usec_per_iteration\":%.3f,\"bytes\":%" G_GUINT64_FORMAT,
+           r->name, r->iterations, r->usec,
+           r->iterations ? (double)r->usec / r->iterations : 0.0, r->bytes);
+    if(r->usec > 0 && r->bytes > 0)
+        printf(",\"mb_per_s\":%.3f", r->bytes / (double)r->usec);
+    if(r->error)
+    {
+        /* libhimd messages contain neither quotes nor backslashes */
+        printf(",\"error\":\"%s\"", r->error);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* opens the image and reads the track count, like a disc monitor would */
+static void bench_open(const char * root, enum himd_rw_mode mode, unsigned int repeat, struct benchresult * r)
+{
+    static struct himderrinfo status;
+    struct himd h;
+    gint64 start = g_get_monotonic_time();
+
+    for(r->iterations = 0; r->iterations < repeat; r->iterations++)
+    {
+        if(himd_open_mode(&h, root, mode, &status) < 0)
+        {
+            r->error = status.statusmsg;
+            break;
+        }
+        himd_track_count(&h);
+        himd_close(&h);
+    }
+    r->usec = g_get_monotonic_time() - start;
+}
+
+static void bench_strings(struct himd * h, unsigned int repeat, struct benchresult * r)
+{
+    struct himderrinfo status;
+    gint64 start = g_get_monotonic_time();
+    int i;
+
+    for(r->iterations = 0; r->iterations < repeat; r->iterations++)
+        for(i = HIMD_FIRST_STRING; i <= HIMD_LAST_STRING; i++)
+        {
+            char * str = himd_get_string_utf8(h, i, NULL, &status);
+            if(str)
+            {
+                r->bytes += strlen(str);
+                himd_free(str);
+            }
+        }
+    r->usec = g_get_monotonic_time() - start;
+}
+
+static void bench_holes(struct himd * h, unsigned int repeat, struct benchresult * r)
+{
+    static struct himderrinfo status;
+    struct himd_holelist holes;
+    gint64 start = g_get_monotonic_time();
+
+    for(r->iterations = 0; r->iterations < repeat; r->iterations++)
+        if(himd_find_holes(h, &holes, &status) < 0)
+        {
+            r->error = status.statusmsg;
+            break;
+        }
+    r->usec = g_get_monotonic_time() - start;
+}
+
+enum readmode { READ_BLOCKS, READ_MP3, READ_NONMP3 };
+
+/* Reads all tracks of the given kind, one iteration per track */
+static void bench_read(struct himd * h, enum readmode mode, struct benchresult * r)
+{
+    static struct himderrinfo status;
+    unsigned char block[BLOCKSIZE];
+    unsigned int i, count = himd_track_count(h);
+    gint64 start = g_get_monotonic_time();
+
+    for(i = 0; i < count && !r->error; i++)
+    {
+        struct trackinfo t;
+        const unsigned char * data;
+        unsigned int len;
+        unsigned int trk = himd_get_trackslot(h, i, &status);
+        int is_mpeg;
+
+        if(trk == 0 || himd_get_track_info(h, trk, &t, &status) < 0)
+        {
+            r->error = status.statusmsg;
+            break;
+        }
+        is_mpeg = sony_codecinfo_is_mpeg(&t.codec_info);
+        if((mode == READ_MP3 && !is_mpeg) || (mode == READ_NONMP3 && is_mpeg))
+            continue;
+
+        if(mode == READ_BLOCKS)
+        {
+            struct himd_blockstream s;
+            if(himd_blockstream_open(h, t.firstfrag, himd_trackinfo_framesperblock(&t), &s, &status) < 0)
+                r->error = status.statusmsg;
+            else
+            {
+                while(himd_blockstream_read(&s, block, NULL, NULL, NULL, &status) >= 0)
+                    r->bytes += BLOCKSIZE;
+                himd_blockstream_close(&s);
+            }
+        }
+        else if(mode == READ_MP3)
+        {
+            struct himd_mp3stream s;
+            if(himd_mp3stream_open(h, trk, &s, &status) < 0)
+                r->error = status.statusmsg;
+            else
+            {
+                while(himd_mp3stream_read_block(&s, &data, &len, NULL, &status) >= 0)
+                    r->bytes += len;
+                himd_mp3stream_close(&s);
+            }
+        }
+        else
+        {
+            struct himd_nonmp3stream s;
+            if(himd_nonmp3stream_open(h, trk, &s, &status) < 0)
+                r->error = status.statusmsg;
+            else
+            {
+                while(himd_nonmp3stream_read_block(&s, &data, &len, NULL, &status) >= 0)
+                    r->bytes += len;
+                himd_nonmp3stream_close(&s);
+            }
+        }
+        if(!r->error && status.status != HIMD_STATUS_AUDIO_EOF)
+            r->error = status.statusmsg;
+        r->iterations++;
+    }
+    r->usec = g_get_monotonic_time() - start;
+}
+
+/* Writes an MP3 track of the given length into the first hole the way
+   himdcli writemp3 does, repeat times. The track index in memory is reset
+   after each import and the original index is written back at the end, so
+   the image stays usable for further runs. */
+static void bench_import(struct himd * h, unsigned int blocks, unsigned int repeat, struct benchresult * r)
+{
+    static struct himderrinfo status;
+    unsigned char * orig_tif = g_malloc(HIMD_TIFFILE_SIZE);
+    struct blockinfo * block = g_new0(struct blockinfo, 1);
+    GRand * rand = g_rand_new_with_seed(0);
+    char title_text[] = "Imported";
+    gint64 elapsed = 0;
+    unsigned int b;
+
+    memcpy(orig_tif, h->tifdata, HIMD_TIFFILE_SIZE);
+
+    for(r->iterations = 0; r->iterations < repeat && !r->error; r->iterations++)
+    {
+        struct himd_writestream ws;
+        struct fraginfo frag;
+        struct trackinfo t;
+        unsigned int first, last;
+        mp3key key;
+        gint64 start = g_get_monotonic_time();
+        int title;
+
+        if(himd_obtain_mp3key(h, himd_get_free_trackindex(h), &key, &status) < 0 ||
+           himd_writestream_open(h, &ws, &first, &last, &status) < 0)
+        {
+            r->error = status.statusmsg;
+            break;
+        }
+        if(last - first + 1 < blocks)
+        {
+            r->error = "First hole is too small for the imported track";
+            himd_writestream_close(&ws);
+            break;
+        }
+        for(b = 0; b < blocks && !r->error; b++)
+        {
+            unsigned char raw[BLOCKSIZE];
+            fill_mp3_block(raw, key, rand);
+            memcpy(&block->type, "SMPA", 4);
+            block->nframes = MP3_FRAMES_PER_BLOCK;
+            block->mcode = 3;
+            block->lendata = MP3_FRAMES_PER_BLOCK * MP3_FRAME_SIZE;
+            block->serial_number = b;
+            memcpy(block->audio_data, raw + 0x20, HIMD_AUDIO_SIZE);
+            if(himd_writestream_write(&ws, block, &status) < 0)
+                r->error = "Can't write audio block";
+        }
+        himd_writestream_close(&ws);
+
+        memset(&frag, 0, sizeof frag);
+        frag.firstblock = first;
+        frag.lastblock = first + blocks - 1;
+        frag.lastframe = MP3_FRAMES_PER_BLOCK;
+
+        memset(&t, 0, sizeof t);
+        set_codec(&t.codec_info, BENCH_MP3);
+        t.firstfrag = himd_add_fragment_info(h, &frag, &status);
+        title = himd_add_string(h, title_text, STRING_TYPE_TITLE, &status);
+        t.title = title > 0 ? title : 0;
+        t.seconds = sony_codecinfo_seconds(&t.codec_info, blocks * MP3_FRAMES_PER_BLOCK);
+        t.trackinalbum = 1;
+        t.lt = 0x10;
+        t.dest = 1;
+        t.xcc = 1;
+        t.cc = 0x40;
+        if(himd_add_track_info(h, &t, &status) < 0 ||
+           himd_write_tifdata(h, &status) < 0)
+            r->error = status.statusmsg;
+
+        elapsed += g_get_monotonic_time() - start;
+        r->bytes += (guint64)blocks * BLOCKSIZE;
+        memcpy(h->tifdata, orig_tif, HIMD_TIFFILE_SIZE);
+    }
+    r->usec = elapsed;
+
+    if(r->iterations > 0 && himd_write_tifdata(h, &status) < 0 && !r->error)
+        r->error = status.statusmsg;
+
+    g_rand_free(rand);
+    g_free(block);
+    g_free(orig_tif);
+}
+
+static int bench_run(int argc, char ** argv)
+{
+    const char * root = argv[0];
+    unsigned int repeat = 20, importblocks = 64;
+    struct benchresult r;
+    struct himd h;
+    struct himderrinfo status;
+    int i;
+
+    for(i = 1; i + 1 < argc; i += 2)
+    {
+        int ok;
+        if(strcmp(argv[i], "--repeat") == 0)
+            ok = parse_uint(argv[i+1], &repeat);
+        else if(strcmp(argv[i], "--import") == 0)
+            ok = parse_uint(argv[i+1], &importblocks);
+        else
+            ok = 0;
+        if(!ok)
+        {
+            fprintf(stderr, "Invalid option %s %s\n", argv[i], argv[i+1]);
+            return 1;
+        }
+    }
+    if(i < argc)
+    {
+        fprintf(stderr, "Option %s needs a value\n", argv[i]);
+        return 1;
+    }
+
+    if(himd_open(&h, root, &status) < 0)
+    {
+        puts(status.statusmsg);
+        return 1;
+    }
+
+#define RUN(benchname, call) \
+    do { memset(&r, 0, sizeof r); r.name = benchname; call; print_result(&r); } while(0)
+
+    RUN("open", bench_open(root, HIMD_READ_WRITE, repeat, &r));
+    RUN("open_readonly", bench_open(root, HIMD_READ_ONLY, repeat, &r));
+    RUN("strings", bench_strings(&h, repeat, &r));
+    RUN("holes", bench_holes(&h, repeat, &r));
+    RUN("blockstream", bench_read(&h, READ_BLOCKS, &r));
+    RUN("mp3", bench_read(&h, READ_MP3, &r));
+    RUN("des", bench_read(&h, READ_NONMP3, &r));
+    if(importblocks > 0)
+        RUN("import", bench_import(&h, importblocks, repeat, &r));
+
+#undef RUN
+
+    himd_close(&h);
+    return 0;
+}
+
+/* ---- allocation check ---- */
+
+/* With glibc, malloc and friends are interposed to count the calls made
+   while the counter is enabled. This catches glib and libgcrypt as well,
+   as they allocate through malloc. */
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNTER 1
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+
+static int count_allocs;
+static unsigned long allocs;
+
+void * malloc(size_t size)
+{
+    if(count_allocs)
+        allocs++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    if(count_allocs)
+        allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    if(count_allocs)
+        allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+    if(count_allocs)
+        allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void ** ptr, size_t alignment, size_t size)
+{
+    if(count_allocs)
+        allocs++;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+/* counts the allocations of the expression */
+#define COUNT_ALLOCS(total, expr) \
+    do { unsigned long before_ = allocs; count_allocs = 1; expr; count_allocs = 0; \
+         (total) += allocs - before_; } while(0)
+#endif
+
+#ifdef HAVE_ALLOC_COUNTER
+/* Opens every track of the image into one reused arena as raw block
+   stream and as MP3 or non-MP3 stream and reads it, counting the heap
+   allocations of the reads. Opening may allocate the cipher handles of
+   libgcrypt, reading a block must not allocate at all. */
+static int bench_allocs(int argc, char ** argv)
+{
+    static struct himderrinfo status;
+    static unsigned char arenabuf[HIMD_STREAM_ARENA_SIZE];
+    unsigned char block[BLOCKSIZE];
+    unsigned long openallocs = 0, readallocs = 0, blocks = 0;
+    struct himd_arena arena;
+    struct himd h;
+    const char * error = NULL;
+    unsigned int i, count;
+
+    if(argc > 1)
+    {
+        fprintf(stderr, "allocs takes no options\n");
+        return 1;
+    }
+    if(himd_open(&h, argv[0], &status) < 0)
+    {
+        puts(status.statusmsg);
+        return 1;
+    }
+    himd_arena_init(&arena, arenabuf, sizeof arenabuf);
+
+    count = himd_track_count(&h);
+    for(i = 0; i < count && !error; i++)
+    {
+        struct trackinfo t;
+        struct himd_blockstream bs;
+        const unsigned char * data;
+        unsigned int len;
+        unsigned int trk = himd_get_trackslot(&h, i, &status);
+        int res;
+
+        if(trk == 0 || himd_get_track_info(&h, trk, &t, &status) < 0)
+        {
+            error = status.statusmsg;
+            break;
+        }
+
+        himd_arena_reset(&arena);
+        COUNT_ALLOCS(openallocs, res = himd_blockstream_open_arena(&h, t.firstfrag,
+                         himd_trackinfo_framesperblock(&t), &bs, &arena, &status));
+        if(res < 0)
+        {
+            error = status.statusmsg;
+            break;
+        }
+        for(;;)
+        {
+            COUNT_ALLOCS(readallocs, res = himd_blockstream_read(&bs, block, NULL, NULL, NULL, &status));
+            if(res < 0)
+                break;
+            blocks++;
+        }
+        himd_blockstream_close(&bs);
+        if(status.status != HIMD_STATUS_AUDIO_EOF)
+        {
+            error = status.statusmsg;
+            break;
+        }
+
+        himd_arena_reset(&arena);
+        if(sony_codecinfo_is_mpeg(&t.codec_info))
+        {
+            struct himd_mp3stream ms;
+            COUNT_ALLOCS(openallocs, res = himd_mp3stream_open_arena(&h, trk, &ms, &arena, &status));
+            if(res < 0)
+            {
+                error = status.statusmsg;
+                break;
+            }
+            for(;;)
+            {
+                COUNT_ALLOCS(readallocs, res = himd_mp3stream_read_block(&ms, &data, &len, NULL, &status));
+                if(res < 0)
+                    break;
+                blocks++;
+            }
+            himd_mp3stream_close(&ms);
+        }
+        else
+        {
+            struct himd_nonmp3stream ns;
+            COUNT_ALLOCS(openallocs, res = himd_nonmp3stream_open_arena(&h, trk, &ns, &arena, &status));
+            if(res < 0)
+            {
+                error = status.statusmsg;
+                break;
+            }
+            for(;;)
+            {
+                COUNT_ALLOCS(readallocs, res = himd_nonmp3stream_read_block(&ns, &data, &len, NULL, &status));
+                if(res < 0)
+                    break;
+                blocks++;
+            }
+            himd_nonmp3stream_close(&ns);
+        }
+        if(status.status != HIMD_STATUS_AUDIO_EOF)
+            error = status.statusmsg;
+    }
+
+    printf("{\"bench\":\"allocs\",\"tracks\":%u,\"blocks\":%lu,"
+           "\"open_allocs\":%lu,\"read_allocs\":%lu", count, blocks, openallocs, readallocs);
+    if(error)
+        printf(",\"error\":\"%s\"", error);
+    else if(readallocs > 0)
+        printf(",\"error\":\"reading blocks allocated memory\"");
+    printf("}\n");
+
+    himd_close(&h);
+    return error || readallocs > 0 ? 1 : 0;
+}
+#endif
+
+/* Generates an image whose tracks take turns on disc and compares the
+   seeking needed to read all of them in play order with the order
+   himd_schedule reads them in. */
+static int bench_seek(int argc, char ** argv)
+{
+    struct genparams p = default_params;
+    struct himd h;
+    struct himderrinfo status;
+    struct himd_schedule * sched;
+    unsigned int * slots;
+    unsigned int i, count;
+
+    p.fragments = 4;
+    p.pattern = PATTERN_INTERLEAVED;
+    if(parse_genparams(&p, argc - 1, argv + 1) < 0 || generate_image(argv[0], &p) < 0)
+        return 1;
+
+    if(himd_open(&h, argv[0], &status) < 0)
+    {
+        puts(status.statusmsg);
+        return 1;
+    }
+    count = himd_track_count(&h);
+    slots = g_new(unsigned int, count);
+    for(i = 0; i < count; i++)
+        slots[i] = himd_get_trackslot(&h, i, NULL);
+
+    sched = himd_schedule_new(&h, slots, count, &status);
+    g_free(slots);
+    if(!sched)
+    {
+        printf("{\"bench\":\"seek\",\"error\":\"%s\"}\n", status.statusmsg);
+        himd_close(&h);
+        return 1;
+    }
+    printf("{\"bench\":\"seek\",\"tracks\":%u,\"fragments\":%u,"
+           "\"play_order_blocks\":%lu,\"schedule_order_blocks\":%lu}\n",
+           count, count * p.fragments, himd_schedule_seek_distance(sched, 0),
+           himd_schedule_seek_distance(sched, 1));
+
+    himd_schedule_free(sched);
+    himd_close(&h);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc >= 3 && strcmp(argv[1], "generate") == 0)
+        return bench_generate(argc - 2, argv + 2);
+    if(argc >= 3 && strcmp(argv[1], "run") == 0)
+        return bench_run(argc - 2, argv + 2);
+    if(argc >= 3 && strcmp(argv[1], "seek") == 0)
+        return bench_seek(argc - 2, argv + 2);
+#ifdef HAVE_ALLOC_COUNTER
+    if(argc >= 3 && strcmp(argv[1], "allocs") == 0)
+        return bench_allocs(argc - 2, argv + 2);
+#endif
+
+    usage(argv[0]);
+    return argc == 2 && strcmp(argv[1], "help") == 0 ? 0 : 1;
+}
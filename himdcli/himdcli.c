@@ -2,11 +2,19 @@
  *   himdcli.c - list contents (tracks, holes), dump tracks and show diskid of a HiMD 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <glib.h>
 #include <locale.h>
 #include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
 #include <mad.h>
 #include <id3tag.h>
 #include <glib/gstdio.h>
@@ -16,20 +24,80 @@
 
 void usage(char * cmdname)
 {
-  printf("Usage: %s <HiMD path> <command>, where <command> is either of:\n\n\
+  printf("Usage: %s [--stats] <HiMD path> <command>, where <command> is either of:\n\n\
           strings          - dumps all strings found in the tracklist file\n\
           tracks           - lists all tracks on disc\n\
           tracks verbose   - lists details of all tracks on disc\n\
           discid           - reads the disc id of the inserted medium\n\
           holes            - lists all holes on disc\n\
           mp3key <TRK>     - show the MP3 encryption key for track <TRK>\n\
-          dumptrack <TRK>  - dump track <TRK>\n\
-          dumpmp3 <TRK>    - dump MP3 track <TRK>\n\
-          dumpnonmp3 <TRK> - dump non-MP3 track <TRK>\n\
-          writemp3 <FILE>  - write mp3 to disc\n", cmdname);
+          dumptrack <TRK> [FILE]  - dump track <TRK>\n\
+          dumpmp3 <TRK> [FILE]    - dump MP3 track <TRK>\n\
+          dumpnonmp3 <TRK> [FILE] - dump non-MP3 track <TRK>\n\
+                             (FILE defaults to stream.*, - is stdout)\n\
+          dumpflac <TRK> [FILE]   - encode LPCM track <TRK> as FLAC\n\
+                             (FILE defaults to stream.flac)\n\
+          writemp3 <FILE>  - write mp3 to disc\n\
+          seekplan [TRK..] - compare seek distance of play order and\n\
+                             physical order extraction\n\
+          exportdisc <NAME> - export the whole disc as one file NAME.wav\n\
+                             or NAME.oma, with a cue sheet NAME.cue\n\
+          exportflac <DIR> - encode all LPCM tracks as FLAC files in DIR\n\
+          decode <DIR> [wav|pcm|flac] [THREADS]\n\
+                           - decode all LPCM and ATRAC tracks to DIR\n\
+          snapshot <FILE>  - save track index, MCLIST and the used audio\n\
+                             blocks into the sparse archive FILE\n\
+          restore <FILE>   - write a snapshot back, HiMD path may be empty\n\
+          sync <DIR>       - extract the tracks not yet extracted to DIR\n\
+          verify [THREADS] - check the headers of all audio blocks and\n\
+                             show the damaged blocks of each track\n\
+          fsck [repair]    - check the track index, repair rebuilds the\n\
+                             free lists\n\
+          batch [write] [FILE] - run the commands in FILE or on stdin, one\n\
+                             per line, and print a JSON result for each;\n\
+                             write allows writemp3 and fsck repair\n\n\
+--stats prints read statistics of the dumped track to stderr.\n", cmdname);
+}
+
+/* set by --stats */
+static int show_stats = 0;
+
+static void print_stats(int trknum, const struct himd_blockstream * stream, gint64 starttime)
+{
+    struct himd_stream_stats st;
+    double seconds = (g_get_monotonic_time() - starttime) / 1e6;
+    unsigned long maxcount = 0;
+    int i;
+
+    if(himd_stream_get_stats(stream, &st) < 0)
+        return;
+
+    fprintf(stderr, "Track %d: %lu blocks, %llu bytes in %.3f s", trknum, st.blocks, st.bytes, seconds);
+    if(seconds > 0)
+        fprintf(stderr, " (%.1f MB/s)", st.bytes / seconds / (1024*1024));
+    fprintf(stderr, "\n  %lu seeks, read %.1f ms, decrypt %.1f ms, frame split %.1f ms\n",
+            st.seeks, st.read_usec / 1e3, st.decrypt_usec / 1e3, st.split_usec / 1e3);
+
+    for(i = 0; i < HIMD_STATS_LATENCY_BUCKETS; i++)
+        if(st.read_latency[i] > maxcount)
+            maxcount = st.read_latency[i];
+    if(maxcount == 0)
+        return;
+    fputs("  block read latency:\n", stderr);
+    for(i = 0; i < HIMD_STATS_LATENCY_BUCKETS; i++)
+    {
+        if(!st.read_latency[i])
+            continue;
+        if(i == HIMD_STATS_LATENCY_BUCKETS - 1)
+            fprintf(stderr, "    >=%6lu us %6lu ", 1UL << (i - 1), st.read_latency[i]);
+        else
+            fprintf(stderr, "    < %6lu us %6lu ", 1UL << i, st.read_latency[i]);
+        fprintf(stderr, "%.*s\n", (int)(st.read_latency[i] * 40 / maxcount + 1),
+                "#########################################");
+    }
 }
 
-static const char * hexdump(unsigned char * input, int len)
+static const char * hexdump(const unsigned char * input, int len)
 {
     static char dumpspace[5][41];
     static int dumpindex = 0;
@@ -44,87 +112,66 @@ static const char * hexdump(unsigned char * input, int len)
     return dumpspace[dumpindex++];
 }
 
-char * get_locale_str(struct himd * himd, int idx)
+static char * get_locale_str(const char * str)
 {
-    char * str, * outstr;
-    if(idx == 0)
-        return NULL;
-
-    str = himd_get_string_utf8(himd, idx, NULL, NULL);
     if(!str)
         return NULL;
-
-    outstr = g_locale_from_utf8(str,-1,NULL,NULL,NULL);
-    himd_free(str);
-    return outstr;
+    return g_locale_from_utf8(str,-1,NULL,NULL,NULL);
 }
 
 void himd_trackdump(struct himd * himd, int verbose)
 {
-    int i;
+    unsigned int i, f;
     struct himderrinfo status;
-    for(i = HIMD_FIRST_TRACK;i <= HIMD_LAST_TRACK;i++)
+    struct himd_catalog * cat;
+
+    if(!(cat = himd_catalog_load(himd, &status)))
     {
-        struct trackinfo t;
-        if(himd_get_track_info(himd, i, &t, NULL)  >= 0)
-        {
-            char *title, *artist, *album;
-            title = get_locale_str(himd, t.title);
-            artist = get_locale_str(himd, t.artist);
-            album = get_locale_str(himd, t.album);
-            printf("%4d: %d:%02d %s %s:%s (%s %d)%s\n",
-                    i, t.seconds/60, t.seconds % 60, himd_get_codec_name(&t),
-                    artist ? artist : "Unknown artist", 
-                    title ? title : "Unknown title",
-                    album ? album : "Unknown album", t.trackinalbum,
-                    himd_track_uploadable(himd, &t) ? " [uploadable]":"");
-            g_free(title);
-            g_free(artist);
-            g_free(album);
-            if(verbose)
-            {
-                char rtime[30],stime[30],etime[30];
-                struct fraginfo f;
-                int fnum = t.firstfrag;
-                int blocks;
-
-                if((blocks = himd_track_blocks(himd, &t, &status)) < 0)
-                    fprintf(stderr, "Can't get block count for Track %d: %s\n", i, status.statusmsg);
-                else
-                    printf("     %5d Blocks of 16 KB each,  %dkbps\n",
-                                blocks, sony_codecinfo_kbps(&t.codec_info));
-
-                while(fnum != 0)
-                {
-                    if(himd_get_fragment_info(himd, fnum, &f, &status) >= 0)
-                    {
-                        printf("     %3d@%05d .. %3d@%05d (%s)\n", f.firstframe, f.firstblock, f.lastframe, f.lastblock, hexdump(f.key, 8));
-                        fnum = f.nextfrag;
-                    }
-                    else
-                    {
-                        printf("     ERROR reading fragment %d info: %s\n", fnum, status.statusmsg);
-                        break;
-                    }
-                }
-                printf("     Content ID: %s\n", hexdump(t.contentid, 20));
-                printf("     Key: %s (EKB %08x); MAC: %s\n", hexdump(t.key, 8), t.ekbnum, hexdump(t.mac, 8));
-                if(t.recordingtime.tm_mon != -1)
-                    strftime(rtime,sizeof rtime, "%x %X", &t.recordingtime);
-                else
-                    strcpy(rtime, "?");
-                if(t.licensestarttime.tm_mon != -1)
-                    strftime(stime,sizeof stime, "%x %X", &t.licensestarttime);
-                else
-                    strcpy(stime, "any time");
-                if(t.licenseendtime.tm_mon != -1)
-                    strftime(etime,sizeof etime, "%x %X", &t.licenseendtime);
-                else
-                    strcpy(etime, "any time");
-                printf("     Recorded: %s, licensed: %s-%s\n", rtime, stime, etime);
-            }
+        fprintf(stderr, "Can't read track list: %s\n", status.statusmsg);
+        return;
+    }
+    for(i = 0;i < cat->trackcount;i++)
+    {
+        const struct trackinfo * t = &cat->info[i];
+        char *title, *artist, *album;
+        title = get_locale_str(cat->title[i]);
+        artist = get_locale_str(cat->artist[i]);
+        album = get_locale_str(cat->album[i]);
+        printf("%4d: %d:%02d %s %s:%s (%s %d)%s\n",
+                cat->slot[i], cat->seconds[i]/60, cat->seconds[i] % 60, cat->codecname[i],
+                artist ? artist : "Unknown artist", 
+                title ? title : "Unknown title",
+                album ? album : "Unknown album", t->trackinalbum,
+                cat->uploadable[i] ? " [uploadable]":"");
+        g_free(title);
+        g_free(artist);
+        g_free(album);
+        if(verbose)
+        {
+            char rtime[30],stime[30],etime[30];
+
+            printf("     %5d Blocks of 16 KB each,  %dkbps\n", cat->blocks[i], cat->kbps[i]);
+            for(f = cat->firstfrag[i]; f < cat->firstfrag[i] + cat->nfrags[i]; f++)
+                printf("     %3d@%05d .. %3d@%05d (%s)\n", cat->frag_firstframe[f], cat->frag_firstblock[f],
+                       cat->frag_lastframe[f], cat->frag_lastblock[f], hexdump(cat->frag_key[f], 8));
+            printf("     Content ID: %s\n", hexdump(t->contentid, 20));
+            printf("     Key: %s (EKB %08x); MAC: %s\n", hexdump(t->key, 8), t->ekbnum, hexdump(t->mac, 8));
+            if(t->recordingtime.tm_mon != -1)
+                strftime(rtime,sizeof rtime, "%x %X", &t->recordingtime);
+            else
+                strcpy(rtime, "?");
+            if(t->licensestarttime.tm_mon != -1)
+                strftime(stime,sizeof stime, "%x %X", &t->licensestarttime);
+            else
+                strcpy(stime, "any time");
+            if(t->licenseendtime.tm_mon != -1)
+                strftime(etime,sizeof etime, "%x %X", &t->licenseendtime);
+            else
+                strcpy(etime, "any time");
+            printf("     Recorded: %s, licensed: %s-%s\n", rtime, stime, etime);
         }
     }
+    himd_catalog_free(cat);
 }
 
 void himd_stringdump(struct himd * himd)
@@ -167,169 +214,1484 @@ void himd_dumpdiscid(struct himd * h)
         fprintf(stderr,"Error obtaining disc ID: %s", status.statusmsg);
         return;
     }
-    printf("Disc ID: ");
-    for(i = 0;i < 16;++i)
-        printf("%02X",discid[i]);
-    puts("");        
+    printf("Disc ID: ");
+    for(i = 0;i < 16;++i)
+        printf("%02X",discid[i]);
+    puts("");        
+}
+
+/* Output of the dump commands. Writes go through a large stdio buffer
+   instead of hitting the file once per block. When dumping unmodified
+   blocks into a pipe on Linux, the blocks are read into a ring of page
+   aligned buffers and handed to the pipe with vmsplice, so they are never
+   copied in user space. */
+#define DUMP_BUFFER_SIZE (1024*1024)
+
+struct dumpout {
+    FILE * f;
+    const char * name;
+    char * buffer;
+#ifdef __linux__
+    int pipefd;                 /* -1 unless vmsplice is used */
+    int pipesize;               /* 0 unless the output is a pipe */
+    unsigned char * ring;
+    unsigned int ringblocks, ringpos;
+#endif
+};
+
+static int dumpout_open(struct dumpout * out, const char * path, const char * defaultname)
+{
+#ifdef __linux__
+    struct stat st;
+    int pipesize;
+#endif
+
+    memset(out, 0, sizeof *out);
+    if(!path)
+        path = defaultname;
+
+    if(strcmp(path, "-") == 0)
+    {
+        /* stdio keeps using the buffer of stdout until exit */
+        static char stdoutbuffer[DUMP_BUFFER_SIZE];
+        out->f = stdout;
+        out->name = "stdout";
+        setvbuf(stdout, stdoutbuffer, _IOFBF, DUMP_BUFFER_SIZE);
+    }
+    else
+    {
+        out->f = fopen(path, "wb");
+        out->name = path;
+        if(!out->f)
+        {
+            fprintf(stderr, "opening ");
+            perror(path);
+            return -1;
+        }
+        out->buffer = g_malloc(DUMP_BUFFER_SIZE);
+        setvbuf(out->f, out->buffer, _IOFBF, DUMP_BUFFER_SIZE);
+    }
+
+#ifdef __linux__
+    out->pipefd = -1;
+    if(fstat(fileno(out->f), &st) == 0 && S_ISFIFO(st.st_mode) &&
+       (pipesize = fcntl(fileno(out->f), F_GETPIPE_SZ)) > 0)
+        out->pipesize = pipesize;
+#endif
+    return 0;
+}
+
+/* Where to put the next block of raw data. If the output is a pipe, this
+   is a slot of the vmsplice ring, otherwise it is fallback. */
+static unsigned char * dumpout_block_buffer(struct dumpout * out, unsigned char * fallback)
+{
+#ifdef __linux__
+    if(!out->ring && out->pipesize > 0)
+    {
+        /* A slot is only reused after more than a pipe full of data has
+           been spliced behind it, so the reader is done with its pages. */
+        out->ringblocks = out->pipesize / HIMD_BLOCKINFO_SIZE + 2;
+        if(posix_memalign((void**)&out->ring, sysconf(_SC_PAGESIZE),
+                          (size_t)out->ringblocks * HIMD_BLOCKINFO_SIZE) != 0)
+        {
+            out->ring = NULL;
+            out->pipesize = 0;
+        }
+        else
+        {
+            fflush(out->f);
+            out->pipefd = fileno(out->f);
+        }
+    }
+    if(out->pipefd >= 0)
+    {
+        unsigned char * slot = out->ring + (size_t)out->ringpos * HIMD_BLOCKINFO_SIZE;
+        out->ringpos = (out->ringpos + 1) % out->ringblocks;
+        return slot;
+    }
+#endif
+    return fallback;
+}
+
+static int dumpout_write(struct dumpout * out, const unsigned char * data, size_t len)
+{
+#ifdef __linux__
+    if(out->pipefd >= 0 && data >= out->ring &&
+       data < out->ring + (size_t)out->ringblocks * HIMD_BLOCKINFO_SIZE)
+    {
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = len;
+        while(iov.iov_len > 0)
+        {
+            ssize_t done = vmsplice(out->pipefd, &iov, 1, 0);
+            if(done < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EINVAL || errno == ENOSYS)
+                {
+                    /* no vmsplice for this pipe, plain writes from here on */
+                    out->pipefd = -1;
+                    break;
+                }
+                perror(out->name);
+                return -1;
+            }
+            iov.iov_base = (char*)iov.iov_base + done;
+            iov.iov_len -= done;
+        }
+        if(iov.iov_len == 0)
+            return 0;
+        data = iov.iov_base;
+        len = iov.iov_len;
+    }
+#endif
+    if(fwrite(data, len, 1, out->f) != 1)
+    {
+        perror(out->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int dumpout_close(struct dumpout * out)
+{
+    int res = 0;
+    if(out->f == stdout)
+    {
+        if(fflush(stdout) != 0)
+            res = -1;
+    }
+    else if(fclose(out->f) != 0)
+        res = -1;
+    if(res < 0)
+        perror(out->name);
+#ifdef __linux__
+    free(out->ring);
+#endif
+    g_free(out->buffer);
+    return res;
+}
+
+void himd_dumptrack(struct himd * himd, int trknum, const char * path)
+{
+    gint64 starttime = g_get_monotonic_time();
+    struct trackinfo t;
+    struct himd_blockstream str;
+    struct himderrinfo status;
+    struct dumpout out;
+    FILE * info;
+    unsigned int firstframe, lastframe;
+    unsigned char blockbuf[16384], * block;
+    unsigned char fragkey[8];
+    int blocknum = 0;
+
+    if(himd_get_track_info(himd, trknum, &t, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return;
+    }
+    if(himd_blockstream_open(himd, t.firstfrag, himd_trackinfo_framesperblock(&t), &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening stream %d: %s\n", t.firstfrag, status.statusmsg);
+        return;
+    }
+    if(dumpout_open(&out, path, "stream.dmp") < 0)
+    {
+        himd_blockstream_close(&str);
+        return;
+    }
+    if(show_stats)
+        himd_stream_enable_stats(&str);
+    /* keep the block list out of the dumped data */
+    info = out.f == stdout ? stderr : stdout;
+
+    while(block = dumpout_block_buffer(&out, blockbuf),
+          himd_blockstream_read(&str, block, &firstframe, &lastframe, fragkey, &status) >= 0)
+    {
+        if(dumpout_write(&out, block, 16384) < 0)
+            goto clean;
+        fprintf(info, "%d: %u..%u %s\n",
+                blocknum++,firstframe,lastframe,hexdump(fragkey,8));
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        fprintf(stderr,"Error reading MP3 data: %s\n", status.statusmsg);
+clean:
+    dumpout_close(&out);
+    if(show_stats)
+        print_stats(trknum, &str, starttime);
+    himd_blockstream_close(&str);
+}
+
+int himd_dumpmp3(struct himd * himd, int trknum, const char * path)
+{
+    gint64 starttime = g_get_monotonic_time();
+    struct himd_mp3stream str;
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct dumpout out;
+    unsigned int len;
+    const unsigned char * data;
+    unsigned char * tag;
+    int res = -1;
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return -1;
+    }
+    if(himd_mp3stream_open(himd, trknum, &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
+        return -1;
+    }
+    if(dumpout_open(&out, path, "stream.mp3") < 0)
+    {
+        himd_mp3stream_close(&str);
+        return -1;
+    }
+    if(show_stats)
+        himd_stream_enable_stats(&str.stream);
+    tag = himd_track_id3v2_tag(himd, &trkinfo, NULL, HIMD_ID3V2_PADDING, &len, &status);
+    if(!tag)
+        fprintf(stderr, "Not writing ID3 tag: %s\n", status.statusmsg);
+    else if(dumpout_write(&out, tag, len) < 0)
+    {
+        himd_free(tag);
+        goto clean;
+    }
+    himd_free(tag);
+    while(himd_mp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(dumpout_write(&out, data, len) < 0)
+            goto clean;
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        fprintf(stderr,"Error reading MP3 data: %s\n", status.statusmsg);
+    else
+        res = 0;
+clean:
+    if(dumpout_close(&out) < 0)
+        res = -1;
+    if(show_stats)
+        print_stats(trknum, &str.stream, starttime);
+    himd_mp3stream_close(&str);
+    return res;
+}
+
+
+int write_oma_header(FILE * f, const struct trackinfo * trkinfo)
+{
+    char header[EA3_FORMAT_HEADER_SIZE];
+    make_ea3_format_header(header, &trkinfo->codec_info);
+
+    if(fwrite(header, sizeof header, 1, f) != 1)
+    {
+        perror("Writing OMA header");
+        return -1;
+    }
+    return 0;
+}
+
+/* For LPCM: creates headerless PCM
+             play with: play -t s2 -r 44100 -B -c2 stream.pcm
+   For ATRAC3/ATRAC3+: creates a .oma file (with ea3 tag header)
+             play with Sonic Stage (ffmpeg needs support of tagless files,
+                                    ffmpeg does not support ATRAC3+)
+ */
+int himd_dumpnonmp3(struct himd * himd, int trknum, const char * path)
+{
+    gint64 starttime = g_get_monotonic_time();
+    struct himd_nonmp3stream str;
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct dumpout out;
+    const char * filename = "stream.pcm";
+    unsigned int len;
+    const unsigned char * data;
+    int res = -1;
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return -1;
+    }
+
+    if(!sony_codecinfo_is_lpcm(&trkinfo.codec_info))
+        filename = "stream.oma";
+
+    if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
+        return -1;
+    }
+    if(dumpout_open(&out, path, filename) < 0)
+    {
+        himd_nonmp3stream_close(&str);
+        return -1;
+    }
+    if(show_stats)
+        himd_stream_enable_stats(&str.stream);
+    if(!sony_codecinfo_is_lpcm(&trkinfo.codec_info) &&
+       write_oma_header(out.f, &trkinfo) < 0)
+        goto clean;
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(dumpout_write(&out, data, len) < 0)
+            goto clean;
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        fprintf(stderr,"Error reading PCM data: %s\n", status.statusmsg);
+    else
+        res = 0;
+clean:
+    if(dumpout_close(&out) < 0)
+        res = -1;
+    if(show_stats)
+        print_stats(trknum, &str.stream, starttime);
+    himd_nonmp3stream_close(&str);
+    return res;
+}
+
+int himd_dumpflac(struct himd * himd, int trknum, const char * path)
+{
+    gint64 starttime = g_get_monotonic_time();
+    struct himd_nonmp3stream str;
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct himd_flacsink * sink;
+    unsigned int len;
+    const unsigned char * data;
+    int res = -1;
+
+    if(!path)
+        path = "stream.flac";
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return -1;
+    }
+    if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
+        return -1;
+    }
+    sink = himd_flacsink_open(himd, &trkinfo, path, &status);
+    if(!sink)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", path, status.statusmsg);
+        himd_nonmp3stream_close(&str);
+        return -1;
+    }
+    if(show_stats)
+        himd_stream_enable_stats(&str.stream);
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+        if(himd_flacsink_write(sink, data, len, &status) < 0)
+            break;
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        fprintf(stderr, "Error dumping track %d: %s\n", trknum, status.statusmsg);
+    else
+        res = 0;
+    if(himd_flacsink_close(sink, &status) < 0)
+    {
+        if(res == 0)
+            fprintf(stderr, "Error writing %s: %s\n", path, status.statusmsg);
+        res = -1;
+    }
+    if(res < 0)
+        g_unlink(path);
+    if(show_stats)
+        print_stats(trknum, &str.stream, starttime);
+    himd_nonmp3stream_close(&str);
+    return res;
+}
+
+int himd_snapshot(struct himd * h, const char * path)
+{
+    struct himd_snapshot_info info;
+    struct himderrinfo status;
+
+    if(himd_snapshot_write(h, path, &info, &status) < 0)
+    {
+        fprintf(stderr, "Snapshot: %s\n", status.statusmsg);
+        return -1;
+    }
+    printf("Saved %u blocks in %u extents, %u of them as holes\n",
+           info.blocks, info.extents, info.skipped);
+    return 0;
+}
+
+int himd_restore(const char * himdroot, const char * path)
+{
+    struct himd_snapshot_info info;
+    struct himderrinfo status;
+
+    if(himd_snapshot_restore(path, himdroot, &info, &status) < 0)
+    {
+        fprintf(stderr, "Restore: %s\n", status.statusmsg);
+        return -1;
+    }
+    printf("Restored %u blocks in %u extents, %u of them as holes\n",
+           info.blocks, info.extents, info.skipped);
+    return 0;
+}
+
+/* sync keeps a manifest for each disc in the target directory. Every
+   extracted track has a group named after a hash of its content id,
+   codec, key and fragment list, recording the content id and the file it
+   went to. Tracks whose hash is listed and whose file still exists are
+   not read again. The content id alone is not unique, transfers of one
+   source in several formats share it. */
+#define SYNC_MANIFEST_PREFIX ".himdsync-"
+
+static char * sync_layout_hash(struct himd * himd, const struct trackinfo * t, struct himderrinfo * status)
+{
+    GChecksum * sum = g_checksum_new(G_CHECKSUM_SHA1);
+    struct fraginfo f;
+    int fnum;
+    char * hash;
+
+    g_checksum_update(sum, t->contentid, sizeof t->contentid);
+    g_checksum_update(sum, &t->codec_info.codec_id, 1);
+    g_checksum_update(sum, t->codec_info.codecinfo, sizeof t->codec_info.codecinfo);
+    g_checksum_update(sum, t->key, sizeof t->key);
+    for(fnum = t->firstfrag; fnum != 0; fnum = f.nextfrag)
+    {
+        char range[48];
+        if(himd_get_fragment_info(himd, fnum, &f, status) < 0)
+        {
+            g_checksum_free(sum);
+            return NULL;
+        }
+        g_snprintf(range, sizeof range, "%u@%u-%u@%u;", f.firstframe, f.firstblock,
+                   f.lastframe, f.lastblock);
+        g_checksum_update(sum, (const guchar *)range, strlen(range));
+        g_checksum_update(sum, f.key, sizeof f.key);
+    }
+    hash = g_strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    return hash;
+}
+
+/* "NN Artist - Title.ext" in UTF-8, ext matching the dump commands
+   unless given */
+static char * sync_filename(struct himd * himd, unsigned int pos, const struct trackinfo * t,
+                            const char * ext)
+{
+    char * title = himd_get_string_utf8(himd, t->title, NULL, NULL);
+    char * artist = himd_get_string_utf8(himd, t->artist, NULL, NULL);
+    char * name;
+
+    if(!ext && sony_codecinfo_is_mpeg(&t->codec_info))
+        ext = "mp3";
+    else if(!ext && sony_codecinfo_is_lpcm(&t->codec_info))
+        ext = "pcm";
+    else if(!ext)
+        ext = "oma";
+    name = g_strdup_printf("%02u %s - %s.%s", pos, artist ? artist : "Unknown artist",
+                           title ? title : "Unknown title", ext);
+    g_strdelimit(name, "/\\", '_');
+    himd_free(title);
+    himd_free(artist);
+    return name;
+}
+
+static int sync_lists_file(GKeyFile * manifest, const char * file)
+{
+    gchar ** groups = g_key_file_get_groups(manifest, NULL);
+    int i, found = 0;
+
+    for(i = 0; groups[i] && !found; i++)
+    {
+        char * other = g_key_file_get_string(manifest, groups[i], "file", NULL);
+        found = other && strcmp(other, file) == 0;
+        g_free(other);
+    }
+    g_strfreev(groups);
+    return found;
+}
+
+/* Another track may already own the name, e.g. an untitled track
+   inserted in front of an unchanged one. Takes file, returns a name
+   neither manifest lists, with " (2)", " (3)"... before the extension. */
+static char * sync_unique_filename(GKeyFile * manifest, GKeyFile * old, char * file)
+{
+    const char * ext = strrchr(file, '.');
+    int stemlen = ext ? (int)(ext - file) : (int)strlen(file);
+    char * name = file;
+    int i;
+
+    for(i = 2; sync_lists_file(manifest, name) || sync_lists_file(old, name); i++)
+    {
+        if(name != file)
+            g_free(name);
+        name = g_strdup_printf("%.*s (%d)%s", stemlen, file, i, ext ? ext : "");
+    }
+    if(name != file)
+        g_free(file);
+    return name;
+}
+
+/* Entries of old are written too, as long as a sync is in progress, so
+   an interrupted sync doesn't forget the tracks it hasn't reached yet. */
+/* copies the groups of from that are not in to */
+static void sync_merge(GKeyFile * to, GKeyFile * from)
+{
+    gchar ** groups = g_key_file_get_groups(from, NULL);
+    unsigned int i, j;
+
+    for(i = 0; groups[i]; i++)
+    {
+        gchar ** keys;
+        if(g_key_file_has_group(to, groups[i]))
+            continue;
+        keys = g_key_file_get_keys(from, groups[i], NULL, NULL);
+        for(j = 0; keys && keys[j]; j++)
+        {
+            char * value = g_key_file_get_value(from, groups[i], keys[j], NULL);
+            if(value)
+                g_key_file_set_value(to, groups[i], keys[j], value);
+            g_free(value);
+        }
+        g_strfreev(keys);
+    }
+    g_strfreev(groups);
+}
+
+/* Saves manifest and, while the sync runs, the entries of the old
+   manifest that were not visited yet. */
+static int sync_save(GKeyFile * manifest, GKeyFile * old, const char * path)
+{
+    GError * error = NULL;
+    GKeyFile * merged = NULL;
+    gsize len;
+    char * data;
+    int res = 0;
+
+    if(old)
+    {
+        merged = g_key_file_new();
+        sync_merge(merged, manifest);
+        sync_merge(merged, old);
+        manifest = merged;
+    }
+    data = g_key_file_to_data(manifest, &len, NULL);
+    if(merged)
+        g_key_file_free(merged);
+    if(!g_file_set_contents(path, data, len, &error))
+    {
+        fprintf(stderr, "Can't write %s: %s\n", path, error->message);
+        g_error_free(error);
+        res = -1;
+    }
+    g_free(data);
+    return res;
+}
+
+/* Returns -1 if the sync could not be set up or saved, or a track failed. */
+int himd_sync(struct himd * himd, const char * dir)
+{
+    struct himderrinfo status;
+    const unsigned char * discid = himd_get_discid(himd, &status);
+    GKeyFile * old, * manifest;
+    char * manifestpath, * name;
+    gchar ** groups;
+    unsigned int i, count, extracted = 0, unchanged = 0, failed = 0;
+    int saved = 0;
+
+    if(!discid)
+    {
+        fprintf(stderr, "Error obtaining disc ID: %s\n", status.statusmsg);
+        return -1;
+    }
+    if(g_mkdir_with_parents(dir, 0777) < 0)
+    {
+        fprintf(stderr, "Can't create %s: %s\n", dir, g_strerror(errno));
+        return -1;
+    }
+    name = g_strconcat(SYNC_MANIFEST_PREFIX, hexdump((unsigned char *)discid, 16), NULL);
+    manifestpath = g_build_filename(dir, name, NULL);
+    g_free(name);
+
+    /* a missing or broken manifest just means everything is new */
+    old = g_key_file_new();
+    g_key_file_load_from_file(old, manifestpath, G_KEY_FILE_NONE, NULL);
+    manifest = g_key_file_new();
+
+    count = himd_track_count(himd);
+    for(i = 0; i < count; i++)
+    {
+        struct trackinfo t;
+        unsigned int slot = himd_get_trackslot(himd, i, &status);
+        char * hash, * file, * path, * part, * oldfile;
+        int res;
+
+        if(slot == 0 || himd_get_track_info(himd, slot, &t, &status) < 0)
+        {
+            fprintf(stderr, "Track %u: %s\n", i + 1, status.statusmsg);
+            failed++;
+            continue;
+        }
+        if(!himd_track_uploadable(himd, &t))
+        {
+            printf("Track %u: not uploadable, skipped\n", i + 1);
+            continue;
+        }
+        hash = sync_layout_hash(himd, &t, &status);
+        if(!hash)
+        {
+            fprintf(stderr, "Track %u: %s\n", i + 1, status.statusmsg);
+            failed++;
+            continue;
+        }
+
+        oldfile = g_key_file_get_string(old, hash, "file", NULL);
+        if(oldfile)
+        {
+            path = g_build_filename(dir, oldfile, NULL);
+            if(g_file_test(path, G_FILE_TEST_IS_REGULAR))
+            {
+                g_key_file_set_string(manifest, hash, "contentid", hexdump(t.contentid, 20));
+                g_key_file_set_string(manifest, hash, "file", oldfile);
+                g_key_file_remove_group(old, hash, NULL);
+                unchanged++;
+                g_free(path);
+                goto next;
+            }
+            g_free(path);
+            /* the file is gone, so the name is free for this track again */
+            g_key_file_remove_group(old, hash, NULL);
+        }
+
+        file = sync_unique_filename(manifest, old, sync_filename(himd, i + 1, &t, NULL));
+        path = g_build_filename(dir, file, NULL);
+        part = g_strconcat(path, ".part", NULL);
+        printf("Track %u: %s\n", i + 1, file);
+        if(sony_codecinfo_is_mpeg(&t.codec_info))
+            res = himd_dumpmp3(himd, slot, part);
+        else
+            res = himd_dumpnonmp3(himd, slot, part);
+        if(res == 0 && g_rename(part, path) < 0)
+        {
+            fprintf(stderr, "Can't rename %s: %s\n", part, g_strerror(errno));
+            res = -1;
+        }
+        if(res == 0)
+        {
+            g_key_file_set_string(manifest, hash, "contentid", hexdump(t.contentid, 20));
+            g_key_file_set_string(manifest, hash, "file", file);
+            g_key_file_remove_group(old, hash, NULL);
+            /* saved after every track, an interrupted sync keeps its work */
+            if(sync_save(manifest, old, manifestpath) < 0)
+                saved = -1;
+            extracted++;
+        }
+        else
+        {
+            g_unlink(part);
+            failed++;
+        }
+        g_free(part);
+        g_free(path);
+        g_free(file);
+    next:
+        g_free(oldfile);
+        g_free(hash);
+    }
+
+    /* whatever is left in the old manifest is gone from the disc or has
+       changed; the file of a changed track may have been rewritten */
+    groups = g_key_file_get_groups(old, NULL);
+    for(i = 0; groups[i]; i++)
+    {
+        char * file = g_key_file_get_string(old, groups[i], "file", NULL);
+        if(file && !sync_lists_file(manifest, file))
+            printf("No longer on disc: %s\n", file);
+        g_free(file);
+    }
+    g_strfreev(groups);
+
+    if(sync_save(manifest, NULL, manifestpath) < 0)
+        saved = -1;
+    printf("%u tracks extracted, %u unchanged, %u failed\n", extracted, unchanged, failed);
+    g_key_file_free(old);
+    g_key_file_free(manifest);
+    g_free(manifestpath);
+    return failed || saved < 0 ? -1 : 0;
+}
+
+void himd_dumpholes(struct himd * h)
+{
+    int i;
+    struct himd_holelist holes;
+    struct himderrinfo status;
+    if(himd_find_holes(h, &holes, &status) < 0)
+    {
+        fprintf(stderr, "Collecting holes: %s\n", status.statusmsg);
+        return;
+    }
+    for(i = 0; i < holes.holecnt;i++)
+        printf("%d: %05u-%05u\n", i, holes.holes[i].firstblock, holes.holes[i].lastblock);
+}
+
+static void print_damage_flags(unsigned int flags)
+{
+    static const char * const names[] = {
+        "read error", "type", "serial", "mcode", "content id", "mp3 frames", "frame count" };
+    unsigned int i;
+    const char * sep = "";
+
+    for(i = 0; i < sizeof names / sizeof names[0]; i++)
+        if(flags & (1U << i))
+        {
+            printf("%s%s", sep, names[i]);
+            sep = ", ";
+        }
+}
+
+/* Prints the damaged block ranges of each track and a map with one
+   character per block. Returns -1 if damage was found. */
+int himd_verify_disc(struct himd * himd, unsigned int threads)
+{
+    struct himderrinfo status;
+    struct himd_verify_result result;
+    unsigned int i, j, k;
+
+    if(himd_verify(himd, threads, &result, &status) < 0)
+    {
+        fprintf(stderr, "Error verifying disc: %s\n", status.statusmsg);
+        return -1;
+    }
+
+    for(i = 0; i < result.trackcount; i++)
+    {
+        const struct himd_verify_track * t = &result.tracks[i];
+        unsigned int damaged = 0;
+
+        for(j = 0; j < t->blocks; j++)
+            if(t->damage[j])
+                damaged++;
+        if(!damaged)
+        {
+            printf("%4d: %u blocks ok\n", t->slot, t->blocks);
+            continue;
+        }
+        printf("%4d: %u of %u blocks damaged\n", t->slot, damaged, t->blocks);
+        for(j = 0; j < t->blocks; j = k)
+        {
+            for(k = j + 1; k < t->blocks && t->damage[k] == t->damage[j]; k++)
+                ;
+            if(!t->damage[j])
+                continue;
+            if(k - j > 1)
+                printf("      blocks %u-%u: ", j, k - 1);
+            else
+                printf("      block %u: ", j);
+            print_damage_flags(t->damage[j]);
+            putchar('\n');
+        }
+        for(j = 0; j < t->blocks; j++)
+        {
+            if(j % 64 == 0)
+                printf("      ");
+            putchar(t->damage[j] ? 'X' : '.');
+            if(j % 64 == 63 || j == t->blocks - 1)
+                putchar('\n');
+        }
+    }
+    printf("%u blocks checked, %u damaged\n", result.blocks, result.damaged);
+    i = result.damaged;
+    himd_verify_result_free(&result);
+    return i ? -1 : 0;
+}
+
+static void fsck_report(void * ctx, enum himd_fsck_table table, unsigned int idx,
+                        enum himd_fsck_problem problem, const char * message)
+{
+    (void)ctx; (void)table; (void)idx; (void)problem;
+    printf("%s\n", message);
+}
+
+/* Returns -1 if problems were found and not repaired. */
+int himd_checkdisc(struct himd * himd, int repair)
+{
+    static const char * const names[HIMD_FSCK_PROBLEM_COUNT] = {
+        "bad entries", "bad links", "loops", "cross-links", "leaked entries", "overlaps" };
+    struct himderrinfo status;
+    struct himd_fsck_result result;
+    unsigned int i, total = 0;
+
+    if(himd_fsck(himd, repair, fsck_report, NULL, &result, &status) < 0)
+    {
+        fprintf(stderr, "Error checking track index: %s\n", status.statusmsg);
+        return -1;
+    }
+    for(i = 0; i < HIMD_FSCK_PROBLEM_COUNT; i++)
+        if(result.problems[i])
+        {
+            printf("%s%u %s", total ? ", " : "", result.problems[i], names[i]);
+            total += result.problems[i];
+        }
+    if(!total)
+        puts("Track index is consistent");
+    else
+        putchar('\n');
+
+    if(repair)
+    {
+        if(!result.repaired)
+        {
+            fprintf(stderr, "Not repairing, tracks or strings in use are damaged\n");
+            return -1;
+        }
+        if(himd_write_tifdata(himd, &status) < 0)
+        {
+            fprintf(stderr, "Error writing track index: %s\n", status.statusmsg);
+            return -1;
+        }
+        puts("Free lists rebuilt");
+        return 0;
+    }
+    return total ? -1 : 0;
+}
+
+/* Tracks given on the command line are track slots, as shown by "tracks".
+   Without arguments, all tracks are planned in play order. */
+void himd_seekplan(struct himd * himd, int argc, char ** argv)
+{
+    struct himderrinfo status;
+    struct himd_schedule * sched;
+    unsigned int * tracks;
+    unsigned int count = 0;
+    unsigned long playorder, physorder;
+    unsigned int i;
+
+    if(argc > 0)
+    {
+        tracks = g_new(unsigned int, argc);
+        for(i = 0; i < (unsigned int)argc; i++)
+            tracks[count++] = atoi(argv[i]);
+    }
+    else
+    {
+        unsigned int total = himd_track_count(himd);
+        tracks = g_new(unsigned int, total);
+        for(i = 0; i < total; i++)
+            tracks[count++] = himd_get_trackslot(himd, i, NULL);
+    }
+
+    sched = himd_schedule_new(himd, tracks, count, &status);
+    g_free(tracks);
+    if(!sched)
+    {
+        fprintf(stderr, "Error planning extraction: %s\n", status.statusmsg);
+        return;
+    }
+
+    playorder = himd_schedule_seek_distance(sched, 0);
+    physorder = himd_schedule_seek_distance(sched, 1);
+    printf("%u tracks\n", count);
+    printf("play order:     %8lu blocks of seeking\n", playorder);
+    printf("physical order: %8lu blocks of seeking\n", physorder);
+    himd_schedule_free(sched);
+}
+
+/* Whole disc export: all tracks are written back to back into a single
+   file. The position of each track in the output is known from its
+   frame count up front, so the blocks can be read in physical order and
+   written at their final place, without any intermediate files. */
+struct discexport {
+    FILE * out;
+    const char * filename;
+    int is_lpcm;
+    unsigned int framesize;
+    long * trackpos;            /* next write position of each track */
+    long filepos;               /* current position of out */
+    unsigned int failed;        /* tracks that left a hole in out */
+    unsigned char swapbuf[HIMD_AUDIO_SIZE];
+};
+
+static void put_le16(unsigned char * p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char * p, unsigned long v)
+{
+    put_le16(p, v & 0xFFFF);
+    put_le16(p+2, v >> 16);
+}
+
+#define WAV_HEADER_SIZE 44
+
+static int write_wav_header(FILE * f, unsigned long datasize, unsigned long samplerate, unsigned int channels)
+{
+    unsigned char header[WAV_HEADER_SIZE];
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header+4, datasize + WAV_HEADER_SIZE - 8);
+    memcpy(header+8, "WAVEfmt ", 8);
+    put_le32(header+16, 16);            /* fmt chunk size */
+    put_le16(header+20, 1);             /* PCM */
+    put_le16(header+22, channels);
+    put_le32(header+24, samplerate);
+    put_le32(header+28, samplerate*channels*2); /* bytes per second */
+    put_le16(header+32, channels*2);    /* bytes per sample frame */
+    put_le16(header+34, 16);            /* bits per sample */
+    memcpy(header+36, "data", 4);
+    put_le32(header+40, datasize);
+
+    if(fwrite(header, sizeof header, 1, f) != 1)
+    {
+        perror("Writing WAV header");
+        return -1;
+    }
+    return 0;
+}
+
+static int export_data(void * ctx, unsigned int idx, const unsigned char * data, unsigned int len, unsigned int framecount, struct himderrinfo * status)
+{
+    struct discexport * exp = ctx;
+
+    (void)framecount; (void)status;
+
+    if(exp->filepos != exp->trackpos[idx] &&
+       fseek(exp->out, exp->trackpos[idx], SEEK_SET) < 0)
+    {
+        perror(exp->filename);
+        return 1;
+    }
+    if(exp->is_lpcm)
+    {
+        /* LPCM is stored big endian on disc, WAV wants little endian */
+        himd_swab16(exp->swapbuf, data, len / 2);
+        data = exp->swapbuf;
+    }
+    if(fwrite(data, len, 1, exp->out) != 1)
+    {
+        perror(exp->filename);
+        return 1;
+    }
+    exp->trackpos[idx] += len;
+    exp->filepos = exp->trackpos[idx];
+    return 0;
+}
+
+static void export_end(void * ctx, unsigned int idx, const struct himderrinfo * result)
+{
+    struct discexport * exp = ctx;
+
+    if(!result)
+        return;
+    if(result->status != HIMD_ERROR_ABORTED)
+        fprintf(stderr, "Error reading track %u: %s\n", idx + 1, result->statusmsg);
+    exp->failed++;
+}
+
+static void write_cue_time(FILE * cue, unsigned long long samples, unsigned long samplerate)
+{
+    /* cue sheets count in CD frames, 75 per second */
+    unsigned long cdframes = samples * 75 / samplerate;
+    fprintf(cue, "%02lu:%02lu:%02lu", cdframes / (75*60), cdframes / 75 % 60, cdframes % 75);
+}
+
+static void write_cue_string(FILE * cue, const char * key, struct himd * himd, int idx)
+{
+    char * str, * p;
+
+    if(idx == 0 || !(str = himd_get_string_utf8(himd, idx, NULL, NULL)))
+        return;
+    /* there is no way to quote a double quote in cue sheets */
+    for(p = str; *p; p++)
+        if(*p == '"')
+            *p = '\'';
+    fprintf(cue, "    %s \"%s\"\n", key, str);
+    himd_free(str);
+}
+
+int himd_exportdisc(struct himd * himd, const char * name)
+{
+    static const struct himd_extract_sink sink = { NULL, export_data, export_end };
+    struct himderrinfo status;
+    struct himd_schedule * sched = NULL;
+    struct discexport exp;
+    struct trackinfo * tracks;
+    unsigned int * slots;
+    unsigned int count, i;
+    unsigned long long samples = 0;
+    unsigned long samplerate;
+    long pos;
+    char * outname = NULL, * cuename = NULL, * basename;
+    FILE * cue = NULL;
+    int res = -1, created = 0;
+
+    count = himd_track_count(himd);
+    if(count == 0)
+    {
+        fputs("No tracks on disc\n", stderr);
+        return -1;
+    }
+
+    memset(&exp, 0, sizeof exp);
+    tracks = g_new(struct trackinfo, count);
+    slots = g_new(unsigned int, count);
+    exp.trackpos = g_new(long, count + 1);
+
+    for(i = 0; i < count; i++)
+    {
+        slots[i] = himd_get_trackslot(himd, i, NULL);
+        if(himd_get_track_info(himd, slots[i], &tracks[i], &status) < 0)
+        {
+            fprintf(stderr, "Error obtaining info of track %u: %s\n", i + 1, status.statusmsg);
+            goto clean;
+        }
+        if(memcmp(&tracks[i].codec_info, &tracks[0].codec_info, sizeof tracks[0].codec_info) != 0)
+        {
+            fprintf(stderr, "Track %u is %s %ukbps, track 1 is %s %ukbps; "
+                            "a disc can only be exported if all tracks use the same format\n",
+                    i + 1, himd_get_codec_name(&tracks[i]), sony_codecinfo_kbps(&tracks[i].codec_info),
+                    himd_get_codec_name(&tracks[0]), sony_codecinfo_kbps(&tracks[0].codec_info));
+            goto clean;
+        }
+        /* a track that can't be read would leave silence in the middle */
+        if(!himd_track_uploadable(himd, &tracks[i]))
+        {
+            fprintf(stderr, "Track %u is protected by DRM, the disc can't be exported\n", i + 1);
+            goto clean;
+        }
+    }
+
+    if(sony_codecinfo_is_mpeg(&tracks[0].codec_info))
+    {
+        fputs("MPEG discs can't be exported as a whole, use dumpmp3\n", stderr);
+        goto clean;
+    }
+
+    exp.is_lpcm = sony_codecinfo_is_lpcm(&tracks[0].codec_info);
+    exp.framesize = himd_trackinfo_framesize(&tracks[0]);
+    samplerate = sony_codecinfo_samplerate(&tracks[0].codec_info);
+
+    /* lay out the tracks back to back behind the header */
+    pos = exp.is_lpcm ? WAV_HEADER_SIZE : EA3_FORMAT_HEADER_SIZE;
+    for(i = 0; i < count; i++)
+    {
+        int frames = himd_track_frames(himd, &tracks[i], &status);
+        if(frames < 0)
+        {
+            fprintf(stderr, "Error counting frames of track %u: %s\n", i + 1, status.statusmsg);
+            goto clean;
+        }
+        exp.trackpos[i] = pos;
+        pos += (long)frames * exp.framesize;
+    }
+    exp.trackpos[count] = pos;
+
+    sched = himd_schedule_new(himd, slots, count, &status);
+    if(!sched)
+    {
+        fprintf(stderr, "Error planning extraction: %s\n", status.statusmsg);
+        goto clean;
+    }
+
+    outname = g_strconcat(name, exp.is_lpcm ? ".wav" : ".oma", NULL);
+    cuename = g_strconcat(name, ".cue", NULL);
+    exp.filename = outname;
+    exp.out = fopen(outname, "wb");
+    if(!exp.out)
+    {
+        perror(outname);
+        goto clean;
+    }
+    created = 1;
+    if(exp.is_lpcm)
+    {
+        if(write_wav_header(exp.out, pos - WAV_HEADER_SIZE, 44100, 2) < 0)
+            goto clean;
+    }
+    else if(write_oma_header(exp.out, &tracks[0]) < 0)
+        goto clean;
+    exp.filepos = ftell(exp.out);
+
+    if(himd_schedule_run(sched, &sink, &exp, &status) < 0 || exp.failed > 0)
+    {
+        fprintf(stderr, "Export aborted\n");
+        goto clean;
+    }
+    if(fclose(exp.out) != 0)
+    {
+        exp.out = NULL;
+        perror(outname);
+        goto clean;
+    }
+    exp.out = NULL;
+
+    cue = fopen(cuename, "w");
+    if(!cue)
+    {
+        perror(cuename);
+        goto clean;
+    }
+    basename = g_path_get_basename(outname);
+    fprintf(cue, "FILE \"%s\" %s\n", basename, exp.is_lpcm ? "WAVE" : "BINARY");
+    g_free(basename);
+    for(i = 0; i < count; i++)
+    {
+        fprintf(cue, "  TRACK %02u AUDIO\n", i + 1);
+        write_cue_string(cue, "TITLE", himd, tracks[i].title);
+        write_cue_string(cue, "PERFORMER", himd, tracks[i].artist);
+        fputs("    INDEX 01 ", cue);
+        write_cue_time(cue, samples, samplerate);
+        fputs("\n", cue);
+        samples += (unsigned long long)(exp.trackpos[i+1] - exp.trackpos[i]) / exp.framesize *
+                   sony_codecinfo_samplesperframe(&tracks[i].codec_info);
+    }
+    if(fclose(cue) != 0)
+    {
+        perror(cuename);
+        g_unlink(cuename);
+    }
+    else
+        res = 0;
+
+clean:
+    /* a partial export is of no use */
+    if(exp.out)
+        fclose(exp.out);
+    if(res < 0 && created)
+        g_unlink(outname);
+    himd_schedule_free(sched);
+    g_free(outname);
+    g_free(cuename);
+    g_free(exp.trackpos);
+    g_free(slots);
+    g_free(tracks);
+    return res;
+}
+
+struct flacexport {
+    struct himd * himd;
+    const char * dir;
+    const unsigned int * pos;		/* track number in play order */
+    struct himd_flacsink ** sinks;
+    char ** paths;
+    unsigned int done, failed;
+};
+
+static int flacexport_begin(void * ctx, unsigned int idx, const struct trackinfo * track, struct himderrinfo * status)
+{
+    struct flacexport * exp = ctx;
+    char * file = sync_filename(exp->himd, exp->pos[idx], track, "flac");
+
+    exp->paths[idx] = g_build_filename(exp->dir, file, NULL);
+    printf("Track %u: %s\n", exp->pos[idx], file);
+    g_free(file);
+    exp->sinks[idx] = himd_flacsink_open(exp->himd, track, exp->paths[idx], status);
+    return exp->sinks[idx] ? 0 : -1;
+}
+
+static int flacexport_data(void * ctx, unsigned int idx, const unsigned char * data, unsigned int len, unsigned int framecount, struct himderrinfo * status)
+{
+    struct flacexport * exp = ctx;
+    (void)framecount;
+
+    return himd_flacsink_write(exp->sinks[idx], data, len, status);
+}
+
+static void flacexport_end(void * ctx, unsigned int idx, const struct himderrinfo * result)
+{
+    struct flacexport * exp = ctx;
+    struct himderrinfo status;
+    int res = result ? -1 : 0;
+
+    if(result && result->status != HIMD_ERROR_ABORTED)
+        fprintf(stderr, "Track %u: %s\n", exp->pos[idx], result->statusmsg);
+    if(exp->sinks[idx] && himd_flacsink_close(exp->sinks[idx], &status) < 0 && res == 0)
+    {
+        fprintf(stderr, "Track %u: %s\n", exp->pos[idx], status.statusmsg);
+        res = -1;
+    }
+    exp->sinks[idx] = NULL;
+    if(res < 0)
+    {
+        if(exp->paths[idx])
+            g_unlink(exp->paths[idx]);
+        exp->failed++;
+    }
+    else
+        exp->done++;
 }
 
-void himd_dumptrack(struct himd * himd, int trknum)
+void himd_exportflac(struct himd * himd, const char * dir)
 {
-    struct trackinfo t;
-    struct himd_blockstream str;
+    static const struct himd_extract_sink sink = { flacexport_begin, flacexport_data, flacexport_end };
     struct himderrinfo status;
-    FILE * strdumpf;
-    unsigned int firstframe, lastframe;
-    unsigned char block[16384];
-    unsigned char fragkey[8];
-    int blocknum = 0;
-    strdumpf = fopen("stream.dmp","wb");
-    if(!strdumpf)
+    struct himd_schedule * sched = NULL;
+    struct flacexport exp;
+    unsigned int * slots, * pos;
+    unsigned int count, i, lpcm = 0;
+
+    if(g_mkdir_with_parents(dir, 0777) < 0)
     {
-        perror("Opening stream.dmp");
+        fprintf(stderr, "Can't create %s: %s\n", dir, g_strerror(errno));
         return;
     }
-    if(himd_get_track_info(himd, trknum, &t, &status) < 0)
+
+    count = himd_track_count(himd);
+    slots = g_new(unsigned int, count);
+    pos = g_new(unsigned int, count);
+    for(i = 0; i < count; i++)
     {
-        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
-        return;
+        struct trackinfo t;
+        unsigned int slot = himd_get_trackslot(himd, i, &status);
+
+        if(slot == 0 || himd_get_track_info(himd, slot, &t, &status) < 0)
+            fprintf(stderr, "Track %u: %s\n", i + 1, status.statusmsg);
+        else if(!sony_codecinfo_is_lpcm(&t.codec_info))
+            printf("Track %u: %s, skipped\n", i + 1, himd_get_codec_name(&t));
+        else
+        {
+            slots[lpcm] = slot;
+            pos[lpcm++] = i + 1;
+        }
     }
-    if(himd_blockstream_open(himd, t.firstfrag, himd_trackinfo_framesperblock(&t), &str, &status) < 0)
+
+    memset(&exp, 0, sizeof exp);
+    if(lpcm == 0)
     {
-        fprintf(stderr, "Error opening stream %d: %s\n", t.firstfrag, status.statusmsg);
-        return;
+        fputs("No LPCM tracks on disc\n", stderr);
+        goto clean;
     }
-    while(himd_blockstream_read(&str, block, &firstframe, &lastframe, fragkey, &status) >= 0)
+    sched = himd_schedule_new(himd, slots, lpcm, &status);
+    if(!sched)
     {
-        if(fwrite(block,16384,1,strdumpf) != 1)
-        {
-            perror("writing dumped stream");
-            goto clean;
-        }
-        printf("%d: %u..%u %s\n",
-                blocknum++,firstframe,lastframe,hexdump(fragkey,8));
+        fprintf(stderr, "Error planning extraction: %s\n", status.statusmsg);
+        goto clean;
     }
-    if(status.status != HIMD_STATUS_AUDIO_EOF)
-        fprintf(stderr,"Error reading MP3 data: %s\n", status.statusmsg);
+
+    exp.himd = himd;
+    exp.dir = dir;
+    exp.pos = pos;
+    exp.sinks = g_new0(struct himd_flacsink *, lpcm);
+    exp.paths = g_new0(char *, lpcm);
+    if(himd_schedule_run(sched, &sink, &exp, &status) < 0)
+        fprintf(stderr, "Export aborted\n");
+    printf("%u tracks exported, %u failed\n", exp.done, exp.failed);
+
+    for(i = 0; i < lpcm; i++)
+        g_free(exp.paths[i]);
+    g_free(exp.paths);
+    g_free(exp.sinks);
 clean:
-    fclose(strdumpf);
-    himd_blockstream_close(&str);
+    himd_schedule_free(sched);
+    g_free(pos);
+    g_free(slots);
 }
 
-void himd_dumpmp3(struct himd * himd, int trknum)
+enum decodeformat { DECODE_WAV, DECODE_PCM, DECODE_FLAC };
+
+struct decodeout {
+    char * path;
+    FILE * f;
+    struct himd_flacsink * flac;
+    unsigned long samplerate;
+    unsigned int channels;
+    unsigned long datasize;
+    unsigned char * buf;	/* samples in the byte order of the file */
+    unsigned int bufsize;
+    char * error;		/* set instead of the status, which is private */
+};
+
+struct decodeexport {
+    struct himd * himd;
+    enum decodeformat format;
+    const unsigned int * pos;		/* track number in play order */
+    struct decodeout * out;
+    gint done, failed;
+};
+
+/* runs on the decoding threads, each track only touches its decodeout */
+static int decode_begin(void * ctx, unsigned int idx, const struct trackinfo * track, unsigned int channels, struct himderrinfo * status)
 {
-    struct himd_mp3stream str;
-    struct himderrinfo status;
-    FILE * strdumpf;
-    unsigned int len;
-    const unsigned char * data;
-    strdumpf = fopen("stream.mp3","wb");
-    if(!strdumpf)
+    struct decodeexport * exp = ctx;
+    struct decodeout * out = &exp->out[idx];
+
+    out->samplerate = sony_codecinfo_samplerate(&track->codec_info);
+    out->channels = channels;
+    if(exp->format == DECODE_FLAC)
     {
-        perror("Opening stream.mp3");
-        return;
+        /* the FLAC sink takes samples like LPCM is stored: big endian stereo */
+        if(channels != 2)
+        {
+            out->error = g_strdup_printf("FLAC output needs stereo, track has %u channels", channels);
+            return -1;
+        }
+        out->flac = himd_flacsink_open(exp->himd, track, out->path, status);
+        if(!out->flac)
+            out->error = g_strdup(status->statusmsg);
+        return out->flac ? 0 : -1;
     }
-    if(himd_mp3stream_open(himd, trknum, &str, &status) < 0)
+    out->f = fopen(out->path, "wb");
+    if(!out->f)
     {
-        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
-        return;
+        out->error = g_strdup_printf("Can't create %s: %s", out->path, g_strerror(errno));
+        return -1;
     }
-    while(himd_mp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    /* the sizes are filled in when the track is complete */
+    if(exp->format == DECODE_WAV && write_wav_header(out->f, 0, out->samplerate, channels) < 0)
     {
-        if(fwrite(data,len,1,strdumpf) != 1)
-        {
-            perror("writing dumped stream");
-            goto clean;
-        }
+        out->error = g_strdup("Can't write WAV header");
+        return -1;
     }
-    if(status.status != HIMD_STATUS_AUDIO_EOF)
-        fprintf(stderr,"Error reading MP3 data: %s\n", status.statusmsg);
-clean:
-    fclose(strdumpf);
-    himd_mp3stream_close(&str);
+    return 0;
 }
 
-
-int write_oma_header(FILE * f, const struct trackinfo * trkinfo)
+static int decode_data(void * ctx, unsigned int idx, const short * samples, unsigned int count, struct himderrinfo * status)
 {
-    char header[EA3_FORMAT_HEADER_SIZE];
-    make_ea3_format_header(header, &trkinfo->codec_info);
+    struct decodeexport * exp = ctx;
+    struct decodeout * out = &exp->out[idx];
+    int bigendian = exp->format != DECODE_WAV;
+    const unsigned char * data = (const unsigned char *)samples;
+    unsigned int len = count * 2, pos;
 
-    if(fwrite(header, sizeof header, 1, f) != 1)
+    if(bigendian != (G_BYTE_ORDER == G_BIG_ENDIAN))
     {
-        perror("Writing OMA header");
+        if(len > out->bufsize)
+        {
+            out->bufsize = len;
+            out->buf = g_realloc(out->buf, len);
+        }
+        himd_swab16(out->buf, data, count);
+        data = out->buf;
+    }
+
+    if(out->flac)
+    {
+        for(pos = 0; pos < len; pos += HIMD_AUDIO_SIZE)
+            if(himd_flacsink_write(out->flac, data + pos, MIN(len - pos, HIMD_AUDIO_SIZE), status) < 0)
+            {
+                out->error = g_strdup(status->statusmsg);
+                return -1;
+            }
+        return 0;
+    }
+    if(fwrite(data, len, 1, out->f) != 1)
+    {
+        out->error = g_strdup_printf("Can't write %s: %s", out->path, g_strerror(errno));
         return -1;
     }
+    out->datasize += len;
     return 0;
 }
 
-/* For LPCM: creates headerless PCM
-             play with: play -t s2 -r 44100 -B -c2 stream.pcm
-   For ATRAC3/ATRAC3+: creates a .oma file (with ea3 tag header)
-             play with Sonic Stage (ffmpeg needs support of tagless files,
-                                    ffmpeg does not support ATRAC3+)
- */
-void himd_dumpnonmp3(struct himd * himd, int trknum)
+static void decode_end(void * ctx, unsigned int idx, const struct himderrinfo * result)
 {
-    struct himd_nonmp3stream str;
+    struct decodeexport * exp = ctx;
+    struct decodeout * out = &exp->out[idx];
     struct himderrinfo status;
-    struct trackinfo trkinfo;
-    FILE * strdumpf;
-    const char * filename = "stream.pcm";
-    unsigned int len;
-    const unsigned char * data;
-    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    const char * error = out->error;
+
+    if(!error && result)
+        error = result->statusmsg;
+
+    if(out->flac && himd_flacsink_close(out->flac, &status) < 0 && !error)
+        error = status.statusmsg;
+    if(out->f && !error && exp->format == DECODE_WAV &&
+       (fseek(out->f, 0, SEEK_SET) < 0 ||
+        write_wav_header(out->f, out->datasize, out->samplerate, out->channels) < 0))
+        error = "Can't update WAV header";
+    if(out->f && fclose(out->f) != 0 && !error)
+        error = g_strerror(errno);
+
+    if(error)
     {
-        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
-        return;
+        if(out->error || !result || result->status != HIMD_ERROR_ABORTED)
+            fprintf(stderr, "Track %u: %s\n", exp->pos[idx], error);
+        g_unlink(out->path);
+        g_atomic_int_inc(&exp->failed);
     }
+    else
+    {
+        printf("Track %u: %s\n", exp->pos[idx], out->path);
+        g_atomic_int_inc(&exp->done);
+    }
+    g_free(out->buf);
+    g_free(out->error);
+    out->buf = NULL;
+    out->error = NULL;
+    out->f = NULL;
+    out->flac = NULL;
+}
 
-    if(!sony_codecinfo_is_lpcm(&trkinfo.codec_info))
-        filename = "stream.oma";
-
-    strdumpf = fopen(filename,"wb");
-    if(!strdumpf)
+void himd_decode(struct himd * himd, const char * dir, const char * format, unsigned int threads)
+{
+    static const struct himd_pcm_sink sink = { decode_begin, decode_data, decode_end };
+    static const char * const exts[] = { "wav", "pcm", "flac" };
+    struct himderrinfo status;
+    struct decodeexport exp;
+    unsigned int * slots, * pos;
+    unsigned int count, i, n = 0;
+
+    memset(&exp, 0, sizeof exp);
+    if(!format || strcmp(format, "wav") == 0)
+        exp.format = DECODE_WAV;
+    else if(strcmp(format, "pcm") == 0)
+        exp.format = DECODE_PCM;
+    else if(strcmp(format, "flac") == 0)
+        exp.format = DECODE_FLAC;
+    else
     {
-        fprintf(stderr, "opening ");
-        perror(filename);
+        fprintf(stderr, "Unknown format %s, use wav, pcm or flac\n", format);
         return;
     }
-    if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
+    if(g_mkdir_with_parents(dir, 0777) < 0)
     {
-        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
-        fclose(strdumpf);
+        fprintf(stderr, "Can't create %s: %s\n", dir, g_strerror(errno));
         return;
     }
-    if(!sony_codecinfo_is_lpcm(&trkinfo.codec_info) &&
-       write_oma_header(strdumpf, &trkinfo) < 0)
-        return;
-    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+
+    count = himd_track_count(himd);
+    slots = g_new(unsigned int, count);
+    pos = g_new(unsigned int, count);
+    exp.out = g_new0(struct decodeout, count);
+    for(i = 0; i < count; i++)
     {
-        if(fwrite(data,len,1,strdumpf) != 1)
+        struct trackinfo t;
+        unsigned int slot = himd_get_trackslot(himd, i, &status);
+        char * file;
+
+        if(slot == 0 || himd_get_track_info(himd, slot, &t, &status) < 0)
         {
-            perror("writing dumped stream");
-            goto clean;
+            fprintf(stderr, "Track %u: %s\n", i + 1, status.statusmsg);
+            continue;
+        }
+        if(sony_codecinfo_is_mpeg(&t.codec_info))
+        {
+            printf("Track %u: MPEG, skipped, use dumpmp3\n", i + 1);
+            continue;
         }
+        file = sync_filename(himd, i + 1, &t, exts[exp.format]);
+        exp.out[n].path = g_build_filename(dir, file, NULL);
+        g_free(file);
+        slots[n] = slot;
+        pos[n++] = i + 1;
     }
-    if(status.status != HIMD_STATUS_AUDIO_EOF)
-        fprintf(stderr,"Error reading PCM data: %s\n", status.statusmsg);
-clean:
-    fclose(strdumpf);
-    himd_nonmp3stream_close(&str);
-}
 
-void himd_dumpholes(struct himd * h)
-{
-    int i;
-    struct himd_holelist holes;
-    struct himderrinfo status;
-    if(himd_find_holes(h, &holes, &status) < 0)
+    if(n > 0)
     {
-        fprintf(stderr, "Collecting holes: %s\n", status.statusmsg);
-        return;
+        exp.himd = himd;
+        exp.pos = pos;
+        if(himd_decode_run(himd, slots, n, threads, &sink, &exp, &status) < 0)
+            fprintf(stderr, "Decoding aborted: %s\n", status.statusmsg);
+        printf("%d tracks decoded, %d failed\n", exp.done, exp.failed);
     }
-    for(i = 0; i < holes.holecnt;i++)
-        printf("%d: %05u-%05u\n", i, holes.holes[i].firstblock, holes.holes[i].lastblock);
+    else
+        fputs("No tracks to decode\n", stderr);
+
+    for(i = 0; i < n; i++)
+        g_free(exp.out[i].path);
+    g_free(exp.out);
+    g_free(pos);
+    g_free(slots);
 }
 
 #ifdef CONFIG_WITH_MAD
@@ -525,8 +1887,8 @@ gint write_blocks(struct mad_stream *stream, struct himd_writestream *write_stre
 	    // Append block to ATDATA file
 	    if(himd_writestream_write(write_stream, &bucket.block, status) < 0)
 		{
-		    fprintf(stderr, "Failed to write block: %d", iblock);
-		    perror("write block");
+		    fprintf(stderr, "Failed to write block %d: %s\n", iblock, status->statusmsg);
+		    return -1;
 		}
 
             // remember number of frames in current audio block
@@ -537,7 +1899,8 @@ gint write_blocks(struct mad_stream *stream, struct himd_writestream *write_stre
 	    // Append the frame to a new block, that not would fit in the previous full block
 	    nbytes_added = bucket_append(&bucket, pframe, framelen);
 	    if(nbytes_added < 0) {
-		exit(1);
+		fprintf(stderr, "MPEG frame of %d bytes does not fit into a block\n", framelen);
+		return -1;
 	    }
 
 	    iblock += 1;
@@ -564,7 +1927,7 @@ gint write_blocks(struct mad_stream *stream, struct himd_writestream *write_stre
     return iblock;
 }
 
-void himd_writemp3(struct himd  *h, const char *filepath)
+int himd_writemp3(struct himd  *h, const char *filepath)
 {
     struct himderrinfo status;
     gint nblocks=0, nframes=0;
@@ -577,6 +1940,8 @@ void himd_writemp3(struct himd  *h, const char *filepath)
     int i;
     unsigned char cid[20] = {0x02, 0x03, 0x00, 0x00};
     unsigned char mp3codecinfo[3];
+    GError * error = NULL;
+    int res = -1;
 
     // Generate random content ID
     for(i = 4; i <=19; i++)
@@ -587,7 +1952,13 @@ void himd_writemp3(struct himd  *h, const char *filepath)
         printf("no tags\n");
 
     // Load mp3 stream
-    mp3file   = g_mapped_file_new(filepath, FALSE, NULL);
+    mp3file   = g_mapped_file_new(filepath, FALSE, &error);
+    if(!mp3file)
+	{
+	    fprintf(stderr, "Cannot open %s: %s\n", filepath, error->message);
+	    g_error_free(error);
+	    goto out_tags;
+	}
     mp3size   = g_mapped_file_get_length(mp3file);
     mp3buffer = g_mapped_file_get_contents(mp3file);
 
@@ -603,8 +1974,8 @@ void himd_writemp3(struct himd  *h, const char *filepath)
 
     if(himd_obtain_mp3key(h, idx_track, &key, &status) < 0)
 	{
-	    printf("Cannot obtain mp3key\n");
-	    exit(1);
+	    fprintf(stderr, "Cannot obtain mp3key: %s\n", status.statusmsg);
+	    goto out;
 	}
     // END: Get track-key
 
@@ -617,13 +1988,22 @@ void himd_writemp3(struct himd  *h, const char *filepath)
 
     if(himd_writestream_open(h, &write_stream, &first_blockno, &last_blockno, &status) < 0)
 	{
-	    fprintf(stderr, "Error opening write stream\n");
-	    exit(1);
+	    fprintf(stderr, "Error opening write stream: %s\n", status.statusmsg);
+	    goto out;
 	}
 
-    write_blocks(&stream, &write_stream, key, &duration, &nblocks, &nframes, cid, mp3codecinfo, &status);
+    if(write_blocks(&stream, &write_stream, key, &duration, &nblocks, &nframes, cid, mp3codecinfo, &status) < 0)
+	{
+	    himd_writestream_close(&write_stream);
+	    goto out;
+	}
 
     himd_writestream_close(&write_stream);
+    if(nblocks == 0)
+	{
+	    fprintf(stderr, "No MPEG frames found in %s\n", filepath);
+	    goto out;
+	}
     // END: Write blocks to ATDATA
 
     //
@@ -646,6 +2026,11 @@ void himd_writemp3(struct himd  *h, const char *filepath)
     fragment.nextfrag   = 0;
 
     idx_frag  = himd_add_fragment_info(h, &fragment, &status);
+    if(idx_frag <= 0)
+	{
+	    fprintf(stderr, "No free fragment descriptor\n");
+	    goto out;
+	}
     // END: Add fragment
 
     // Add strings for title, album and artist. Retrieve string index numbers.
@@ -716,24 +2101,351 @@ void himd_writemp3(struct himd  *h, const char *filepath)
     track.cn = 0;
 
     idx_track = himd_add_track_info(h, &track, &status);
+    if(idx_track <= 0)
+	{
+	    fprintf(stderr, "No free track slot\n");
+	    goto out;
+	}
     // END: Add track descriptor
 
     //
     // Update TRACK-INDEX file with track strings, fragment descriptor and track-descriptor.
     //
-    himd_write_tifdata(h, &status);
+    if(himd_write_tifdata(h, &status) < 0)
+	{
+	    fprintf(stderr, "Error writing track index: %s\n", status.statusmsg);
+	    goto out;
+	}
+    res = 0;
+
+out:
+    mad_stream_finish(&stream);
+    g_mapped_file_unref(mp3file);
+out_tags:
     free(artist); free(album); free(title);
+    return res;
 }
 
 #endif
 
+/* runs argv[0] with its arguments, tracks if argc is 0. Returns 1 if the
+   command failed, -1 if it is unknown. Commands that report errors only
+   on stderr return 0. */
+static int run_command(struct himd * h, int argc, char ** argv)
+{
+    int idx, res = 0;
+
+    if(argc == 0 || strcmp(argv[0],"tracks") == 0)
+        himd_trackdump(h, argc > 1);
+    else if(strcmp(argv[0],"strings") == 0)
+        himd_stringdump(h);
+    else if(strcmp(argv[0],"discid") == 0)
+        himd_dumpdiscid(h);
+    else if(strcmp(argv[0],"holes") == 0)
+        himd_dumpholes(h);
+    else if(strcmp(argv[0],"mp3key") == 0 && argc > 1)
+    {
+        mp3key k;
+        idx = 1;
+        sscanf(argv[1], "%d", &idx);
+        himd_obtain_mp3key(h, idx, &k, NULL);
+        printf("Track key: %02x%02x%02x%02x\n", k[0], k[1], k[2], k[3]);
+    }
+    else if(strcmp(argv[0],"dumptrack") == 0 && argc > 1)
+    {
+        idx = 1;
+        sscanf(argv[1], "%d", &idx);
+        himd_dumptrack(h, idx, argc > 2 ? argv[2] : NULL);
+    }
+    else if(strcmp(argv[0],"dumpmp3") == 0 && argc > 1)
+    {
+        idx = 1;
+        sscanf(argv[1], "%d", &idx);
+        if(himd_dumpmp3(h, idx, argc > 2 ? argv[2] : NULL) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"dumpnonmp3") == 0 && argc > 1)
+    {
+        idx = 1;
+        sscanf(argv[1], "%d", &idx);
+        if(himd_dumpnonmp3(h, idx, argc > 2 ? argv[2] : NULL) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"dumpflac") == 0 && argc > 1)
+    {
+        idx = 1;
+        sscanf(argv[1], "%d", &idx);
+        if(himd_dumpflac(h, idx, argc > 2 ? argv[2] : NULL) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"seekplan") == 0)
+        himd_seekplan(h, argc - 1, argv + 1);
+    else if(strcmp(argv[0],"exportdisc") == 0 && argc > 1)
+    {
+        if(himd_exportdisc(h, argv[1]) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"decode") == 0 && argc > 1)
+    {
+        idx = 0;
+        if(argc > 3)
+            sscanf(argv[3], "%d", &idx);
+        himd_decode(h, argv[1], argc > 2 ? argv[2] : NULL, idx > 0 ? idx : 0);
+    }
+    else if(strcmp(argv[0],"exportflac") == 0 && argc > 1)
+        himd_exportflac(h, argv[1]);
+    else if(strcmp(argv[0],"sync") == 0 && argc > 1)
+    {
+        if(himd_sync(h, argv[1]) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"snapshot") == 0 && argc > 1)
+    {
+        if(himd_snapshot(h, argv[1]) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"fsck") == 0)
+    {
+        if(himd_checkdisc(h, argc > 1 && strcmp(argv[1],"repair") == 0) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"verify") == 0)
+    {
+        idx = 0;
+        if(argc > 1)
+            sscanf(argv[1], "%d", &idx);
+        if(himd_verify_disc(h, idx > 0 ? idx : 0) < 0)
+            res = 1;
+    }
+    else if(strcmp(argv[0],"writemp3") == 0 && argc > 1)
+    {
+#ifdef CONFIG_WITH_MAD
+        if(himd_writemp3(h, argv[1]) < 0)
+            res = 1;
+#else
+        fputs("Compiled without libmad - no MP3 download support\n", stderr);
+        res = 1;
+#endif
+    }
+    else
+        return -1;
+    return res;
+}
+
+/* Batch mode runs one command per line against the HiMD opened once, so
+   the track index and the caches of the handle are shared. What a
+   command prints is captured and emitted as one JSON object per line. */
+
+struct capture {
+    FILE * stream;
+    FILE * tmp;
+    int savedfd;
+};
+
+static int capture_start(struct capture * c, FILE * stream)
+{
+    fflush(stream);
+    c->stream = stream;
+    c->tmp = tmpfile();
+    if(!c->tmp)
+        return -1;
+    c->savedfd = dup(fileno(stream));
+    if(c->savedfd < 0 || dup2(fileno(c->tmp), fileno(stream)) < 0)
+    {
+        if(c->savedfd >= 0)
+            close(c->savedfd);
+        fclose(c->tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static GString * capture_end(struct capture * c)
+{
+    GString * text = g_string_new(NULL);
+    char buf[4096];
+    size_t n;
+
+    fflush(c->stream);
+    dup2(c->savedfd, fileno(c->stream));
+    close(c->savedfd);
+    rewind(c->tmp);
+    while((n = fread(buf, 1, sizeof buf, c->tmp)) > 0)
+        g_string_append_len(text, buf, n);
+    fclose(c->tmp);
+    return text;
+}
+
+static void json_string(GString * out, const char * s, gsize len)
+{
+    /* bytes of text that is not UTF-8 are taken as Latin-1 */
+    int utf8 = g_utf8_validate(s, len, NULL);
+    gsize i;
+
+    g_string_append_c(out, '"');
+    for(i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if(c == '"' || c == '\\')
+        {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, c);
+        }
+        else if(c == '\n')
+            g_string_append(out, "\\n");
+        else if(c == '\t')
+            g_string_append(out, "\\t");
+        else if(c < 0x20 || c == 0x7F || (c >= 0x80 && !utf8))
+            g_string_append_printf(out, "\\u%04x", c);
+        else
+            g_string_append_c(out, c);
+    }
+    g_string_append_c(out, '"');
+}
+
+/* dumping to stdout would mix audio into the results */
+static int batch_allowed(int argc, char ** argv, const char ** why)
+{
+    if(strcmp(argv[0], "batch") == 0 || strcmp(argv[0], "restore") == 0 ||
+       strcmp(argv[0], "help") == 0)
+    {
+        *why = "not available in batch mode";
+        return 0;
+    }
+    if(strncmp(argv[0], "dump", 4) == 0 && argc > 2 && strcmp(argv[2], "-") == 0)
+    {
+        *why = "stdout carries the results in batch mode";
+        return 0;
+    }
+    return 1;
+}
+
+static int batch_run_line(struct himd * h, unsigned int lineno, const char * line)
+{
+    GString * json = g_string_new(NULL);
+    GString * out = NULL, * err = NULL;
+    struct capture outcap, errcap;
+    GError * error = NULL;
+    const char * why = NULL;
+    gint64 start = g_get_monotonic_time();
+    char ** argv = NULL;
+    int argc, res = 1;
+
+    if(!g_shell_parse_argv(line, &argc, &argv, &error))
+    {
+        why = error->message;
+        argv = NULL;
+    }
+    else if(batch_allowed(argc, argv, &why))
+    {
+        if(capture_start(&outcap, stdout) < 0)
+            why = "can't capture output";
+        else if(capture_start(&errcap, stderr) < 0)
+        {
+            g_string_free(capture_end(&outcap), TRUE);
+            why = "can't capture output";
+        }
+        else
+        {
+            res = run_command(h, argc, argv);
+            err = capture_end(&errcap);
+            out = capture_end(&outcap);
+            if(res < 0)
+            {
+                why = "unknown command or missing arguments";
+                res = 1;
+            }
+        }
+    }
+
+    g_string_append_printf(json, "{\"line\":%u,\"command\":", lineno);
+    json_string(json, line, strlen(line));
+    /* commands that only report errors on stderr count as failed too */
+    g_string_append_printf(json, ",\"ok\":%s,\"exit\":%d",
+                           !why && res == 0 && err->len == 0 ? "true" : "false", res);
+    if(why)
+    {
+        g_string_append(json, ",\"error\":");
+        json_string(json, why, strlen(why));
+    }
+    if(out)
+    {
+        g_string_append(json, ",\"stdout\":");
+        json_string(json, out->str, out->len);
+        g_string_append(json, ",\"stderr\":");
+        json_string(json, err->str, err->len);
+    }
+    g_string_append_printf(json, ",\"ms\":%.3f}\n", (g_get_monotonic_time() - start) / 1e3);
+    fwrite(json->str, json->len, 1, stdout);
+    /* a reader can act on each result as soon as it arrives */
+    fflush(stdout);
+
+    res = res != 0 || why || err->len != 0;
+    if(out)
+        g_string_free(out, TRUE);
+    if(err)
+        g_string_free(err, TRUE);
+    if(error)
+        g_error_free(error);
+    g_strfreev(argv);
+    g_string_free(json, TRUE);
+    return res;
+}
+
+/* returns 1 if any command failed */
+int himd_batch(struct himd * h, const char * path)
+{
+    FILE * in = stdin;
+    GString * line = g_string_new(NULL);
+    char buf[1024];
+    unsigned int lineno = 0;
+    int failed = 0;
+
+    if(path && strcmp(path, "-") != 0)
+    {
+        in = fopen(path, "r");
+        if(!in)
+        {
+            perror(path);
+            g_string_free(line, TRUE);
+            return 1;
+        }
+    }
+
+    while(fgets(buf, sizeof buf, in))
+    {
+        g_string_append(line, buf);
+        if(line->len > 0 && line->str[line->len - 1] != '\n' && !feof(in))
+            continue;
+        lineno++;
+        g_strstrip(line->str);
+        if(line->str[0] != '\0' && line->str[0] != '#')
+            failed |= batch_run_line(h, lineno, line->str);
+        g_string_truncate(line, 0);
+    }
+
+    if(in != stdin)
+        fclose(in);
+    g_string_free(line, TRUE);
+    return failed;
+}
+
 int main(int argc, char ** argv)
 {
-    int idx;
+    int idx, res = 0;
     struct himd h;
     struct himderrinfo status;
     setlocale(LC_ALL,"");
 
+    for(idx = 1; idx < argc; idx++)
+        if(strcmp(argv[idx], "--stats") == 0)
+        {
+            show_stats = 1;
+            memmove(argv + idx, argv + idx + 1, (argc - idx) * sizeof argv[0]);
+            argc--;
+            break;
+        }
+
     if (argc == 2 && (strcmp (argv[1], "help") == 0)) {
       usage(argv[0]);
       return 0;
@@ -744,54 +2456,32 @@ int main(int argc, char ** argv)
       return 0;
     }
 
-    if(himd_open(&h,argv[1], &status) < 0)
-    {
-        puts(status.statusmsg);
-        return 1;
-    }
-    if(argc == 2 || strcmp(argv[2],"tracks") == 0)
-        himd_trackdump(&h, argc > 3);
-    else if(strcmp(argv[2],"strings") == 0)
-        himd_stringdump(&h);
-    else if(strcmp(argv[2],"discid") == 0)
-        himd_dumpdiscid(&h);
-    else if(strcmp(argv[2],"holes") == 0)
-        himd_dumpholes(&h);
-    else if(strcmp(argv[2],"mp3key") == 0 && argc > 3)
-    {
-        mp3key k;
-        idx = 1;
-        sscanf(argv[3], "%d", &idx);
-        himd_obtain_mp3key(&h, idx, &k, NULL);
-        printf("Track key: %02x%02x%02x%02x\n", k[0], k[1], k[2], k[3]);
-    }
-    else if(strcmp(argv[2],"dumptrack") == 0 && argc > 3)
+    /* the target of restore need not be a HiMD yet */
+    if(argc > 3 && strcmp(argv[2],"restore") == 0)
     {
-        idx = 1;
-        sscanf(argv[3], "%d", &idx);
-        himd_dumptrack(&h, idx);
-    }
-    else if(strcmp(argv[2],"dumpmp3") == 0 && argc > 3)
-    {
-        idx = 1;
-        sscanf(argv[3], "%d", &idx);
-        himd_dumpmp3(&h, idx);
+        return himd_restore(argv[1], argv[3]) < 0 ? 1 : 0;
     }
-    else if(strcmp(argv[2],"dumpnonmp3") == 0 && argc > 3)
+
+    /* only writemp3, fsck repair and batch write modify the track index */
+    if(himd_open_mode(&h, argv[1], argc > 2 && (strcmp(argv[2],"writemp3") == 0 ||
+                      (argc > 3 && strcmp(argv[2],"fsck") == 0 && strcmp(argv[3],"repair") == 0) ||
+                      (argc > 3 && strcmp(argv[2],"batch") == 0 && strcmp(argv[3],"write") == 0)) ?
+                      HIMD_READ_WRITE : HIMD_READ_ONLY, &status) < 0)
     {
-        idx = 1;
-        sscanf(argv[3], "%d", &idx);
-        himd_dumpnonmp3(&h, idx);
+        puts(status.statusmsg);
+        return 1;
     }
-    else if(strcmp(argv[2],"writemp3") == 0 && argc > 3)
+    if(argc > 2 && strcmp(argv[2],"batch") == 0)
     {
-#ifdef CONFIG_WITH_MAD
-	himd_writemp3(&h, argv[3]);
-#else
-	fputs("Compiled without libmad - no MP3 download support\n", stderr);
-#endif
+        idx = argc > 3 && strcmp(argv[3],"write") == 0 ? 4 : 3;
+        res = himd_batch(&h, argc > idx ? argv[idx] : NULL);
     }
+    else
+        res = run_command(&h, argc - 2, argv + 2);
+    /* unknown commands are ignored, as they always were */
+    if(res < 0)
+        res = 0;
 
     himd_close(&h);
-    return 0;
+    return res;
 }
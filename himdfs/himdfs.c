@@ -0,0 +1,544 @@
+/*
+ *   himdfs.c - FUSE filesystem showing the tracks of a HiMD as audio files
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "sony_oma.h"
+
+#define WAV_HEADER_SIZE 44
+#define CACHE_BLOCKS 16		/* decrypted blocks kept per file */
+
+enum filekind { KIND_MP3, KIND_OMA, KIND_WAV };
+
+/* One track shown as a file. Everything except the MP3 block index is
+   computed from the track index when mounting. Until an MP3 file has been
+   opened, its size is only an upper bound, and the file is read with
+   direct_io, so the kernel takes the end of the data from read. */
+struct trackfile {
+    char * name;
+    unsigned int slot;
+    enum filekind kind;
+    unsigned char * header;		/* ID3 tag, EA3 header or WAV header */
+    unsigned int headerlen;
+    guint64 maxsize;			/* MP3 size if all blocks were full */
+
+    GMutex lock;			/* protects the rest */
+    int indexed;
+    int broken;
+    unsigned int blockcount;
+    guint64 * blockpos;			/* start of each block's data after the
+                                           header, blockcount+1 entries */
+    struct himd_blockcache * cache;
+};
+
+struct openfile {
+    struct trackfile * file;
+    GMutex lock;
+    union {
+        struct himd_mp3stream mp3;
+        struct himd_nonmp3stream nonmp3;
+    } str;
+    unsigned int nextblock;		/* block the stream reads next */
+    unsigned char swapbuf[HIMD_AUDIO_SIZE];
+};
+
+static struct himd himd;
+static struct trackfile * files;
+static unsigned int filecount;
+static const char * himdpath;
+
+static void put_le16(unsigned char * p, unsigned int v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char * p, unsigned long v)
+{
+    put_le16(p, v & 0xFFFF);
+    put_le16(p+2, v >> 16);
+}
+
+static unsigned char * make_wav_header(unsigned long datasize)
+{
+    unsigned char * header = g_malloc(WAV_HEADER_SIZE);
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header+4, datasize + WAV_HEADER_SIZE - 8);
+    memcpy(header+8, "WAVEfmt ", 8);
+    put_le32(header+16, 16);            /* fmt chunk size */
+    put_le16(header+20, 1);             /* PCM */
+    put_le16(header+22, 2);             /* channels */
+    put_le32(header+24, 44100);         /* sample rate */
+    put_le32(header+28, 44100*4);       /* bytes per second */
+    put_le16(header+32, 4);             /* bytes per sample frame */
+    put_le16(header+34, 16);            /* bits per sample */
+    memcpy(header+36, "data", 4);
+    put_le32(header+40, datasize);
+    return header;
+}
+
+/* Block positions of ATRAC and LPCM tracks follow from the fragment
+   list, as every frame has the same size. */
+static int index_nonmp3(struct trackfile * f, const struct trackinfo * ti, struct himderrinfo * status)
+{
+    unsigned int fpb = himd_trackinfo_framesperblock(ti);
+    unsigned int framesize = himd_trackinfo_framesize(ti);
+    struct fraginfo frag;
+    GArray * pos = g_array_new(FALSE, FALSE, sizeof(guint64));
+    guint64 cur = 0;
+    unsigned int fragnum, block;
+
+    g_array_append_val(pos, cur);
+    for(fragnum = ti->firstfrag; fragnum != 0; fragnum = frag.nextfrag)
+    {
+        if(himd_get_fragment_info(&himd, fragnum, &frag, status) < 0)
+        {
+            g_array_free(pos, TRUE);
+            return -1;
+        }
+        for(block = frag.firstblock; block <= frag.lastblock; block++)
+        {
+            unsigned int first = block == frag.firstblock ? frag.firstframe : 0;
+            unsigned int last = block == frag.lastblock ? frag.lastframe : fpb - 1;
+            cur += (guint64)(last - first + 1) * framesize;
+            g_array_append_val(pos, cur);
+        }
+    }
+    f->blockcount = pos->len - 1;
+    f->blockpos = (guint64 *)g_array_free(pos, FALSE);
+    return 0;
+}
+
+/* The byte count of MP3 blocks is only stored in the blocks themselves,
+   so the stream is read once, when the file is first opened. */
+static int index_mp3(struct trackfile * f, struct himderrinfo * status)
+{
+    struct himd_mp3stream str;
+    GArray * pos = g_array_new(FALSE, FALSE, sizeof(guint64));
+    guint64 cur = 0;
+    unsigned int len;
+
+    if(himd_mp3stream_open(&himd, f->slot, &str, status) < 0)
+    {
+        g_array_free(pos, TRUE);
+        return -1;
+    }
+    himd_mp3stream_set_cache(&str, f->cache);
+    g_array_append_val(pos, cur);
+    while(himd_mp3stream_read_block(&str, NULL, &len, NULL, status) >= 0)
+    {
+        cur += len;
+        g_array_append_val(pos, cur);
+    }
+    himd_mp3stream_close(&str);
+    if(status->status != HIMD_STATUS_AUDIO_EOF)
+    {
+        g_array_free(pos, TRUE);
+        return -1;
+    }
+    f->blockcount = pos->len - 1;
+    f->blockpos = (guint64 *)g_array_free(pos, FALSE);
+    return 0;
+}
+
+static int ensure_index(struct trackfile * f)
+{
+    struct himderrinfo status;
+    int ret = 0;
+
+    g_mutex_lock(&f->lock);
+    if(!f->indexed && !f->broken)
+    {
+        if(index_mp3(f, &status) < 0)
+        {
+            fprintf(stderr, "himdfs: %s: %s\n", f->name, status.statusmsg);
+            f->broken = 1;
+        }
+        else
+            f->indexed = 1;
+    }
+    if(f->broken)
+        ret = -EIO;
+    g_mutex_unlock(&f->lock);
+    return ret;
+}
+
+static guint64 file_size(const struct trackfile * f)
+{
+    return f->headerlen + f->blockpos[f->blockcount];
+}
+
+static int count_blocks(const struct trackinfo * ti, unsigned int * blocks, struct himderrinfo * status)
+{
+    struct fraginfo frag;
+    unsigned int fragnum;
+
+    *blocks = 0;
+    for(fragnum = ti->firstfrag; fragnum != 0; fragnum = frag.nextfrag)
+    {
+        if(himd_get_fragment_info(&himd, fragnum, &frag, status) < 0)
+            return -1;
+        *blocks += frag.lastblock - frag.firstblock + 1;
+    }
+    return 0;
+}
+
+static char * make_name(unsigned int idx, const struct trackinfo * ti, const char * ext)
+{
+    char * title = ti->title ? himd_get_string_utf8(&himd, ti->title, NULL, NULL) : NULL;
+    char * artist = ti->artist ? himd_get_string_utf8(&himd, ti->artist, NULL, NULL) : NULL;
+    char * name, * p;
+
+    if(title && artist)
+        name = g_strdup_printf("%02u %s - %s.%s", idx + 1, artist, title, ext);
+    else if(title)
+        name = g_strdup_printf("%02u %s.%s", idx + 1, title, ext);
+    else
+        name = g_strdup_printf("%02u.%s", idx + 1, ext);
+    himd_free(title);
+    himd_free(artist);
+    for(p = name; *p; p++)
+        if(*p == '/')
+            *p = '_';
+    return name;
+}
+
+static int load_tracks(struct himderrinfo * status)
+{
+    unsigned int idx, count = himd_track_count(&himd);
+
+    files = g_new0(struct trackfile, count);
+    for(idx = 0; idx < count; idx++)
+    {
+        struct trackfile * f = &files[filecount];
+        struct trackinfo ti;
+
+        f->slot = himd_get_trackslot(&himd, idx, status);
+        if(f->slot == 0 || himd_get_track_info(&himd, f->slot, &ti, status) < 0)
+            return -1;
+        if(!himd_track_uploadable(&himd, &ti))
+            continue;
+
+        g_mutex_init(&f->lock);
+        if(sony_codecinfo_is_mpeg(&ti.codec_info))
+        {
+            struct himderrinfo tagstatus;
+            unsigned int blocks;
+
+            f->kind = KIND_MP3;
+            f->header = himd_track_id3v2_tag(&himd, &ti, NULL, HIMD_ID3V2_PADDING,
+                                             &f->headerlen, &tagstatus);
+            if(!f->header)
+                f->headerlen = 0;
+            if(count_blocks(&ti, &blocks, status) < 0)
+                return -1;
+            f->maxsize = f->headerlen + (guint64)blocks * HIMD_AUDIO_SIZE;
+        }
+        else
+        {
+            if(index_nonmp3(f, &ti, status) < 0)
+                return -1;
+            f->indexed = 1;
+            if(sony_codecinfo_is_lpcm(&ti.codec_info))
+            {
+                f->kind = KIND_WAV;
+                f->header = make_wav_header(f->blockpos[f->blockcount]);
+                f->headerlen = WAV_HEADER_SIZE;
+            }
+            else
+            {
+                f->kind = KIND_OMA;
+                f->header = g_malloc(EA3_FORMAT_HEADER_SIZE);
+                make_ea3_format_header((char *)f->header, &ti.codec_info);
+                f->headerlen = EA3_FORMAT_HEADER_SIZE;
+            }
+        }
+        f->name = make_name(idx, &ti, f->kind == KIND_MP3 ? "mp3" :
+                                      f->kind == KIND_WAV ? "wav" : "oma");
+        f->cache = himd_blockcache_new(CACHE_BLOCKS);
+        filecount++;
+    }
+    return 0;
+}
+
+static struct trackfile * find_file(const char * path)
+{
+    unsigned int i;
+
+    if(*path++ != '/')
+        return NULL;
+    for(i = 0; i < filecount; i++)
+        if(strcmp(files[i].name, path) == 0)
+            return &files[i];
+    return NULL;
+}
+
+static int himdfs_getattr(const char * path, struct stat * st)
+{
+    struct trackfile * f;
+
+    memset(st, 0, sizeof *st);
+    if(strcmp(path, "/") == 0)
+    {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    f = find_file(path);
+    if(!f)
+        return -ENOENT;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    /* no audio is read here, so listing the mount stays cheap */
+    g_mutex_lock(&f->lock);
+    st->st_size = f->indexed ? file_size(f) : f->maxsize;
+    g_mutex_unlock(&f->lock);
+    return 0;
+}
+
+static int himdfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info * fi)
+{
+    unsigned int i;
+
+    (void)offset;
+    (void)fi;
+    if(strcmp(path, "/") != 0)
+        return -ENOENT;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for(i = 0; i < filecount; i++)
+        filler(buf, files[i].name, NULL, 0);
+    return 0;
+}
+
+static int himdfs_open(const char * path, struct fuse_file_info * fi)
+{
+    struct trackfile * f = find_file(path);
+    struct openfile * of;
+    struct himderrinfo status;
+    int ret;
+
+    if(!f)
+        return -ENOENT;
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    if((ret = ensure_index(f)) < 0)
+        return ret;
+
+    of = g_new(struct openfile, 1);
+    of->file = f;
+    of->nextblock = 0;
+    if((f->kind == KIND_MP3 ? himd_mp3stream_open(&himd, f->slot, &of->str.mp3, &status)
+                            : himd_nonmp3stream_open(&himd, f->slot, &of->str.nonmp3, &status)) < 0)
+    {
+        fprintf(stderr, "himdfs: %s: %s\n", f->name, status.statusmsg);
+        g_free(of);
+        return -EIO;
+    }
+    if(f->kind == KIND_MP3)
+        himd_mp3stream_set_cache(&of->str.mp3, f->cache);
+    else
+        himd_nonmp3stream_set_cache(&of->str.nonmp3, f->cache);
+    g_mutex_init(&of->lock);
+    fi->fh = (uintptr_t)of;
+    if(f->kind == KIND_MP3)
+        fi->direct_io = 1;
+    else
+        fi->keep_cache = 1;
+    return 0;
+}
+
+/* Reads block blockidx of the file, seeking only if reads are not
+   sequential. Returns the length of the block's audio data or -1. */
+static int read_block(struct openfile * of, unsigned int blockidx, const unsigned char ** data)
+{
+    struct himderrinfo status;
+    unsigned int len;
+    int ret;
+
+    if(blockidx != of->nextblock)
+    {
+        ret = of->file->kind == KIND_MP3 ?
+                  himd_mp3stream_seek_block(&of->str.mp3, blockidx, &status) :
+                  himd_nonmp3stream_seek_block(&of->str.nonmp3, blockidx, &status);
+        if(ret < 0)
+            goto fail;
+    }
+    of->nextblock = blockidx + 1;
+    ret = of->file->kind == KIND_MP3 ?
+              himd_mp3stream_read_block(&of->str.mp3, data, &len, NULL, &status) :
+              himd_nonmp3stream_read_block(&of->str.nonmp3, data, &len, NULL, &status);
+    if(ret < 0)
+        goto fail;
+    if(len != of->file->blockpos[blockidx+1] - of->file->blockpos[blockidx])
+    {
+        fprintf(stderr, "himdfs: %s: block %u has %u bytes instead of %u\n", of->file->name,
+                blockidx, len, (unsigned int)(of->file->blockpos[blockidx+1] - of->file->blockpos[blockidx]));
+        of->nextblock = -1;
+        return -1;
+    }
+    if(of->file->kind == KIND_WAV)
+    {
+        /* LPCM is stored big endian on disc, WAV wants little endian */
+        himd_swab16(of->swapbuf, *data, len / 2);
+        *data = of->swapbuf;
+    }
+    return len;
+
+fail:
+    fprintf(stderr, "himdfs: %s: %s\n", of->file->name, status.statusmsg);
+    of->nextblock = -1;
+    return -1;
+}
+
+static int himdfs_read(const char * path, char * buf, size_t size, off_t offset,
+                       struct fuse_file_info * fi)
+{
+    struct openfile * of = (struct openfile *)(uintptr_t)fi->fh;
+    struct trackfile * f = of->file;
+    guint64 total = file_size(f);
+    guint64 pos;
+    size_t done = 0;
+    unsigned int lo, hi;
+
+    (void)path;
+    if((guint64)offset >= total)
+        return 0;
+    if(size > total - offset)
+        size = total - offset;
+
+    if((guint64)offset < f->headerlen)
+    {
+        done = MIN(size, (size_t)(f->headerlen - offset));
+        memcpy(buf, f->header + offset, done);
+    }
+    if(done == size)
+        return done;
+
+    /* last block starting at or before the requested position */
+    pos = offset + done - f->headerlen;
+    lo = 0;
+    hi = f->blockcount;
+    while(hi - lo > 1)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if(f->blockpos[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    g_mutex_lock(&of->lock);
+    while(done < size && lo < f->blockcount)
+    {
+        const unsigned char * data;
+        unsigned int skip = pos - f->blockpos[lo];
+        size_t n;
+        int len = read_block(of, lo, &data);
+
+        if(len < 0)
+        {
+            g_mutex_unlock(&of->lock);
+            return done ? (int)done : -EIO;
+        }
+        n = MIN(size - done, (size_t)(len - skip));
+        memcpy(buf + done, data + skip, n);
+        done += n;
+        pos += n;
+        lo++;
+    }
+    g_mutex_unlock(&of->lock);
+    return done;
+}
+
+static int himdfs_release(const char * path, struct fuse_file_info * fi)
+{
+    struct openfile * of = (struct openfile *)(uintptr_t)fi->fh;
+
+    (void)path;
+    if(of->file->kind == KIND_MP3)
+        himd_mp3stream_close(&of->str.mp3);
+    else
+        himd_nonmp3stream_close(&of->str.nonmp3);
+    g_mutex_clear(&of->lock);
+    g_free(of);
+    return 0;
+}
+
+static void himdfs_destroy(void * data)
+{
+    unsigned int i;
+
+    (void)data;
+    for(i = 0; i < filecount; i++)
+    {
+        g_free(files[i].name);
+        g_free(files[i].header);
+        g_free(files[i].blockpos);
+        himd_blockcache_free(files[i].cache);
+        g_mutex_clear(&files[i].lock);
+    }
+    g_free(files);
+    himd_close(&himd);
+}
+
+static struct fuse_operations himdfs_ops = {
+    .getattr = himdfs_getattr,
+    .readdir = himdfs_readdir,
+    .open = himdfs_open,
+    .read = himdfs_read,
+    .release = himdfs_release,
+    .destroy = himdfs_destroy,
+};
+
+/* the first non-option argument is the HiMD, the rest goes to FUSE */
+static int parse_arg(void * data, const char * arg, int key, struct fuse_args * outargs)
+{
+    (void)data;
+    (void)outargs;
+    if(key == FUSE_OPT_KEY_NONOPT && !himdpath)
+    {
+        himdpath = arg;
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct himderrinfo status;
+
+    if(fuse_opt_parse(&args, NULL, NULL, parse_arg) < 0)
+        return 1;
+    if(!himdpath)
+    {
+        fprintf(stderr, "Usage: %s <HiMD path> <mount point> [FUSE options]\n", argv[0]);
+        return 1;
+    }
+    if(himd_open_mode(&himd, himdpath, HIMD_READ_ONLY, &status) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", himdpath, status.statusmsg);
+        return 1;
+    }
+    if(load_tracks(&status) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", himdpath, status.statusmsg);
+        himd_close(&himd);
+        return 1;
+    }
+    return fuse_main(args.argc, args.argv, &himdfs_ops, NULL);
+}
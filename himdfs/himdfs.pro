@@ -0,0 +1,8 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0 fuse
+INCLUDEPATH += ../libhimd
+SOURCES += himdfs.c
+
+include(../libhimd/use_libhimd.pri)
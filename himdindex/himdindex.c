@@ -0,0 +1,853 @@
+/*
+ *   himdindex.c - keep an index of the tracks on many HiMD discs and snapshots
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+
+/* Index layout, all numbers big endian:
+      0  "HIMDINDX"
+      8  format version
+     12  number of discs
+     16  number of tracks
+     20  size of the string pool
+     32  disc records, sorted by disc ID, the newest copy of a disc first
+         track records, the tracks of each disc in play order
+         track numbers sorted by content ID, 4 bytes each
+         string pool
+   Disc record:
+      0  disc ID
+     16  mtime of the track index, high and low word
+     24  source (string)
+     28  first track record
+     32  number of tracks
+     36  blocks in ATDATA
+     40  free blocks
+   Track record:
+      0  content ID
+     20  slot (16 bit)
+     22  seconds (16 bit)
+     24  codec id and codec info
+     30  uploadable
+     32  title, artist and album (strings)
+     44  blocks
+   A string is an offset into the pool, which holds each string followed
+   by its case folded version, both NUL terminated. Offset 0 is the empty
+   string.
+   Every source gets a record, so a disc and its snapshots are all known
+   to scan, but queries only look at the newest copy. */
+#define INDEX_MAGIC "HIMDINDX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 32
+#define INDEX_DISC_SIZE 48
+#define INDEX_TRACK_SIZE 48
+
+void usage(char * cmdname)
+{
+  printf("Usage: %s <command>, where <command> is either of:\n\n\
+          scan <INDEX> <PATH>...       - add the HiMDs, snapshots and images\n\
+                                         found in PATH to INDEX, rescanning\n\
+                                         only what changed since the last run\n\
+          find <INDEX> [--title|--artist|--album] <TEXT>\n\
+                                       - list tracks whose title, artist or\n\
+                                         album contains TEXT (any of them by\n\
+                                         default)\n\
+          contentid <INDEX> <HEX>      - list tracks whose content ID starts\n\
+                                         with HEX\n\
+          discs <INDEX>                - list all indexed discs\n", cmdname);
+}
+
+static void put_be16(unsigned char * p, unsigned int val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static void put_be32(unsigned char * p, unsigned int val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static unsigned int get_be16(const unsigned char * p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned int get_be32(const unsigned char * p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static const char * hexdump(const unsigned char * input, int len)
+{
+    static char dumpspace[41];
+    int i;
+
+    for(i = 0; i < len && i < 20; i++)
+        sprintf(dumpspace + i * 2, "%02X", input[i]);
+    return dumpspace;
+}
+
+/* ---- index file ---- */
+
+struct index {
+    GMappedFile * map;
+    unsigned int disccount;
+    unsigned int trackcount;
+    const unsigned char * discs;
+    const unsigned char * tracks;
+    const unsigned char * byid;
+    const char * strings;
+    unsigned int stringbytes;
+};
+
+static int string_valid(const struct index * idx, unsigned int off)
+{
+    const char * orig, * fold;
+
+    if(off >= idx->stringbytes)
+        return 0;
+    orig = idx->strings + off;
+    fold = memchr(orig, 0, idx->stringbytes - off);
+    return fold && memchr(fold + 1, 0, idx->strings + idx->stringbytes - fold - 1) != NULL;
+}
+
+static const char * index_string(const struct index * idx, const unsigned char * p)
+{
+    return idx->strings + get_be32(p);
+}
+
+static const char * index_folded(const struct index * idx, const unsigned char * p)
+{
+    const char * s = index_string(idx, p);
+    return s + strlen(s) + 1;
+}
+
+/* Maps an index written by scan. A missing index is an empty one if
+   missing_ok is set. */
+static int index_open(struct index * idx, const char * path, int missing_ok)
+{
+    GError * error = NULL;
+    const unsigned char * data;
+    gsize len, need;
+    unsigned int i;
+
+    memset(idx, 0, sizeof *idx);
+    idx->map = g_mapped_file_new(path, FALSE, &error);
+    if(!idx->map)
+    {
+        if(missing_ok && g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+            g_error_free(error);
+            return 0;
+        }
+        fprintf(stderr, "Can't open index %s: %s\n", path, error->message);
+        g_error_free(error);
+        return -1;
+    }
+    data = (const unsigned char *)g_mapped_file_get_contents(idx->map);
+    len = g_mapped_file_get_length(idx->map);
+    if(len < INDEX_HEADER_SIZE || memcmp(data, INDEX_MAGIC, 8) != 0 ||
+       get_be32(data + 8) != INDEX_VERSION)
+    {
+        fprintf(stderr, "%s is no index of this version\n", path);
+        goto fail;
+    }
+    idx->disccount = get_be32(data + 12);
+    idx->trackcount = get_be32(data + 16);
+    idx->stringbytes = get_be32(data + 20);
+    need = INDEX_HEADER_SIZE + (gsize)idx->disccount * INDEX_DISC_SIZE +
+           (gsize)idx->trackcount * (INDEX_TRACK_SIZE + 4) + idx->stringbytes;
+    if(idx->disccount > 0x1000000 || idx->trackcount > 0x10000000 ||
+       idx->stringbytes < 2 || len != need)
+    {
+        fprintf(stderr, "Index %s is corrupt\n", path);
+        goto fail;
+    }
+    idx->discs = data + INDEX_HEADER_SIZE;
+    idx->tracks = idx->discs + (gsize)idx->disccount * INDEX_DISC_SIZE;
+    idx->byid = idx->tracks + (gsize)idx->trackcount * INDEX_TRACK_SIZE;
+    idx->strings = (const char *)(idx->byid + (gsize)idx->trackcount * 4);
+
+    /* check once, so the queries need not */
+    for(i = 0; i < idx->disccount; i++)
+    {
+        const unsigned char * d = idx->discs + i * INDEX_DISC_SIZE;
+        if(!string_valid(idx, get_be32(d + 24)) || get_be32(d + 28) > idx->trackcount ||
+           get_be32(d + 32) > idx->trackcount - get_be32(d + 28))
+        {
+            fprintf(stderr, "Index %s is corrupt\n", path);
+            goto fail;
+        }
+    }
+    for(i = 0; i < idx->trackcount; i++)
+    {
+        const unsigned char * t = idx->tracks + (gsize)i * INDEX_TRACK_SIZE;
+        if(!string_valid(idx, get_be32(t + 32)) || !string_valid(idx, get_be32(t + 36)) ||
+           !string_valid(idx, get_be32(t + 40)) || get_be32(idx->byid + i * 4) >= idx->trackcount)
+        {
+            fprintf(stderr, "Index %s is corrupt\n", path);
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    g_mapped_file_unref(idx->map);
+    idx->map = NULL;
+    return -1;
+}
+
+static void index_close(struct index * idx)
+{
+    if(idx->map)
+        g_mapped_file_unref(idx->map);
+}
+
+/* ---- scanning ---- */
+
+struct idxtrack {
+    unsigned char contentid[20];
+    unsigned int slot;
+    unsigned int seconds;
+    struct sony_codecinfo codec;
+    int uploadable;
+    char * title;
+    char * artist;
+    char * album;
+    unsigned int blocks;
+};
+
+struct idxdisc {
+    unsigned char discid[16];
+    gint64 mtime;
+    char * source;
+    unsigned int totalblocks;
+    unsigned int freeblocks;
+    GArray * tracks;
+};
+
+static void idxdisc_free(gpointer p)
+{
+    struct idxdisc * disc = p;
+    unsigned int i;
+
+    for(i = 0; i < disc->tracks->len; i++)
+    {
+        struct idxtrack * t = &g_array_index(disc->tracks, struct idxtrack, i);
+        g_free(t->title);
+        g_free(t->artist);
+        g_free(t->album);
+    }
+    g_array_free(disc->tracks, TRUE);
+    g_free(disc->source);
+    g_free(disc);
+}
+
+static struct idxdisc * idxdisc_new(void)
+{
+    struct idxdisc * disc = g_new0(struct idxdisc, 1);
+    disc->tracks = g_array_new(FALSE, FALSE, sizeof(struct idxtrack));
+    return disc;
+}
+
+/* the entries of an existing index, keyed by source */
+static GHashTable * index_entries(const struct index * idx)
+{
+    GHashTable * entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, idxdisc_free);
+    unsigned int i, j;
+
+    for(i = 0; i < idx->disccount; i++)
+    {
+        const unsigned char * d = idx->discs + i * INDEX_DISC_SIZE;
+        struct idxdisc * disc = idxdisc_new();
+
+        memcpy(disc->discid, d, 16);
+        disc->mtime = ((gint64)get_be32(d + 16) << 32) | get_be32(d + 20);
+        disc->source = g_strdup(index_string(idx, d + 24));
+        disc->totalblocks = get_be32(d + 36);
+        disc->freeblocks = get_be32(d + 40);
+        for(j = 0; j < get_be32(d + 32); j++)
+        {
+            const unsigned char * p = idx->tracks + (gsize)(get_be32(d + 28) + j) * INDEX_TRACK_SIZE;
+            struct idxtrack t;
+
+            memcpy(t.contentid, p, 20);
+            t.slot = get_be16(p + 20);
+            t.seconds = get_be16(p + 22);
+            t.codec.codec_id = p[24];
+            memcpy(t.codec.codecinfo, p + 25, 5);
+            t.uploadable = p[30];
+            t.title = g_strdup(index_string(idx, p + 32));
+            t.artist = g_strdup(index_string(idx, p + 36));
+            t.album = g_strdup(index_string(idx, p + 40));
+            t.blocks = get_be32(p + 44);
+            g_array_append_val(disc->tracks, t);
+        }
+        /* a corrupt index may list a source twice, the hash table frees the old one */
+        g_hash_table_replace(entries, disc->source, disc);
+    }
+    return entries;
+}
+
+/* A directory containing HMDHIFI is a HiMD root, its time stamp is the
+   one of the newest track index. Snapshots and images are files. */
+static int is_himd_root(const char * dir)
+{
+    char * hifi = g_build_filename(dir, "HMDHIFI", NULL);
+    char * lower = g_build_filename(dir, "hmdhifi", NULL);
+    int ret = g_file_test(hifi, G_FILE_TEST_IS_DIR) || g_file_test(lower, G_FILE_TEST_IS_DIR);
+
+    g_free(hifi);
+    g_free(lower);
+    return ret;
+}
+
+static gint64 source_mtime(const char * source)
+{
+    GStatBuf st;
+    gint64 mtime = -1;
+    GDir * dir;
+    const char * name;
+    char * hifi;
+
+    if(!g_file_test(source, G_FILE_TEST_IS_DIR))
+        return g_stat(source, &st) == 0 ? (gint64)st.st_mtime : -1;
+
+    hifi = g_build_filename(source, "HMDHIFI", NULL);
+    if(!g_file_test(hifi, G_FILE_TEST_IS_DIR))
+    {
+        g_free(hifi);
+        hifi = g_build_filename(source, "hmdhifi", NULL);
+    }
+    dir = g_dir_open(hifi, 0, NULL);
+    while(dir && (name = g_dir_read_name(dir)) != NULL)
+        if(g_ascii_strncasecmp(name, "trkidx", 6) == 0)
+        {
+            char * path = g_build_filename(hifi, name, NULL);
+            if(g_stat(path, &st) == 0 && (gint64)st.st_mtime > mtime)
+                mtime = st.st_mtime;
+            g_free(path);
+        }
+    if(dir)
+        g_dir_close(dir);
+    g_free(hifi);
+    return mtime;
+}
+
+/* Collects the sources below path. Files named on the command line are
+   taken as they are, files found in directories only if they are
+   snapshots, as telling an image from any other file means opening it. */
+static void find_sources(const char * path, int named, GPtrArray * sources, GHashTable * seen)
+{
+    GStatBuf st;
+    GDir * dir;
+    const char * name;
+
+    if(g_hash_table_lookup(seen, path))
+        return;
+    if(is_himd_root(path) || (g_file_test(path, G_FILE_TEST_IS_REGULAR) &&
+                              (named || himd_is_snapshot(path))))
+    {
+        char * source = g_strdup(path);
+        g_hash_table_add(seen, source);
+        g_ptr_array_add(sources, source);
+        return;
+    }
+    /* don't follow links to directories found on the way, they may loop */
+    if(named ? g_stat(path, &st) < 0 : g_lstat(path, &st) < 0)
+    {
+        if(named)
+            fprintf(stderr, "Can't access %s: %s\n", path, g_strerror(errno));
+        return;
+    }
+    if(!S_ISDIR(st.st_mode))
+        return;
+    dir = g_dir_open(path, 0, NULL);
+    if(!dir)
+    {
+        fprintf(stderr, "Can't read directory %s\n", path);
+        return;
+    }
+    while((name = g_dir_read_name(dir)) != NULL)
+    {
+        char * child = g_build_filename(path, name, NULL);
+        find_sources(child, 0, sources, seen);
+        g_free(child);
+    }
+    g_dir_close(dir);
+}
+
+/* Reads everything the index holds about a disc. Only the track index
+   and MCLIST are read, ATDATA is just looked at for its size. */
+static struct idxdisc * read_disc(const char * source, gint64 mtime)
+{
+    struct himd himd;
+    struct himderrinfo status;
+    struct himd_catalog * cat;
+    struct idxdisc * disc;
+    const unsigned char * discid;
+    unsigned int i, used = 0;
+    int total;
+
+    if(himd_open_mode(&himd, source, HIMD_READ_ONLY, &status) < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", source, status.statusmsg);
+        return NULL;
+    }
+    discid = himd_get_discid(&himd, &status);
+    if(!discid)
+    {
+        fprintf(stderr, "Skipping %s, it has no disc ID: %s\n", source, status.statusmsg);
+        himd_close(&himd);
+        return NULL;
+    }
+    total = himd_atdata_blocks(&himd, &status);
+    cat = total < 0 ? NULL : himd_catalog_load(&himd, &status);
+    if(!cat)
+    {
+        fprintf(stderr, "Can't read %s: %s\n", source, status.statusmsg);
+        himd_close(&himd);
+        return NULL;
+    }
+
+    disc = idxdisc_new();
+    memcpy(disc->discid, discid, 16);
+    disc->mtime = mtime;
+    disc->source = g_strdup(source);
+    for(i = 0; i < cat->trackcount; i++)
+    {
+        struct idxtrack t;
+
+        memcpy(t.contentid, cat->info[i].contentid, 20);
+        t.slot = cat->slot[i];
+        t.seconds = MIN(cat->seconds[i], 0xFFFF);
+        t.codec = cat->info[i].codec_info;
+        t.uploadable = cat->uploadable[i];
+        t.title = g_strdup(cat->title[i] ? cat->title[i] : "");
+        t.artist = g_strdup(cat->artist[i] ? cat->artist[i] : "");
+        t.album = g_strdup(cat->album[i] ? cat->album[i] : "");
+        t.blocks = cat->blocks[i];
+        used += t.blocks;
+        g_array_append_val(disc->tracks, t);
+    }
+    disc->totalblocks = total;
+    disc->freeblocks = used < (unsigned int)total ? total - used : 0;
+
+    himd_catalog_free(cat);
+    himd_close(&himd);
+    return disc;
+}
+
+/* ---- writing ---- */
+
+struct stringpool {
+    GByteArray * data;
+    GHashTable * offsets;
+};
+
+static unsigned int pool_add(struct stringpool * pool, const char * str)
+{
+    gpointer off;
+    char * fold;
+
+    if(!*str)
+        return 0;
+    if(g_hash_table_lookup_extended(pool->offsets, str, NULL, &off))
+        return GPOINTER_TO_UINT(off);
+    off = GUINT_TO_POINTER(pool->data->len);
+    fold = g_utf8_casefold(str, -1);
+    g_byte_array_append(pool->data, (const guint8 *)str, strlen(str) + 1);
+    g_byte_array_append(pool->data, (const guint8 *)fold, strlen(fold) + 1);
+    g_free(fold);
+    g_hash_table_insert(pool->offsets, (gpointer)str, off);
+    return GPOINTER_TO_UINT(off);
+}
+
+struct idref {
+    const unsigned char * contentid;
+    unsigned int track;
+};
+
+static int compare_idref(const void * a, const void * b)
+{
+    const struct idref * x = a, * y = b;
+    int c = memcmp(x->contentid, y->contentid, 20);
+    return c ? c : (x->track > y->track) - (x->track < y->track);
+}
+
+static int write_index(const char * path, GPtrArray * discs)
+{
+    GByteArray * out = g_byte_array_new();
+    struct stringpool pool;
+    struct idref * ids;
+    unsigned char rec[INDEX_DISC_SIZE];
+    unsigned int i, j, trackcount = 0, first = 0;
+    GError * error = NULL;
+    int ret = 0;
+
+    pool.data = g_byte_array_new();
+    pool.offsets = g_hash_table_new(g_str_hash, g_str_equal);
+    g_byte_array_append(pool.data, (const guint8 *)"\0", 2);
+    for(i = 0; i < discs->len; i++)
+        trackcount += ((struct idxdisc *)g_ptr_array_index(discs, i))->tracks->len;
+
+    memset(rec, 0, INDEX_HEADER_SIZE);
+    memcpy(rec, INDEX_MAGIC, 8);
+    put_be32(rec + 8, INDEX_VERSION);
+    put_be32(rec + 12, discs->len);
+    put_be32(rec + 16, trackcount);
+    g_byte_array_append(out, rec, INDEX_HEADER_SIZE);
+
+    for(i = 0; i < discs->len; i++)
+    {
+        const struct idxdisc * disc = g_ptr_array_index(discs, i);
+
+        memset(rec, 0, sizeof rec);
+        memcpy(rec, disc->discid, 16);
+        put_be32(rec + 16, (guint64)disc->mtime >> 32);
+        put_be32(rec + 20, disc->mtime);
+        put_be32(rec + 24, pool_add(&pool, disc->source));
+        put_be32(rec + 28, first);
+        put_be32(rec + 32, disc->tracks->len);
+        put_be32(rec + 36, disc->totalblocks);
+        put_be32(rec + 40, disc->freeblocks);
+        g_byte_array_append(out, rec, INDEX_DISC_SIZE);
+        first += disc->tracks->len;
+    }
+
+    ids = g_new(struct idref, trackcount + 1);
+    for(i = 0, first = 0; i < discs->len; i++)
+    {
+        const struct idxdisc * disc = g_ptr_array_index(discs, i);
+        for(j = 0; j < disc->tracks->len; j++, first++)
+        {
+            const struct idxtrack * t = &g_array_index(disc->tracks, struct idxtrack, j);
+
+            memset(rec, 0, sizeof rec);
+            memcpy(rec, t->contentid, 20);
+            put_be16(rec + 20, t->slot);
+            put_be16(rec + 22, t->seconds);
+            rec[24] = t->codec.codec_id;
+            memcpy(rec + 25, t->codec.codecinfo, 5);
+            rec[30] = t->uploadable != 0;
+            put_be32(rec + 32, pool_add(&pool, t->title));
+            put_be32(rec + 36, pool_add(&pool, t->artist));
+            put_be32(rec + 40, pool_add(&pool, t->album));
+            put_be32(rec + 44, t->blocks);
+            g_byte_array_append(out, rec, INDEX_TRACK_SIZE);
+            ids[first].contentid = t->contentid;
+            ids[first].track = first;
+        }
+    }
+    qsort(ids, trackcount, sizeof *ids, compare_idref);
+    for(i = 0; i < trackcount; i++)
+    {
+        put_be32(rec, ids[i].track);
+        g_byte_array_append(out, rec, 4);
+    }
+    g_free(ids);
+
+    g_byte_array_append(out, pool.data->data, pool.data->len);
+    put_be32(out->data + 20, pool.data->len);
+
+    if(!g_file_set_contents(path, (const gchar *)out->data, out->len, &error))
+    {
+        fprintf(stderr, "Can't write index %s: %s\n", path, error->message);
+        g_error_free(error);
+        ret = -1;
+    }
+    g_hash_table_destroy(pool.offsets);
+    g_byte_array_free(pool.data, TRUE);
+    g_byte_array_free(out, TRUE);
+    return ret;
+}
+
+/* ---- commands ---- */
+
+static int compare_disc(gconstpointer a, gconstpointer b)
+{
+    const struct idxdisc * x = *(struct idxdisc * const *)a, * y = *(struct idxdisc * const *)b;
+    int c = memcmp(x->discid, y->discid, 16);
+    if(c)
+        return c;
+    /* the newest copy of a disc first */
+    return (y->mtime > x->mtime) - (y->mtime < x->mtime);
+}
+
+static int index_scan(const char * indexpath, int argc, char ** argv)
+{
+    struct index idx;
+    GHashTable * old, * seen;
+    GPtrArray * sources, * discs;
+    GHashTableIter iter;
+    gpointer value;
+    char * cwd;
+    unsigned int i, rescanned = 0, unchanged = 0, dropped = 0, tracks = 0;
+    int ret;
+
+    if(index_open(&idx, indexpath, 1) < 0)
+        return 1;
+    old = index_entries(&idx);
+    index_close(&idx);
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    sources = g_ptr_array_new();
+    cwd = g_get_current_dir();
+    for(i = 0; i < (unsigned int)argc; i++)
+    {
+        char * path = g_path_is_absolute(argv[i]) ? g_strdup(argv[i]) :
+                      g_build_filename(cwd, argv[i], NULL);
+        find_sources(path, 1, sources, seen);
+        g_free(path);
+    }
+    g_free(cwd);
+
+    discs = g_ptr_array_new_with_free_func(idxdisc_free);
+    for(i = 0; i < sources->len; i++)
+    {
+        const char * source = g_ptr_array_index(sources, i);
+        gint64 mtime = source_mtime(source);
+        struct idxdisc * disc = g_hash_table_lookup(old, source);
+
+        if(disc && disc->mtime == mtime)
+        {
+            g_hash_table_steal(old, source);
+            unchanged++;
+        }
+        else
+        {
+            struct idxdisc * known = disc;
+            disc = read_disc(source, mtime);
+            if(disc)
+                rescanned++;
+            else if(known)
+                dropped++;
+        }
+        if(disc)
+            g_ptr_array_add(discs, disc);
+    }
+
+    /* sources not scanned this time stay as long as they exist */
+    g_hash_table_iter_init(&iter, old);
+    while(g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        struct idxdisc * disc = value;
+        if(g_hash_table_lookup(seen, disc->source))
+            continue;
+        if(source_mtime(disc->source) < 0)
+            dropped++;
+        else
+        {
+            g_hash_table_iter_steal(&iter);
+            g_ptr_array_add(discs, disc);
+        }
+    }
+
+    g_ptr_array_sort(discs, compare_disc);
+    for(i = 0; i < discs->len; i++)
+        tracks += ((struct idxdisc *)g_ptr_array_index(discs, i))->tracks->len;
+
+    ret = write_index(indexpath, discs) < 0;
+    if(!ret)
+        printf("%u sources with %u tracks indexed (%u rescanned, %u unchanged, %u removed)\n",
+               discs->len, tracks, rescanned, unchanged, dropped);
+
+    g_ptr_array_free(discs, TRUE);
+    g_ptr_array_free(sources, TRUE);
+    g_hash_table_destroy(seen);
+    g_hash_table_destroy(old);
+    return ret;
+}
+
+/* older copies of a disc follow the newest one */
+static int newest_copy(const struct index * idx, const unsigned char * d)
+{
+    return d == idx->discs || memcmp(d - INDEX_DISC_SIZE, d, 16) != 0;
+}
+
+static const unsigned char * track_disc(const struct index * idx, unsigned int track)
+{
+    unsigned int lo = 0, hi = idx->disccount;
+
+    /* the last disc starting at or before track */
+    while(hi - lo > 1)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if(get_be32(idx->discs + mid * INDEX_DISC_SIZE + 28) <= track)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return idx->discs + lo * INDEX_DISC_SIZE;
+}
+
+static void print_track(const struct index * idx, unsigned int track, int show_contentid)
+{
+    const unsigned char * t = idx->tracks + (gsize)track * INDEX_TRACK_SIZE;
+    const unsigned char * d = track_disc(idx, track);
+    struct sony_codecinfo codec;
+    char * title, * artist, * album, * source;
+    unsigned int seconds = get_be16(t + 22);
+
+    codec.codec_id = t[24];
+    memcpy(codec.codecinfo, t + 25, 5);
+    title = g_locale_from_utf8(index_string(idx, t + 32), -1, NULL, NULL, NULL);
+    artist = g_locale_from_utf8(index_string(idx, t + 36), -1, NULL, NULL, NULL);
+    album = g_locale_from_utf8(index_string(idx, t + 40), -1, NULL, NULL, NULL);
+    source = g_filename_display_name(index_string(idx, d + 24));
+    printf("%s %4u: %d:%02d %s %s:%s (%s)%s\n", hexdump(d, 16), get_be16(t + 20),
+           seconds / 60, seconds % 60, sony_codecinfo_codecname(&codec),
+           artist && *artist ? artist : "Unknown artist",
+           title && *title ? title : "Unknown title",
+           album && *album ? album : "Unknown album", t[30] ? " [uploadable]" : "");
+    if(show_contentid)
+        printf("     Content ID: %s\n", hexdump(t, 20));
+    printf("     in %s\n", source);
+    g_free(title);
+    g_free(artist);
+    g_free(album);
+    g_free(source);
+}
+
+enum find_field { FIND_ANY, FIND_TITLE, FIND_ARTIST, FIND_ALBUM };
+
+static int index_find(const char * indexpath, enum find_field field, const char * text)
+{
+    struct index idx;
+    char * utf8, * needle;
+    unsigned int i, found = 0;
+
+    if(index_open(&idx, indexpath, 0) < 0)
+        return 1;
+    utf8 = g_locale_to_utf8(text, -1, NULL, NULL, NULL);
+    needle = g_utf8_casefold(utf8 ? utf8 : text, -1);
+    g_free(utf8);
+
+    for(i = 0; i < idx.trackcount; i++)
+    {
+        const unsigned char * t = idx.tracks + (gsize)i * INDEX_TRACK_SIZE;
+        if(!newest_copy(&idx, track_disc(&idx, i)))
+            continue;
+        if(((field == FIND_ANY || field == FIND_TITLE) && strstr(index_folded(&idx, t + 32), needle)) ||
+           ((field == FIND_ANY || field == FIND_ARTIST) && strstr(index_folded(&idx, t + 36), needle)) ||
+           ((field == FIND_ANY || field == FIND_ALBUM) && strstr(index_folded(&idx, t + 40), needle)))
+        {
+            print_track(&idx, i, 0);
+            found++;
+        }
+    }
+    printf("%u tracks found\n", found);
+    g_free(needle);
+    index_close(&idx);
+    return 0;
+}
+
+static int index_contentid(const char * indexpath, const char * hex)
+{
+    struct index idx;
+    unsigned char prefix[20];
+    unsigned int len = strlen(hex), lo, hi, found = 0, i;
+
+    if(len == 0 || len > 40 || len % 2 != 0 || strspn(hex, "0123456789abcdefABCDEF") != len)
+    {
+        fprintf(stderr, "The content ID must be given as up to 40 hex digits\n");
+        return 1;
+    }
+    for(i = 0; i < len / 2; i++)
+        prefix[i] = g_ascii_xdigit_value(hex[2 * i]) << 4 | g_ascii_xdigit_value(hex[2 * i + 1]);
+    len /= 2;
+    if(index_open(&idx, indexpath, 0) < 0)
+        return 1;
+
+    /* first entry not below the prefix */
+    lo = 0;
+    hi = idx.trackcount;
+    while(lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        unsigned int track = get_be32(idx.byid + mid * 4);
+        if(memcmp(idx.tracks + (gsize)track * INDEX_TRACK_SIZE, prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for(; lo < idx.trackcount; lo++)
+    {
+        unsigned int track = get_be32(idx.byid + lo * 4);
+        if(memcmp(idx.tracks + (gsize)track * INDEX_TRACK_SIZE, prefix, len) != 0)
+            break;
+        if(newest_copy(&idx, track_disc(&idx, track)))
+        {
+            print_track(&idx, track, 1);
+            found++;
+        }
+    }
+    printf("%u tracks found\n", found);
+    index_close(&idx);
+    return 0;
+}
+
+static int index_discs(const char * indexpath)
+{
+    struct index idx;
+    unsigned int i, discs = 0;
+
+    if(index_open(&idx, indexpath, 0) < 0)
+        return 1;
+    for(i = 0; i < idx.disccount; i++)
+    {
+        const unsigned char * d = idx.discs + i * INDEX_DISC_SIZE;
+        char * source = g_filename_display_name(index_string(&idx, d + 24));
+
+        if(newest_copy(&idx, d))
+        {
+            printf("%s %4u tracks, %5u of %5u blocks free  %s\n", hexdump(d, 16),
+                   get_be32(d + 32), get_be32(d + 40), get_be32(d + 36), source);
+            discs++;
+        }
+        else
+            printf("%32s older copy in %s\n", "", source);
+        g_free(source);
+    }
+    printf("%u discs\n", discs);
+    index_close(&idx);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    setlocale(LC_ALL, "");
+
+    if(argc >= 4 && strcmp(argv[1], "scan") == 0)
+        return index_scan(argv[2], argc - 3, argv + 3);
+    if(argc == 4 && strcmp(argv[1], "find") == 0)
+        return index_find(argv[2], FIND_ANY, argv[3]);
+    if(argc == 5 && strcmp(argv[1], "find") == 0)
+    {
+        if(strcmp(argv[3], "--title") == 0)
+            return index_find(argv[2], FIND_TITLE, argv[4]);
+        if(strcmp(argv[3], "--artist") == 0)
+            return index_find(argv[2], FIND_ARTIST, argv[4]);
+        if(strcmp(argv[3], "--album") == 0)
+            return index_find(argv[2], FIND_ALBUM, argv[4]);
+    }
+    if(argc == 4 && strcmp(argv[1], "contentid") == 0)
+        return index_contentid(argv[2], argv[3]);
+    if(argc == 3 && strcmp(argv[1], "discs") == 0)
+        return index_discs(argv[2]);
+
+    usage(argv[0]);
+    return argc == 2 && strcmp(argv[1], "help") == 0 ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0
+INCLUDEPATH += ../libhimd
+SOURCES += himdindex.c
+
+include(../libhimd/use_libhimd.pri)
+
+macx {
+  CONFIG -= app_bundle
+}
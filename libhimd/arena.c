@@ -0,0 +1,61 @@
+/*
+ * arena.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <glib.h>
+
+#include "himd.h"
+
+#define ARENA_ALIGN 16
+
+void himd_arena_init(struct himd_arena * arena, void * buffer, size_t size)
+{
+    g_return_if_fail(arena != NULL);
+
+    arena->base = buffer;
+    arena->size = size;
+    arena->used = 0;
+}
+
+/* Releases everything allocated from the arena at once. Streams opened
+   into it must have been closed before. */
+void himd_arena_reset(struct himd_arena * arena)
+{
+    g_return_if_fail(arena != NULL);
+    arena->used = 0;
+}
+
+/* Returns NULL if the arena is exhausted */
+void * himd_arena_alloc(struct himd_arena * arena, size_t size)
+{
+    size_t start;
+
+    g_return_val_if_fail(arena != NULL, NULL);
+
+    start = arena->used + (-(guintptr)(arena->base + arena->used) & (ARENA_ALIGN - 1));
+    if(start > arena->size || arena->size - start < size)
+        return NULL;
+    arena->used = start + size;
+    return arena->base + start;
+}
@@ -0,0 +1,200 @@
+/*
+ * blockcache.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+/* The cache is split into shards selected by the low bits of the block
+   number, so readers working on different blocks rarely contend for the
+   same lock. Each shard keeps its own LRU list and counters. */
+#define CACHE_SHARDS 16
+
+struct cacheentry {
+    guint64 key;
+    GList lru;
+    unsigned char data[HIMD_BLOCKINFO_SIZE];
+};
+
+struct cacheshard {
+    GMutex lock;
+    GHashTable * entries;
+    GQueue lru;           /* most recently used at the head */
+    unsigned int capacity;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct himd_blockcache {
+    unsigned int maxblocks;
+    struct cacheshard shards[CACHE_SHARDS];
+};
+
+static volatile gint next_cacheid = 1;
+
+unsigned int himd_blockcache_new_id(void)
+{
+    return g_atomic_int_add(&next_cacheid, 1);
+}
+
+static inline guint64 make_key(const struct himd * himd, unsigned int blockno)
+{
+    return ((guint64)himd->cacheid << 16) | (blockno & 0xFFFF);
+}
+
+static inline struct cacheshard * get_shard(struct himd_blockcache * cache, unsigned int blockno)
+{
+    return &cache->shards[blockno % CACHE_SHARDS];
+}
+
+struct himd_blockcache * himd_blockcache_new(unsigned int maxblocks)
+{
+    struct himd_blockcache * cache;
+    int i;
+
+    g_return_val_if_fail(maxblocks > 0, NULL);
+
+    cache = g_new0(struct himd_blockcache, 1);
+    cache->maxblocks = maxblocks;
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cacheshard * shard = &cache->shards[i];
+        g_mutex_init(&shard->lock);
+        shard->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+        g_queue_init(&shard->lru);
+        /* distribute the budget, rounding up for the first shards */
+        shard->capacity = maxblocks / CACHE_SHARDS +
+                          ((unsigned int)i < maxblocks % CACHE_SHARDS ? 1 : 0);
+        if(shard->capacity == 0)
+            shard->capacity = 1;
+    }
+    return cache;
+}
+
+void himd_blockcache_free(struct himd_blockcache * cache)
+{
+    int i;
+
+    if(!cache)
+        return;
+
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cacheshard * shard = &cache->shards[i];
+        GList * link;
+        while((link = g_queue_pop_tail_link(&shard->lru)) != NULL)
+            g_free(link->data);
+        g_hash_table_destroy(shard->entries);
+        g_mutex_clear(&shard->lock);
+    }
+    g_free(cache);
+}
+
+int himd_blockcache_lookup(struct himd_blockcache * cache, const struct himd * himd,
+                           unsigned int blockno, unsigned char * block)
+{
+    struct cacheshard * shard = get_shard(cache, blockno);
+    guint64 key = make_key(himd, blockno);
+    struct cacheentry * entry;
+
+    g_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->entries, &key);
+    if(!entry)
+    {
+        shard->misses++;
+        g_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    shard->hits++;
+    g_queue_unlink(&shard->lru, &entry->lru);
+    g_queue_push_head_link(&shard->lru, &entry->lru);
+    memcpy(block, entry->data, sizeof entry->data);
+    g_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+void himd_blockcache_insert(struct himd_blockcache * cache, const struct himd * himd,
+                            unsigned int blockno, const unsigned char * block)
+{
+    struct cacheshard * shard = get_shard(cache, blockno);
+    guint64 key = make_key(himd, blockno);
+    struct cacheentry * entry;
+
+    g_mutex_lock(&shard->lock);
+    entry = g_hash_table_lookup(shard->entries, &key);
+    if(entry)
+    {
+        /* another reader was faster */
+        g_queue_unlink(&shard->lru, &entry->lru);
+    }
+    else
+    {
+        if(shard->lru.length >= shard->capacity)
+        {
+            /* recycle the least recently used entry */
+            GList * link = g_queue_pop_tail_link(&shard->lru);
+            entry = link->data;
+            g_hash_table_remove(shard->entries, &entry->key);
+        }
+        else
+        {
+            entry = g_try_new(struct cacheentry, 1);
+            if(!entry)
+            {
+                g_mutex_unlock(&shard->lock);
+                return;
+            }
+            entry->lru.data = entry;
+            entry->lru.next = entry->lru.prev = NULL;
+        }
+        entry->key = key;
+        g_hash_table_insert(shard->entries, &entry->key, entry);
+    }
+    memcpy(entry->data, block, sizeof entry->data);
+    g_queue_push_head_link(&shard->lru, &entry->lru);
+    g_mutex_unlock(&shard->lock);
+}
+
+void himd_blockcache_get_stats(struct himd_blockcache * cache, struct himd_blockcache_stats * stats)
+{
+    int i;
+
+    g_return_if_fail(cache != NULL);
+    g_return_if_fail(stats != NULL);
+
+    memset(stats, 0, sizeof *stats);
+    stats->maxblocks = cache->maxblocks;
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        struct cacheshard * shard = &cache->shards[i];
+        g_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->blocks += shard->lru.length;
+        g_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,233 @@
+/*
+ * catalog.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+/* The catalog is built in two passes. The first one reads all track
+   infos, fragments and strings into temporary storage and adds up the
+   size, the second one copies everything into a single allocation that
+   starts with the struct himd_catalog itself. Strings are decoded once
+   per string index, so tracks sharing an artist share the copy. */
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1))
+
+struct catalogtemp {
+    struct trackinfo * info;
+    unsigned int * slot;
+    unsigned int * nfrags;
+    GArray * frags;
+    char * strings[HIMD_LAST_STRING + 1];
+    char * copies[HIMD_LAST_STRING + 1];	/* location in the arena */
+    gsize stringbytes;
+};
+
+static void catalogtemp_free(struct catalogtemp * tmp)
+{
+    unsigned int i;
+
+    for(i = 0; i <= HIMD_LAST_STRING; i++)
+        himd_free(tmp->strings[i]);
+    g_free(tmp->info);
+    g_free(tmp->slot);
+    g_free(tmp->nfrags);
+    if(tmp->frags)
+        g_array_free(tmp->frags, TRUE);
+    g_free(tmp);
+}
+
+static void read_string(struct himd * himd, struct catalogtemp * tmp, int idx)
+{
+    if(idx <= 0 || idx > HIMD_LAST_STRING || tmp->strings[idx])
+        return;
+    tmp->strings[idx] = himd_get_string_utf8(himd, idx, NULL, NULL);
+    if(tmp->strings[idx])
+        tmp->stringbytes += ARENA_ROUND(strlen(tmp->strings[idx]) + 1);
+}
+
+static int read_track(struct himd * himd, struct catalogtemp * tmp, unsigned int i,
+                      struct himderrinfo * status)
+{
+    struct trackinfo * t = &tmp->info[i];
+    struct fraginfo frag;
+    unsigned int fragnum, steps = 0;
+
+    tmp->slot[i] = himd_get_trackslot(himd, i, status);
+    if(tmp->slot[i] == 0 || himd_get_track_info(himd, tmp->slot[i], t, status) < 0)
+        return -1;
+
+    for(fragnum = t->firstfrag; fragnum != 0; fragnum = frag.nextfrag)
+    {
+        if(++steps > HIMD_LAST_FRAGMENT)
+        {
+            set_status_printf(status, HIMD_ERROR_FRAGMENT_CHAIN_BROKEN,
+                              _("Fragment chain of track %u loops"), tmp->slot[i]);
+            return -1;
+        }
+        if(himd_get_fragment_info(himd, fragnum, &frag, status) < 0)
+            return -1;
+        g_array_append_val(tmp->frags, frag);
+    }
+    tmp->nfrags[i] = steps;
+
+    read_string(himd, tmp, t->title);
+    read_string(himd, tmp, t->artist);
+    read_string(himd, tmp, t->album);
+    return 0;
+}
+
+static const char * string_copy(struct catalogtemp * tmp, struct himd_arena * arena, int idx)
+{
+    gsize len;
+
+    if(idx <= 0 || idx > HIMD_LAST_STRING || !tmp->strings[idx])
+        return NULL;
+    if(!tmp->copies[idx])
+    {
+        len = strlen(tmp->strings[idx]) + 1;
+        tmp->copies[idx] = himd_arena_alloc(arena, len);
+        memcpy(tmp->copies[idx], tmp->strings[idx], len);
+    }
+    return tmp->copies[idx];
+}
+
+/**
+ * Reads the whole track list of a HiMD into one block of memory, to be
+ * freed with himd_catalog_free. The arrays of the catalog are indexed by
+ * the track number in play order, the fragment arrays by fragment number
+ * within the catalog, starting at firstfrag for each track.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns the catalog, NULL on error
+ */
+struct himd_catalog * himd_catalog_load(struct himd * himd, struct himderrinfo * status)
+{
+    struct catalogtemp * tmp;
+    struct himd_catalog * cat;
+    struct himd_arena arena;
+    unsigned int i, count, fragcount, f;
+    gsize size;
+
+    g_return_val_if_fail(himd != NULL, NULL);
+
+    count = himd_track_count(himd);
+    tmp = g_new0(struct catalogtemp, 1);
+    tmp->info = g_new(struct trackinfo, count);
+    tmp->slot = g_new(unsigned int, count);
+    tmp->nfrags = g_new(unsigned int, count);
+    tmp->frags = g_array_new(FALSE, FALSE, sizeof(struct fraginfo));
+    for(i = 0; i < count; i++)
+        if(read_track(himd, tmp, i, status) < 0)
+        {
+            catalogtemp_free(tmp);
+            return NULL;
+        }
+    fragcount = tmp->frags->len;
+
+    size = ARENA_ROUND(sizeof *cat) +
+           7 * ARENA_ROUND(count * sizeof(unsigned int)) +	/* slot .. nfrags */
+           4 * ARENA_ROUND(count * sizeof(const char *)) +	/* title .. codecname */
+           ARENA_ROUND(count) +					/* uploadable */
+           ARENA_ROUND(count * sizeof(struct trackinfo)) +
+           2 * ARENA_ROUND(fragcount * sizeof(unsigned int)) +
+           2 * ARENA_ROUND(fragcount) +
+           ARENA_ROUND(fragcount * 8) +
+           tmp->stringbytes + ARENA_ALIGN;
+    himd_arena_init(&arena, g_malloc(size), size);
+
+    cat = himd_arena_alloc(&arena, sizeof *cat);
+    cat->trackcount = count;
+    cat->fragcount = fragcount;
+    cat->slot = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->seconds = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->blocks = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->frames = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->kbps = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->firstfrag = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->nfrags = himd_arena_alloc(&arena, count * sizeof(unsigned int));
+    cat->title = himd_arena_alloc(&arena, count * sizeof(const char *));
+    cat->artist = himd_arena_alloc(&arena, count * sizeof(const char *));
+    cat->album = himd_arena_alloc(&arena, count * sizeof(const char *));
+    cat->codecname = himd_arena_alloc(&arena, count * sizeof(const char *));
+    cat->uploadable = himd_arena_alloc(&arena, count);
+    cat->info = himd_arena_alloc(&arena, count * sizeof(struct trackinfo));
+    cat->frag_firstblock = himd_arena_alloc(&arena, fragcount * sizeof(unsigned int));
+    cat->frag_lastblock = himd_arena_alloc(&arena, fragcount * sizeof(unsigned int));
+    cat->frag_firstframe = himd_arena_alloc(&arena, fragcount);
+    cat->frag_lastframe = himd_arena_alloc(&arena, fragcount);
+    cat->frag_key = himd_arena_alloc(&arena, fragcount * 8);
+
+    for(i = 0, f = 0; i < count; i++)
+    {
+        const struct trackinfo * t = &tmp->info[i];
+        unsigned int fpb = himd_trackinfo_framesperblock(t);
+        unsigned int end = f + tmp->nfrags[i];
+
+        cat->slot[i] = tmp->slot[i];
+        cat->seconds[i] = t->seconds;
+        cat->kbps[i] = sony_codecinfo_kbps(&t->codec_info);
+        cat->codecname[i] = himd_get_codec_name(t);
+        cat->uploadable[i] = himd_track_uploadable(himd, t);
+        cat->title[i] = string_copy(tmp, &arena, t->title);
+        cat->artist[i] = string_copy(tmp, &arena, t->artist);
+        cat->album[i] = string_copy(tmp, &arena, t->album);
+        cat->info[i] = *t;
+        cat->firstfrag[i] = f;
+        cat->nfrags[i] = tmp->nfrags[i];
+        cat->blocks[i] = 0;
+        cat->frames[i] = 0;
+        for(; f < end; f++)
+        {
+            const struct fraginfo * frag = &g_array_index(tmp->frags, struct fraginfo, f);
+            unsigned int blocks = frag->lastblock - frag->firstblock + 1;
+
+            cat->frag_firstblock[f] = frag->firstblock;
+            cat->frag_lastblock[f] = frag->lastblock;
+            cat->frag_firstframe[f] = frag->firstframe;
+            cat->frag_lastframe[f] = frag->lastframe;
+            memcpy(cat->frag_key[f], frag->key, 8);
+            cat->blocks[i] += blocks;
+            /* same as himd_track_frames, MPEG frame counts are not stored */
+            if(fpb != TRACK_IS_MPEG)
+                cat->frames[i] += blocks * fpb - frag->firstframe - (fpb - 1 - frag->lastframe);
+        }
+    }
+
+    catalogtemp_free(tmp);
+    return cat;
+}
+
+void himd_catalog_free(struct himd_catalog * catalog)
+{
+    g_free(catalog);
+}
@@ -0,0 +1,563 @@
+/*
+ * decode.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+#ifdef CONFIG_WITH_AVCODEC
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+/* The decoder is set up like the OMA demuxer of libavformat would do it
+   from the same codec info bytes, so nothing has to be probed. */
+
+struct himd_atracdecoder {
+    AVCodecContext * avctx;
+    AVPacket * packet;
+    AVFrame * frame;
+    unsigned int framesize;
+    unsigned int channels;
+    unsigned char * inbuf;	/* framesize plus the padding libavcodec wants */
+    short * pcm;
+    unsigned int pcmsize;
+};
+
+static unsigned int atrac_channels(const struct sony_codecinfo * ci)
+{
+    static const unsigned char at3p_channels[8] = {0, 1, 2, 3, 4, 6, 7, 8};
+
+    if(sony_codecinfo_is_at3p(ci))
+        return at3p_channels[(ci->codecinfo[1] >> 2) & 7];
+    return 2;
+}
+
+static void set_av_status(struct himderrinfo * status, enum himdstatus code, const char * what, int err)
+{
+    char msg[AV_ERROR_MAX_STRING_SIZE];
+
+    av_strerror(err, msg, sizeof msg);
+    set_status_printf(status, code, "%s: %s", what, msg);
+}
+
+/**
+ * Creates a decoder for ATRAC3 or ATRAC3plus frames of the given codec,
+ * producing interleaved 16 bit samples in host byte order.
+ *
+ * @param ci Codec info of the track
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns the decoder, NULL on error
+ */
+struct himd_atracdecoder * himd_atracdecoder_new(const struct sony_codecinfo * ci, struct himderrinfo * status)
+{
+    struct himd_atracdecoder * dec;
+    const AVCodec * codec;
+    int err;
+
+    g_return_val_if_fail(ci != NULL, NULL);
+
+    if(!sony_codecinfo_is_at3(ci) && !sony_codecinfo_is_at3p(ci))
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_AUDIO_CODEC,
+                          _("Can't decode %s audio"), sony_codecinfo_codecname(ci));
+        return NULL;
+    }
+    codec = avcodec_find_decoder(sony_codecinfo_is_at3(ci) ? AV_CODEC_ID_ATRAC3 : AV_CODEC_ID_ATRAC3P);
+    if(!codec)
+    {
+        set_status_printf(status, HIMD_ERROR_DISABLED_FEATURE,
+                          _("Can't decode %s: libavcodec has no decoder for it"),
+                          sony_codecinfo_codecname(ci));
+        return NULL;
+    }
+
+    dec = g_new0(struct himd_atracdecoder, 1);
+    dec->framesize = sony_codecinfo_bytesperframe(ci);
+    dec->channels = atrac_channels(ci);
+    dec->avctx = avcodec_alloc_context3(codec);
+    dec->packet = av_packet_alloc();
+    dec->frame = av_frame_alloc();
+    if(!dec->avctx || !dec->packet || !dec->frame || dec->channels == 0)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate ATRAC decoder"));
+        goto fail;
+    }
+    dec->avctx->sample_rate = sony_codecinfo_samplerate(ci);
+    dec->avctx->block_align = dec->framesize;
+    av_channel_layout_default(&dec->avctx->ch_layout, dec->channels);
+
+    if(sony_codecinfo_is_at3(ci))
+    {
+        /* WAV style extradata: version, sample rate, twice the joint
+           stereo flag and the frame factor */
+        unsigned char * ed = av_mallocz(14 + AV_INPUT_BUFFER_PADDING_SIZE);
+        unsigned int jointstereo = (ci->codecinfo[0] >> 1) & 1;
+
+        if(!ed)
+        {
+            set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate ATRAC decoder"));
+            goto fail;
+        }
+        ed[0] = 1;
+        ed[2] = dec->avctx->sample_rate & 0xFF;
+        ed[3] = (dec->avctx->sample_rate >> 8) & 0xFF;
+        ed[4] = (dec->avctx->sample_rate >> 16) & 0xFF;
+        ed[6] = jointstereo;
+        ed[8] = jointstereo;
+        ed[10] = 1;
+        dec->avctx->extradata = ed;
+        dec->avctx->extradata_size = 14;
+    }
+
+    err = avcodec_open2(dec->avctx, codec, NULL);
+    if(err < 0)
+    {
+        set_av_status(status, HIMD_ERROR_BAD_AUDIO_CODEC, _("Can't open ATRAC decoder"), err);
+        goto fail;
+    }
+    dec->inbuf = g_malloc0(dec->framesize + AV_INPUT_BUFFER_PADDING_SIZE);
+    return dec;
+
+fail:
+    himd_atracdecoder_free(dec);
+    return NULL;
+}
+
+unsigned int himd_atracdecoder_channels(const struct himd_atracdecoder * dec)
+{
+    g_return_val_if_fail(dec != NULL, 0);
+    return dec->channels;
+}
+
+static inline short scale_float(float sample)
+{
+    sample *= 32768.0f;
+    if(sample >= 32767.0f)
+        return 32767;
+    if(sample <= -32768.0f)
+        return -32768;
+    return (short)(sample + (sample < 0 ? -0.5f : 0.5f));
+}
+
+/* appends the decoded frame to dec->pcm, returns the sample count */
+static int convert_frame(struct himd_atracdecoder * dec, unsigned int offset, struct himderrinfo * status)
+{
+    const AVFrame * f = dec->frame;
+    unsigned int count = f->nb_samples * dec->channels;
+    unsigned int i, c;
+    short * out;
+
+    if(f->format != AV_SAMPLE_FMT_FLTP && f->format != AV_SAMPLE_FMT_FLT)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                          _("ATRAC decoder returned unsupported sample format %d"), f->format);
+        return -1;
+    }
+    if(offset + count > dec->pcmsize)
+    {
+        dec->pcmsize = offset + count;
+        dec->pcm = g_renew(short, dec->pcm, dec->pcmsize);
+    }
+    out = dec->pcm + offset;
+
+    if(f->format == AV_SAMPLE_FMT_FLT)
+    {
+        const float * in = (const float *)f->extended_data[0];
+        for(i = 0; i < count; i++)
+            out[i] = scale_float(in[i]);
+    }
+    else
+        for(c = 0; c < dec->channels; c++)
+        {
+            const float * in = (const float *)f->extended_data[c];
+            for(i = 0; i < (unsigned int)f->nb_samples; i++)
+                out[i * dec->channels + c] = scale_float(in[i]);
+        }
+    return count;
+}
+
+/**
+ * Decodes one frame as returned by himd_nonmp3stream_read_frame. The
+ * samples stay valid until the next call.
+ *
+ * @param dec Decoder from himd_atracdecoder_new
+ * @param frame Frame data
+ * @param len Frame length, has to be the frame size of the codec
+ * @param pcmout Returns the interleaved samples
+ * @param countout Returns the number of samples of all channels
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if successful, -1 otherwise
+ */
+int himd_atracdecoder_decode(struct himd_atracdecoder * dec, const unsigned char * frame, unsigned int len,
+                             const short ** pcmout, unsigned int * countout, struct himderrinfo * status)
+{
+    unsigned int count = 0;
+    int err, n;
+
+    g_return_val_if_fail(dec != NULL, -1);
+    g_return_val_if_fail(frame != NULL, -1);
+
+    if(len != dec->framesize)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                          _("ATRAC frame of %u bytes, expected %u"), len, dec->framesize);
+        return -1;
+    }
+    memcpy(dec->inbuf, frame, len);
+    dec->packet->data = dec->inbuf;
+    dec->packet->size = len;
+
+    err = avcodec_send_packet(dec->avctx, dec->packet);
+    if(err < 0)
+    {
+        set_av_status(status, HIMD_ERROR_BAD_DATA_FORMAT, _("Can't decode ATRAC frame"), err);
+        return -1;
+    }
+    while((err = avcodec_receive_frame(dec->avctx, dec->frame)) >= 0)
+    {
+        n = convert_frame(dec, count, status);
+        av_frame_unref(dec->frame);
+        if(n < 0)
+            return -1;
+        count += n;
+    }
+    if(err != AVERROR(EAGAIN))
+    {
+        set_av_status(status, HIMD_ERROR_BAD_DATA_FORMAT, _("Can't decode ATRAC frame"), err);
+        return -1;
+    }
+
+    *pcmout = dec->pcm;
+    *countout = count;
+    return 0;
+}
+
+void himd_atracdecoder_free(struct himd_atracdecoder * dec)
+{
+    if(!dec)
+        return;
+    /* frees the extradata as well */
+    avcodec_free_context(&dec->avctx);
+    av_packet_free(&dec->packet);
+    av_frame_free(&dec->frame);
+    g_free(dec->inbuf);
+    g_free(dec->pcm);
+    g_free(dec);
+}
+
+#else
+
+struct himd_atracdecoder * himd_atracdecoder_new(const struct sony_codecinfo * ci, struct himderrinfo * status)
+{
+    (void)ci;
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't decode ATRAC: Compiled without libavcodec"));
+    return NULL;
+}
+
+unsigned int himd_atracdecoder_channels(const struct himd_atracdecoder * dec)
+{
+    (void)dec;
+    return 0;
+}
+
+int himd_atracdecoder_decode(struct himd_atracdecoder * dec, const unsigned char * frame, unsigned int len,
+                             const short ** pcmout, unsigned int * countout, struct himderrinfo * status)
+{
+    (void)dec;
+    (void)frame;
+    (void)len;
+    (void)pcmout;
+    (void)countout;
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't decode ATRAC: Compiled without libavcodec"));
+    return -1;
+}
+
+void himd_atracdecoder_free(struct himd_atracdecoder * dec)
+{
+    (void)dec;
+}
+
+#endif
+
+/* Parallel decoding of several tracks.
+
+   The calling thread reads the frames of one track after the other and
+   collects them in buffers of up to DECODE_CHUNK bytes. Each track has
+   DECODE_BUFFERS_PER_TRACK of them, passed to its decoding job in the
+   thread pool through a queue; when all of them are queued, reading
+   waits for the decoder. Once a track is read completely, reading
+   continues with the next one while the decoder finishes, so up to one
+   track per thread is decoded at a time. */
+
+#define DECODE_CHUNK HIMD_AUDIO_SIZE
+#define DECODE_BUFFERS_PER_TRACK 4
+
+struct decodebuffer {
+    unsigned int len;		/* 0 ends the track */
+    unsigned char data[DECODE_CHUNK];
+};
+
+struct decodectx {
+    const struct himd_pcm_sink * sink;
+    void * userctx;
+    gint aborted;
+};
+
+struct decodetrack {
+    unsigned int idx;
+    struct trackinfo info;
+    GAsyncQueue * full;
+    GAsyncQueue * free;
+    int skip;			/* no usable track info, only end is called */
+    gint failed;		/* set by the job, reading stops */
+    int readfailed;		/* set by the reader before the end marker */
+    struct himderrinfo readstatus;
+};
+
+/* LPCM is stored big endian, the sink gets host byte order */
+static int decode_lpcm(struct decodectx * ctx, struct decodetrack * t, struct decodebuffer * buf,
+                       struct himderrinfo * status)
+{
+    if(G_BYTE_ORDER == G_LITTLE_ENDIAN)
+        himd_swab16(buf->data, buf->data, buf->len / 2);
+    return ctx->sink->data(ctx->userctx, t->idx, (const short *)buf->data, buf->len / 2, status);
+}
+
+static int decode_atrac(struct decodectx * ctx, struct decodetrack * t, struct himd_atracdecoder * dec,
+                        struct decodebuffer * buf, struct himderrinfo * status)
+{
+    unsigned int framesize = sony_codecinfo_bytesperframe(&t->info.codec_info);
+    unsigned int pos, count;
+    const short * pcm;
+    int res;
+
+    for(pos = 0; pos + framesize <= buf->len; pos += framesize)
+    {
+        if(himd_atracdecoder_decode(dec, buf->data + pos, framesize, &pcm, &count, status) < 0)
+            return -1;
+        if(count > 0 && (res = ctx->sink->data(ctx->userctx, t->idx, pcm, count, status)) != 0)
+            return res;
+    }
+    return 0;
+}
+
+static void decode_job(gpointer data, gpointer user_data)
+{
+    struct decodetrack * t = data;
+    struct decodectx * ctx = user_data;
+    struct himd_atracdecoder * dec = NULL;
+    struct himderrinfo status;
+    const struct himderrinfo * result = NULL;
+    struct decodebuffer * buf;
+    unsigned int channels = 2;
+    int res;
+
+    if(t->skip)
+        result = &t->readstatus;
+    else if(!sony_codecinfo_is_lpcm(&t->info.codec_info))
+    {
+        dec = himd_atracdecoder_new(&t->info.codec_info, &status);
+        if(dec)
+            channels = himd_atracdecoder_channels(dec);
+        else
+            result = &status;
+    }
+    if(!result && ctx->sink->begin &&
+       ctx->sink->begin(ctx->userctx, t->idx, &t->info, channels, &status) < 0)
+        result = &status;
+    if(result)
+        g_atomic_int_set(&t->failed, 1);
+
+    while((buf = g_async_queue_pop(t->full))->len != 0)
+    {
+        if(!result && g_atomic_int_get(&ctx->aborted))
+        {
+            set_status_const(&status, HIMD_ERROR_ABORTED, _("Extraction aborted"));
+            result = &status;
+        }
+        if(!result)
+        {
+            if(dec)
+                res = decode_atrac(ctx, t, dec, buf, &status);
+            else
+                res = decode_lpcm(ctx, t, buf, &status);
+            if(res > 0)
+            {
+                /* the sink asked to stop */
+                set_status_const(&status, HIMD_ERROR_ABORTED, _("Extraction aborted"));
+                g_atomic_int_set(&ctx->aborted, 1);
+            }
+            if(res != 0)
+            {
+                result = &status;
+                g_atomic_int_set(&t->failed, 1);
+            }
+        }
+        g_async_queue_push(t->free, buf);
+    }
+
+    if(!result && t->readfailed)
+        result = &t->readstatus;
+    if(ctx->sink->end)
+        ctx->sink->end(ctx->userctx, t->idx, result);
+
+    g_free(buf);
+    himd_atracdecoder_free(dec);
+    g_async_queue_unref(t->full);
+    g_async_queue_unref(t->free);
+    g_free(t);
+}
+
+/* reads all frames of the track into the queue of its job */
+static void read_track(struct himd * himd, unsigned int trackno, struct decodectx * ctx,
+                       struct decodetrack * t)
+{
+    struct himd_nonmp3stream stream;
+    struct decodebuffer * buf;
+    const unsigned char * frame;
+    unsigned int len;
+
+    buf = g_async_queue_pop(t->free);
+    buf->len = 0;
+    if(!t->skip && himd_nonmp3stream_open(himd, trackno, &stream, &t->readstatus) < 0)
+        t->readfailed = 1;
+    else if(!t->skip)
+    {
+        while(!g_atomic_int_get(&t->failed) && !g_atomic_int_get(&ctx->aborted))
+        {
+            if(himd_nonmp3stream_read_frame(&stream, &frame, &len, &t->readstatus) < 0)
+            {
+                t->readfailed = t->readstatus.status != HIMD_STATUS_AUDIO_EOF;
+                break;
+            }
+            if(buf->len + len > DECODE_CHUNK)
+            {
+                g_async_queue_push(t->full, buf);
+                /* waits while the decoder is behind */
+                buf = g_async_queue_pop(t->free);
+                buf->len = 0;
+            }
+            memcpy(buf->data + buf->len, frame, len);
+            buf->len += len;
+        }
+        himd_nonmp3stream_close(&stream);
+    }
+    if(buf->len > 0)
+    {
+        g_async_queue_push(t->full, buf);
+        buf = g_async_queue_pop(t->free);
+        buf->len = 0;
+    }
+    /* the job owns the track from here on */
+    g_async_queue_push(t->full, buf);
+}
+
+/**
+ * Decodes LPCM and ATRAC tracks to 16 bit PCM, several tracks at the same
+ * time. The sink is called from the decoding threads: the calls for one
+ * track come one after the other from the same thread, those of
+ * different tracks may run concurrently. begin gets the channel count,
+ * the sample rate is the one of the codec info. data returns a negative
+ * value to fail the track and a positive value to abort the whole run,
+ * end is called with result NULL when a track completed.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param tracknos Track slots to decode, idx of the sink is the position in this list
+ * @param count Number of tracks
+ * @param threads Number of decoding threads, 0 for one per processor
+ * @param sink Callbacks receiving the samples
+ * @param ctx Passed to the callbacks
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if all tracks were processed, even if some failed,
+ *         -1 if the run was aborted or couldn't start
+ */
+int himd_decode_run(struct himd * himd, const unsigned int * tracknos, unsigned int count,
+                    unsigned int threads, const struct himd_pcm_sink * sink, void * ctx,
+                    struct himderrinfo * status)
+{
+    struct decodectx dctx;
+    GThreadPool * pool;
+    GError * error = NULL;
+    unsigned int i, b;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(sink->data != NULL, -1);
+
+    if(threads == 0)
+        threads = g_get_num_processors();
+    dctx.sink = sink;
+    dctx.userctx = ctx;
+    dctx.aborted = 0;
+
+    pool = g_thread_pool_new(decode_job, &dctx, threads, FALSE, &error);
+    if(!pool)
+    {
+        set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
+                          _("Can't start decoding threads: %s"), error->message);
+        g_error_free(error);
+        return -1;
+    }
+
+    for(i = 0; i < count && !g_atomic_int_get(&dctx.aborted); i++)
+    {
+        struct decodetrack * t = g_new0(struct decodetrack, 1);
+
+        t->idx = i;
+        t->full = g_async_queue_new();
+        t->free = g_async_queue_new_full(g_free);
+        for(b = 0; b < DECODE_BUFFERS_PER_TRACK; b++)
+            g_async_queue_push(t->free, g_new(struct decodebuffer, 1));
+
+        if(himd_get_track_info(himd, tracknos[i], &t->info, &t->readstatus) < 0)
+            t->skip = 1;
+        else if(sony_codecinfo_is_mpeg(&t->info.codec_info))
+        {
+            set_status_printf(&t->readstatus, HIMD_ERROR_BAD_AUDIO_CODEC,
+                              _("Can't decode %s audio of track %d"),
+                              sony_codecinfo_codecname(&t->info.codec_info), tracknos[i]);
+            t->skip = 1;
+        }
+        g_thread_pool_push(pool, t, NULL);
+        read_track(himd, tracknos[i], &dctx, t);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    if(dctx.aborted)
+    {
+        set_status_const(status, HIMD_ERROR_ABORTED, _("Extraction aborted"));
+        return -1;
+    }
+    return 0;
+}
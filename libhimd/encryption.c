@@ -58,6 +58,7 @@ int himd_obtain_mp3key(struct himd * himd, int track, mp3key * key, struct himde
 }
 
 #ifdef CONFIG_WITH_GCRYPT
+#include <glib.h>
 #include "himd_private.h"
 #include <gcrypt.h>
 #include <string.h>
@@ -124,7 +125,15 @@ static void xor_keys(unsigned char * out,
         out[i] = in1[i] ^ in2[i];
 }
 
-int descrypt_open(void ** dataptr, const unsigned char * trackkey, 
+G_STATIC_ASSERT(sizeof(struct descrypt_data) <= 512);	/* see HIMD_STREAM_ARENA_SIZE */
+
+size_t descrypt_size(void)
+{
+    return sizeof(struct descrypt_data);
+}
+
+/* sets up the decryption state in descrypt_size() bytes at dataptr */
+int descrypt_init(void * dataptr, const unsigned char * trackkey,
                   unsigned int ekbnum, struct himderrinfo * status)
 {
     /* gcrypt only supports three-key 3DES, so set key1 == key3 */
@@ -132,7 +141,7 @@ int descrypt_open(void ** dataptr, const unsigned char * trackkey,
                                                     0x54,0x2e,0xf5,0x12,0x3b,0xcd,0xbc,0xa4,
                                                     0xf5,0x1e,0xcb,0x2a,0x80,0x8f,0x15,0xfd};
     gcry_cipher_hd_t rootcipher;
-    struct descrypt_data * data;
+    struct descrypt_data * data = dataptr;
     int err;
 
     if(ekbnum != 0x00010012)
@@ -141,12 +150,6 @@ int descrypt_open(void ** dataptr, const unsigned char * trackkey,
         return -1;
     }
 
-    data = malloc(sizeof *data);
-    if(!data)
-    {
-        set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate crypt helper structure"));
-        return -1;
-    }
     if(gcry_cipher_open(&rootcipher, GCRY_CIPHER_3DES, GCRY_CIPHER_MODE_ECB, 0) != 0)
     {
         set_status_const(status, HIMD_ERROR_ENCRYPTION_FAILURE, _("Can't aquire 3DES ECB encryption"));
@@ -178,7 +181,23 @@ int descrypt_open(void ** dataptr, const unsigned char * trackkey,
         cached_cipher_deinit(&data->master);
         return -1;
     }
+    return 0;
+}
 
+int descrypt_open(void ** dataptr, const unsigned char * trackkey, 
+                  unsigned int ekbnum, struct himderrinfo * status)
+{
+    void * data = malloc(descrypt_size());
+    if(!data)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate crypt helper structure"));
+        return -1;
+    }
+    if(descrypt_init(data, trackkey, ekbnum, status) < 0)
+    {
+        free(data);
+        return -1;
+    }
     *dataptr = data;
     return 0;
 }
@@ -219,11 +238,16 @@ int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
     return 0;
 }
 
-void descrypt_close(void * dataptr)
+void descrypt_fini(void * dataptr)
 {
     struct descrypt_data * data = dataptr;
     cached_cipher_deinit(&data->block);
     cached_cipher_deinit(&data->master);
+}
+
+void descrypt_close(void * dataptr)
+{
+    descrypt_fini(dataptr);
     free(dataptr);
 }
 
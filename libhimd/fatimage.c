@@ -0,0 +1,473 @@
+/*
+ * fatimage.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Read-only access to the HMDHIFI directory of a FAT12 or FAT16 image,
+   so raw disc images can be used without mounting them. The image may
+   start with a partition table, then the first partition is used. */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "himd.h"
+#include "himd_private.h"
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define _(x) (x)
+
+#define FAT_END 0xFFFFFFFF		/* end of chain marker in fatimage.next */
+
+/* a contiguous piece of a file */
+struct fat_extent {
+    goffset fileoffset;
+    goffset imageoffset;
+    goffset length;
+};
+
+struct fat_dirent {
+    char name[13];
+    guint32 firstcluster;
+    guint32 size;
+};
+
+struct fatimage {
+    int fd;
+    GMutex lock;
+    unsigned int clustersize;
+    unsigned int clusters;		/* data clusters, numbered from 2 */
+    goffset dataoffset;
+    guint32 * next;			/* decoded FAT, next cluster of each cluster */
+    GArray * files;			/* fat_dirent of everything in HMDHIFI */
+};
+
+struct fatimage_file {
+    struct fatimage * img;
+    goffset size;
+    unsigned int extentcount;
+    struct fat_extent * extents;
+};
+
+static inline unsigned int le16(const unsigned char * c)
+{
+    return c[0] | c[1] << 8;
+}
+
+static inline guint32 le32(const unsigned char * c)
+{
+    return c[0] | c[1] << 8 | c[2] << 16 | (guint32)c[3] << 24;
+}
+
+static int read_exact(struct fatimage * img, unsigned char * buffer, gsize len, goffset offset)
+{
+    return himd_pread(img->fd, &img->lock, buffer, len, offset) == (gssize)len ? 0 : -1;
+}
+
+static int is_fat_bootsector(const unsigned char * sector)
+{
+    unsigned int bps = le16(sector + 0x0B);
+    unsigned int spc = sector[0x0D];
+
+    return (sector[0] == 0xEB || sector[0] == 0xE9) &&
+           (bps == 512 || bps == 1024 || bps == 2048 || bps == 4096) &&
+           spc != 0 && (spc & (spc - 1)) == 0 &&
+           le16(sector + 0x0E) != 0 && sector[0x10] != 0;
+}
+
+/* Maps the cluster chain starting at first to extents, merging adjacent
+   clusters, until maxlen bytes or the end of the chain are reached. */
+static struct fat_extent * resolve_chain(struct fatimage * img, guint32 first, goffset maxlen,
+                                         unsigned int * count, struct himderrinfo * status)
+{
+    GArray * extents = g_array_new(FALSE, FALSE, sizeof(struct fat_extent));
+    goffset done = 0;
+    guint32 cluster = first;
+    unsigned int steps = 0;
+
+    while(done < maxlen && cluster != FAT_END)
+    {
+        goffset imageoffset;
+        struct fat_extent * last;
+
+        if(cluster < 2 || cluster >= img->clusters + 2 || steps++ > img->clusters)
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_FILESYSTEM,
+                              _("Broken cluster chain starting at %u"), first);
+            g_array_free(extents, TRUE);
+            return NULL;
+        }
+        imageoffset = img->dataoffset + (goffset)(cluster - 2) * img->clustersize;
+        last = extents->len ? &g_array_index(extents, struct fat_extent, extents->len - 1) : NULL;
+        if(last && last->imageoffset + last->length == imageoffset)
+            last->length += img->clustersize;
+        else
+        {
+            struct fat_extent e;
+            e.fileoffset = done;
+            e.imageoffset = imageoffset;
+            e.length = img->clustersize;
+            g_array_append_val(extents, e);
+        }
+        done += img->clustersize;
+        cluster = img->next[cluster];
+    }
+    if(done < maxlen && maxlen != G_MAXINT64)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_FILESYSTEM,
+                          _("Cluster chain starting at %u is too short"), first);
+        g_array_free(extents, TRUE);
+        return NULL;
+    }
+    *count = extents->len;
+    return (struct fat_extent *)g_array_free(extents, FALSE);
+}
+
+static void dirent_name(const unsigned char * entry, char * name)
+{
+    int i, len = 0;
+
+    for(i = 0; i < 8 && entry[i] != ' '; i++)
+        name[len++] = entry[i];
+    if(entry[8] != ' ')
+    {
+        name[len++] = '.';
+        for(i = 8; i < 11 && entry[i] != ' '; i++)
+            name[len++] = entry[i];
+    }
+    name[len] = '\0';
+    if((unsigned char)name[0] == 0x05)
+        name[0] = (char)0xE5;
+}
+
+/* Calls back for all files and directories in the directory listing,
+   skipping long name entries, deleted entries and volume labels.
+   Stops and returns the entry if found returns nonzero. */
+static const unsigned char * scan_dir(const unsigned char * dir, gsize len,
+                                      int (*found)(const unsigned char * entry, void * ctx),
+                                      void * ctx)
+{
+    gsize off;
+
+    for(off = 0; off + 32 <= len; off += 32)
+    {
+        const unsigned char * entry = dir + off;
+        if(entry[0] == 0)
+            break;
+        if(entry[0] == 0xE5 || (entry[11] & 0x0F) == 0x0F || (entry[11] & 0x08))
+            continue;
+        if(found(entry, ctx))
+            return entry;
+    }
+    return NULL;
+}
+
+static int is_hmdhifi(const unsigned char * entry, void * ctx)
+{
+    (void)ctx;
+    return (entry[11] & 0x10) && g_ascii_strncasecmp((const char *)entry, "HMDHIFI    ", 11) == 0;
+}
+
+static int add_file(const unsigned char * entry, void * ctx)
+{
+    GArray * files = ctx;
+    struct fat_dirent f;
+
+    if(entry[11] & 0x10)
+        return 0;
+    dirent_name(entry, f.name);
+    f.firstcluster = le16(entry + 26);
+    f.size = le32(entry + 28);
+    g_array_append_val(files, f);
+    return 0;
+}
+
+static int fatimage_load(struct fatimage * img, struct himderrinfo * status)
+{
+    unsigned char sector[512];
+    goffset partoffset = 0;
+    unsigned int bps, reserved, nfats, rootentries, fatsectors, rootsectors;
+    guint32 totalsectors, datasectors, hmdhifi, i;
+    goffset fatoffset, rootoffset;
+    unsigned char * fat, * root, * dir;
+    const unsigned char * entry;
+    struct fat_extent * extents;
+    unsigned int extentcount;
+    gsize fatlen;
+
+    if(read_exact(img, sector, sizeof sector, 0) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_FILESYSTEM, _("Can't read boot sector: %s"),
+                          g_strerror(errno));
+        return -1;
+    }
+    if(!is_fat_bootsector(sector) && sector[510] == 0x55 && sector[511] == 0xAA)
+    {
+        /* partitioned image, use the first partition */
+        partoffset = (goffset)le32(sector + 0x1BE + 8) * 512;
+        if(read_exact(img, sector, sizeof sector, partoffset) < 0)
+            sector[0] = 0;
+    }
+    if(!is_fat_bootsector(sector))
+    {
+        set_status_const(status, HIMD_ERROR_BAD_FILESYSTEM, _("Not a FAT filesystem image"));
+        return -1;
+    }
+
+    bps = le16(sector + 0x0B);
+    img->clustersize = bps * sector[0x0D];
+    reserved = le16(sector + 0x0E);
+    nfats = sector[0x10];
+    rootentries = le16(sector + 0x11);
+    totalsectors = le16(sector + 0x13) ? le16(sector + 0x13) : le32(sector + 0x20);
+    fatsectors = le16(sector + 0x16);
+    if(fatsectors == 0 || rootentries == 0)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_FILESYSTEM, _("FAT32 images are not supported"));
+        return -1;
+    }
+    rootsectors = (rootentries * 32 + bps - 1) / bps;
+    fatoffset = partoffset + (goffset)reserved * bps;
+    rootoffset = fatoffset + (goffset)nfats * fatsectors * bps;
+    img->dataoffset = rootoffset + (goffset)rootsectors * bps;
+    if(totalsectors <= reserved + nfats * fatsectors + rootsectors)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_FILESYSTEM, _("FAT filesystem has no data area"));
+        return -1;
+    }
+    datasectors = totalsectors - (reserved + nfats * fatsectors + rootsectors);
+    img->clusters = datasectors / sector[0x0D];
+    if(img->clusters >= 65525)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_FILESYSTEM, _("FAT32 images are not supported"));
+        return -1;
+    }
+
+    /* decode the first FAT once, FAT12 entries are 1.5 bytes */
+    fatlen = (gsize)fatsectors * bps;
+    fat = g_malloc(fatlen);
+    if(read_exact(img, fat, fatlen, fatoffset) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_FILESYSTEM, _("Can't read FAT: %s"),
+                          g_strerror(errno));
+        g_free(fat);
+        return -1;
+    }
+    img->next = g_new(guint32, img->clusters + 2);
+    for(i = 0; i < img->clusters + 2; i++)
+    {
+        guint32 val, endmark;
+        if(img->clusters < 4085)
+        {
+            gsize off = i + i/2;
+            val = off + 1 < fatlen ? le16(fat + off) : 0xFFF;
+            val = (i & 1) ? val >> 4 : val & 0xFFF;
+            endmark = 0xFF8;
+        }
+        else
+        {
+            val = 2*i + 1 < fatlen ? le16(fat + 2*i) : 0xFFFF;
+            endmark = 0xFFF8;
+        }
+        img->next[i] = val >= endmark ? FAT_END : val;
+    }
+    g_free(fat);
+
+    root = g_malloc((gsize)rootsectors * bps);
+    if(read_exact(img, root, (gsize)rootsectors * bps, rootoffset) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_FILESYSTEM, _("Can't read root directory: %s"),
+                          g_strerror(errno));
+        g_free(root);
+        return -1;
+    }
+    entry = scan_dir(root, (gsize)rootentries * 32, is_hmdhifi, NULL);
+    hmdhifi = entry ? le16(entry + 26) : 0;
+    g_free(root);
+    if(!entry)
+    {
+        set_status_const(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI, _("No HMDHIFI directory in image"));
+        return -1;
+    }
+
+    extents = resolve_chain(img, hmdhifi, G_MAXINT64, &extentcount, status);
+    if(!extents)
+        return -1;
+    img->files = g_array_new(FALSE, FALSE, sizeof(struct fat_dirent));
+    for(i = 0; i < extentcount; i++)
+    {
+        dir = g_malloc(extents[i].length);
+        if(read_exact(img, dir, extents[i].length, extents[i].imageoffset) < 0)
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_FILESYSTEM, _("Can't read HMDHIFI directory: %s"),
+                              g_strerror(errno));
+            g_free(dir);
+            g_free(extents);
+            return -1;
+        }
+        scan_dir(dir, extents[i].length, add_file, img->files);
+        g_free(dir);
+    }
+    g_free(extents);
+    return 0;
+}
+
+static void fatimage_destroy(void * iodata)
+{
+    struct fatimage * img = iodata;
+
+    close(img->fd);
+    g_mutex_clear(&img->lock);
+    g_free(img->next);
+    if(img->files)
+        g_array_free(img->files, TRUE);
+    g_free(img);
+}
+
+void * himd_fatimage_open(const char * imagepath, struct himderrinfo * status)
+{
+    struct fatimage * img = g_new0(struct fatimage, 1);
+
+    img->fd = g_open(imagepath, O_RDONLY | O_BINARY, 0);
+    if(img->fd < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI, _("Can't open image %s: %s"),
+                          imagepath, g_strerror(errno));
+        g_free(img);
+        return NULL;
+    }
+    g_mutex_init(&img->lock);
+    if(fatimage_load(img, status) < 0)
+    {
+        fatimage_destroy(img);
+        return NULL;
+    }
+    return img;
+}
+
+static gchar ** fatimage_list(void * iodata, struct himderrinfo * status)
+{
+    struct fatimage * img = iodata;
+    gchar ** names = g_new(gchar *, img->files->len + 1);
+    unsigned int i;
+
+    (void)status;
+    for(i = 0; i < img->files->len; i++)
+        names[i] = g_strdup(g_array_index(img->files, struct fat_dirent, i).name);
+    names[i] = NULL;
+    return names;
+}
+
+static void * fatimage_open(void * iodata, const char * name)
+{
+    struct fatimage * img = iodata;
+    struct fatimage_file * file;
+    unsigned int i;
+
+    for(i = 0; i < img->files->len; i++)
+    {
+        struct fat_dirent * f = &g_array_index(img->files, struct fat_dirent, i);
+        if(g_ascii_strcasecmp(f->name, name) != 0)
+            continue;
+        file = g_new0(struct fatimage_file, 1);
+        file->img = img;
+        file->size = f->size;
+        if(f->size != 0)
+        {
+            file->extents = resolve_chain(img, f->firstcluster, f->size, &file->extentcount, NULL);
+            if(!file->extents)
+            {
+                g_free(file);
+                errno = EIO;
+                return NULL;
+            }
+        }
+        return file;
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+/* Splits the read at extent boundaries, so a contiguous file is read
+   with a single pread. */
+static gssize fatimage_pread(void * file, unsigned char * buffer, gsize len, goffset offset)
+{
+    struct fatimage_file * f = file;
+    unsigned int lo = 0, hi = f->extentcount;
+    gsize done = 0;
+
+    if(offset >= f->size)
+        return 0;
+    if((goffset)len > f->size - offset)
+        len = f->size - offset;
+
+    /* find the last extent starting at or before offset */
+    while(hi - lo > 1)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if(f->extents[mid].fileoffset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    while(done < len)
+    {
+        const struct fat_extent * e = &f->extents[lo++];
+        goffset skip = offset + done - e->fileoffset;
+        gsize chunk = MIN(len - done, (gsize)(e->length - skip));
+        gssize n = himd_pread(f->img->fd, &f->img->lock, buffer + done, chunk, e->imageoffset + skip);
+
+        if(n < 0)
+            return -1;
+        done += n;
+        if((gsize)n < chunk)
+            break;
+    }
+    return done;
+}
+
+static goffset fatimage_size(void * file)
+{
+    struct fatimage_file * f = file;
+    return f->size;
+}
+
+static void fatimage_close(void * file)
+{
+    struct fatimage_file * f = file;
+
+    g_free(f->extents);
+    g_free(f);
+}
+
+const struct himd_io himd_fatimage_io = {
+    fatimage_list, fatimage_open, fatimage_pread, fatimage_size, fatimage_close, fatimage_destroy,
+    NULL, 1
+};
@@ -0,0 +1,317 @@
+/*
+ * flacsink.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+#ifdef CONFIG_WITH_FLAC
+#include <FLAC/stream_encoder.h>
+#include <FLAC/metadata.h>
+
+/* The caller decrypts and hands over blocks, which are copied into one of
+   FLACSINK_BUFFERS buffers and queued for the encoder thread. When all
+   buffers are waiting, the caller blocks until the encoder catches up. */
+#define FLACSINK_BUFFERS 8
+#define FLACSINK_CHANNELS 2
+
+struct flacbuffer {
+    unsigned int len;		/* 0 ends the stream */
+    unsigned char data[HIMD_AUDIO_SIZE];
+};
+
+struct himd_flacsink {
+    FLAC__StreamEncoder * encoder;
+    FLAC__StreamMetadata * comments;
+    GThread * thread;
+    GAsyncQueue * full;
+    GAsyncQueue * free;
+    gint failed;
+    char errmsg[128];		/* set by the encoder thread before failed */
+};
+
+static gpointer flacsink_thread(gpointer data)
+{
+    struct himd_flacsink * sink = data;
+    FLAC__int32 * samples = g_new(FLAC__int32, HIMD_AUDIO_SIZE / 2);
+    struct flacbuffer * buf;
+
+    while((buf = g_async_queue_pop(sink->full))->len != 0)
+    {
+        unsigned int i, count = buf->len / 2;
+
+        if(!g_atomic_int_get(&sink->failed))
+        {
+            /* LPCM is stored big endian */
+            for(i = 0; i < count; i++)
+                samples[i] = (FLAC__int16)((buf->data[2*i] << 8) | buf->data[2*i+1]);
+            if(!FLAC__stream_encoder_process_interleaved(sink->encoder, samples,
+                                                         count / FLACSINK_CHANNELS))
+            {
+                g_snprintf(sink->errmsg, sizeof sink->errmsg, _("FLAC encoder failed: %s"),
+                           FLAC__stream_encoder_get_resolved_state_string(sink->encoder));
+                g_atomic_int_set(&sink->failed, 1);
+            }
+        }
+        g_async_queue_push(sink->free, buf);
+    }
+    g_async_queue_push(sink->free, buf);
+    g_free(samples);
+    return NULL;
+}
+
+static int add_comment(FLAC__StreamMetadata * comments, const char * name, const char * value)
+{
+    FLAC__StreamMetadata_VorbisComment_Entry entry;
+
+    if(!value || !*value)
+        return 0;
+    if(!FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry, name, value))
+        return -1;
+    return FLAC__metadata_object_vorbiscomment_append_comment(comments, entry, FALSE) ? 0 : -1;
+}
+
+static int add_string_comment(struct himd * himd, FLAC__StreamMetadata * comments,
+                              const char * name, unsigned int idx)
+{
+    char * str;
+    int ret;
+
+    if(idx == 0 || !(str = himd_get_string_utf8(himd, idx, NULL, NULL)))
+        return 0;
+    ret = add_comment(comments, name, str);
+    himd_free(str);
+    return ret;
+}
+
+static FLAC__StreamMetadata * track_comments(struct himd * himd, const struct trackinfo * track)
+{
+    FLAC__StreamMetadata * comments = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    char buf[32];
+    int ret;
+
+    if(!comments)
+        return NULL;
+    ret = add_string_comment(himd, comments, "TITLE", track->title);
+    ret |= add_string_comment(himd, comments, "ARTIST", track->artist);
+    ret |= add_string_comment(himd, comments, "ALBUM", track->album);
+    if(track->trackinalbum > 0)
+    {
+        g_snprintf(buf, sizeof buf, "%d", track->trackinalbum);
+        ret |= add_comment(comments, "TRACKNUMBER", buf);
+    }
+    if(track->recordingtime.tm_mon != -1)
+    {
+        strftime(buf, sizeof buf, "%Y-%m-%d", &track->recordingtime);
+        ret |= add_comment(comments, "DATE", buf);
+    }
+    if(ret != 0)
+    {
+        FLAC__metadata_object_delete(comments);
+        return NULL;
+    }
+    return comments;
+}
+
+/**
+ * Creates a FLAC file for an LPCM track, tagged with the title, artist
+ * and album of the track. Encoding runs in a thread of its own, so
+ * reading the next blocks overlaps with compressing the previous ones.
+ * ATRAC tracks can be written after decoding them to stereo samples in
+ * the byte order of LPCM.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param track Track info of the LPCM or ATRAC track
+ * @param path Name of the FLAC file
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns the sink, NULL on error
+ */
+struct himd_flacsink * himd_flacsink_open(struct himd * himd, const struct trackinfo * track,
+                                          const char * path, struct himderrinfo * status)
+{
+    struct himd_flacsink * sink;
+    FLAC__StreamEncoderInitStatus initstatus;
+    struct himderrinfo framestatus;
+    int frames, i;
+
+    g_return_val_if_fail(himd != NULL, NULL);
+    g_return_val_if_fail(track != NULL, NULL);
+    g_return_val_if_fail(path != NULL, NULL);
+
+    if(sony_codecinfo_is_mpeg(&track->codec_info))
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_AUDIO_CODEC,
+                          _("Only LPCM and ATRAC tracks can be encoded as FLAC, not %s"),
+                          himd_get_codec_name(track));
+        return NULL;
+    }
+
+    sink = g_new0(struct himd_flacsink, 1);
+    sink->encoder = FLAC__stream_encoder_new();
+    sink->comments = track_comments(himd, track);
+    if(!sink->encoder || !sink->comments)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate FLAC encoder"));
+        goto fail;
+    }
+
+    FLAC__stream_encoder_set_channels(sink->encoder, FLACSINK_CHANNELS);
+    FLAC__stream_encoder_set_bits_per_sample(sink->encoder, 16);
+    FLAC__stream_encoder_set_sample_rate(sink->encoder, sony_codecinfo_samplerate(&track->codec_info));
+    FLAC__stream_encoder_set_compression_level(sink->encoder, 5);
+    frames = himd_track_frames(himd, track, &framestatus);
+    if(frames > 0)
+        FLAC__stream_encoder_set_total_samples_estimate(sink->encoder,
+            (FLAC__uint64)frames * sony_codecinfo_samplesperframe(&track->codec_info));
+    FLAC__stream_encoder_set_metadata(sink->encoder, &sink->comments, 1);
+
+    initstatus = FLAC__stream_encoder_init_file(sink->encoder, path, NULL, NULL);
+    if(initstatus != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO, _("Can't create FLAC file: %s"),
+                          initstatus == FLAC__STREAM_ENCODER_INIT_STATUS_ENCODER_ERROR ?
+                          FLAC__stream_encoder_get_resolved_state_string(sink->encoder) :
+                          FLAC__StreamEncoderInitStatusString[initstatus]);
+        goto fail;
+    }
+
+    sink->full = g_async_queue_new();
+    sink->free = g_async_queue_new_full(g_free);
+    for(i = 0; i < FLACSINK_BUFFERS; i++)
+        g_async_queue_push(sink->free, g_new(struct flacbuffer, 1));
+    sink->thread = g_thread_new("flacsink", flacsink_thread, sink);
+    return sink;
+
+fail:
+    if(sink->encoder)
+        FLAC__stream_encoder_delete(sink->encoder);
+    if(sink->comments)
+        FLAC__metadata_object_delete(sink->comments);
+    g_free(sink);
+    return NULL;
+}
+
+/**
+ * Queues a block of LPCM data as returned by himd_nonmp3stream_read_block
+ * for encoding. Blocks if the encoder is behind.
+ *
+ * @return Returns 0 if successful, -1 if the encoder failed
+ */
+int himd_flacsink_write(struct himd_flacsink * sink, const unsigned char * data, unsigned int len,
+                        struct himderrinfo * status)
+{
+    struct flacbuffer * buf;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(len <= HIMD_AUDIO_SIZE, -1);
+
+    if(g_atomic_int_get(&sink->failed))
+    {
+        set_status_const(status, HIMD_ERROR_CANT_WRITE_AUDIO, sink->errmsg);
+        return -1;
+    }
+    if(len == 0)
+        return 0;
+    buf = g_async_queue_pop(sink->free);
+    memcpy(buf->data, data, len);
+    buf->len = len;
+    g_async_queue_push(sink->full, buf);
+    return 0;
+}
+
+/**
+ * Encodes the queued data, completes the FLAC file and frees the sink.
+ * After an error, the file is incomplete and should be removed.
+ *
+ * @return Returns 0 if successful, -1 otherwise
+ */
+int himd_flacsink_close(struct himd_flacsink * sink, struct himderrinfo * status)
+{
+    struct flacbuffer * end;
+    int ret = 0;
+
+    g_return_val_if_fail(sink != NULL, -1);
+
+    end = g_async_queue_pop(sink->free);
+    end->len = 0;
+    g_async_queue_push(sink->full, end);
+    g_thread_join(sink->thread);
+
+    if(g_atomic_int_get(&sink->failed))
+    {
+        set_status_const(status, HIMD_ERROR_CANT_WRITE_AUDIO, sink->errmsg);
+        ret = -1;
+    }
+    /* writes the final STREAMINFO with sample count and MD5 */
+    if(!FLAC__stream_encoder_finish(sink->encoder) && ret == 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO, _("FLAC encoder failed: %s"),
+                          FLAC__stream_encoder_get_resolved_state_string(sink->encoder));
+        ret = -1;
+    }
+    FLAC__stream_encoder_delete(sink->encoder);
+    FLAC__metadata_object_delete(sink->comments);
+    g_async_queue_unref(sink->full);
+    g_async_queue_unref(sink->free);
+    g_free(sink);
+    return ret;
+}
+
+#else
+
+struct himd_flacsink * himd_flacsink_open(struct himd * himd, const struct trackinfo * track,
+                                          const char * path, struct himderrinfo * status)
+{
+    (void)himd;
+    (void)track;
+    (void)path;
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't write FLAC: Compiled without FLAC library"));
+    return NULL;
+}
+
+int himd_flacsink_write(struct himd_flacsink * sink, const unsigned char * data, unsigned int len,
+                        struct himderrinfo * status)
+{
+    (void)sink;
+    (void)data;
+    (void)len;
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't write FLAC: Compiled without FLAC library"));
+    return -1;
+}
+
+int himd_flacsink_close(struct himd_flacsink * sink, struct himderrinfo * status)
+{
+    (void)sink;
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't write FLAC: Compiled without FLAC library"));
+    return -1;
+}
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * fsck.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+/* Consistency check of the track index.
+
+   Every table entry gets an owner: the track slot for fragments, the
+   head of the string for string chunks, or OWNER_FREE for entries on a
+   free list. Each chain is walked once, so reaching an entry that
+   already has the owner of the current chain is a loop, reaching one
+   with another owner is a cross-link. Entries without an owner after
+   all chains are walked are leaks. Used blocks are tracked in a bitmap
+   to find overlapping fragments.
+
+   Problems found on the free lists or as leaks only concern entries
+   that no chain in use reaches, so rebuilding the free lists repairs
+   them. Any other problem leaves part of a chain unowned, and freeing
+   it would corrupt the chain further, so the repair is refused. */
+
+#define TRACK_ENTRY(tif, idx) ((tif) + 0x8000 + 0x50 * (idx))
+#define FRAG_ENTRY(tif, idx) ((tif) + 0x30000 + 0x10 * (idx))
+#define STRING_ENTRY(tif, idx) ((tif) + 0x40000 + 0x10 * (idx))
+#define LINK12(entry) (beword16((entry) + 14) & 0xFFF)
+
+#define OWNER_NONE 0
+#define OWNER_FREE 0xFFFF
+
+struct fsckstate {
+    const unsigned char * tif;
+    himd_fsck_report report;
+    void * ctx;
+    struct himd_fsck_result * result;
+    int free_lists;			/* checking free lists or leaks */
+    unsigned int unrepairable;
+    unsigned short trackowner[HIMD_LAST_TRACK + 1];	/* OWNER_FREE or 1 if in play order */
+    unsigned short fragowner[HIMD_LAST_FRAGMENT + 1];
+    unsigned short stringowner[HIMD_LAST_STRING + 1];
+    unsigned char blocks[65536 / 8];
+};
+
+static void problem(struct fsckstate * st, enum himd_fsck_table table, unsigned int idx,
+                    enum himd_fsck_problem kind, unsigned int count, const char * format, ...)
+{
+    char message[128];
+    va_list args;
+
+    st->result->problems[kind] += count;
+    if(!st->free_lists && kind != HIMD_FSCK_LEAK)
+        st->unrepairable += count;
+    if(!st->report)
+        return;
+    va_start(args, format);
+    g_vsnprintf(message, sizeof message, format, args);
+    va_end(args);
+    st->report(st->ctx, table, idx, kind, message);
+}
+
+static void mark_blocks(struct fsckstate * st, unsigned int fragidx, const unsigned char * frag)
+{
+    unsigned int first = beword16(frag + 8), last = beword16(frag + 10);
+    unsigned int b, overlap = 0;
+
+    if(first > last)
+    {
+        problem(st, HIMD_FSCK_FRAGMENTS, fragidx, HIMD_FSCK_BAD_ENTRY, 1,
+                _("Fragment %u ends at block %u before it starts at %u"), fragidx, last, first);
+        return;
+    }
+    for(b = first; b <= last; b++)
+    {
+        if(st->blocks[b >> 3] & (1 << (b & 7)))
+            overlap++;
+        st->blocks[b >> 3] |= 1 << (b & 7);
+    }
+    if(overlap)
+        problem(st, HIMD_FSCK_FRAGMENTS, fragidx, HIMD_FSCK_OVERLAP, 1,
+                _("Fragment %u shares %u of its blocks %u-%u with other fragments"),
+                fragidx, overlap, first, last);
+}
+
+static void walk_fragments(struct fsckstate * st, unsigned int slot)
+{
+    unsigned int idx = beword16(TRACK_ENTRY(st->tif, slot) + 36);
+
+    if(idx == 0 || idx > HIMD_LAST_FRAGMENT)
+    {
+        problem(st, HIMD_FSCK_TRACKS, slot, HIMD_FSCK_BAD_LINK, 1,
+                _("Track %u has invalid first fragment %u"), slot, idx);
+        return;
+    }
+    for(; idx != 0; idx = LINK12(FRAG_ENTRY(st->tif, idx)))
+    {
+        if(st->fragowner[idx] == slot)
+        {
+            problem(st, HIMD_FSCK_FRAGMENTS, idx, HIMD_FSCK_LOOP, 1,
+                    _("Fragment chain of track %u loops at fragment %u"), slot, idx);
+            return;
+        }
+        if(st->fragowner[idx] != OWNER_NONE)
+        {
+            problem(st, HIMD_FSCK_FRAGMENTS, idx, HIMD_FSCK_CROSS_LINK, 1,
+                    _("Fragment %u of track %u also belongs to track %u"),
+                    idx, slot, st->fragowner[idx]);
+            return;
+        }
+        st->fragowner[idx] = slot;
+        mark_blocks(st, idx, FRAG_ENTRY(st->tif, idx));
+    }
+}
+
+static void walk_string(struct fsckstate * st, unsigned int head, const char * what, unsigned int from)
+{
+    unsigned int idx, type;
+
+    if(head == 0)
+        return;
+    /* strings may be shared, e.g. the artist of several tracks */
+    if(head <= HIMD_LAST_STRING && st->stringowner[head] == head)
+        return;
+    type = head <= HIMD_LAST_STRING ? STRING_ENTRY(st->tif, head)[14] >> 4 : 0;
+    if(head > HIMD_LAST_STRING || type < STRING_TYPE_TITLE)
+    {
+        problem(st, HIMD_FSCK_STRINGS, head, HIMD_FSCK_BAD_LINK, 1,
+                _("%s %u refers to string %u, which is no string head"), what, from, head);
+        return;
+    }
+    for(idx = head; idx != 0; idx = LINK12(STRING_ENTRY(st->tif, idx)))
+    {
+        if(st->stringowner[idx] == head)
+        {
+            problem(st, HIMD_FSCK_STRINGS, idx, HIMD_FSCK_LOOP, 1,
+                    _("String chain starting at %u loops at %u"), head, idx);
+            return;
+        }
+        if(st->stringowner[idx] != OWNER_NONE)
+        {
+            problem(st, HIMD_FSCK_STRINGS, idx, HIMD_FSCK_CROSS_LINK, 1,
+                    _("String chunk %u of string %u also belongs to %s"), idx, head,
+                    st->stringowner[idx] == OWNER_FREE ? _("the free list") : _("another string"));
+            return;
+        }
+        if(idx != head && (STRING_ENTRY(st->tif, idx)[14] >> 4) != STRING_TYPE_CONTINUATION)
+        {
+            problem(st, HIMD_FSCK_STRINGS, idx, HIMD_FSCK_BAD_LINK, 1,
+                    _("String chunk %u of string %u has type %d"), idx, head,
+                    STRING_ENTRY(st->tif, idx)[14] >> 4);
+            return;
+        }
+        st->stringowner[idx] = head;
+    }
+}
+
+static void check_tracks(struct fsckstate * st)
+{
+    unsigned int count = beword16(st->tif + 0x100);
+    unsigned int i;
+
+    if(count > HIMD_LAST_TRACK)
+    {
+        problem(st, HIMD_FSCK_TRACKS, 0, HIMD_FSCK_BAD_ENTRY, 1,
+                _("Play order holds %u tracks, more than there are slots"), count);
+        count = HIMD_LAST_TRACK;
+    }
+    for(i = 0; i < count; i++)
+    {
+        unsigned int slot = beword16(st->tif + 0x102 + 2*i);
+        const unsigned char * track;
+
+        if(slot < HIMD_FIRST_TRACK || slot > HIMD_LAST_TRACK)
+        {
+            problem(st, HIMD_FSCK_TRACKS, slot, HIMD_FSCK_BAD_LINK, 1,
+                    _("Play order entry %u refers to invalid slot %u"), i, slot);
+            continue;
+        }
+        if(st->trackowner[slot] != OWNER_NONE)
+        {
+            problem(st, HIMD_FSCK_TRACKS, slot, HIMD_FSCK_CROSS_LINK, 1,
+                    _("Track %u is listed twice in the play order"), slot);
+            continue;
+        }
+        st->trackowner[slot] = 1;
+        track = TRACK_ENTRY(st->tif, slot);
+        walk_fragments(st, slot);
+        walk_string(st, beword16(track + 8), _("Title of track"), slot);
+        walk_string(st, beword16(track + 10), _("Artist of track"), slot);
+        walk_string(st, beword16(track + 12), _("Album of track"), slot);
+    }
+}
+
+/* The disc title and the group names are not referenced by tracks. The
+   group table is not decoded, so all group name strings are kept. */
+static void check_disc_strings(struct fsckstate * st)
+{
+    unsigned int i;
+
+    walk_string(st, beword16(st->tif + 14), _("Disc title"), 0);
+    for(i = HIMD_FIRST_STRING; i <= HIMD_LAST_STRING; i++)
+        if(st->stringowner[i] == OWNER_NONE &&
+           (STRING_ENTRY(st->tif, i)[14] >> 4) == STRING_TYPE_GROUP)
+            walk_string(st, i, _("Group"), i);
+}
+
+static void check_free_lists(struct fsckstate * st)
+{
+    unsigned int idx;
+
+    for(idx = beword16(TRACK_ENTRY(st->tif, 0) + 38); idx != 0;
+        idx = beword16(TRACK_ENTRY(st->tif, idx) + 38))
+    {
+        if(idx > HIMD_LAST_TRACK)
+        {
+            problem(st, HIMD_FSCK_TRACKS, idx, HIMD_FSCK_BAD_LINK, 1,
+                    _("Free track list refers to invalid slot %u"), idx);
+            break;
+        }
+        if(st->trackowner[idx] != OWNER_NONE)
+        {
+            problem(st, HIMD_FSCK_TRACKS, idx,
+                    st->trackowner[idx] == OWNER_FREE ? HIMD_FSCK_LOOP : HIMD_FSCK_CROSS_LINK, 1,
+                    st->trackowner[idx] == OWNER_FREE ? _("Free track list loops at slot %u") :
+                                                        _("Track %u is in use and on the free list"), idx);
+            break;
+        }
+        st->trackowner[idx] = OWNER_FREE;
+    }
+
+    for(idx = LINK12(FRAG_ENTRY(st->tif, 0)); idx != 0; idx = LINK12(FRAG_ENTRY(st->tif, idx)))
+    {
+        if(st->fragowner[idx] != OWNER_NONE)
+        {
+            problem(st, HIMD_FSCK_FRAGMENTS, idx,
+                    st->fragowner[idx] == OWNER_FREE ? HIMD_FSCK_LOOP : HIMD_FSCK_CROSS_LINK, 1,
+                    st->fragowner[idx] == OWNER_FREE ? _("Free fragment list loops at %u") :
+                                                       _("Fragment %u is in use and on the free list"), idx);
+            break;
+        }
+        st->fragowner[idx] = OWNER_FREE;
+    }
+
+    for(idx = LINK12(STRING_ENTRY(st->tif, 0)); idx != 0; idx = LINK12(STRING_ENTRY(st->tif, idx)))
+    {
+        if(st->stringowner[idx] != OWNER_NONE)
+        {
+            problem(st, HIMD_FSCK_STRINGS, idx,
+                    st->stringowner[idx] == OWNER_FREE ? HIMD_FSCK_LOOP : HIMD_FSCK_CROSS_LINK, 1,
+                    st->stringowner[idx] == OWNER_FREE ? _("Free string list loops at %u") :
+                                                         _("String chunk %u is in use and on the free list"), idx);
+            break;
+        }
+        if((STRING_ENTRY(st->tif, idx)[14] >> 4) != STRING_TYPE_UNUSED)
+            problem(st, HIMD_FSCK_STRINGS, idx, HIMD_FSCK_BAD_ENTRY, 1,
+                    _("Free string chunk %u has type %d"), idx, STRING_ENTRY(st->tif, idx)[14] >> 4);
+        st->stringowner[idx] = OWNER_FREE;
+    }
+}
+
+/* Leaked entries are reported as runs, a broken free list leaks
+   thousands of them. */
+static void check_leaks(struct fsckstate * st, enum himd_fsck_table table,
+                        const unsigned short * owner, unsigned int last, const char * what)
+{
+    unsigned int i, start;
+
+    for(i = 1; i <= last; i++)
+    {
+        if(owner[i] != OWNER_NONE)
+            continue;
+        for(start = i; i < last && owner[i + 1] == OWNER_NONE; i++)
+            ;
+        if(start == i)
+            problem(st, table, start, HIMD_FSCK_LEAK, 1,
+                    _("%s %u is neither used nor free"), what, start);
+        else
+            problem(st, table, start, HIMD_FSCK_LEAK, i - start + 1,
+                    _("%ss %u-%u are neither used nor free"), what, start, i);
+    }
+}
+
+/* Frees all entries that are not in use, in ascending order like a
+   freshly formatted disc. */
+static void rebuild_free_lists(struct fsckstate * st, unsigned char * tif)
+{
+    unsigned int i, prev;
+
+    prev = 0;
+    for(i = HIMD_FIRST_TRACK; i <= HIMD_LAST_TRACK; i++)
+        if(st->trackowner[i] != 1)
+        {
+            memset(TRACK_ENTRY(tif, i), 0, 0x50);
+            setbeword16(TRACK_ENTRY(tif, prev) + 38, i);
+            prev = i;
+        }
+    setbeword16(TRACK_ENTRY(tif, prev) + 38, 0);
+
+    prev = 0;
+    for(i = HIMD_FIRST_FRAGMENT; i <= HIMD_LAST_FRAGMENT; i++)
+        if(st->fragowner[i] == OWNER_NONE || st->fragowner[i] == OWNER_FREE)
+        {
+            memset(FRAG_ENTRY(tif, i), 0, 0x10);
+            setbeword16(FRAG_ENTRY(tif, prev) + 14, (FRAG_ENTRY(tif, prev)[14] & 0xF0) << 8 | i);
+            prev = i;
+        }
+    setbeword16(FRAG_ENTRY(tif, prev) + 14, (FRAG_ENTRY(tif, prev)[14] & 0xF0) << 8);
+
+    prev = 0;
+    for(i = HIMD_FIRST_STRING; i <= HIMD_LAST_STRING; i++)
+        if(st->stringowner[i] == OWNER_NONE || st->stringowner[i] == OWNER_FREE)
+        {
+            memset(STRING_ENTRY(tif, i), 0, 0x10);
+            setbeword16(STRING_ENTRY(tif, prev) + 14, (STRING_ENTRY(tif, prev)[14] & 0xF0) << 8 | i);
+            prev = i;
+        }
+    setbeword16(STRING_ENTRY(tif, prev) + 14, (STRING_ENTRY(tif, prev)[14] & 0xF0) << 8);
+}
+
+/**
+ * Checks the track, fragment and string tables and their free lists in
+ * one pass. Each problem found is passed to report, which may be NULL.
+ *
+ * With repair set, the free lists are rebuilt from all entries that are
+ * not in use, which also frees leaked entries. The track index is only
+ * changed in memory, use himd_write_tifdata to save it. If problems were
+ * found in the chains of tracks or strings in use, nothing is changed
+ * and result->repaired stays 0.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param repair Nonzero to rebuild the free lists
+ * @param report Called for each problem, may be NULL
+ * @param ctx Passed to report
+ * @param result Filled with the number of problems of each kind
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if the check ran, even if problems were found, -1 otherwise
+ */
+int himd_fsck(struct himd * himd, int repair, himd_fsck_report report, void * ctx,
+              struct himd_fsck_result * result, struct himderrinfo * status)
+{
+    struct fsckstate * st;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(result != NULL, -1);
+
+    if(repair && himd->shared->io->read_only)
+    {
+        set_status_const(status, HIMD_ERROR_READ_ONLY, _("Disc images can't be written"));
+        return -1;
+    }
+
+    memset(result, 0, sizeof *result);
+    st = g_new0(struct fsckstate, 1);
+    st->report = report;
+    st->ctx = ctx;
+    st->result = result;
+
+    /* the TIF lock can't be upgraded, so repairs hold the write lock throughout */
+    if(repair)
+    {
+        himd_tif_write_lock(himd);
+        himd_tif_make_writable(himd);
+    }
+    else
+        himd_tif_read_lock(himd);
+    st->tif = himd->tifdata;
+
+    check_tracks(st);
+    check_disc_strings(st);
+    st->free_lists = 1;
+    check_free_lists(st);
+    check_leaks(st, HIMD_FSCK_TRACKS, st->trackowner, HIMD_LAST_TRACK, _("Track slot"));
+    check_leaks(st, HIMD_FSCK_FRAGMENTS, st->fragowner, HIMD_LAST_FRAGMENT, _("Fragment"));
+    check_leaks(st, HIMD_FSCK_STRINGS, st->stringowner, HIMD_LAST_STRING, _("String chunk"));
+
+    if(repair)
+    {
+        if(!st->unrepairable)
+        {
+            rebuild_free_lists(st, himd->tifdata);
+            result->repaired = 1;
+        }
+        himd_tif_write_unlock(himd);
+    }
+    else
+        himd_tif_read_unlock(himd);
+
+    g_free(st);
+    return 0;
+}
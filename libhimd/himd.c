@@ -28,6 +28,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define G_LOG_DOMAIN "HiMD"
 #include <glib.h>
@@ -35,6 +37,16 @@
 #include "himd.h"
 #include "himd_private.h"
 
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #define _(x) (x)
 
 void set_status_const(struct himderrinfo * status, enum himdstatus code, const char * msg)
@@ -58,13 +70,13 @@ void set_status_printf(struct himderrinfo * status, enum himdstatus code, const
     }
 }
 
-static int scanforatdata(GDir * dir)
+static int scanforatdata(gchar ** names)
 {
     const char * hmafile;
     /* I don't use g_pattern_* stuff, because they can't be case insensitive */
     int maxdatanum = -1;
     int curdatanum;
-    while((hmafile = g_dir_read_name(dir)) != NULL)
+    while((hmafile = *names++) != NULL)
     {
         /* atdataNN.hma - should be only one of them */
         if(g_ascii_strncasecmp(hmafile,"atdata0",7) == 0 &&
@@ -84,13 +96,13 @@ static int scanforatdata(GDir * dir)
 
 
 // scan for TRKIDX files
-static int scanfortif(GDir * dir, int* oldnum, int *newnum)
+static int scanfortif(gchar ** names, int* oldnum, int *newnum)
 {
     const char * hmafile;
     int found_unused=FALSE, found_used=FALSE;
     int old_datanum, new_datanum;
 
-    while((hmafile = g_dir_read_name(dir)) != NULL)
+    while((hmafile = *names++) != NULL)
     {
 	// Look for old version
 	if(!found_unused)
@@ -140,38 +152,297 @@ static void nong_inplace_ascii_up(gchar * string)
     }
 }
 
-FILE * himd_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+static void himd_file_name(struct himd * himd, const char * fileid, char * filename)
 {
-    char filename[13];
-    FILE * file;
-    char * filepath;
-
     sprintf(filename,"%s%02X.HMA",fileid,himd->datanum);
     if(himd->need_lowercase)
         nong_inplace_ascii_down(filename);
     else
         nong_inplace_ascii_up(filename);
-    filepath = g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI",filename,NULL);
+}
+
+static char * himd_file_path(struct himd * himd, const char * fileid)
+{
+    char filename[13];
+
+    himd_file_name(himd, fileid, filename);
+    return g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI",filename,NULL);
+}
+
+void * himd_io_open(struct himd * himd, const char * fileid)
+{
+    char filename[13];
+
+    himd_file_name(himd, fileid, filename);
+    return himd->shared->io->open(himd->shared->iodata, filename);
+}
+
+/* Files in disc images are copied to a temporary file, as stdio can't
+   read from them directly. Images can't be written. */
+static FILE * himd_copy_to_tmpfile(struct himd * himd, const char * fileid)
+{
+    const struct himd_io * io = himd->shared->io;
+    unsigned char buffer[16384];
+    goffset offset = 0;
+    gssize len;
+    FILE * file;
+    void * src = himd_io_open(himd, fileid);
+
+    if(!src)
+        return NULL;
+    file = tmpfile();
+    while(file && (len = io->pread(src, buffer, sizeof buffer, offset)) > 0)
+    {
+        if(fwrite(buffer, 1, len, file) != (size_t)len)
+            break;
+        offset += len;
+    }
+    if(file && offset != io->size(src))
+    {
+        fclose(file);
+        file = NULL;
+    }
+    io->close(src);
+    if(file)
+        rewind(file);
+    return file;
+}
+
+FILE * himd_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+{
+    FILE * file;
+    char * filepath;
+
+    if(himd->shared->io->read_only)
+    {
+        if(mode == HIMD_READ_WRITE)
+        {
+            errno = EROFS;
+            return NULL;
+        }
+        return himd_copy_to_tmpfile(himd, fileid);
+    }
+    filepath = himd_file_path(himd, fileid);
     file = fopen(filepath,mode == HIMD_READ_WRITE ? "rb+" : "rb");
     g_free(filepath);
     return file;
 }
 
+/* Reads len bytes at offset, retrying short reads. Returns the number of
+   bytes read, which is only less than len at the end of the file, or -1
+   on errors. Without pread, lock serializes the seek and the read. */
+gssize himd_pread(int fd, GMutex * lock, unsigned char * buffer, gsize len, goffset offset)
+{
+    gsize done = 0;
+    gssize n = 0;
+
+#ifndef G_OS_UNIX
+    g_mutex_lock(lock);
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        n = -1;
+#else
+    (void)lock;
+#endif
+    while(n >= 0 && done < len)
+    {
+#ifdef G_OS_UNIX
+        n = pread(fd, buffer + done, len - done, offset + done);
+#else
+        n = read(fd, buffer + done, len - done);
+#endif
+        if(n < 0 && errno == EINTR)
+            n = 0;
+        else if(n == 0)
+            break;
+        else if(n > 0)
+            done += n;
+    }
+#ifndef G_OS_UNIX
+    g_mutex_unlock(lock);
+#endif
+    return n < 0 ? -1 : (gssize)done;
+}
+
+/* Finds the next data region of a sparse file, see struct himd_io. */
+goffset himd_find_data(int fd, goffset offset, goffset * dataend)
+{
+#ifdef SEEK_DATA
+    off_t start = lseek(fd, offset, SEEK_DATA);
+    off_t end;
+
+    if(start < 0)
+    {
+        if(errno != ENXIO)
+            return -1;
+        /* only a hole follows */
+        start = lseek(fd, 0, SEEK_END);
+        if(start < 0)
+            return -1;
+        *dataend = start;
+        return start;
+    }
+    end = lseek(fd, start, SEEK_HOLE);
+    if(end < 0)
+        return -1;
+    *dataend = end;
+    return start;
+#else
+    (void)fd;
+    (void)offset;
+    (void)dataend;
+    return -1;
+#endif
+}
+
+/* Reads from the ATDATA file shared by all read streams of the handle,
+   see himd_pread for the return value. */
+gssize himd_read_atdata(struct himd * himd, unsigned char * buffer, gsize len, goffset offset)
+{
+    return himd->shared->io->pread(himd->shared->atdata, buffer, len, offset);
+}
+
+/* the HMDHIFI directory of a mounted filesystem */
+struct dirio {
+    char * dirpath;
+};
+
+struct dirio_file {
+    int fd;
+    GMutex lock;
+};
+
+static gchar ** dirio_list(void * iodata, struct himderrinfo * status)
+{
+    struct dirio * dio = iodata;
+    GError * error = NULL;
+    GPtrArray * names;
+    const char * name;
+    GDir * dir = g_dir_open(dio->dirpath, 0, &error);
+
+    if(dir == NULL)
+    {
+        set_status_const(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    names = g_ptr_array_new();
+    while((name = g_dir_read_name(dir)) != NULL)
+        g_ptr_array_add(names, g_strdup(name));
+    g_ptr_array_add(names, NULL);
+    g_dir_close(dir);
+    return (gchar **)g_ptr_array_free(names, FALSE);
+}
+
+static void * dirio_open(void * iodata, const char * name)
+{
+    struct dirio * dio = iodata;
+    struct dirio_file * file;
+    char * filepath = g_build_filename(dio->dirpath, name, NULL);
+    int fd = g_open(filepath, O_RDONLY | O_BINARY, 0);
+
+    g_free(filepath);
+    if(fd < 0)
+        return NULL;
+    file = g_new(struct dirio_file, 1);
+    file->fd = fd;
+    g_mutex_init(&file->lock);
+    return file;
+}
+
+static gssize dirio_pread(void * file, unsigned char * buffer, gsize len, goffset offset)
+{
+    struct dirio_file * f = file;
+    return himd_pread(f->fd, &f->lock, buffer, len, offset);
+}
+
+static goffset dirio_size(void * file)
+{
+    struct dirio_file * f = file;
+    struct stat st;
+
+    if(fstat(f->fd, &st) < 0)
+        return -1;
+    return st.st_size;
+}
+
+static goffset dirio_find_data(void * file, goffset offset, goffset * dataend)
+{
+    struct dirio_file * f = file;
+    goffset start;
+
+    /* moves the file position, which unlocked reads don't depend on */
+    g_mutex_lock(&f->lock);
+    start = himd_find_data(f->fd, offset, dataend);
+    g_mutex_unlock(&f->lock);
+    return start;
+}
+
+static void dirio_close(void * file)
+{
+    struct dirio_file * f = file;
+
+    close(f->fd);
+    g_mutex_clear(&f->lock);
+    g_free(f);
+}
+
+static void dirio_destroy(void * iodata)
+{
+    struct dirio * dio = iodata;
+
+    g_free(dio->dirpath);
+    g_free(dio);
+}
+
+static const struct himd_io dirio = {
+    dirio_list, dirio_open, dirio_pread, dirio_size, dirio_close, dirio_destroy,
+    dirio_find_data, 0
+};
+
+static void * dirio_new(const char * himdroot, int * need_lowercase, struct himderrinfo * status)
+{
+    struct dirio * dio;
+    char * filepath;
+
+    *need_lowercase = 0;
+    filepath = g_build_filename(himdroot,"HMDHIFI",NULL);
+    if(!g_file_test(filepath, G_FILE_TEST_IS_DIR))
+    {
+        g_free(filepath);
+        filepath = g_build_filename(himdroot,"hmdhifi",NULL);
+        *need_lowercase = 1;
+    }
+    if(!g_file_test(filepath, G_FILE_TEST_IS_DIR))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                          _("No HMDHIFI directory in %s"), himdroot);
+        g_free(filepath);
+        return NULL;
+    }
+    dio = g_new(struct dirio, 1);
+    dio->dirpath = filepath;
+    return dio;
+}
+
 
 int himd_write_tifdata(struct himd * himd, struct himderrinfo * status)
 {
     char indexfilename[13];
     gchar *unusedfile,*usedfile,*tempfile;
-    gchar *filepath;
-    GDir * dir;
+    gchar **names;
     GError * error = NULL;
-    (void)status;
-
-    filepath = g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI", NULL);
-    dir      = g_dir_open(filepath,0,&error);
     int oldnum=0, newnum=0;
 
-    if(scanfortif(dir, &oldnum, &newnum))
+    if(himd->shared->io->read_only)
+    {
+        set_status_const(status, HIMD_ERROR_READ_ONLY, _("Disc images can't be written"));
+        return -1;
+    }
+    names = himd->shared->io->list(himd->shared->iodata, status);
+    if(!names)
+        return -1;
+
+    if(scanfortif(names, &oldnum, &newnum))
 	{
 	    sprintf(indexfilename, himd->need_lowercase ? "_rkidx%02x.hma" : "_RKIDX%02X.HMA", oldnum);
 	    unusedfile = g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI",
@@ -190,6 +461,10 @@ int himd_write_tifdata(struct himd * himd, struct himderrinfo * status)
     tempfile         = g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI",
 					"TRKIDX.TMP",NULL);
 
+    /* exclusive, as concurrent calls would mix up the renames below */
+    himd_tif_write_lock(himd);
+    /* a mapped index could not be replaced on every platform */
+    himd_tif_make_writable(himd);
     if(!g_file_set_contents(unusedfile, (const char*)himd->tifdata, HIMD_TIFFILE_SIZE, &error))
 	{
 	    printf("Could not update unused TIFDATA file %s.\n", unusedfile);
@@ -214,16 +489,16 @@ int himd_write_tifdata(struct himd * himd, struct himderrinfo * status)
 	{
 	    printf("Could not rename %s to %s\n", tempfile, usedfile);
 	}
+    himd_tif_write_unlock(himd);
 
-    g_free(filepath);
-    g_dir_close(dir);
+    g_strfreev(names);
 
     return 0;
 }
 
 static int himd_read_discid(struct himd * himd, struct himderrinfo * status)
 {
-    FILE * mclistfile = himd_open_file(himd, "MCLIST", HIMD_READ_ONLY);
+    void * mclistfile = himd_io_open(himd, "MCLIST");
 
     if(!mclistfile)
     {
@@ -232,77 +507,80 @@ static int himd_read_discid(struct himd * himd, struct himderrinfo * status)
         return -1;
     }
 
-    fseek(mclistfile,0x40L,SEEK_SET);
-    if(fread(himd->discid,16,1,mclistfile) != 1)
+    if(himd->shared->io->pread(mclistfile, himd->discid, 16, 0x40) != 16)
     {
         set_status_printf(status, HIMD_ERROR_CANT_READ_MCLIST,
                           _("Can't read mclist file: %s\n"), g_strerror(errno));
-        fclose(mclistfile);
+        himd->shared->io->close(mclistfile);
         return -1;
     }
-    fclose(mclistfile);
+    himd->shared->io->close(mclistfile);
     himd->discid_valid = 1;
     return 0;
 }
 
-int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * status)
+/* Loads the track index into a heap buffer, or maps it for read-only
+   handles on a mounted filesystem, so only the pages that are actually
+   used are read. */
+static int himd_load_tif(struct himd * himd, const char * indexfilename, enum himd_rw_mode mode,
+                         struct himderrinfo * status)
 {
-    char * filepath;
-    char indexfilename[13];
-    gsize filelen;
-    GDir * dir;
+    const struct himd_io * io = himd->shared->io;
     GError * error = NULL;
-    
-    g_return_val_if_fail(himd != NULL, -1);
-    g_return_val_if_fail(himdroot != NULL, -1);
+    goffset filelen;
+    void * file;
 
-    himd->need_lowercase = 0;
-    filepath = g_build_filename(himdroot,"HMDHIFI",NULL);
-    dir = g_dir_open(filepath,0,&error);
-    if(g_error_matches(error,G_FILE_ERROR,G_FILE_ERROR_NOENT))
+    himd->tifdata = NULL;
+    if(mode == HIMD_READ_ONLY && io == &dirio)
     {
-        g_error_free(error);
-        error = NULL;
-        filepath = g_build_filename(himdroot,"hmdhifi",NULL);
-        dir = g_dir_open(filepath,0,&error);
-        himd->need_lowercase = 1;
-    }
-    g_free(filepath);
-    if(dir == NULL)
-    {
-        set_status_const(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI, error->message);
-        return -1;
-    }
+        struct dirio * dio = himd->shared->iodata;
+        char * filepath = g_build_filename(dio->dirpath, indexfilename, NULL);
+        GMappedFile * map = g_mapped_file_new(filepath, FALSE, &error);
 
-    himd->datanum = scanforatdata(dir);
-    g_dir_close(dir);
-    if(himd->datanum == -1)
-    {
-        set_status_const(status, HIMD_ERROR_NO_TRACK_INDEX, _("No track index file found"));
-        return -1;		/* ERROR: track index not found */
+        g_free(filepath);
+        if(!map)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                              _("Can't load TIF data from %s: %s"),
+                              indexfilename, error->message);
+            g_error_free(error);
+            return -1;
+        }
+        himd->shared->tifmap = map;
+        himd->tifdata = (unsigned char *)g_mapped_file_get_contents(map);
+        filelen = g_mapped_file_get_length(map);
     }
-    
-    sprintf(indexfilename,
-            himd->need_lowercase ? "trkidx%02x.hma" : "TRKIDX%02X.HMA",
-            himd->datanum);
-    filepath = g_build_filename(himdroot,himd->need_lowercase ? "hmdhifi" : 
-                                "HMDHIFI",indexfilename,NULL);
-    if(!g_file_get_contents(filepath, (char**)&himd->tifdata, &filelen, &error))
+    else
     {
-        set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
-                          _("Can't load TIF data from %s: %s"),
-                          filepath, error->message);
-        g_free(filepath);
-        return -1;
+        file = io->open(himd->shared->iodata, indexfilename);
+        if(!file)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                              _("Can't load TIF data from %s: %s"),
+                              indexfilename, g_strerror(errno));
+            return -1;
+        }
+        filelen = io->size(file);
+        if(filelen == HIMD_TIFFILE_SIZE)
+        {
+            himd->tifdata = g_malloc(HIMD_TIFFILE_SIZE);
+            if(io->pread(file, himd->tifdata, HIMD_TIFFILE_SIZE, 0) != HIMD_TIFFILE_SIZE)
+            {
+                set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                                  _("Can't load TIF data from %s: %s"),
+                                  indexfilename, g_strerror(errno));
+                io->close(file);
+                return -1;
+            }
+        }
+        io->close(file);
     }
-    g_free(filepath);
-    
+
     if(filelen != 0x50000)
     {
         set_status_printf(status, HIMD_ERROR_WRONG_TIF_SIZE,
                           _("TIF file is 0x%x bytes instead of 0x50000"),
                           (int)filelen);
-        g_free(himd->tifdata);
         return -1;
     }
 
@@ -311,26 +589,175 @@ int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * st
         set_status_printf(status, HIMD_ERROR_WRONG_TIF_MAGIC,
                          _("TIF file starts with wrong magic: %02x %02x %02x %02x"),
                          himd->tifdata[0],himd->tifdata[1],himd->tifdata[2],himd->tifdata[3]);
+        return -1;
+    }
+    return 0;
+}
+
+static void himd_free_tif(struct himd * himd)
+{
+    if(himd->shared->tifmap)
+        g_mapped_file_unref(himd->shared->tifmap);
+    else
         g_free(himd->tifdata);
+    himd->shared->tifmap = NULL;
+    himd->tifdata = NULL;
+}
+
+/* Replaces a mapped track index by a private copy on the heap. Called
+   with the TIF lock held for writing before the index is modified. */
+void himd_tif_make_writable(struct himd * himd)
+{
+    GMappedFile * map = himd->shared->tifmap;
+
+    if(!map)
+        return;
+    himd->tifdata = g_malloc(HIMD_TIFFILE_SIZE);
+    memcpy(himd->tifdata, g_mapped_file_get_contents(map), HIMD_TIFFILE_SIZE);
+    g_mapped_file_unref(map);
+    himd->shared->tifmap = NULL;
+}
+
+int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * status)
+{
+    return himd_open_mode(himd, himdroot, HIMD_READ_WRITE, status);
+}
+
+/**
+ * Opens HiMD data like himd_open. With HIMD_READ_ONLY, the track index
+ * is mapped into memory instead of being read completely, which makes
+ * opening faster if only a few tracks are looked at. The handle can
+ * still be modified; the first modification copies the track index to
+ * the heap.
+ * If himdroot is a regular file, it is read as a snapshot written by
+ * himd_snapshot_write or else as an image of a FAT12 or FAT16 formatted
+ * HiMD. Neither can be written back, so any mode works for reading, but
+ * himd_write_tifdata and write streams fail.
+ */
+int himd_open_mode(struct himd * himd, const char * himdroot, enum himd_rw_mode mode, struct himderrinfo * status)
+{
+    char indexfilename[13];
+    gchar ** names;
+    
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(himdroot != NULL, -1);
+
+    himd->shared = g_new0(struct himd_shared, 1);
+    himd->need_lowercase = 0;
+    if(g_file_test(himdroot, G_FILE_TEST_IS_REGULAR))
+    {
+        if(himd_is_snapshot(himdroot))
+        {
+            himd->shared->io = &himd_snapshot_io;
+            himd->shared->iodata = himd_snapshot_io_open(himdroot, status);
+        }
+        else
+        {
+            himd->shared->io = &himd_fatimage_io;
+            himd->shared->iodata = himd_fatimage_open(himdroot, status);
+        }
+    }
+    else
+    {
+        himd->shared->io = &dirio;
+        himd->shared->iodata = dirio_new(himdroot, &himd->need_lowercase, status);
+    }
+    if(!himd->shared->iodata)
+    {
+        g_free(himd->shared);
         return -1;
     }
 
+    names = himd->shared->io->list(himd->shared->iodata, status);
+    if(!names)
+        goto fail_io;
+    himd->datanum = scanforatdata(names);
+    g_strfreev(names);
+    if(himd->datanum == -1)
+    {
+        set_status_const(status, HIMD_ERROR_NO_TRACK_INDEX, _("No track index file found"));
+        goto fail_io;		/* ERROR: track index not found */
+    }
+    
+    sprintf(indexfilename,
+            himd->need_lowercase ? "trkidx%02x.hma" : "TRKIDX%02X.HMA",
+            himd->datanum);
+    if(himd_load_tif(himd, indexfilename, mode, status) < 0)
+        goto fail_tif;
+
     himd->rootpath = g_strdup(himdroot);
+    himd->cacheid = himd_blockcache_new_id();
+
+    himd->shared->atdata = himd_io_open(himd, "ATDATA");
+    if(!himd->shared->atdata)
+    {
+        himd_file_name(himd, "ATDATA", indexfilename);
+        set_status_printf(status, HIMD_ERROR_CANT_OPEN_AUDIO,
+                          _("Can't open audio data %s: %s"), indexfilename, g_strerror(errno));
+        g_free(himd->rootpath);
+        goto fail_tif;
+    }
+
+    g_rw_lock_init(&himd->shared->tiflock);
+
+    /* Loaded now so that readers never modify the handle. A disc without
+       a readable MCLIST is still usable for everything except MP3. */
     himd->discid_valid = 0;
+    himd_read_discid(himd, &himd->shared->discid_status);
 
     return 0;
+
+fail_tif:
+    himd_free_tif(himd);
+fail_io:
+    himd->shared->io->destroy(himd->shared->iodata);
+    g_free(himd->shared);
+    return -1;
 }
 
 const unsigned char * himd_get_discid(struct himd * himd, struct himderrinfo * status)
 {
-    if(!himd->discid_valid && himd_read_discid(himd, status) < 0)
+    if(!himd->discid_valid)
+    {
+        if(status)
+            *status = himd->shared->discid_status;
         return 0;
+    }
     return himd->discid;
 }
 
+/**
+ * Returns the size of the audio data file in blocks, which is the
+ * capacity of the disc.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns the number of blocks, -1 on error
+ */
+int himd_atdata_blocks(struct himd * himd, struct himderrinfo * status)
+{
+    goffset size;
+
+    g_return_val_if_fail(himd != NULL, -1);
+
+    size = himd->shared->io->size(himd->shared->atdata);
+    if(size < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_OPEN_AUDIO,
+                          _("Can't determine the size of the audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    return size / HIMD_BLOCKINFO_SIZE;
+}
+
 void himd_close(struct himd * himd)
 {
-    g_free(himd->tifdata);
+    himd->shared->io->close(himd->shared->atdata);
+    himd->shared->io->destroy(himd->shared->iodata);
+    g_rw_lock_clear(&himd->shared->tiflock);
+    himd_free_tif(himd);
+    g_free(himd->shared);
     g_free(himd->rootpath);
 }
 
@@ -85,7 +85,13 @@ enum himdstatus { HIMD_OK,
                   HIMD_ERROR_UNSUPPORTED_ENCRYPTION,
                   HIMD_ERROR_ENCRYPTION_FAILURE,
                   HIMD_ERROR_OUT_OF_MEMORY,
-                  HIMD_ERROR_NO_ID3_TAGS_FOUND };
+                  HIMD_ERROR_NO_ID3_TAGS_FOUND,
+                  HIMD_ERROR_ABORTED,
+                  HIMD_ERROR_CANT_WRITE_AUDIO,
+                  HIMD_ERROR_BAD_FILESYSTEM,
+                  HIMD_ERROR_READ_ONLY,
+                  HIMD_ERROR_CANT_READ_SNAPSHOT,
+                  HIMD_ERROR_CANT_WRITE_SNAPSHOT };
 
 enum himd_rw_mode { HIMD_READ_ONLY, HIMD_READ_WRITE };
 
@@ -143,6 +149,17 @@ struct himdstring {
     unsigned int nextstring : 12;
 };
 
+/* A handle may be shared by several threads. The track index is guarded
+   by a reader-writer lock: the himd_get_* functions, stream opens and
+   himd_find_holes take it for reading, the himd_add_* functions and
+   himd_write_tifdata for writing. Each call is atomic on its own, but a
+   sequence of calls is not, so writers should not modify tracks that
+   other threads are opening streams for at the same time.
+   The disc id is loaded by himd_open and never changes afterwards.
+   All read streams share one ATDATA descriptor that is accessed with
+   positioned reads, so streams on one handle can be read in parallel
+   as long as each stream is only used by one thread at a time.
+   himd_open and himd_close must not race with any other call. */
 struct himd {
     /* everything below this line is private, i.e. no API stability. */
     char * rootpath;
@@ -151,6 +168,8 @@ struct himd {
     unsigned char discid[16];
     int datanum;
     int need_lowercase;
+    unsigned int cacheid;
+    struct himd_shared * shared;
 };
 
 struct himderrinfo {
@@ -159,12 +178,15 @@ struct himderrinfo {
 };
 
 int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * status);
+int himd_open_mode(struct himd * himd, const char * himdroot, enum himd_rw_mode mode, struct himderrinfo * status);
 void himd_close(struct himd * himd);
 char* himd_get_string_raw(struct himd * himd, unsigned int idx, int*type, int* length, struct himderrinfo * status);
 char* himd_get_string_utf8(struct himd * himd, unsigned int idx, int*type, struct himderrinfo * status);
+int himd_get_string_utf8_buf(struct himd * himd, unsigned int idx, int*type, char * buffer, size_t size, struct himderrinfo * status);
 int himd_add_string(struct himd * himd, char *string, int type, struct himderrinfo * status);
 void himd_free(void * p);
 const unsigned char * himd_get_discid(struct himd * himd, struct himderrinfo * status);
+int himd_atdata_blocks(struct himd * himd, struct himderrinfo * status);
 FILE * himd_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode);
 int himd_write_tifdata(struct himd * himd, struct himderrinfo * status);
 unsigned int himd_track_count(struct himd * himd);
@@ -174,6 +196,7 @@ int himd_get_track_info(struct himd * himd, unsigned int idx, struct trackinfo *
 int himd_get_fragment_info(struct himd * himd, unsigned int idx, struct fraginfo * f, struct himderrinfo * status);
 int himd_track_uploadable(struct himd * himd, const struct trackinfo * track);
 int himd_track_blocks(struct himd * himd, const struct trackinfo * track, struct himderrinfo * status);
+int himd_track_frames(struct himd * himd, const struct trackinfo * track, struct himderrinfo * status);
 
 int himd_get_free_trackindex(struct himd * himd);
 int himd_add_track_info(struct himd * himd, struct trackinfo * track, struct himderrinfo * status);
@@ -186,24 +209,89 @@ unsigned int himd_trackinfo_framesperblock(const struct trackinfo * track);
 typedef unsigned char mp3key[4];
 int himd_obtain_mp3key(struct himd * himd, int track, mp3key * key, struct himderrinfo * status);
 
+/* decrypted block cache, blockcache.c */
+
+struct himd_blockcache;
+
+struct himd_blockcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned int blocks;
+    unsigned int maxblocks;
+};
+
+struct himd_blockcache * himd_blockcache_new(unsigned int maxblocks);
+void himd_blockcache_free(struct himd_blockcache * cache);
+void himd_blockcache_get_stats(struct himd_blockcache * cache, struct himd_blockcache_stats * stats);
+
+/* caller supplied memory, arena.c */
+
+/* The *_open_arena stream functions take the memory they need from an
+   arena instead of the heap, and reading from such streams does not
+   allocate either, unless a block cache or statistics are used. The
+   arena must outlive the stream. HIMD_STREAM_ARENA_SIZE bytes are
+   enough for opening any one stream. */
+struct himd_arena {
+    unsigned char * base;
+    size_t size;
+    size_t used;
+};
+
+void himd_arena_init(struct himd_arena * arena, void * buffer, size_t size);
+void himd_arena_reset(struct himd_arena * arena);
+void * himd_arena_alloc(struct himd_arena * arena, size_t size);
+
+/* the shortest MPEG frame is 24 bytes (MPEG-2 layer III, 8 kbps, 24 kHz) */
+#define HIMD_MAX_MP3_FRAMES_PER_BLOCK (HIMD_AUDIO_SIZE / 24)
+
+/* fragment list, frame pointers of an MPEG block, decryption state
+   (no more than 512 bytes) and alignment */
+#define HIMD_STREAM_ARENA_SIZE (HIMD_LAST_FRAGMENT * sizeof(struct fraginfo) + \
+                                (HIMD_MAX_MP3_FRAMES_PER_BLOCK + 2) * sizeof(const unsigned char *) + \
+                                512 + 3 * 16)
+
 /* data stream, mdstream.c */
 
+/* Performance counters of a stream. They are only collected after
+   himd_stream_enable_stats has been called on the stream. */
+#define HIMD_STATS_LATENCY_BUCKETS 16
+
+struct himd_stream_stats {
+    unsigned long blocks;               /* blocks read from ATDATA */
+    unsigned long long bytes;
+    unsigned long seeks;
+    unsigned long long read_usec;       /* time spent seeking and reading */
+    unsigned long long decrypt_usec;    /* decryption or MP3 de-obfuscation */
+    unsigned long long split_usec;      /* splitting MP3 blocks into frames */
+    /* bucket i counts block reads that took less than 2^i microseconds,
+       the last bucket also counts all slower ones */
+    unsigned long read_latency[HIMD_STATS_LATENCY_BUCKETS];
+};
+
 struct himd_blockstream {
     struct himd * himd;
-    FILE * atdata;
     struct fraginfo *frags;
     unsigned int curblockno;
     unsigned int curfragno;
     unsigned int fragcount;
     unsigned int blockcount;
     unsigned int frames_per_block;
+    int needseek;
+    struct himd_stream_stats * stats;
+    int in_arena;
 };
 
 int himd_blockstream_open(struct himd * himd, unsigned int firstfrag, unsigned int frames_per_block, struct himd_blockstream * stream, struct himderrinfo * status);
+int himd_blockstream_open_arena(struct himd * himd, unsigned int firstfrag, unsigned int frames_per_block, struct himd_blockstream * stream, struct himd_arena * arena, struct himderrinfo * status);
 void himd_blockstream_close(struct himd_blockstream * stream);
 int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * block,
                             unsigned int * firstframe, unsigned int * lastframe,
                             unsigned char * fragkey, struct himderrinfo * status);
+int himd_blockstream_seek(struct himd_blockstream * stream, unsigned int blockidx, struct himderrinfo * status);
+
+/* for MP3 and non-MP3 streams, pass their embedded blockstream */
+void himd_stream_enable_stats(struct himd_blockstream * stream);
+int himd_stream_get_stats(const struct himd_blockstream * stream, struct himd_stream_stats * stats);
 
 
 struct himd_writestream {
@@ -222,14 +310,19 @@ struct himd_mp3stream {
     struct himd_blockstream stream;
     unsigned char blockbuf[16384];
     const unsigned char ** frameptrs;
+    const unsigned char ** framebuf;	/* arena storage for frameptrs */
     mp3key key;
     unsigned int curframe;
     unsigned int frames;
+    struct himd_blockcache * cache;
 };
 
 int himd_mp3stream_open(struct himd * himd, unsigned int trackno, struct himd_mp3stream * stream, struct himderrinfo * status);
+int himd_mp3stream_open_arena(struct himd * himd, unsigned int trackno, struct himd_mp3stream * stream, struct himd_arena * arena, struct himderrinfo * status);
 int himd_mp3stream_read_frame(struct himd_mp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, struct himderrinfo * status);
 int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status);
+int himd_mp3stream_seek_block(struct himd_mp3stream * stream, unsigned int blockidx, struct himderrinfo * status);
+void himd_mp3stream_set_cache(struct himd_mp3stream * stream, struct himd_blockcache * cache);
 void himd_mp3stream_close(struct himd_mp3stream * stream);
 
 #define HIMD_MAX_PCMFRAME_SAMPLES (0x3FC0/4)
@@ -241,13 +334,86 @@ struct himd_nonmp3stream {
     int framesize;
     const unsigned char * frameptr;
     unsigned int framesleft;
+    struct himd_blockcache * cache;
 };
 
 int himd_nonmp3stream_open(struct himd * himd, unsigned int trackno, struct himd_nonmp3stream * stream, struct himderrinfo * status);
+int himd_nonmp3stream_open_arena(struct himd * himd, unsigned int trackno, struct himd_nonmp3stream * stream, struct himd_arena * arena, struct himderrinfo * status);
 int himd_nonmp3stream_read_frame(struct himd_nonmp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, struct himderrinfo * status);
 int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status);
+int himd_nonmp3stream_seek_block(struct himd_nonmp3stream * stream, unsigned int blockidx, struct himderrinfo * status);
+void himd_nonmp3stream_set_cache(struct himd_nonmp3stream * stream, struct himd_blockcache * cache);
 void himd_nonmp3stream_close(struct himd_nonmp3stream * stream);
 
+/* decoded audio, pcmstream.c */
+
+#define HIMD_PCMSTREAM_BUFFER_SAMPLES (2*1152)
+
+struct himd_pcmstream {
+    int is_mpeg;
+    int is_atrac;
+    union {
+        struct himd_mp3stream mp3;
+        struct himd_nonmp3stream nonmp3;
+    } src;
+    void * decoder;
+    unsigned long samplerate;
+    unsigned int channels;
+    const short * pcmptr;
+    unsigned int pcmleft;
+    short pcmbuf[HIMD_PCMSTREAM_BUFFER_SAMPLES];
+};
+
+int himd_pcmstream_open(struct himd * himd, unsigned int trackno, struct himd_pcmstream * stream, struct himderrinfo * status);
+int himd_pcmstream_read(struct himd_pcmstream * stream, short * samples, unsigned int maxsamples, unsigned int * countout, struct himderrinfo * status);
+void himd_pcmstream_close(struct himd_pcmstream * stream);
+void himd_swab16(unsigned char * dst, const unsigned char * src, size_t samples);
+
+/* ATRAC decoding and parallel decoding of tracks, decode.c */
+struct himd_atracdecoder;
+
+struct himd_atracdecoder * himd_atracdecoder_new(const struct sony_codecinfo * ci, struct himderrinfo * status);
+unsigned int himd_atracdecoder_channels(const struct himd_atracdecoder * dec);
+int himd_atracdecoder_decode(struct himd_atracdecoder * dec, const unsigned char * frame, unsigned int len, const short ** pcmout, unsigned int * countout, struct himderrinfo * status);
+void himd_atracdecoder_free(struct himd_atracdecoder * dec);
+
+/* Samples are interleaved in host byte order, count covers all channels.
+   See himd_decode_run for the threads the callbacks run on. */
+struct himd_pcm_sink {
+    int (*begin)(void * ctx, unsigned int idx, const struct trackinfo * track, unsigned int channels, struct himderrinfo * status);
+    int (*data)(void * ctx, unsigned int idx, const short * samples, unsigned int count, struct himderrinfo * status);
+    void (*end)(void * ctx, unsigned int idx, const struct himderrinfo * result);
+};
+
+int himd_decode_run(struct himd * himd, const unsigned int * tracknos, unsigned int count, unsigned int threads, const struct himd_pcm_sink * sink, void * ctx, struct himderrinfo * status);
+
+/* physical order batch extraction, schedule.c */
+
+/* idx is the position of the track in the list passed to
+   himd_schedule_new. data is called for the blocks of each track in
+   track order; it returns a negative value to fail the track and a
+   positive value to abort the whole run. end is called with result NULL
+   when a track completed. */
+struct himd_extract_sink {
+    int (*begin)(void * ctx, unsigned int idx, const struct trackinfo * track, struct himderrinfo * status);
+    int (*data)(void * ctx, unsigned int idx, const unsigned char * data, unsigned int len, unsigned int framecount, struct himderrinfo * status);
+    void (*end)(void * ctx, unsigned int idx, const struct himderrinfo * result);
+};
+
+struct himd_schedule;
+
+struct himd_schedule * himd_schedule_new(struct himd * himd, const unsigned int * tracknos, unsigned int count, struct himderrinfo * status);
+int himd_schedule_run(struct himd_schedule * sched, const struct himd_extract_sink * sink, void * ctx, struct himderrinfo * status);
+unsigned long himd_schedule_seek_distance(struct himd_schedule * sched, int physical);
+void himd_schedule_free(struct himd_schedule * sched);
+
+/* lossless LPCM output, flacsink.c */
+struct himd_flacsink;
+
+struct himd_flacsink * himd_flacsink_open(struct himd * himd, const struct trackinfo * track, const char * path, struct himderrinfo * status);
+int himd_flacsink_write(struct himd_flacsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status);
+int himd_flacsink_close(struct himd_flacsink * sink, struct himderrinfo * status);
+
 /* frag.c */
 struct himd_hole {
     unsigned short firstblock;
@@ -261,10 +427,114 @@ struct himd_holelist {
 
 int himd_find_holes(struct himd * himd, struct himd_holelist * holes, struct himderrinfo * status);
 
+/* snapshot.c */
+struct himd_snapshot_info {
+    unsigned int extents;
+    unsigned int blocks;	/* in all extents */
+    unsigned int skipped;	/* blocks of zeros or holes that were not written */
+};
+
+int himd_snapshot_write(struct himd * himd, const char * path, struct himd_snapshot_info * info,
+                        struct himderrinfo * status);
+int himd_snapshot_restore(const char * path, const char * himdroot, struct himd_snapshot_info * info,
+                          struct himderrinfo * status);
+int himd_is_snapshot(const char * path);
+
+/* catalog.c */
+/* The whole track list in one allocation. Arrays are indexed by track
+   number in play order, the frag_* arrays by fragment number within the
+   catalog, where each track has nfrags fragments starting at firstfrag. */
+struct himd_catalog {
+    unsigned int trackcount;
+    unsigned int fragcount;
+
+    unsigned int * slot;
+    const char ** title;	/* UTF-8, NULL if not set */
+    const char ** artist;
+    const char ** album;
+    const char ** codecname;
+    unsigned int * seconds;
+    unsigned int * blocks;
+    unsigned int * frames;	/* 0 for MPEG */
+    unsigned int * kbps;
+    unsigned char * uploadable;
+    unsigned int * firstfrag;
+    unsigned int * nfrags;
+    struct trackinfo * info;	/* everything else, e.g. keys and dates */
+
+    unsigned int * frag_firstblock;
+    unsigned int * frag_lastblock;
+    unsigned char * frag_firstframe;
+    unsigned char * frag_lastframe;
+    unsigned char (* frag_key)[8];
+};
+
+struct himd_catalog * himd_catalog_load(struct himd * himd, struct himderrinfo * status);
+void himd_catalog_free(struct himd_catalog * catalog);
+
+/* verify.c */
+#define HIMD_DAMAGE_READ_ERROR  0x01
+#define HIMD_DAMAGE_TYPE        0x02	/* wrong block type or backup copy differs */
+#define HIMD_DAMAGE_SERIAL      0x04
+#define HIMD_DAMAGE_MCODE       0x08
+#define HIMD_DAMAGE_CONTENTID   0x10
+#define HIMD_DAMAGE_MP3_FRAMES  0x20	/* frames don't add up to the data length */
+#define HIMD_DAMAGE_FRAME_COUNT 0x40	/* fragment frames outside the block */
+
+struct himd_verify_track {
+    unsigned int slot;
+    unsigned int blocks;
+    unsigned char * damage;	/* HIMD_DAMAGE_* flags per block, in play order */
+};
+
+struct himd_verify_result {
+    unsigned int trackcount;
+    struct himd_verify_track * tracks;	/* in play order */
+    unsigned int blocks;
+    unsigned int damaged;
+};
+
+int himd_verify(struct himd * himd, unsigned int threads, struct himd_verify_result * result,
+                struct himderrinfo * status);
+void himd_verify_result_free(struct himd_verify_result * result);
+
+/* fsck.c */
+enum himd_fsck_table { HIMD_FSCK_TRACKS, HIMD_FSCK_FRAGMENTS, HIMD_FSCK_STRINGS };
+
+enum himd_fsck_problem {
+    HIMD_FSCK_BAD_ENTRY,	/* entry with invalid contents */
+    HIMD_FSCK_BAD_LINK,		/* link out of range or to an entry of the wrong kind */
+    HIMD_FSCK_LOOP,
+    HIMD_FSCK_CROSS_LINK,	/* entry reached from two chains */
+    HIMD_FSCK_LEAK,		/* entry neither in use nor on a free list */
+    HIMD_FSCK_OVERLAP,		/* blocks used by more than one fragment */
+    HIMD_FSCK_PROBLEM_COUNT
+};
+
+typedef void (*himd_fsck_report)(void * ctx, enum himd_fsck_table table, unsigned int idx,
+                                 enum himd_fsck_problem problem, const char * message);
+
+struct himd_fsck_result {
+    unsigned int problems[HIMD_FSCK_PROBLEM_COUNT];	/* affected entries of each kind */
+    int repaired;			/* free lists rebuilt, 0 if the chains in use are damaged */
+};
+
+int himd_fsck(struct himd * himd, int repair, himd_fsck_report report, void * ctx,
+              struct himd_fsck_result * result, struct himderrinfo * status);
+
 /* mp3tools.c */
 
 int himd_get_songinfo(const char *filepath, char ** artist, char ** title, char **album, struct himderrinfo * status);
 
+/* suggested padding, lets taggers add frames without rewriting the file */
+#define HIMD_ID3V2_PADDING 1024
+
+unsigned char * himd_make_id3v2_tag(const char * title, const char * artist, const char * album,
+                                    const char * comment, unsigned int padding, unsigned int * lenout);
+unsigned char * himd_track_id3v2_tag(struct himd * himd, const struct trackinfo * track,
+                                     const char * comment, unsigned int padding,
+                                     unsigned int * lenout, struct himderrinfo * status);
+
 #ifdef __cplusplus
 }
 #endif
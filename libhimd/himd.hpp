@@ -0,0 +1,463 @@
+/*
+ * himd.hpp
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef INCLUDED_LIBHIMD_HIMD_HPP
+#define INCLUDED_LIBHIMD_HIMD_HPP
+
+/* Header-only C++ wrapper around himd.h. Everything is inline and calls
+   straight into the C functions. The only extra cost is one heap
+   allocation per opened disc or stream: the C structures are not
+   relocatable, because streams point to their disc and to their own
+   block buffer, so the handles own them through a pointer.
+
+   Needs C++11. With C++20, bytes is std::span<const unsigned char>. */
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#include "himd.h"
+
+namespace libhimd {
+
+#ifdef __cpp_lib_span
+typedef std::span<const unsigned char> bytes;
+#else
+/* read-only view into a buffer owned by libhimd, minimal std::span */
+class bytes {
+public:
+    typedef const unsigned char * iterator;
+    bytes() : ptr(NULL), len(0) {}
+    bytes(const unsigned char * data, std::size_t size) : ptr(data), len(size) {}
+    const unsigned char * data() const { return ptr; }
+    std::size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const unsigned char & operator[](std::size_t i) const { return ptr[i]; }
+    iterator begin() const { return ptr; }
+    iterator end() const { return ptr + len; }
+private:
+    const unsigned char * ptr;
+    std::size_t len;
+};
+#endif
+
+class error {
+public:
+    error() { info.status = HIMD_OK; info.statusmsg[0] = '\0'; }
+    error(enum himdstatus code, const char * message)
+    {
+        info.status = code;
+        std::strncpy(info.statusmsg, message, sizeof info.statusmsg - 1);
+        info.statusmsg[sizeof info.statusmsg - 1] = '\0';
+    }
+    enum himdstatus code() const { return info.status; }
+    const char * message() const { return info.statusmsg; }
+    bool is_eof() const { return info.status == HIMD_STATUS_AUDIO_EOF; }
+    struct himderrinfo * c_ptr() { return &info; }
+private:
+    struct himderrinfo info;
+};
+
+/* Either a value or the error that prevented getting it, modelled after
+   std::expected. T has to be default constructible. */
+template<typename T>
+class result {
+public:
+    result() : ok(false) {}
+    result(T value) : val(std::move(value)), ok(true) {}
+    result(const libhimd::error & e) : err(e), ok(false) {}
+    bool has_value() const { return ok; }
+    explicit operator bool() const { return ok; }
+    T & value() { assert(ok); return val; }
+    const T & value() const { assert(ok); return val; }
+    T & operator*() { return value(); }
+    const T & operator*() const { return value(); }
+    T * operator->() { return &value(); }
+    const T * operator->() const { return &value(); }
+    T value_or(T fallback) const { return ok ? val : fallback; }
+    const libhimd::error & error() const { assert(!ok); return err; }
+private:
+    T val;
+    libhimd::error err;
+    bool ok;
+};
+
+/* a track in play order. index is the position in the play order,
+   slot is what the stream and track info functions take. */
+struct track {
+    unsigned int index;
+    unsigned int slot;
+    struct trackinfo info;
+
+    bool is_mpeg() const { return sony_codecinfo_is_mpeg(&info.codec_info); }
+    bool is_lpcm() const { return sony_codecinfo_is_lpcm(&info.codec_info); }
+    const char * codec_name() const { return himd_get_codec_name(&info); }
+};
+
+struct block {
+    bytes data;
+    unsigned int frames;
+};
+
+namespace detail {
+
+/* Input iterator that calls Next until it fails. End of data and errors
+   both end the range, the error is kept by the source. */
+template<typename Source, typename Item, bool (Source::*Next)(Item &)>
+class pull_iterator {
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef Item value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Item * pointer;
+    typedef const Item & reference;
+
+    pull_iterator() : src(NULL) {}
+    explicit pull_iterator(Source * source) : src(source) { ++*this; }
+    const Item & operator*() const { return cur; }
+    const Item * operator->() const { return &cur; }
+    pull_iterator & operator++()
+    {
+        if(!(src->*Next)(cur))
+            src = NULL;
+        return *this;
+    }
+    bool operator==(const pull_iterator & other) const { return src == other.src; }
+    bool operator!=(const pull_iterator & other) const { return src != other.src; }
+private:
+    Source * src;
+    Item cur;
+};
+
+template<typename Iterator>
+class range {
+public:
+    range(Iterator first) : first(first) {}
+    Iterator begin() const { return first; }
+    Iterator end() const { return Iterator(); }
+private:
+    Iterator first;
+};
+
+}
+
+class disc {
+    struct closer {
+        void operator()(struct himd * h) const { himd_close(h); delete h; }
+    };
+public:
+    disc() {}
+
+    static result<disc> open(const char * root, enum himd_rw_mode mode = HIMD_READ_WRITE)
+    {
+        libhimd::error e;
+        std::unique_ptr<struct himd, closer> h(new struct himd);
+        if(himd_open_mode(h.get(), root, mode, e.c_ptr()) < 0)
+        {
+            /* himd_open cleans up after itself on failure */
+            delete h.release();
+            return e;
+        }
+        disc d;
+        d.h = std::move(h);
+        return d;
+    }
+
+    explicit operator bool() const { return h != nullptr; }
+    struct himd * get() const { return h.get(); }
+
+    unsigned int track_count() const { return himd_track_count(h.get()); }
+
+    /* index counts from 0 in play order */
+    result<track> track_at(unsigned int index) const
+    {
+        libhimd::error e;
+        track t;
+        t.index = index;
+        t.slot = himd_get_trackslot(h.get(), index, e.c_ptr());
+        if(t.slot == 0)
+            return e;
+        if(himd_get_track_info(h.get(), t.slot, &t.info, e.c_ptr()) < 0)
+            return e;
+        return t;
+    }
+
+    result<struct fraginfo> fragment(unsigned int idx) const
+    {
+        libhimd::error e;
+        struct fraginfo f;
+        if(himd_get_fragment_info(h.get(), idx, &f, e.c_ptr()) < 0)
+            return e;
+        return f;
+    }
+
+    /* string idx as UTF-8. 0 is the empty string, as in unset fields */
+    result<std::string> get_string(unsigned int idx) const
+    {
+        libhimd::error e;
+        char buf[256];
+        int len;
+        if(idx == 0)
+            return std::string();
+        len = himd_get_string_utf8_buf(h.get(), idx, NULL, buf, sizeof buf, e.c_ptr());
+        if(len >= 0)
+            return std::string(buf, len);
+        if(e.code() != HIMD_ERROR_OUT_OF_MEMORY)
+            return e;
+        /* longer than 255 bytes, rare enough to pay for the copy */
+        char * str = himd_get_string_utf8(h.get(), idx, NULL, e.c_ptr());
+        if(!str)
+            return e;
+        std::string s(str);
+        himd_free(str);
+        return s;
+    }
+
+    /* string idx into a caller buffer, returns the length */
+    result<std::size_t> get_string(unsigned int idx, char * buffer, std::size_t size) const
+    {
+        libhimd::error e;
+        int len = himd_get_string_utf8_buf(h.get(), idx, NULL, buffer, size, e.c_ptr());
+        if(len < 0)
+            return e;
+        return std::size_t(len);
+    }
+
+    result<bytes> discid() const
+    {
+        libhimd::error e;
+        const unsigned char * id = himd_get_discid(h.get(), e.c_ptr());
+        if(!id)
+            return e;
+        return bytes(id, 16);
+    }
+
+    class track_source {
+    public:
+        track_source() : d(NULL), next(0) {}
+        track_source(const disc * owner) : d(owner), next(0) {}
+        bool advance(result<track> & t)
+        {
+            if(next >= d->track_count())
+                return false;
+            t = d->track_at(next++);
+            return true;
+        }
+    private:
+        const disc * d;
+        unsigned int next;
+    };
+
+    class fragment_source {
+    public:
+        fragment_source() : d(NULL), next(0), steps(0) {}
+        fragment_source(const disc * owner, unsigned int first) : d(owner), next(first), steps(0) {}
+        bool advance(result<struct fraginfo> & f)
+        {
+            if(next == 0)
+                return false;
+            if(++steps > HIMD_LAST_FRAGMENT)
+            {
+                f = libhimd::error(HIMD_ERROR_FRAGMENT_CHAIN_BROKEN, "fragment chain loops");
+                next = 0;
+                return true;
+            }
+            f = d->fragment(next);
+            next = f ? f->nextfrag : 0;
+            return true;
+        }
+    private:
+        const disc * d;
+        unsigned int next;
+        unsigned int steps;
+    };
+
+    typedef detail::pull_iterator<track_source, result<track>,
+                                  &track_source::advance> track_iterator;
+    typedef detail::pull_iterator<fragment_source, result<struct fraginfo>,
+                                  &fragment_source::advance> fragment_iterator;
+
+    /* The sources live in the range object, so keep the range alive
+       while iterating; a range-based for loop does that. */
+    class track_range {
+    public:
+        track_range(const disc * d) : src(d) {}
+        track_iterator begin() { return track_iterator(&src); }
+        track_iterator end() { return track_iterator(); }
+    private:
+        track_source src;
+    };
+
+    class fragment_range {
+    public:
+        fragment_range(const disc * d, unsigned int first) : src(d, first) {}
+        fragment_iterator begin() { return fragment_iterator(&src); }
+        fragment_iterator end() { return fragment_iterator(); }
+    private:
+        fragment_source src;
+    };
+
+    track_range tracks() const { return track_range(this); }
+    fragment_range fragments(const track & t) const { return fragment_range(this, t.info.firstfrag); }
+
+private:
+    std::unique_ptr<struct himd, closer> h;
+};
+
+namespace detail {
+
+/* shared parts of mp3stream and nonmp3stream */
+template<typename Stream,
+         int (*ReadFrame)(Stream *, const unsigned char **, unsigned int *, struct himderrinfo *),
+         int (*ReadBlock)(Stream *, const unsigned char **, unsigned int *, unsigned int *, struct himderrinfo *),
+         int (*Seek)(Stream *, unsigned int, struct himderrinfo *),
+         void (*Close)(Stream *)>
+class stream {
+    struct closer {
+        void operator()(Stream * s) const { Close(s); delete s; }
+    };
+public:
+    explicit operator bool() const { return s != nullptr; }
+    Stream * get() const { return s.get(); }
+
+    /* the returned data stays valid until the next read */
+    result<bytes> read_frame()
+    {
+        libhimd::error e;
+        const unsigned char * data;
+        unsigned int len;
+        if(ReadFrame(s.get(), &data, &len, e.c_ptr()) < 0)
+            return e;
+        return bytes(data, len);
+    }
+
+    result<block> read_block()
+    {
+        libhimd::error e;
+        const unsigned char * data;
+        unsigned int len;
+        block b;
+        if(ReadBlock(s.get(), &data, &len, &b.frames, e.c_ptr()) < 0)
+            return e;
+        b.data = bytes(data, len);
+        return b;
+    }
+
+    result<bool> seek_block(unsigned int blockidx)
+    {
+        libhimd::error e;
+        if(Seek(s.get(), blockidx, e.c_ptr()) < 0)
+            return e;
+        return true;
+    }
+
+    bool next_frame(bytes & out)
+    {
+        const unsigned char * data;
+        unsigned int len;
+        if(ReadFrame(s.get(), &data, &len, last.c_ptr()) < 0)
+            return false;
+        out = bytes(data, len);
+        return true;
+    }
+
+    bool next_block(block & out)
+    {
+        const unsigned char * data;
+        unsigned int len;
+        if(ReadBlock(s.get(), &data, &len, &out.frames, last.c_ptr()) < 0)
+            return false;
+        out.data = bytes(data, len);
+        return true;
+    }
+
+    typedef pull_iterator<stream, bytes, &stream::next_frame> frame_iterator;
+    typedef pull_iterator<stream, block, &stream::next_block> block_iterator;
+
+    /* Ranges over the rest of the stream. They end at the end of the
+       track or on the first error; last_error tells which. */
+    range<frame_iterator> frames() { return range<frame_iterator>(frame_iterator(this)); }
+    range<block_iterator> blocks() { return range<block_iterator>(block_iterator(this)); }
+    const libhimd::error & last_error() const { return last; }
+    bool failed() const { return last.code() != HIMD_OK && !last.is_eof(); }
+
+protected:
+    template<typename Derived, typename OpenFn>
+    static result<Derived> open_with(OpenFn open, const disc & d, unsigned int slot)
+    {
+        libhimd::error e;
+        std::unique_ptr<Stream> raw(new Stream);
+        if(open(d.get(), slot, raw.get(), e.c_ptr()) < 0)
+            return e;
+        Derived str;
+        str.s.reset(raw.release());
+        return str;
+    }
+
+private:
+    std::unique_ptr<Stream, closer> s;
+    libhimd::error last;
+};
+
+}
+
+class mp3stream : public detail::stream<struct himd_mp3stream,
+                                        himd_mp3stream_read_frame,
+                                        himd_mp3stream_read_block,
+                                        himd_mp3stream_seek_block,
+                                        himd_mp3stream_close> {
+public:
+    static result<mp3stream> open(const disc & d, unsigned int slot)
+    {
+        return open_with<mp3stream>(himd_mp3stream_open, d, slot);
+    }
+    static result<mp3stream> open(const disc & d, const track & t)
+    {
+        return open(d, t.slot);
+    }
+};
+
+class nonmp3stream : public detail::stream<struct himd_nonmp3stream,
+                                           himd_nonmp3stream_read_frame,
+                                           himd_nonmp3stream_read_block,
+                                           himd_nonmp3stream_seek_block,
+                                           himd_nonmp3stream_close> {
+public:
+    static result<nonmp3stream> open(const disc & d, unsigned int slot)
+    {
+        return open_with<nonmp3stream>(himd_nonmp3stream_open, d, slot);
+    }
+    static result<nonmp3stream> open(const disc & d, const track & t)
+    {
+        return open(d, t.slot);
+    }
+};
+
+}
+
+#endif
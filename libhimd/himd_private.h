@@ -23,11 +23,69 @@ static inline void setbeword32(unsigned char * c, unsigned int val)
     c[3] =  val        & 0xFF;
 }
 
+/* state of a handle that is shared by all threads using it */
+struct himd_shared {
+    GRWLock tiflock;
+    GMappedFile * tifmap;		/* set while tifdata is mapped */
+    struct himderrinfo discid_status;	/* why discid is not valid */
+    const struct himd_io * io;
+    void * iodata;
+    void * atdata;			/* ATDATA opened through io */
+};
+
+/* Access to the files in the HMDHIFI directory. himd.c implements it
+   for a mounted filesystem, fatimage.c for a FAT image file and
+   snapshot.c for a snapshot archive. Files are read with positioned
+   reads, which must be safe to call from several threads on the same
+   file. */
+struct himd_io {
+    /* the names of all files in HMDHIFI, free with g_strfreev */
+    gchar ** (*list)(void * iodata, struct himderrinfo * status);
+    /* returns NULL and sets errno if the file can't be opened */
+    void * (*open)(void * iodata, const char * name);
+    gssize (*pread)(void * file, unsigned char * buffer, gsize len, goffset offset);
+    goffset (*size)(void * file);
+    void (*close)(void * file);
+    void (*destroy)(void * iodata);
+    /* start of the first data at or after offset, with the end of that
+       data in *dataend, like SEEK_DATA and SEEK_HOLE; the file size if
+       only a hole follows. -1 if holes can't be detected. May be NULL. */
+    goffset (*find_data)(void * file, goffset offset, goffset * dataend);
+    int read_only;
+};
+
+extern const struct himd_io himd_fatimage_io;
+void * himd_fatimage_open(const char * imagepath, struct himderrinfo * status);
+extern const struct himd_io himd_snapshot_io;
+void * himd_snapshot_io_open(const char * path, struct himderrinfo * status);
+
+gssize himd_pread(int fd, GMutex * lock, unsigned char * buffer, gsize len, goffset offset);
+goffset himd_find_data(int fd, goffset offset, goffset * dataend);
+void * himd_io_open(struct himd * himd, const char * fileid);
+
+#define himd_tif_read_lock(himd) g_rw_lock_reader_lock(&(himd)->shared->tiflock)
+#define himd_tif_read_unlock(himd) g_rw_lock_reader_unlock(&(himd)->shared->tiflock)
+#define himd_tif_write_lock(himd) g_rw_lock_writer_lock(&(himd)->shared->tiflock)
+#define himd_tif_write_unlock(himd) g_rw_lock_writer_unlock(&(himd)->shared->tiflock)
+
+void himd_tif_make_writable(struct himd * himd);
+gssize himd_read_atdata(struct himd * himd, unsigned char * buffer, gsize len, goffset offset);
+
 void set_status_const(struct himderrinfo * status, enum himdstatus code, const char * msg);
 void set_status_printf(struct himderrinfo * status, enum himdstatus code, const char * format, ...);
 
 int descrypt_open(void ** dataptr, const unsigned char * trackkey, 
                   unsigned int ekbnum, struct himderrinfo * status);
+size_t descrypt_size(void);
+int descrypt_init(void * dataptr, const unsigned char * trackkey,
+                  unsigned int ekbnum, struct himderrinfo * status);
+void descrypt_fini(void * dataptr);
 int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
                      const unsigned char * fragkey, struct himderrinfo * status);
 void descrypt_close(void * dataptr);
+
+unsigned int himd_blockcache_new_id(void);
+int himd_blockcache_lookup(struct himd_blockcache * cache, const struct himd * himd,
+                           unsigned int blockno, unsigned char * block);
+void himd_blockcache_insert(struct himd_blockcache * cache, const struct himd * himd,
+                            unsigned int blockno, const unsigned char * block);
@@ -16,6 +16,18 @@ else: !build_pass: message(You disabled mcrypt: No PCM and ATRAC transfer will b
 }
 else: !build_pass: message(You disabled mad: MP3 transfer will be limited)
 
+!without_flac: {
+  LIBS += -lFLAC
+  DEFINES += CONFIG_WITH_FLAC
+}
+else: !build_pass: message(You disabled FLAC: LPCM tracks can't be saved as FLAC)
+
+with_avcodec: {
+  PKGCONFIG += libavcodec libavutil
+  DEFINES += CONFIG_WITH_AVCODEC
+}
+else: !build_pass: message(ATRAC decoding is disabled, use CONFIG+=with_avcodec to enable it)
+
 PKGCONFIG += glib-2.0
-HEADERS += codecinfo.h himd.h himd_private.h sony_oma.h
-SOURCES += codecinfo.c encryption.c himd.c mdstream.c trackindex.c sony_oma.c frag.c mp3tools.c
+HEADERS += codecinfo.h himd.h himd.hpp himd_private.h sony_oma.h
+SOURCES += codecinfo.c encryption.c himd.c mdstream.c trackindex.c sony_oma.c frag.c mp3tools.c blockcache.c pcmstream.c schedule.c arena.c fatimage.c snapshot.c verify.c fsck.c catalog.c flacsink.c decode.c
@@ -34,6 +34,13 @@
 #define _(x) (x)
 
 int himd_blockstream_open(struct himd * himd, unsigned int firstfrag, unsigned int frags_per_block, struct himd_blockstream * stream, struct himderrinfo * status)
+{
+    return himd_blockstream_open_arena(himd, firstfrag, frags_per_block, stream, NULL, status);
+}
+
+/* With arena == NULL, the fragment list is allocated on the heap */
+int himd_blockstream_open_arena(struct himd * himd, unsigned int firstfrag, unsigned int frags_per_block,
+                                struct himd_blockstream * stream, struct himd_arena * arena, struct himderrinfo * status)
 {
     struct fraginfo frag;
     unsigned int fragcount, fragnum, blockcount;
@@ -60,7 +67,11 @@ int himd_blockstream_open(struct himd * himd, unsigned int firstfrag, unsigned i
         blockcount += frag.lastblock - frag.firstblock + 1;
     }
 
-    stream->frags = malloc(fragcount * sizeof stream->frags[0]);
+    if(arena)
+        stream->frags = himd_arena_alloc(arena, fragcount * sizeof stream->frags[0]);
+    else
+        stream->frags = malloc(fragcount * sizeof stream->frags[0]);
+    stream->in_arena = arena != NULL;
     if(!stream->frags)
     {
         set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
@@ -78,25 +89,64 @@ int himd_blockstream_open(struct himd * himd, unsigned int firstfrag, unsigned i
         fragnum = stream->frags[fragcount].nextfrag;
     }
 
-    stream->atdata = himd_open_file(himd, "ATDATA", HIMD_READ_ONLY);
-    if(!stream->atdata)
-    {
-        set_status_printf(status, HIMD_ERROR_CANT_OPEN_AUDIO,
-                          _("Can't open audio data: %s"), g_strerror(errno));
-        free(stream->frags);
-        return -1;
-    }
-
     stream->curblockno = stream->frags[0].firstblock;
     stream->frames_per_block = frags_per_block;
+    stream->needseek = 1;
+    stream->stats = NULL;
     
     return 0;
 }
 
 void himd_blockstream_close(struct himd_blockstream * stream)
 {
-    fclose(stream->atdata);
-    free(stream->frags);
+    if(!stream->in_arena)
+        free(stream->frags);
+    g_free(stream->stats);
+}
+
+void himd_stream_enable_stats(struct himd_blockstream * stream)
+{
+    g_return_if_fail(stream != NULL);
+    if(!stream->stats)
+        stream->stats = g_new0(struct himd_stream_stats, 1);
+}
+
+int himd_stream_get_stats(const struct himd_blockstream * stream, struct himd_stream_stats * stats)
+{
+    g_return_val_if_fail(stream != NULL, -1);
+    g_return_val_if_fail(stats != NULL, -1);
+
+    if(!stream->stats)
+    {
+        memset(stats, 0, sizeof *stats);
+        return -1;
+    }
+    *stats = *stream->stats;
+    return 0;
+}
+
+/* Timing helpers, these only look at the clock if stats are enabled. */
+static inline gint64 stats_clock(const struct himd_stream_stats * stats)
+{
+    return stats ? g_get_monotonic_time() : 0;
+}
+
+static inline gint64 stats_elapsed(gint64 start)
+{
+    return g_get_monotonic_time() - start;
+}
+
+static void stats_count_read(struct himd_stream_stats * stats, gint64 start)
+{
+    gint64 usec = stats_elapsed(start);
+    unsigned int bucket = 0;
+
+    while(bucket < HIMD_STATS_LATENCY_BUCKETS - 1 && usec >= (G_GINT64_CONSTANT(1) << bucket))
+        bucket++;
+    stats->read_latency[bucket]++;
+    stats->read_usec += usec;
+    stats->blocks++;
+    stats->bytes += 16384;
 }
 
 static inline int is_mpeg(struct himd_blockstream * stream)
@@ -104,9 +154,13 @@ static inline int is_mpeg(struct himd_blockstream * stream)
     return stream->frames_per_block == TRACK_IS_MPEG;
 }
 
-int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * block,
-                            unsigned int * firstframe, unsigned int * lastframe,
-                            unsigned char * fragkey, struct himderrinfo * status)
+/* Reads the next block of the stream into block. If cache is non-NULL and
+   already holds the block, it is copied from there instead and *cached is
+   set, meaning the block contents are already decrypted. */
+static int blockstream_fetch(struct himd_blockstream * stream, struct himd_blockcache * cache,
+                             unsigned char * block, unsigned int * blockno, int * cached,
+                             unsigned int * firstframe, unsigned int * lastframe,
+                             unsigned char * fragkey, struct himderrinfo * status)
 {
     struct fraginfo * curfrag;
 
@@ -125,23 +179,49 @@ int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * bloc
     {
         if(firstframe)
             *firstframe = curfrag->firstframe;
-        if(fseek(stream->atdata, stream->curblockno*16384L, SEEK_SET) < 0)
-        {
-            set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
-                              _("Can't seek in audio data: %s"), g_strerror(errno));
-            return -1;
-        }
+        stream->needseek = 1;
     }
     else if(firstframe)
         *firstframe = 0;
 
-    if(fread(block, 16384, 1, stream->atdata) != 1)
+    if(blockno)
+        *blockno = stream->curblockno;
+
+    if(cache && himd_blockcache_lookup(cache, stream->himd, stream->curblockno, block))
     {
-        if(feof(stream->atdata))
-            set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO, _("Unexpected EOF while reading audio block %d"),stream->curblockno);
-        else
-            set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO, _("Read error on block audio %d: %s"), stream->curblockno, g_strerror(errno));
-        return -1;
+        *cached = 1;
+        /* the file position is stale now */
+        stream->needseek = 1;
+    }
+    else
+    {
+        gint64 start = stats_clock(stream->stats);
+        gssize len;
+
+        if(cached)
+            *cached = 0;
+
+        /* reads are positioned, needseek only tells whether this read
+           continues the previous one */
+        if(stream->needseek)
+        {
+            if(stream->stats)
+                stream->stats->seeks++;
+            stream->needseek = 0;
+        }
+
+        len = himd_read_atdata(stream->himd, block, 16384, stream->curblockno*(goffset)16384);
+        if(len != 16384)
+        {
+            if(len >= 0)
+                set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO, _("Unexpected EOF while reading audio block %d"),stream->curblockno);
+            else
+                set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO, _("Read error on block audio %d: %s"), stream->curblockno, g_strerror(errno));
+            stream->needseek = 1;
+            return -1;
+        }
+        if(stream->stats)
+            stats_count_read(stream->stats, start);
     }
 
     if(fragkey)
@@ -176,6 +256,45 @@ int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * bloc
     return 0;
 }
 
+int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * block,
+                            unsigned int * firstframe, unsigned int * lastframe,
+                            unsigned char * fragkey, struct himderrinfo * status)
+{
+    return blockstream_fetch(stream, NULL, block, NULL, NULL,
+                             firstframe, lastframe, fragkey, status);
+}
+
+/* Positions the stream on the blockidx'th block of the track, counted from
+   zero. Seeking to blockcount positions the stream at EOF. */
+int himd_blockstream_seek(struct himd_blockstream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    unsigned int fragno, fragblocks;
+
+    g_return_val_if_fail(stream != NULL, -1);
+
+    if(blockidx > stream->blockcount)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
+                          _("Can't seek to block %u of a stream of %u blocks"),
+                          blockidx, stream->blockcount);
+        return -1;
+    }
+
+    for(fragno = 0; fragno < stream->fragcount; fragno++)
+    {
+        fragblocks = stream->frags[fragno].lastblock - stream->frags[fragno].firstblock + 1;
+        if(blockidx < fragblocks)
+            break;
+        blockidx -= fragblocks;
+    }
+
+    stream->curfragno = fragno;
+    if(fragno < stream->fragcount)
+        stream->curblockno = stream->frags[fragno].firstblock + blockidx;
+    stream->needseek = 1;
+    return 0;
+}
+
 int himd_writestream_open(struct himd * himd, struct himd_writestream * stream,
 		       unsigned int * out_first_blockno, unsigned int * out_last_blockno, struct himderrinfo * status)
 {
@@ -267,6 +386,12 @@ int himd_writestream_write(struct himd_writestream * stream, struct blockinfo *
 }
 
 int himd_mp3stream_open(struct himd * himd, unsigned int trackno, struct himd_mp3stream * stream, struct himderrinfo * status)
+{
+    return himd_mp3stream_open_arena(himd, trackno, stream, NULL, status);
+}
+
+int himd_mp3stream_open_arena(struct himd * himd, unsigned int trackno, struct himd_mp3stream * stream,
+                              struct himd_arena * arena, struct himderrinfo * status)
 {
     struct trackinfo trkinfo;
 
@@ -287,16 +412,56 @@ int himd_mp3stream_open(struct himd * himd, unsigned int trackno, struct himd_mp
     if(himd_obtain_mp3key(himd, trackno, &stream->key, status) < 0)
         return -1;
 
-    if(himd_blockstream_open(himd, trkinfo.firstfrag, TRACK_IS_MPEG, &stream->stream, status) < 0)
+    if(himd_blockstream_open_arena(himd, trkinfo.firstfrag, TRACK_IS_MPEG, &stream->stream, arena, status) < 0)
         return -1;
 
+    stream->framebuf = NULL;
+    if(arena)
+    {
+        stream->framebuf = himd_arena_alloc(arena, (HIMD_MAX_MP3_FRAMES_PER_BLOCK + 2) * sizeof stream->framebuf[0]);
+        if(!stream->framebuf)
+        {
+            set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Arena too small for MP3 frame pointers"));
+            himd_blockstream_close(&stream->stream);
+            return -1;
+        }
+    }
+
     stream->frames = 0;
     stream->curframe = 0;
     stream->frameptrs = NULL;
+    stream->cache = NULL;
 
     return 0;
 }
 
+static void drop_frameptrs(struct himd_mp3stream * stream)
+{
+    if(stream->frameptrs != stream->framebuf)
+        free(stream->frameptrs);
+    stream->frameptrs = NULL;
+}
+
+void himd_mp3stream_set_cache(struct himd_mp3stream * stream, struct himd_blockcache * cache)
+{
+    g_return_if_fail(stream != NULL);
+    stream->cache = cache;
+}
+
+int himd_mp3stream_seek_block(struct himd_mp3stream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    g_return_val_if_fail(stream != NULL, -1);
+
+    if(himd_blockstream_seek(&stream->stream, blockidx, status) < 0)
+        return -1;
+
+    /* drop what is left of the current block */
+    drop_frameptrs(stream);
+    stream->frames = 0;
+    stream->curframe = 0;
+    return 0;
+}
+
 #ifdef CONFIG_WITH_MAD
 #include <mad.h>
 
@@ -310,7 +475,19 @@ static int himd_mp3stream_split_frames(struct himd_mp3stream * stream, unsigned
     /* stream->frameptrs is NULL if the current frame has not been splitted yet */
     g_warn_if_fail(stream->frameptrs == NULL);
 
-    stream->frameptrs = malloc((lastframe - firstframe + 2) * sizeof stream->frameptrs[0]);
+    if(stream->framebuf)
+    {
+        if(lastframe - firstframe + 2 > HIMD_MAX_MP3_FRAMES_PER_BLOCK + 2)
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_FRAME_NUMBERS,
+                       _("Block with %u frames exceeds the frame limit"),
+                       lastframe-firstframe+1);
+            return -1;
+        }
+        stream->frameptrs = stream->framebuf;
+    }
+    else
+        stream->frameptrs = malloc((lastframe - firstframe + 2) * sizeof stream->frameptrs[0]);
     if(!stream->frameptrs)
     {
         set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
@@ -374,6 +551,11 @@ int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned cha
     unsigned int i;
     unsigned int firstframe, lastframe;
     unsigned int dataframes, databytes;
+    unsigned int blockno;
+    int cached;
+#ifdef CONFIG_WITH_MAD
+    gint64 start;
+#endif
 
     /* partial block remaining, return all remaining frames */
     if(stream->curframe < stream->frames)
@@ -391,12 +573,11 @@ int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned cha
     }
     
     /* need to read next block */
-    if(himd_blockstream_read(&stream->stream, stream->blockbuf,
-                             &firstframe, &lastframe, NULL, status) < 0)
+    if(blockstream_fetch(&stream->stream, stream->cache, stream->blockbuf,
+                         &blockno, &cached, &firstframe, &lastframe, NULL, status) < 0)
         return -1;
 
-    free(stream->frameptrs);
-    stream->frameptrs = NULL;
+    drop_frameptrs(stream);
 
     if(firstframe > lastframe)
     {
@@ -426,8 +607,16 @@ int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned cha
     }
 
     /* Decrypt block */
-    for(i = 0;i < (databytes & ~7U);i++)
-        stream->blockbuf[i+0x20] ^= stream->key[i & 3];
+    if(!cached)
+    {
+        gint64 start = stats_clock(stream->stream.stats);
+        for(i = 0;i < (databytes & ~7U);i++)
+            stream->blockbuf[i+0x20] ^= stream->key[i & 3];
+        if(stream->stream.stats)
+            stream->stream.stats->decrypt_usec += stats_elapsed(start);
+        if(stream->cache)
+            himd_blockcache_insert(stream->cache, stream->stream.himd, blockno, stream->blockbuf);
+    }
 
     /* Indicate completely consumed block 
        be sure to set this *before* writing to *framecont,
@@ -437,7 +626,7 @@ int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned cha
 
     /* The common case - all frames belong to the stream to read.
        If compiled without MAD, always put all frames into the block */
-#ifndef CONFIG_WITH_MAD
+#ifdef CONFIG_WITH_MAD
     if(firstframe == 0 && lastframe == dataframes - 1)
 #endif
     {
@@ -454,11 +643,19 @@ int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned cha
     }
 
 #ifdef CONFIG_WITH_MAD
+    start = stats_clock(stream->stream.stats);
     if(himd_mp3stream_split_frames(stream, databytes, firstframe, lastframe, status) < 0)
         return -1;
+    if(stream->stream.stats)
+        stream->stream.stats->split_usec += stats_elapsed(start);
 
-    if(*framecount)
-        *framecount = lastframe - firstframe + 1;
+    if(frameout)
+        *frameout = stream->frameptrs[0];
+    if(lenout)
+        *lenout = stream->frameptrs[stream->frames] - stream->frameptrs[0];
+    if(framecount)
+        *framecount = stream->frames;
+    stream->curframe = stream->frames;
 #endif
     return 0;
 }
@@ -473,9 +670,16 @@ int himd_mp3stream_read_frame(struct himd_mp3stream * stream, const unsigned cha
         if(himd_mp3stream_read_block(stream, NULL, &databytes, &framecount, status) < 0)
             return -1;
         /* if whole block should be used, it is not yet splitted */
-        if(!stream->frameptrs &&
-            himd_mp3stream_split_frames(stream, databytes, 0, framecount, status) < 0)
-            return -1;
+        if(!stream->frameptrs)
+        {
+            gint64 start = stats_clock(stream->stream.stats);
+            if(himd_mp3stream_split_frames(stream, databytes, 0, framecount, status) < 0)
+                return -1;
+            if(stream->stream.stats)
+                stream->stream.stats->split_usec += stats_elapsed(start);
+        }
+        /* read_block returned a partial block as consumed */
+        stream->curframe = 0;
     }
     
     if(frameout)
@@ -504,7 +708,7 @@ int himd_mp3stream_read_frame(struct himd_mp3stream * stream, const unsigned cha
 void himd_mp3stream_close(struct himd_mp3stream * stream)
 {
     g_return_if_fail(stream != NULL);
-    free(stream->frameptrs);
+    drop_frameptrs(stream);
     himd_blockstream_close(&stream->stream);
 }
 
@@ -512,6 +716,12 @@ void himd_mp3stream_close(struct himd_mp3stream * stream)
 #include <string.h>
 
 int himd_nonmp3stream_open(struct himd * himd, unsigned int trackno, struct himd_nonmp3stream * stream, struct himderrinfo * status)
+{
+    return himd_nonmp3stream_open_arena(himd, trackno, stream, NULL, status);
+}
+
+int himd_nonmp3stream_open_arena(struct himd * himd, unsigned int trackno, struct himd_nonmp3stream * stream,
+                                 struct himd_arena * arena, struct himderrinfo * status)
 {
     struct trackinfo trkinfo;
 
@@ -530,15 +740,40 @@ int himd_nonmp3stream_open(struct himd * himd, unsigned int trackno, struct himd
                           _("Track %d does not contain PCM, ATRAC3 or ATRAC3+ data"), trackno);
         return -1;
     }
-    if(himd_blockstream_open(himd, trkinfo.firstfrag, himd_trackinfo_framesperblock(&trkinfo), &stream->stream, status) < 0)
+    if(himd_blockstream_open_arena(himd, trkinfo.firstfrag, himd_trackinfo_framesperblock(&trkinfo), &stream->stream, arena, status) < 0)
         return -1;
 
-    if(descrypt_open(&stream->cryptinfo, trkinfo.key, trkinfo.ekbnum, status) < 0)
+    if(arena)
+    {
+        stream->cryptinfo = himd_arena_alloc(arena, descrypt_size());
+        if(!stream->cryptinfo)
+            set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Arena too small for decryption state"));
+    }
+    if(arena ? !stream->cryptinfo || descrypt_init(stream->cryptinfo, trkinfo.key, trkinfo.ekbnum, status) < 0
+             : descrypt_open(&stream->cryptinfo, trkinfo.key, trkinfo.ekbnum, status) < 0)
     {
         himd_blockstream_close(&stream->stream);
         return -1;
     }
     stream->framesize = himd_trackinfo_framesize(&trkinfo);
+    stream->framesleft = 0;
+    stream->cache = NULL;
+    return 0;
+}
+
+void himd_nonmp3stream_set_cache(struct himd_nonmp3stream * stream, struct himd_blockcache * cache)
+{
+    g_return_if_fail(stream != NULL);
+    stream->cache = cache;
+}
+
+int himd_nonmp3stream_seek_block(struct himd_nonmp3stream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    g_return_val_if_fail(stream != NULL, -1);
+
+    if(himd_blockstream_seek(&stream->stream, blockidx, status) < 0)
+        return -1;
+
     stream->framesleft = 0;
     return 0;
 }
@@ -548,8 +783,13 @@ int himd_nonmp3stream_read_frame(struct himd_nonmp3stream * stream, const unsign
     g_return_val_if_fail(stream != NULL, -1);
 
     if(!stream->framesleft)
-        if(himd_nonmp3stream_read_block(stream, &stream->frameptr, NULL, &stream->framesleft, status) < 0)
+    {
+        unsigned int count;
+        /* read_block clears framesleft, so it can't store the count there */
+        if(himd_nonmp3stream_read_block(stream, &stream->frameptr, NULL, &count, status) < 0)
             return -1;
+        stream->framesleft = count;
+    }
 
     if(frameout)
         *frameout = (unsigned char *)stream->frameptr;
@@ -565,6 +805,8 @@ int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsign
 {
     unsigned int firstframe, lastframe;
     unsigned char fragkey[8];
+    unsigned int blockno;
+    int cached;
 
     g_return_val_if_fail(stream != NULL, -1);
     /* if partial block left */
@@ -581,13 +823,21 @@ int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsign
         return 0;
     }
     
-    if(himd_blockstream_read(&stream->stream, stream->blockbuf,
-                             &firstframe, &lastframe, fragkey, status) < 0)
-        return -1;
-    if(descrypt_decrypt(stream->cryptinfo, stream->blockbuf,
-                        stream->framesize * stream->stream.frames_per_block,
-                        fragkey, status) < 0)
+    if(blockstream_fetch(&stream->stream, stream->cache, stream->blockbuf,
+                         &blockno, &cached, &firstframe, &lastframe, fragkey, status) < 0)
         return -1;
+    if(!cached)
+    {
+        gint64 start = stats_clock(stream->stream.stats);
+        if(descrypt_decrypt(stream->cryptinfo, stream->blockbuf,
+                            stream->framesize * stream->stream.frames_per_block,
+                            fragkey, status) < 0)
+            return -1;
+        if(stream->stream.stats)
+            stream->stream.stats->decrypt_usec += stats_elapsed(start);
+        if(stream->cache)
+            himd_blockcache_insert(stream->cache, stream->stream.himd, blockno, stream->blockbuf);
+    }
     if(frameout)
         *frameout = stream->blockbuf+32 + firstframe * stream->framesize;
     if(lenout)
@@ -602,8 +852,11 @@ void himd_nonmp3stream_close(struct himd_nonmp3stream * stream)
 {
     g_return_if_fail(stream != NULL);
 
+    if(stream->stream.in_arena)
+        descrypt_fini(stream->cryptinfo);
+    else
+        descrypt_close(stream->cryptinfo);
     himd_blockstream_close(&stream->stream);
-    descrypt_close(stream->cryptinfo);
 }
 
 #else
@@ -614,12 +867,28 @@ int himd_nonmp3stream_open(struct himd * himd, unsigned int trackno, struct himd
     return -1;
 }
 
+int himd_nonmp3stream_open_arena(struct himd * himd, unsigned int trackno, struct himd_nonmp3stream * stream,
+                                 struct himd_arena * arena, struct himderrinfo * status)
+{
+    return himd_nonmp3stream_open(himd, trackno, stream, status);
+}
+
 int himd_nonmp3stream_read_frame(struct himd_nonmp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, struct himderrinfo * status)
 {
     set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't do non-mp3 read: Compiled without mcrypt library"));
     return -1;
 }
 
+int himd_nonmp3stream_seek_block(struct himd_nonmp3stream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't do non-mp3 seek: Compiled without mcrypt library"));
+    return -1;
+}
+
+void himd_nonmp3stream_set_cache(struct himd_nonmp3stream * stream, struct himd_blockcache * cache)
+{
+}
+
 void himd_nonmp3stream_close(struct himd_nonmp3stream * stream)
 {
 }
@@ -23,6 +23,8 @@
  *
  */
 
+#include <string.h>
+#include <glib.h>
 #include <id3tag.h>
 #include "himd.h"
 #include "himd_private.h"
@@ -78,3 +80,97 @@ int himd_get_songinfo(const char *filepath, char ** artist, char ** title, char
     id3_file_close(file);
     return 0;
 }
+
+/* ID3v2.4 tag writer. Version 2.4 is used because it is the first one
+   that can store UTF-8 strings as they are kept on the disc. */
+
+#define ID3V2_HEADER_SIZE 10
+#define ID3V2_ENCODING_UTF8 3
+
+static void put_syncsafe(unsigned char * p, unsigned int value)
+{
+    p[0] = (value >> 21) & 0x7F;
+    p[1] = (value >> 14) & 0x7F;
+    p[2] = (value >> 7) & 0x7F;
+    p[3] = value & 0x7F;
+}
+
+static void append_frame(GString * tag, const char * id, const char * prefix, unsigned int prefixlen, const char * text)
+{
+    unsigned char header[ID3V2_HEADER_SIZE];
+    unsigned int textlen = strlen(text);
+
+    memcpy(header, id, 4);
+    put_syncsafe(header + 4, 1 + prefixlen + textlen);
+    header[8] = header[9] = 0;   /* no frame flags */
+    g_string_append_len(tag, (const char *)header, sizeof header);
+    g_string_append_c(tag, ID3V2_ENCODING_UTF8);
+    g_string_append_len(tag, prefix, prefixlen);
+    g_string_append_len(tag, text, textlen);
+}
+
+/*
+ * Builds an ID3v2 tag with the given texts (each may be NULL), followed
+ * by padding zero bytes, so the tag can be written in front of the audio
+ * data in one go. The result is to be freed with himd_free.
+ */
+unsigned char * himd_make_id3v2_tag(const char * title, const char * artist, const char * album,
+                                    const char * comment, unsigned int padding, unsigned int * lenout)
+{
+    GString * tag;
+    unsigned char header[ID3V2_HEADER_SIZE];
+
+    g_return_val_if_fail(lenout != NULL, NULL);
+
+    tag = g_string_sized_new(ID3V2_HEADER_SIZE + 256 + padding);
+    g_string_append_len(tag, "ID3\x04\x00\x00" "\0\0\0\0", ID3V2_HEADER_SIZE);
+
+    if(title)
+        append_frame(tag, "TIT2", NULL, 0, title);
+    if(artist)
+        append_frame(tag, "TPE1", NULL, 0, artist);
+    if(album)
+        append_frame(tag, "TALB", NULL, 0, album);
+    if(comment)
+        /* language and an empty content description */
+        append_frame(tag, "COMM", "eng", 4, comment);
+
+    while(padding--)
+        g_string_append_c(tag, 0);
+
+    put_syncsafe(header, tag->len - ID3V2_HEADER_SIZE);
+    memcpy(tag->str + 6, header, 4);
+
+    *lenout = tag->len;
+    return (unsigned char *)g_string_free(tag, FALSE);
+}
+
+/*
+ * Same as himd_make_id3v2_tag, taking title, artist and album from the
+ * track on the disc.
+ */
+unsigned char * himd_track_id3v2_tag(struct himd * himd, const struct trackinfo * track,
+                                     const char * comment, unsigned int padding,
+                                     unsigned int * lenout, struct himderrinfo * status)
+{
+    char * title = NULL, * artist = NULL, * album = NULL;
+    unsigned char * tag = NULL;
+
+    g_return_val_if_fail(himd != NULL, NULL);
+    g_return_val_if_fail(track != NULL, NULL);
+
+    if(track->title && !(title = himd_get_string_utf8(himd, track->title, NULL, status)))
+        goto clean;
+    if(track->artist && !(artist = himd_get_string_utf8(himd, track->artist, NULL, status)))
+        goto clean;
+    if(track->album && !(album = himd_get_string_utf8(himd, track->album, NULL, status)))
+        goto clean;
+
+    tag = himd_make_id3v2_tag(title, artist, album, comment, padding, lenout);
+
+clean:
+    himd_free(title);
+    himd_free(artist);
+    himd_free(album);
+    return tag;
+}
@@ -0,0 +1,313 @@
+/*
+ * pcmstream.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define _(x) (x)
+
+/* Swaps the bytes of 16-bit samples. dst and src may be identical. */
+void himd_swab16(unsigned char * dst, const unsigned char * src, size_t samples)
+{
+#if defined(__SSSE3__)
+    const __m128i shuffle = _mm_set_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+    for(; samples >= 8; samples -= 8, src += 16, dst += 16)
+        _mm_storeu_si128((__m128i*)dst,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuffle));
+#elif defined(__SSE2__)
+    for(; samples >= 8; samples -= 8, src += 16, dst += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst,
+                         _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for(; samples >= 8; samples -= 8, src += 16, dst += 16)
+        vst1q_u8(dst, vrev16q_u8(vld1q_u8(src)));
+#endif
+    for(; samples > 0; samples--, src += 2, dst += 2)
+    {
+        unsigned char tmp = src[0];
+        dst[0] = src[1];
+        dst[1] = tmp;
+    }
+}
+
+#ifdef CONFIG_WITH_MAD
+#include <mad.h>
+
+struct mp3decoder {
+    struct mad_stream stream;
+    struct mad_frame frame;
+    struct mad_synth synth;
+    unsigned char inbuf[HIMD_AUDIO_SIZE + MAD_BUFFER_GUARD];
+};
+
+static int mp3decoder_open(struct himd_pcmstream * stream, struct himderrinfo * status)
+{
+    struct mp3decoder * dec = g_try_new(struct mp3decoder, 1);
+    if(!dec)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate MPEG decoder"));
+        return -1;
+    }
+    mad_stream_init(&dec->stream);
+    mad_frame_init(&dec->frame);
+    mad_synth_init(&dec->synth);
+    /* nothing buffered yet, the first decode asks for a block */
+    mad_stream_buffer(&dec->stream, dec->inbuf, 0);
+    stream->decoder = dec;
+    return 0;
+}
+
+static void mp3decoder_close(struct himd_pcmstream * stream)
+{
+    struct mp3decoder * dec = stream->decoder;
+    mad_synth_finish(&dec->synth);
+    mad_frame_finish(&dec->frame);
+    mad_stream_finish(&dec->stream);
+    g_free(dec);
+}
+
+/* round and clip to 16 bits, like minimad does */
+static inline short scale_sample(mad_fixed_t sample)
+{
+    sample += (1L << (MAD_F_FRACBITS - 16));
+    if(sample >= MAD_F_ONE)
+        sample = MAD_F_ONE - 1;
+    else if(sample < -MAD_F_ONE)
+        sample = -MAD_F_ONE;
+    return sample >> (MAD_F_FRACBITS + 1 - 16);
+}
+
+static int mp3decoder_refill(struct himd_pcmstream * stream, struct himderrinfo * status)
+{
+    struct mp3decoder * dec = stream->decoder;
+    const struct mad_pcm * pcm;
+    const unsigned char * data;
+    unsigned int len, i;
+    short * out;
+
+    while(mad_frame_decode(&dec->frame, &dec->stream) < 0)
+    {
+        if(MAD_RECOVERABLE(dec->stream.error))
+            continue;
+        if(dec->stream.error != MAD_ERROR_BUFLEN)
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                              _("Can't decode MPEG frame: %s"),
+                              mad_stream_errorstr(&dec->stream));
+            return -1;
+        }
+        /* blocks only contain complete frames, so nothing is carried over */
+        if(himd_mp3stream_read_block(&stream->src.mp3, &data, &len, NULL, status) < 0)
+            return -1;
+        memcpy(dec->inbuf, data, len);
+        memset(dec->inbuf + len, 0, MAD_BUFFER_GUARD);
+        mad_stream_buffer(&dec->stream, dec->inbuf, len + MAD_BUFFER_GUARD);
+    }
+
+    mad_synth_frame(&dec->synth, &dec->frame);
+    pcm = &dec->synth.pcm;
+
+    out = stream->pcmbuf;
+    for(i = 0; i < pcm->length; i++)
+    {
+        *out++ = scale_sample(pcm->samples[0][i]);
+        if(stream->channels == 2)
+            *out++ = scale_sample(pcm->samples[pcm->channels == 2 ? 1 : 0][i]);
+    }
+    stream->pcmptr = stream->pcmbuf;
+    stream->pcmleft = out - stream->pcmbuf;
+    return 0;
+}
+
+#endif
+
+static int lpcm_refill(struct himd_pcmstream * stream, struct himderrinfo * status)
+{
+    const unsigned char * data;
+    unsigned int len;
+
+    if(himd_nonmp3stream_read_block(&stream->src.nonmp3, &data, &len, NULL, status) < 0)
+        return -1;
+
+    /* HiMD stores big endian samples. data points into the block buffer
+       of the stream, so convert it where it is. */
+    if(G_BYTE_ORDER == G_LITTLE_ENDIAN)
+        himd_swab16((unsigned char *)data, data, len / 2);
+
+    stream->pcmptr = (const short *)data;
+    stream->pcmleft = len / 2;
+    return 0;
+}
+
+static int atrac_refill(struct himd_pcmstream * stream, struct himderrinfo * status)
+{
+    const unsigned char * frame;
+    unsigned int len;
+
+    if(himd_nonmp3stream_read_frame(&stream->src.nonmp3, &frame, &len, status) < 0)
+        return -1;
+    return himd_atracdecoder_decode(stream->decoder, frame, len, &stream->pcmptr, &stream->pcmleft, status);
+}
+
+int himd_pcmstream_open(struct himd * himd, unsigned int trackno, struct himd_pcmstream * stream, struct himderrinfo * status)
+{
+    struct trackinfo trkinfo;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(stream != NULL, -1);
+
+    if(himd_get_track_info(himd, trackno, &trkinfo, status) < 0)
+        return -1;
+
+    stream->decoder = NULL;
+    stream->pcmptr = NULL;
+    stream->pcmleft = 0;
+    stream->samplerate = sony_codecinfo_samplerate(&trkinfo.codec_info);
+    stream->is_mpeg = 0;
+    stream->is_atrac = 0;
+
+    if(sony_codecinfo_is_lpcm(&trkinfo.codec_info))
+    {
+        stream->channels = 2;
+        return himd_nonmp3stream_open(himd, trackno, &stream->src.nonmp3, status);
+    }
+
+    if(sony_codecinfo_is_at3(&trkinfo.codec_info) || sony_codecinfo_is_at3p(&trkinfo.codec_info))
+    {
+        /* reports a build without libavcodec */
+        stream->decoder = himd_atracdecoder_new(&trkinfo.codec_info, status);
+        if(!stream->decoder)
+            return -1;
+        if(himd_nonmp3stream_open(himd, trackno, &stream->src.nonmp3, status) < 0)
+        {
+            himd_atracdecoder_free(stream->decoder);
+            return -1;
+        }
+        stream->is_atrac = 1;
+        stream->channels = himd_atracdecoder_channels(stream->decoder);
+        return 0;
+    }
+
+    if(sony_codecinfo_is_mpeg(&trkinfo.codec_info))
+    {
+#ifdef CONFIG_WITH_MAD
+        stream->is_mpeg = 1;
+        /* channel mode 3 is single channel */
+        stream->channels = ((trkinfo.codec_info.codecinfo[4] >> 4) & 3) == 3 ? 1 : 2;
+        if(himd_mp3stream_open(himd, trackno, &stream->src.mp3, status) < 0)
+            return -1;
+        if(mp3decoder_open(stream, status) < 0)
+        {
+            himd_mp3stream_close(&stream->src.mp3);
+            return -1;
+        }
+        return 0;
+#else
+        set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't decode MPEG: Compiled without mad library"));
+        return -1;
+#endif
+    }
+
+    set_status_printf(status, HIMD_ERROR_BAD_AUDIO_CODEC,
+                      _("Can't decode %s audio of track %d"),
+                      sony_codecinfo_codecname(&trkinfo.codec_info), trackno);
+    return -1;
+}
+
+int himd_pcmstream_read(struct himd_pcmstream * stream, short * samples, unsigned int maxsamples, unsigned int * countout, struct himderrinfo * status)
+{
+    unsigned int count = 0;
+
+    g_return_val_if_fail(stream != NULL, -1);
+    g_return_val_if_fail(samples != NULL, -1);
+
+    /* only hand out complete sample frames */
+    maxsamples -= maxsamples % stream->channels;
+    g_return_val_if_fail(maxsamples > 0, -1);
+
+    while(count < maxsamples)
+    {
+        unsigned int chunk;
+        if(!stream->pcmleft)
+        {
+            int res;
+            if(stream->is_atrac)
+                res = atrac_refill(stream, status);
+#ifdef CONFIG_WITH_MAD
+            else if(stream->is_mpeg)
+                res = mp3decoder_refill(stream, status);
+#endif
+            else
+                res = lpcm_refill(stream, status);
+            if(res < 0)
+            {
+                /* deliver what we got, report the EOF next time */
+                if(count > 0 && status && status->status == HIMD_STATUS_AUDIO_EOF)
+                    break;
+                return -1;
+            }
+        }
+        chunk = MIN(stream->pcmleft, maxsamples - count);
+        memcpy(samples + count, stream->pcmptr, chunk * sizeof samples[0]);
+        stream->pcmptr += chunk;
+        stream->pcmleft -= chunk;
+        count += chunk;
+    }
+
+    if(countout)
+        *countout = count;
+    return 0;
+}
+
+void himd_pcmstream_close(struct himd_pcmstream * stream)
+{
+    g_return_if_fail(stream != NULL);
+
+#ifdef CONFIG_WITH_MAD
+    if(stream->is_mpeg)
+    {
+        mp3decoder_close(stream);
+        himd_mp3stream_close(&stream->src.mp3);
+        return;
+    }
+#endif
+    if(stream->is_atrac)
+        himd_atracdecoder_free(stream->decoder);
+    himd_nonmp3stream_close(&stream->src.nonmp3);
+}
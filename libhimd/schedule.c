@@ -0,0 +1,325 @@
+/*
+ * schedule.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+/* Batch extraction in physical block order.
+
+   Reading several tracks one after the other makes the read head follow
+   play order, which jumps back and forth when the fragments of different
+   tracks are interleaved on disc. The scheduler collects the fragments
+   of all tracks of a batch and orders them like an elevator: it always
+   continues with the next fragment at or behind the current head
+   position, only starting a new sweep if there is none. Fragments of one
+   track are still read in track order, so each track's blocks can be
+   handed to its sink as they come in, without buffering. */
+
+struct schedextent {
+    unsigned int track;
+    unsigned int firstblock;
+    unsigned int lastblock;
+};
+
+struct schedtrack {
+    unsigned int trackno;
+    struct trackinfo info;
+    unsigned int firstextent;   /* index into play order extent list */
+    unsigned int fragcount;
+    unsigned int fragsread;
+    int failed;
+    struct himd_mp3stream * mp3;
+    struct himd_nonmp3stream * nonmp3;
+};
+
+struct himd_schedule {
+    struct himd * himd;
+    unsigned int trackcount;
+    struct schedtrack * tracks;
+    unsigned int extentcount;
+    struct schedextent * playorder;
+    struct schedextent * physorder;
+};
+
+static void order_extents(struct himd_schedule * sched)
+{
+    unsigned int * nextfrag = g_new0(unsigned int, sched->trackcount);
+    unsigned int head = 0, i, t;
+
+    for(i = 0; i < sched->extentcount; i++)
+    {
+        const struct schedextent * best = NULL, * wrap = NULL;
+        for(t = 0; t < sched->trackcount; t++)
+        {
+            const struct schedextent * e;
+            if(nextfrag[t] == sched->tracks[t].fragcount)
+                continue;
+            e = &sched->playorder[sched->tracks[t].firstextent + nextfrag[t]];
+            if(e->firstblock >= head && (!best || e->firstblock < best->firstblock))
+                best = e;
+            if(!wrap || e->firstblock < wrap->firstblock)
+                wrap = e;
+        }
+        /* nothing left behind the head, start the next sweep */
+        if(!best)
+            best = wrap;
+        sched->physorder[i] = *best;
+        nextfrag[best->track]++;
+        head = best->lastblock + 1;
+    }
+    g_free(nextfrag);
+}
+
+struct himd_schedule * himd_schedule_new(struct himd * himd, const unsigned int * tracknos, unsigned int count, struct himderrinfo * status)
+{
+    struct himd_schedule * sched;
+    struct fraginfo frag;
+    unsigned int i, fragnum, extents = 0;
+
+    g_return_val_if_fail(himd != NULL, NULL);
+    g_return_val_if_fail(tracknos != NULL || count == 0, NULL);
+
+    sched = g_new0(struct himd_schedule, 1);
+    sched->himd = himd;
+    sched->trackcount = count;
+    sched->tracks = g_new0(struct schedtrack, count);
+
+    /* first pass: validate tracks and count fragments */
+    for(i = 0; i < count; i++)
+    {
+        struct schedtrack * t = &sched->tracks[i];
+        t->trackno = tracknos[i];
+        if(himd_get_track_info(himd, t->trackno, &t->info, status) < 0)
+            goto fail;
+        t->firstextent = extents;
+        for(fragnum = t->info.firstfrag; fragnum != 0; fragnum = frag.nextfrag)
+        {
+            if(himd_get_fragment_info(himd, fragnum, &frag, status) < 0)
+                goto fail;
+            if(t->fragcount++ > HIMD_LAST_FRAGMENT)
+            {
+                set_status_printf(status, HIMD_ERROR_FRAGMENT_CHAIN_BROKEN,
+                                  _("Fragment chain starting at %d loops"), t->info.firstfrag);
+                goto fail;
+            }
+        }
+        extents += t->fragcount;
+    }
+
+    sched->extentcount = extents;
+    sched->playorder = g_new(struct schedextent, extents);
+    sched->physorder = g_new(struct schedextent, extents);
+
+    /* second pass: collect the block extents */
+    for(i = 0, extents = 0; i < count; i++)
+        for(fragnum = sched->tracks[i].info.firstfrag; fragnum != 0; fragnum = frag.nextfrag)
+        {
+            himd_get_fragment_info(himd, fragnum, &frag, NULL);
+            sched->playorder[extents].track = i;
+            sched->playorder[extents].firstblock = frag.firstblock;
+            sched->playorder[extents].lastblock = frag.lastblock;
+            extents++;
+        }
+
+    order_extents(sched);
+    return sched;
+
+fail:
+    himd_schedule_free(sched);
+    return NULL;
+}
+
+void himd_schedule_free(struct himd_schedule * sched)
+{
+    if(!sched)
+        return;
+    g_free(sched->tracks);
+    g_free(sched->playorder);
+    g_free(sched->physorder);
+    g_free(sched);
+}
+
+static unsigned long seek_distance(const struct schedextent * extents, unsigned int count)
+{
+    unsigned long distance = 0;
+    unsigned int i;
+
+    for(i = 1; i < count; i++)
+    {
+        unsigned int head = extents[i-1].lastblock + 1;
+        if(extents[i].firstblock >= head)
+            distance += extents[i].firstblock - head;
+        else
+            distance += head - extents[i].firstblock;
+    }
+    return distance;
+}
+
+unsigned long himd_schedule_seek_distance(struct himd_schedule * sched, int physical)
+{
+    g_return_val_if_fail(sched != NULL, 0);
+    return seek_distance(physical ? sched->physorder : sched->playorder, sched->extentcount);
+}
+
+static int open_track(struct himd_schedule * sched, struct schedtrack * t, struct himderrinfo * status)
+{
+    if(sony_codecinfo_is_mpeg(&t->info.codec_info))
+    {
+        t->mp3 = g_try_new(struct himd_mp3stream, 1);
+        if(!t->mp3)
+        {
+            set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate MPEG stream"));
+            return -1;
+        }
+        if(himd_mp3stream_open(sched->himd, t->trackno, t->mp3, status) < 0)
+        {
+            g_free(t->mp3);
+            t->mp3 = NULL;
+            return -1;
+        }
+    }
+    else
+    {
+        t->nonmp3 = g_try_new(struct himd_nonmp3stream, 1);
+        if(!t->nonmp3)
+        {
+            set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't allocate audio stream"));
+            return -1;
+        }
+        if(himd_nonmp3stream_open(sched->himd, t->trackno, t->nonmp3, status) < 0)
+        {
+            g_free(t->nonmp3);
+            t->nonmp3 = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_track(struct schedtrack * t)
+{
+    if(t->mp3)
+    {
+        himd_mp3stream_close(t->mp3);
+        g_free(t->mp3);
+        t->mp3 = NULL;
+    }
+    if(t->nonmp3)
+    {
+        himd_nonmp3stream_close(t->nonmp3);
+        g_free(t->nonmp3);
+        t->nonmp3 = NULL;
+    }
+}
+
+static void finish_track(struct schedtrack * t, unsigned int idx,
+                         const struct himd_extract_sink * sink, void * ctx,
+                         const struct himderrinfo * result)
+{
+    close_track(t);
+    if(result)
+        t->failed = 1;
+    if(sink->end)
+        sink->end(ctx, idx, result);
+}
+
+int himd_schedule_run(struct himd_schedule * sched, const struct himd_extract_sink * sink, void * ctx, struct himderrinfo * status)
+{
+    struct himderrinfo trackstatus;
+    unsigned int i, t;
+
+    g_return_val_if_fail(sched != NULL, -1);
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(sink->data != NULL, -1);
+
+    for(t = 0; t < sched->trackcount; t++)
+    {
+        sched->tracks[t].fragsread = 0;
+        sched->tracks[t].failed = 0;
+    }
+
+    for(i = 0; i < sched->extentcount; i++)
+    {
+        const struct schedextent * e = &sched->physorder[i];
+        struct schedtrack * trk = &sched->tracks[e->track];
+        unsigned int block;
+
+        if(trk->failed)
+            continue;
+
+        if(trk->fragsread == 0)
+        {
+            if(open_track(sched, trk, &trackstatus) < 0)
+            {
+                finish_track(trk, e->track, sink, ctx, &trackstatus);
+                continue;
+            }
+            if(sink->begin && sink->begin(ctx, e->track, &trk->info, &trackstatus) < 0)
+            {
+                finish_track(trk, e->track, sink, ctx, &trackstatus);
+                continue;
+            }
+        }
+
+        for(block = e->firstblock; block <= e->lastblock; block++)
+        {
+            const unsigned char * data;
+            unsigned int len, frames;
+            int res;
+
+            if(trk->mp3)
+                res = himd_mp3stream_read_block(trk->mp3, &data, &len, &frames, &trackstatus);
+            else
+                res = himd_nonmp3stream_read_block(trk->nonmp3, &data, &len, &frames, &trackstatus);
+            if(res < 0)
+                break;
+
+            res = sink->data(ctx, e->track, data, len, frames, &trackstatus);
+            if(res < 0)
+                break;
+            if(res > 0)
+            {
+                /* the sink asked to stop */
+                set_status_const(status, HIMD_ERROR_ABORTED, _("Extraction aborted"));
+                for(t = 0; t < sched->trackcount; t++)
+                    if(sched->tracks[t].mp3 || sched->tracks[t].nonmp3)
+                        finish_track(&sched->tracks[t], t, sink, ctx, status);
+                return -1;
+            }
+        }
+
+        if(block <= e->lastblock)
+            finish_track(trk, e->track, sink, ctx, &trackstatus);
+        else if(++trk->fragsread == trk->fragcount)
+            finish_track(trk, e->track, sink, ctx, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,1006 @@
+/*
+ * snapshot.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "himd.h"
+#include "himd_private.h"
+
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define _(x) (x)
+
+/* Archive layout, all numbers big endian:
+      0  "HIMDSNAP"
+      8  format version
+     12  number of the HiMD files (the ## in ATDATA##.HMA)
+     16  size of the track index
+     20  size of MCLIST
+     24  number of extents
+     28  size of ATDATA, high and low word
+     64  extent table, first block and block count of each extent
+         track index
+         MCLIST
+         padding to a multiple of the block size
+         the blocks of all extents in physical order
+   As the blocks are aligned, blocks of zeros are left as holes in the
+   archive where the filesystem supports sparse files. */
+#define SNAPSHOT_MAGIC "HIMDSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 64
+#define SNAPSHOT_EXTENT_SIZE 8
+#define SNAPSHOT_MAX_MCLIST 0x10000
+#define SNAPSHOT_CHUNK 64		/* blocks per read or write */
+
+struct extent {
+    unsigned int first;
+    unsigned int count;
+};
+
+static goffset data_offset(unsigned int extentcount, unsigned int tifsize, unsigned int mclistsize)
+{
+    goffset end = SNAPSHOT_HEADER_SIZE + (goffset)extentcount * SNAPSHOT_EXTENT_SIZE +
+                  tifsize + mclistsize;
+    return (end + HIMD_BLOCKINFO_SIZE - 1) / HIMD_BLOCKINFO_SIZE * HIMD_BLOCKINFO_SIZE;
+}
+
+static int block_is_zero(const unsigned char * block)
+{
+    unsigned int i;
+
+    for(i = 0; i < HIMD_BLOCKINFO_SIZE; i++)
+        if(block[i])
+            return 0;
+    return 1;
+}
+
+static int read_at(int fd, unsigned char * buffer, gsize len, goffset offset)
+{
+    gssize n;
+
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    while(len > 0)
+    {
+        n = read(fd, buffer, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            if(n == 0)
+                errno = EIO;
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_at(int fd, const unsigned char * buffer, gsize len, goffset offset)
+{
+    gssize n;
+
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    while(len > 0)
+    {
+        n = write(fd, buffer, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -1;
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes count blocks, leaving out blocks of zeros unless they are the
+   last block of the file. Returns the number of blocks left out or -1. */
+static int write_blocks(int fd, const unsigned char * blocks, unsigned int count,
+                        goffset offset, goffset filesize)
+{
+    unsigned int i, run = 0, skipped = 0;
+
+    for(i = 0; i <= count; i++)
+    {
+        goffset blockend = offset + (goffset)(i + 1) * HIMD_BLOCKINFO_SIZE;
+        if(i < count && (blockend == filesize ||
+                         !block_is_zero(blocks + (gsize)i * HIMD_BLOCKINFO_SIZE)))
+        {
+            run++;
+            continue;
+        }
+        if(run && write_at(fd, blocks + (gsize)(i - run) * HIMD_BLOCKINFO_SIZE,
+                           (gsize)run * HIMD_BLOCKINFO_SIZE,
+                           offset + (goffset)(i - run) * HIMD_BLOCKINFO_SIZE) < 0)
+            return -1;
+        if(i < count)
+            skipped++;
+        run = 0;
+    }
+    return skipped;
+}
+
+/* The blocks not covered by holes. himd_find_holes does not report very
+   small holes, so a few free blocks may be included. */
+static GArray * live_extents(struct himd * himd, unsigned int blockcount, struct himderrinfo * status)
+{
+    struct himd_holelist holes;
+    GArray * extents;
+    unsigned int next = 0;
+    int i;
+
+    if(himd_find_holes(himd, &holes, status) < 0)
+        return NULL;
+    extents = g_array_new(FALSE, FALSE, sizeof(struct extent));
+    for(i = 0; i <= holes.holecnt && next < blockcount; i++)
+    {
+        unsigned int end = i < holes.holecnt ? holes.holes[i].firstblock : blockcount;
+        if(end > blockcount)
+            end = blockcount;
+        if(end > next)
+        {
+            struct extent e = { next, end - next };
+            g_array_append_val(extents, e);
+        }
+        if(i < holes.holecnt)
+            next = holes.holes[i].lastblock + 1;
+    }
+    return extents;
+}
+
+/* Copies one extent of ATDATA into the archive. Ranges the source reports
+   as holes are not read at all. */
+static int snapshot_extent(struct himd * himd, int fd, const struct extent * e, goffset archiveoff,
+                           goffset archivesize, unsigned char * buffer,
+                           struct himd_snapshot_info * info, struct himderrinfo * status)
+{
+    const struct himd_io * io = himd->shared->io;
+    unsigned int block = e->first, end = e->first + e->count;
+    unsigned int dataend = block;
+    int sparse = io->find_data != NULL;
+
+    while(block < end)
+    {
+        unsigned int count;
+        int skipped;
+
+        if(block >= dataend && sparse)
+        {
+            goffset hole = 0;
+            goffset data = io->find_data(himd->shared->atdata,
+                                         (goffset)block * HIMD_BLOCKINFO_SIZE, &hole);
+            if(data < 0)
+                sparse = 0;
+            else
+            {
+                unsigned int datablock = data / HIMD_BLOCKINFO_SIZE;
+                if(datablock > end)
+                    datablock = end;
+                if(datablock > block)
+                {
+                    /* the last block is written to give the archive its size */
+                    if(datablock == end &&
+                       archiveoff + (goffset)(end - block) * HIMD_BLOCKINFO_SIZE == archivesize)
+                        datablock--;
+                    info->skipped += datablock - block;
+                    archiveoff += (goffset)(datablock - block) * HIMD_BLOCKINFO_SIZE;
+                    block = datablock;
+                    if(block == end)
+                        break;
+                }
+                dataend = (hole + HIMD_BLOCKINFO_SIZE - 1) / HIMD_BLOCKINFO_SIZE;
+                if(dataend <= block)
+                    dataend = block + 1;
+            }
+        }
+        if(!sparse)
+            dataend = end;
+
+        count = MIN(MIN(end, dataend) - block, SNAPSHOT_CHUNK);
+        if(himd_read_atdata(himd, buffer, (gsize)count * HIMD_BLOCKINFO_SIZE,
+                            (goffset)block * HIMD_BLOCKINFO_SIZE) != (gssize)count * HIMD_BLOCKINFO_SIZE)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO,
+                              _("Can't read audio blocks %u-%u"), block, block + count - 1);
+            return -1;
+        }
+        skipped = write_blocks(fd, buffer, count, archiveoff, archivesize);
+        if(skipped < 0)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_WRITE_SNAPSHOT,
+                              _("Can't write snapshot: %s"), g_strerror(errno));
+            return -1;
+        }
+        info->skipped += skipped;
+        archiveoff += (goffset)count * HIMD_BLOCKINFO_SIZE;
+        block += count;
+    }
+    return 0;
+}
+
+/**
+ * Saves the track index, MCLIST and the used blocks of ATDATA of a HiMD
+ * into an archive that himd_snapshot_restore can write back. Free blocks
+ * are not saved, so the archive is much smaller than a mostly empty disc.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param path Name of the archive to create
+ * @param info Filled with the number of extents and blocks, may be NULL
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if successful, -1 otherwise
+ */
+int himd_snapshot_write(struct himd * himd, const char * path, struct himd_snapshot_info * info,
+                        struct himderrinfo * status)
+{
+    const struct himd_io * io = himd->shared->io;
+    struct himd_snapshot_info dummyinfo;
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char * meta = NULL, * buffer = NULL;
+    void * mclist;
+    goffset atdatasize, mclistsize, metasize, dataoff, archivesize, off;
+    unsigned int i, blocks = 0;
+    GArray * extents;
+    int fd, ret = -1;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(path != NULL, -1);
+
+    if(!info)
+        info = &dummyinfo;
+    memset(info, 0, sizeof *info);
+
+    atdatasize = io->size(himd->shared->atdata);
+    if(atdatasize < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO,
+                          _("Can't get size of audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    extents = live_extents(himd, atdatasize / HIMD_BLOCKINFO_SIZE, status);
+    if(!extents)
+        return -1;
+
+    mclist = himd_io_open(himd, "MCLIST");
+    if(!mclist)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_OPEN_MCLIST,
+                          _("Can't open mclist file: %s"), g_strerror(errno));
+        goto out_extents;
+    }
+    mclistsize = io->size(mclist);
+    if(mclistsize < 0 || mclistsize > SNAPSHOT_MAX_MCLIST)
+    {
+        set_status_const(status, HIMD_ERROR_CANT_READ_MCLIST, _("Unexpected size of mclist file"));
+        io->close(mclist);
+        goto out_extents;
+    }
+
+    /* extent table, track index and MCLIST */
+    metasize = (goffset)extents->len * SNAPSHOT_EXTENT_SIZE + HIMD_TIFFILE_SIZE + mclistsize;
+    meta = g_malloc(metasize);
+    for(i = 0; i < extents->len; i++)
+    {
+        const struct extent * e = &g_array_index(extents, struct extent, i);
+        setbeword32(meta + i * SNAPSHOT_EXTENT_SIZE, e->first);
+        setbeword32(meta + i * SNAPSHOT_EXTENT_SIZE + 4, e->count);
+        blocks += e->count;
+    }
+    off = (goffset)extents->len * SNAPSHOT_EXTENT_SIZE;
+    himd_tif_read_lock(himd);
+    memcpy(meta + off, himd->tifdata, HIMD_TIFFILE_SIZE);
+    himd_tif_read_unlock(himd);
+    off += HIMD_TIFFILE_SIZE;
+    if(io->pread(mclist, meta + off, mclistsize, 0) != mclistsize)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_MCLIST,
+                          _("Can't read mclist file: %s"), g_strerror(errno));
+        io->close(mclist);
+        goto out_meta;
+    }
+    io->close(mclist);
+
+    memset(header, 0, sizeof header);
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    setbeword32(header + 8, SNAPSHOT_VERSION);
+    setbeword32(header + 12, himd->datanum);
+    setbeword32(header + 16, HIMD_TIFFILE_SIZE);
+    setbeword32(header + 20, mclistsize);
+    setbeword32(header + 24, extents->len);
+    setbeword32(header + 28, (guint64)atdatasize >> 32);
+    setbeword32(header + 32, atdatasize & 0xFFFFFFFF);
+
+    fd = g_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if(fd < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_SNAPSHOT,
+                          _("Can't create %s: %s"), path, g_strerror(errno));
+        goto out_meta;
+    }
+    if(write_at(fd, header, sizeof header, 0) < 0 ||
+       write_at(fd, meta, metasize, SNAPSHOT_HEADER_SIZE) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_SNAPSHOT,
+                          _("Can't write snapshot: %s"), g_strerror(errno));
+        goto out_fd;
+    }
+
+    dataoff = data_offset(extents->len, HIMD_TIFFILE_SIZE, mclistsize);
+    archivesize = dataoff + (goffset)blocks * HIMD_BLOCKINFO_SIZE;
+    buffer = g_malloc((gsize)SNAPSHOT_CHUNK * HIMD_BLOCKINFO_SIZE);
+    off = dataoff;
+    for(i = 0; i < extents->len; i++)
+    {
+        const struct extent * e = &g_array_index(extents, struct extent, i);
+        if(snapshot_extent(himd, fd, e, off, archivesize, buffer, info, status) < 0)
+            goto out_fd;
+        off += (goffset)e->count * HIMD_BLOCKINFO_SIZE;
+    }
+
+    info->extents = extents->len;
+    info->blocks = blocks;
+    ret = 0;
+
+out_fd:
+    if(close(fd) < 0 && ret == 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_SNAPSHOT,
+                          _("Can't write snapshot: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    if(ret < 0)
+        g_unlink(path);
+out_meta:
+    g_free(buffer);
+    g_free(meta);
+out_extents:
+    g_array_free(extents, TRUE);
+    return ret;
+}
+
+/* an archive as read back by restore and by the snapshot I/O */
+struct snapshot {
+    unsigned int datanum;
+    unsigned int mclistsize;
+    unsigned int extentcount;
+    unsigned int blockcount;		/* of ATDATA */
+    goffset atdatasize;
+    goffset dataoff;
+    unsigned char * meta;		/* extent table, track index, MCLIST */
+    const unsigned char * tif;
+    const unsigned char * mclist;
+    struct extent * extents;
+};
+
+/* Reads and checks header and extent table. The extents are in
+   physical order and don't overlap. */
+static int read_snapshot(int fd, const char * path, struct snapshot * snap, struct himderrinfo * status)
+{
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned int i, tifsize;
+    goffset metasize;
+
+    memset(snap, 0, sizeof *snap);
+    if(read_at(fd, header, sizeof header, 0) < 0 ||
+       memcmp(header, SNAPSHOT_MAGIC, 8) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT, _("%s is no HiMD snapshot"), path);
+        return -1;
+    }
+    if(beword32(header + 8) != SNAPSHOT_VERSION)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                          _("Unsupported snapshot version %u"), beword32(header + 8));
+        return -1;
+    }
+    snap->datanum = beword32(header + 12);
+    tifsize = beword32(header + 16);
+    snap->mclistsize = beword32(header + 20);
+    snap->extentcount = beword32(header + 24);
+    snap->atdatasize = ((goffset)beword32(header + 28) << 32) | beword32(header + 32);
+    snap->blockcount = snap->atdatasize / HIMD_BLOCKINFO_SIZE;
+    if(snap->datanum > 0xFF || tifsize != HIMD_TIFFILE_SIZE ||
+       snap->mclistsize > SNAPSHOT_MAX_MCLIST || snap->extentcount > snap->blockcount)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_DATA_FORMAT, _("Corrupt snapshot header"));
+        return -1;
+    }
+    snap->dataoff = data_offset(snap->extentcount, tifsize, snap->mclistsize);
+
+    metasize = (goffset)snap->extentcount * SNAPSHOT_EXTENT_SIZE + tifsize + snap->mclistsize;
+    snap->meta = g_malloc(metasize);
+    if(read_at(fd, snap->meta, metasize, SNAPSHOT_HEADER_SIZE) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_SNAPSHOT,
+                          _("Can't read snapshot: %s"), g_strerror(errno));
+        goto fail;
+    }
+    snap->tif = snap->meta + snap->extentcount * SNAPSHOT_EXTENT_SIZE;
+    snap->mclist = snap->tif + tifsize;
+
+    snap->extents = g_new(struct extent, snap->extentcount + 1);
+    for(i = 0; i < snap->extentcount; i++)
+    {
+        struct extent * e = &snap->extents[i];
+        e->first = beword32(snap->meta + i * SNAPSHOT_EXTENT_SIZE);
+        e->count = beword32(snap->meta + i * SNAPSHOT_EXTENT_SIZE + 4);
+        if(e->count == 0 || e->first >= snap->blockcount ||
+           e->count > snap->blockcount - e->first ||
+           (i > 0 && e->first < e[-1].first + e[-1].count))
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                              _("Corrupt snapshot extent %u"), i);
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    g_free(snap->extents);
+    g_free(snap->meta);
+    return -1;
+}
+
+static void free_snapshot(struct snapshot * snap)
+{
+    g_free(snap->extents);
+    g_free(snap->meta);
+}
+
+static char * restore_path(const char * dirpath, int lowercase, const char * fileid, int datanum)
+{
+    char filename[13];
+    char * path;
+
+    g_snprintf(filename, sizeof filename, "%s%02X.HMA", fileid, datanum);
+    if(lowercase)
+    {
+        char * lower = g_ascii_strdown(filename, -1);
+        path = g_build_filename(dirpath, lower, NULL);
+        g_free(lower);
+    }
+    else
+        path = g_build_filename(dirpath, filename, NULL);
+    return path;
+}
+
+/* A HiMD only has one ATDATA file. Restoring a snapshot with another
+   number next to it would leave two. */
+static int other_atdata(const char * dirpath, unsigned int datanum, struct himderrinfo * status)
+{
+    GDir * dir = g_dir_open(dirpath, 0, NULL);
+    const char * name;
+    unsigned int num;
+    int found = 0;
+
+    if(!dir)
+        return 0;
+    while(!found && (name = g_dir_read_name(dir)) != NULL)
+        if(g_ascii_strncasecmp(name, "atdata", 6) == 0 && strlen(name) == 12 &&
+           g_ascii_strcasecmp(name + 8, ".hma") == 0 &&
+           sscanf(name + 6, "%2x", &num) == 1 && num != datanum)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO,
+                              _("%s already contains %s"), dirpath, name);
+            found = 1;
+        }
+    g_dir_close(dir);
+    return found;
+}
+
+/* Writes the extents into ATDATA in physical order. A new ATDATA file is
+   created sparse and only gets the blocks that are not zero; an existing
+   one is overwritten completely within the extents. */
+static int restore_atdata(int fd, const char * atdatapath, const struct extent * extents,
+                          unsigned int extentcount, goffset dataoff, goffset atdatasize,
+                          struct himd_snapshot_info * info, struct himderrinfo * status)
+{
+    unsigned char * buffer;
+    struct stat st;
+    goffset archiveoff = dataoff;
+    int out, fresh, ret = -1;
+    unsigned int i;
+
+    if(g_stat(atdatapath, &st) == 0)
+    {
+        if(st.st_size != atdatasize)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO,
+                              _("%s has %lld bytes, the snapshot %lld"), atdatapath,
+                              (long long)st.st_size, (long long)atdatasize);
+            return -1;
+        }
+        fresh = 0;
+        out = g_open(atdatapath, O_WRONLY | O_BINARY, 0);
+    }
+    else
+    {
+        fresh = 1;
+        out = g_open(atdatapath, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    }
+    if(out < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO,
+                          _("Can't open %s: %s"), atdatapath, g_strerror(errno));
+        return -1;
+    }
+
+#ifdef __linux__
+    /* reserve the used areas in one go, so they don't get fragmented */
+    if(fresh)
+        for(i = 0; i < extentcount; i++)
+            fallocate(out, 0, (goffset)extents[i].first * HIMD_BLOCKINFO_SIZE,
+                      (goffset)extents[i].count * HIMD_BLOCKINFO_SIZE);
+#endif
+
+    buffer = g_malloc((gsize)SNAPSHOT_CHUNK * HIMD_BLOCKINFO_SIZE);
+    for(i = 0; i < extentcount; i++)
+    {
+        unsigned int block = extents[i].first, end = extents[i].first + extents[i].count;
+        while(block < end)
+        {
+            unsigned int count = MIN(end - block, SNAPSHOT_CHUNK);
+            goffset atdataoff = (goffset)block * HIMD_BLOCKINFO_SIZE;
+            int skipped;
+
+            if(fresh)
+            {
+                /* holes in the archive stay holes */
+                goffset hole, data = himd_find_data(fd, archiveoff, &hole);
+                if(data > archiveoff)
+                {
+                    unsigned int holeblocks = (data - archiveoff) / HIMD_BLOCKINFO_SIZE;
+                    if(holeblocks > 0)
+                    {
+                        count = MIN(count, holeblocks);
+                        info->skipped += count;
+                        archiveoff += (goffset)count * HIMD_BLOCKINFO_SIZE;
+                        block += count;
+                        continue;
+                    }
+                }
+            }
+            if(read_at(fd, buffer, (gsize)count * HIMD_BLOCKINFO_SIZE, archiveoff) < 0)
+            {
+                set_status_printf(status, HIMD_ERROR_CANT_READ_SNAPSHOT,
+                                  _("Can't read snapshot: %s"), g_strerror(errno));
+                goto out;
+            }
+            if(fresh)
+                skipped = write_blocks(out, buffer, count, atdataoff, atdatasize);
+            else
+                skipped = write_at(out, buffer, (gsize)count * HIMD_BLOCKINFO_SIZE, atdataoff);
+            if(skipped < 0)
+            {
+                set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO,
+                                  _("Can't write audio blocks %u-%u: %s"), block,
+                                  block + count - 1, g_strerror(errno));
+                goto out;
+            }
+            info->skipped += skipped;
+            archiveoff += (goffset)count * HIMD_BLOCKINFO_SIZE;
+            block += count;
+        }
+    }
+
+    /* the last extent need not reach the end of the file */
+    if(fresh && atdatasize > 0 && lseek(out, 0, SEEK_END) < atdatasize)
+    {
+        unsigned char zero = 0;
+        if(write_at(out, &zero, 1, atdatasize - 1) < 0)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO,
+                              _("Can't extend %s: %s"), atdatapath, g_strerror(errno));
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    g_free(buffer);
+    if(close(out) < 0 && ret == 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_AUDIO,
+                          _("Can't write %s: %s"), atdatapath, g_strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+static int restore_file(const char * path, const unsigned char * data, gsize len,
+                        struct himderrinfo * status)
+{
+    GError * error = NULL;
+
+    if(!g_file_set_contents(path, (const gchar *)data, len, &error))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_SNAPSHOT,
+                          _("Can't write %s: %s"), path, error->message);
+        g_error_free(error);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes a snapshot created by himd_snapshot_write back into a HiMD.
+ * ATDATA is written first, in physical order, then MCLIST and last the
+ * track index TRKIDX, so an interrupted restore leaves the old index in
+ * place. An existing backup index _RKIDX is left alone; if there is none,
+ * as in a new directory, a copy of the restored index is written there,
+ * since writing the track index later needs both files.
+ * The HMDHIFI directory is created if it does not exist yet. An existing
+ * ATDATA file must have the size of the saved one.
+ *
+ * @param path Name of the archive
+ * @param himdroot Directory containing HMDHIFI
+ * @param info Filled with the number of extents and blocks, may be NULL
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if successful, -1 otherwise
+ */
+int himd_snapshot_restore(const char * path, const char * himdroot, struct himd_snapshot_info * info,
+                          struct himderrinfo * status)
+{
+    struct himd_snapshot_info dummyinfo;
+    struct snapshot snap;
+    unsigned int i;
+    char * dirpath, * filepath;
+    int fd, lowercase = 0, ret = -1;
+
+    g_return_val_if_fail(path != NULL, -1);
+    g_return_val_if_fail(himdroot != NULL, -1);
+
+    if(!info)
+        info = &dummyinfo;
+    memset(info, 0, sizeof *info);
+
+    fd = g_open(path, O_RDONLY | O_BINARY, 0);
+    if(fd < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_SNAPSHOT,
+                          _("Can't open %s: %s"), path, g_strerror(errno));
+        return -1;
+    }
+    if(read_snapshot(fd, path, &snap, status) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    for(i = 0; i < snap.extentcount; i++)
+        info->blocks += snap.extents[i].count;
+    info->extents = snap.extentcount;
+
+    dirpath = g_build_filename(himdroot, "HMDHIFI", NULL);
+    if(!g_file_test(dirpath, G_FILE_TEST_IS_DIR))
+    {
+        char * lowerpath = g_build_filename(himdroot, "hmdhifi", NULL);
+        if(g_file_test(lowerpath, G_FILE_TEST_IS_DIR))
+        {
+            g_free(dirpath);
+            dirpath = lowerpath;
+            lowercase = 1;
+        }
+        else
+        {
+            g_free(lowerpath);
+            if(g_mkdir_with_parents(dirpath, 0777) < 0)
+            {
+                set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                                  _("Can't create %s: %s"), dirpath, g_strerror(errno));
+                g_free(dirpath);
+                goto out;
+            }
+        }
+    }
+
+    if(other_atdata(dirpath, snap.datanum, status))
+    {
+        g_free(dirpath);
+        goto out;
+    }
+    filepath = restore_path(dirpath, lowercase, "ATDATA", snap.datanum);
+    ret = restore_atdata(fd, filepath, snap.extents, snap.extentcount, snap.dataoff,
+                         snap.atdatasize, info, status);
+    g_free(filepath);
+
+    if(ret == 0)
+    {
+        filepath = restore_path(dirpath, lowercase, "MCLIST", snap.datanum);
+        ret = restore_file(filepath, snap.mclist, snap.mclistsize, status);
+        g_free(filepath);
+    }
+    if(ret == 0)
+    {
+        filepath = restore_path(dirpath, lowercase, "TRKIDX", snap.datanum);
+        ret = restore_file(filepath, snap.tif, HIMD_TIFFILE_SIZE, status);
+        g_free(filepath);
+    }
+    if(ret == 0)
+    {
+        filepath = restore_path(dirpath, lowercase, "_RKIDX", snap.datanum);
+        if(!g_file_test(filepath, G_FILE_TEST_EXISTS))
+            ret = restore_file(filepath, snap.tif, HIMD_TIFFILE_SIZE, status);
+        g_free(filepath);
+    }
+    g_free(dirpath);
+
+out:
+    free_snapshot(&snap);
+    close(fd);
+    return ret;
+}
+
+/**
+ * Checks whether a file is an archive written by himd_snapshot_write.
+ *
+ * @param path Name of the file
+ *
+ * @return Returns 1 for a snapshot, 0 otherwise
+ */
+int himd_is_snapshot(const char * path)
+{
+    unsigned char magic[8];
+    int fd, ret;
+
+    g_return_val_if_fail(path != NULL, 0);
+
+    fd = g_open(path, O_RDONLY | O_BINARY, 0);
+    if(fd < 0)
+        return 0;
+    ret = read_at(fd, magic, sizeof magic, 0) == 0 && memcmp(magic, SNAPSHOT_MAGIC, 8) == 0;
+    close(fd);
+    return ret;
+}
+
+/* Read access to a snapshot as if it was the HMDHIFI directory it was
+   taken from. Blocks outside the extents read as zeros. */
+enum snapshotio_kind { SNAPSHOT_TIF, SNAPSHOT_MCLIST, SNAPSHOT_ATDATA };
+static const char * const snapshotio_names[] = { "TRKIDX", "MCLIST", "ATDATA" };
+
+struct snapshotio {
+    int fd;
+    GMutex lock;
+    struct snapshot snap;
+    goffset * extentoff;		/* archive offset of each extent */
+};
+
+struct snapshotio_file {
+    struct snapshotio * sio;
+    enum snapshotio_kind kind;
+};
+
+void * himd_snapshot_io_open(const char * path, struct himderrinfo * status)
+{
+    struct snapshotio * sio = g_new0(struct snapshotio, 1);
+    goffset off;
+    unsigned int i;
+
+    sio->fd = g_open(path, O_RDONLY | O_BINARY, 0);
+    if(sio->fd < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_SNAPSHOT,
+                          _("Can't open %s: %s"), path, g_strerror(errno));
+        g_free(sio);
+        return NULL;
+    }
+    if(read_snapshot(sio->fd, path, &sio->snap, status) < 0)
+    {
+        close(sio->fd);
+        g_free(sio);
+        return NULL;
+    }
+    g_mutex_init(&sio->lock);
+    sio->extentoff = g_new(goffset, sio->snap.extentcount + 1);
+    for(i = 0, off = sio->snap.dataoff; i < sio->snap.extentcount; i++)
+    {
+        sio->extentoff[i] = off;
+        off += (goffset)sio->snap.extents[i].count * HIMD_BLOCKINFO_SIZE;
+    }
+    return sio;
+}
+
+static void snapshotio_destroy(void * iodata)
+{
+    struct snapshotio * sio = iodata;
+
+    close(sio->fd);
+    g_mutex_clear(&sio->lock);
+    free_snapshot(&sio->snap);
+    g_free(sio->extentoff);
+    g_free(sio);
+}
+
+static gchar ** snapshotio_list(void * iodata, struct himderrinfo * status)
+{
+    struct snapshotio * sio = iodata;
+    gchar ** names = g_new(gchar *, G_N_ELEMENTS(snapshotio_names) + 1);
+    unsigned int i;
+
+    (void)status;
+    for(i = 0; i < G_N_ELEMENTS(snapshotio_names); i++)
+        names[i] = g_strdup_printf("%s%02X.HMA", snapshotio_names[i], sio->snap.datanum);
+    names[i] = NULL;
+    return names;
+}
+
+static void * snapshotio_open(void * iodata, const char * name)
+{
+    struct snapshotio * sio = iodata;
+    struct snapshotio_file * file;
+    char filename[13];
+    unsigned int i;
+
+    for(i = 0; i < G_N_ELEMENTS(snapshotio_names); i++)
+    {
+        g_snprintf(filename, sizeof filename, "%s%02X.HMA", snapshotio_names[i], sio->snap.datanum);
+        if(g_ascii_strcasecmp(filename, name) != 0)
+            continue;
+        file = g_new(struct snapshotio_file, 1);
+        file->sio = sio;
+        file->kind = i;
+        return file;
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+static goffset snapshotio_size(void * file)
+{
+    struct snapshotio_file * f = file;
+
+    switch(f->kind)
+    {
+    case SNAPSHOT_TIF:
+        return HIMD_TIFFILE_SIZE;
+    case SNAPSHOT_MCLIST:
+        return f->sio->snap.mclistsize;
+    default:
+        return f->sio->snap.atdatasize;
+    }
+}
+
+/* index of the first extent ending after block, extentcount if none */
+static unsigned int find_extent(const struct snapshot * snap, unsigned int block)
+{
+    unsigned int lo = 0, hi = snap->extentcount;
+
+    while(lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if(snap->extents[mid].first + snap->extents[mid].count <= block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static gssize snapshotio_pread(void * file, unsigned char * buffer, gsize len, goffset offset)
+{
+    struct snapshotio_file * f = file;
+    const struct snapshot * snap = &f->sio->snap;
+    goffset size = snapshotio_size(file);
+    unsigned int e;
+    gsize done = 0;
+
+    if(offset >= size)
+        return 0;
+    if((goffset)len > size - offset)
+        len = size - offset;
+    if(f->kind == SNAPSHOT_TIF)
+    {
+        memcpy(buffer, snap->tif + offset, len);
+        return len;
+    }
+    if(f->kind == SNAPSHOT_MCLIST)
+    {
+        memcpy(buffer, snap->mclist + offset, len);
+        return len;
+    }
+
+    e = find_extent(snap, offset / HIMD_BLOCKINFO_SIZE);
+    while(done < len)
+    {
+        goffset pos = offset + done;
+        goffset start = e < snap->extentcount ?
+                        (goffset)snap->extents[e].first * HIMD_BLOCKINFO_SIZE : size;
+        goffset end = e < snap->extentcount ?
+                      start + (goffset)snap->extents[e].count * HIMD_BLOCKINFO_SIZE : size;
+        gsize chunk;
+
+        if(pos < start)
+        {
+            chunk = MIN(len - done, (gsize)(start - pos));
+            memset(buffer + done, 0, chunk);
+        }
+        else
+        {
+            gssize n;
+            chunk = MIN(len - done, (gsize)(end - pos));
+            n = himd_pread(f->sio->fd, &f->sio->lock, buffer + done, chunk,
+                           f->sio->extentoff[e] + (pos - start));
+            if(n < 0)
+                return done > 0 ? (gssize)done : -1;
+            if((gsize)n < chunk)
+                return done + n;
+            e++;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+static void snapshotio_close(void * file)
+{
+    g_free(file);
+}
+
+/* The extents are the data, everything between them reads as a hole. */
+static goffset snapshotio_find_data(void * file, goffset offset, goffset * dataend)
+{
+    struct snapshotio_file * f = file;
+    const struct snapshot * snap = &f->sio->snap;
+    goffset size = snapshotio_size(file), start;
+    unsigned int e;
+
+    if(f->kind != SNAPSHOT_ATDATA || offset >= size)
+    {
+        *dataend = size;
+        return MIN(offset, size);
+    }
+    e = find_extent(snap, offset / HIMD_BLOCKINFO_SIZE);
+    if(e == snap->extentcount)
+    {
+        *dataend = size;
+        return size;
+    }
+    start = (goffset)snap->extents[e].first * HIMD_BLOCKINFO_SIZE;
+    *dataend = start + (goffset)snap->extents[e].count * HIMD_BLOCKINFO_SIZE;
+    return MAX(start, offset);
+}
+
+const struct himd_io himd_snapshot_io = {
+    snapshotio_list, snapshotio_open, snapshotio_pread, snapshotio_size, snapshotio_close,
+    snapshotio_destroy, snapshotio_find_data, 1
+};
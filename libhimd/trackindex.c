@@ -59,14 +59,22 @@ static int strlink(unsigned char * stringchunk)
 
 int himdll_strtype(struct himd *himd, unsigned int idx)
 {
+    int type;
     g_return_val_if_fail(idx < 4096, -1);
-    return strtype(get_strchunk(himd, idx));
+    himd_tif_read_lock(himd);
+    type = strtype(get_strchunk(himd, idx));
+    himd_tif_read_unlock(himd);
+    return type;
 }
 
 int himdll_strlink(struct himd *himd, unsigned int idx)
 {
+    int link;
     g_return_val_if_fail(idx < 4096, -1);
-    return strlink(get_strchunk(himd, idx));
+    himd_tif_read_lock(himd);
+    link = strlink(get_strchunk(himd, idx));
+    himd_tif_read_unlock(himd);
+    return link;
 }
 
 static void set_strlink(unsigned char * stringchunk, int link)
@@ -79,19 +87,34 @@ static void set_strtype(unsigned char * stringchunk, int type)
     stringchunk[14] = (stringchunk[14] & 0x0F) |  (type << 4);
 }
 
-unsigned int himd_track_count(struct himd * himd)
+/* The TIF lock is not recursive, so functions holding it use this */
+static unsigned int track_count(struct himd * himd)
 {
     return beword16(himd->tifdata + 0x100);
 }
 
+unsigned int himd_track_count(struct himd * himd)
+{
+    unsigned int count;
+    himd_tif_read_lock(himd);
+    count = track_count(himd);
+    himd_tif_read_unlock(himd);
+    return count;
+}
+
 unsigned int himd_get_trackslot(struct himd * himd, unsigned int idx, struct himderrinfo * status)
 {
-    if(idx >= himd_track_count(himd))
-    {
-        set_status_printf(status, HIMD_ERROR_NO_SUCH_TRACK, _("Track %d of %d requested"));
-        return 0;
-    }
-    return beword16(himd->tifdata + 0x102 + 2*idx);
+    unsigned int count, slot = 0;
+
+    himd_tif_read_lock(himd);
+    count = track_count(himd);
+    if(idx < count)
+        slot = beword16(himd->tifdata + 0x102 + 2*idx);
+    himd_tif_read_unlock(himd);
+
+    if(idx >= count)
+        set_status_printf(status, HIMD_ERROR_NO_SUCH_TRACK, _("Track %d of %d requested"), idx, count);
+    return slot;
 }
 
 static void get_dostime(struct tm * tm, unsigned const char * bytes)
@@ -179,8 +202,10 @@ int himd_get_free_trackindex(struct himd * himd)
     int idx_freeslot;
     unsigned char * linkbuffer;
 
+    himd_tif_read_lock(himd);
     linkbuffer   = get_track(himd, 0);
     idx_freeslot = beword16(&linkbuffer[38]);
+    himd_tif_read_unlock(himd);
 
     return idx_freeslot;
 }
@@ -195,6 +220,7 @@ int himdll_get_track_info(struct himd * himd, unsigned int idx, struct trackinfo
     g_return_val_if_fail(idx <= HIMD_LAST_TRACK, -1);
     g_return_val_if_fail(t != NULL, -1);
 
+    himd_tif_read_lock(himd);
     trackbuffer = get_track(himd, idx);
 
     get_dostime(&t->recordingtime,trackbuffer+0);
@@ -220,6 +246,7 @@ int himdll_get_track_info(struct himd * himd, unsigned int idx, struct trackinfo
     t->ct = trackbuffer[77];
     t->cc = trackbuffer[78];
     t->cn = trackbuffer[79];
+    himd_tif_read_unlock(himd);
     return 0;
 }
 
@@ -243,13 +270,18 @@ int himd_add_track_info(struct himd * himd, struct trackinfo * t, struct himderr
     int idx_freeslot;
     unsigned char * linkbuffer;
     unsigned char * trackbuffer;
-    unsigned char * play_order_table = himd->tifdata+0x100;
+    unsigned char * play_order_table;
 
     (void)status;
 
     g_return_val_if_fail(himd != NULL, -1);
     g_return_val_if_fail(t != NULL, -1);
 
+    himd_tif_write_lock(himd);
+    /* replaces a mapped tifdata, so all pointers into it are taken below */
+    himd_tif_make_writable(himd);
+    play_order_table = himd->tifdata+0x100;
+
     /* get track[0] - the free-chain index */
     linkbuffer   = get_track(himd, 0);
     idx_freeslot = beword16(&linkbuffer[38]);
@@ -265,10 +297,11 @@ int himd_add_track_info(struct himd * himd, struct trackinfo * t, struct himderr
     settrack(t, trackbuffer);
 
     /* increase track count */
-    setbeword16(play_order_table, himd_track_count(himd)+1);
+    setbeword16(play_order_table, track_count(himd)+1);
 
     /* add entry for new track in play order table */
     setbeword16(play_order_table+2*idx_freeslot, t->tracknum);
+    himd_tif_write_unlock(himd);
     return idx_freeslot;
 }
 
@@ -325,6 +358,43 @@ int himd_track_blocks(struct himd * himd, const struct trackinfo * track, struct
     return blocks;
 }
 
+/* Number of codec frames in a track, from the frame limits of its
+   fragments. Not available for MPEG, whose blocks hold a variable number
+   of frames. */
+int himd_track_frames(struct himd * himd, const struct trackinfo * track, struct himderrinfo * status)
+{
+    struct fraginfo frag;
+    int fragnum, frames = 0;
+    unsigned int fpb;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(track != NULL, -1);
+
+    fpb = himd_trackinfo_framesperblock(track);
+    if(fpb == TRACK_IS_MPEG)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_AUDIO_CODEC, _("Frame count of MPEG tracks is not stored on disc"));
+        return -1;
+    }
+
+    for(fragnum = track->firstfrag; fragnum != 0; fragnum = frag.nextfrag)
+    {
+        if(himd_get_fragment_info(himd, fragnum, &frag, status) < 0)
+            return -1;
+        if(frag.firstframe >= fpb || frag.lastframe >= fpb ||
+           (frag.firstblock == frag.lastblock && frag.firstframe > frag.lastframe))
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_FRAME_NUMBERS,
+                              _("Fragment %d has bad frame numbers %d..%d"),
+                              fragnum, frag.firstframe, frag.lastframe);
+            return -1;
+        }
+        frames += (frag.lastblock - frag.firstblock + 1) * fpb
+                  - frag.firstframe - (fpb - 1 - frag.lastframe);
+    }
+    return frames;
+}
+
 int himd_get_fragment_info(struct himd * himd, unsigned int idx, struct fraginfo * f, struct himderrinfo * status)
 {
     unsigned char * fragbuffer;
@@ -334,6 +404,7 @@ int himd_get_fragment_info(struct himd * himd, unsigned int idx, struct fraginfo
     g_return_val_if_fail(idx <= HIMD_LAST_FRAGMENT, -1);
     g_return_val_if_fail(f != NULL, -1);
 
+    himd_tif_read_lock(himd);
     fragbuffer = get_frag(himd, idx);
     memcpy(f->key, fragbuffer, 8);
     f->firstblock = beword16(fragbuffer + 8);
@@ -342,6 +413,7 @@ int himd_get_fragment_info(struct himd * himd, unsigned int idx, struct fraginfo
     f->lastframe = fragbuffer[13];
     f->fragtype = fragbuffer[14] >> 4;
     f->nextfrag = beword16(fragbuffer+14) & 0xFFF;
+    himd_tif_read_unlock(himd);
     (void)status;
     return 0;
 }
@@ -358,6 +430,8 @@ int himd_add_fragment_info(struct himd * himd, struct fraginfo * f, struct himde
     g_return_val_if_fail(himd != NULL, -1);
     g_return_val_if_fail(f != NULL, -1);
 
+    himd_tif_write_lock(himd);
+    himd_tif_make_writable(himd);
     linkbuffer    = get_frag(himd, 0);
 
     idx_freefrag  = beword16(linkbuffer+14) & 0xFFF;
@@ -368,12 +442,13 @@ int himd_add_fragment_info(struct himd * himd, struct fraginfo * f, struct himde
 
     /* copy fragment struct to slot buffer */
     setfrag(f, fragbuffer);
+    himd_tif_write_unlock(himd);
 
     return idx_freefrag;
 }
 
 
-char* himd_get_string_raw(struct himd * himd, unsigned int idx, int*type, int* length, struct himderrinfo * status)
+static char* get_string_raw(struct himd * himd, unsigned int idx, int*type, int* length, struct himderrinfo * status)
 {
     int curidx;
     int len;
@@ -439,6 +514,18 @@ char* himd_get_string_raw(struct himd * himd, unsigned int idx, int*type, int* l
     return rawstr;
 }
 
+char* himd_get_string_raw(struct himd * himd, unsigned int idx, int*type, int* length, struct himderrinfo * status)
+{
+    char * rawstr;
+
+    g_return_val_if_fail(himd != NULL, NULL);
+
+    himd_tif_read_lock(himd);
+    rawstr = get_string_raw(himd, idx, type, length, status);
+    himd_tif_read_unlock(himd);
+    return rawstr;
+}
+
 char* himd_get_string_utf8(struct himd * himd, unsigned int idx, int*type, struct himderrinfo * status)
 {
     int length;
@@ -485,7 +572,149 @@ char* himd_get_string_utf8(struct himd * himd, unsigned int idx, int*type, struc
 }
 
 
-int himd_add_string(struct himd * himd, char *string, int type, struct himderrinfo * status)
+static int put_utf8(char * buffer, size_t size, size_t * pos, gunichar c)
+{
+    gchar utf8[6];
+    int len = g_unichar_to_utf8(c, utf8);
+
+    if(*pos + len >= size)
+        return -1;
+    memcpy(buffer + *pos, utf8, len);
+    *pos += len;
+    return 0;
+}
+
+/* Converts the string chain starting at idx into buffer. Latin-1 and
+   UTF-16 are handled here, so no memory is allocated. Returns the length
+   of the converted string, -2 if the string is Shift-JIS encoded, which is
+   left to g_convert, or -1. */
+static int get_string_utf8_buf(struct himd * himd, unsigned int idx, int*type, char * buffer, size_t size, struct himderrinfo * status)
+{
+    unsigned char * chunk = get_strchunk(himd, idx);
+    unsigned int encoding = chunk[0];
+    unsigned int n, i, curidx;
+    unsigned int pending = 0, highsurrogate = 0;
+    int have_pending = 0;
+    size_t pos = 0;
+
+    if(strtype(chunk) < 8)
+    {
+        set_status_printf(status, HIMD_ERROR_NOT_STRING_HEAD,
+                   _("String table entry %d is not a head: Type %d"),
+                   idx, strtype(chunk));
+        return -1;
+    }
+    if(type != NULL)
+        *type = strtype(chunk);
+    if(encoding == HIMD_ENCODING_SHIFT_JIS)
+        return -2;
+    if(encoding != HIMD_ENCODING_LATIN1 && encoding != HIMD_ENCODING_UTF16BE)
+    {
+        set_status_printf(status, HIMD_ERROR_UNKNOWN_ENCODING,
+                   "string %d has unknown encoding with ID %d",
+                   idx, encoding);
+        return -1;
+    }
+
+    for(curidx = idx, n = 0; curidx != 0; curidx = strlink(chunk), n++)
+    {
+        chunk = get_strchunk(himd, curidx);
+        if(n > 0 && strtype(chunk) != STRING_TYPE_CONTINUATION)
+        {
+            set_status_printf(status, HIMD_ERROR_STRING_CHAIN_BROKEN,
+                       _("%dth entry in string chain starting at %d has type %d"),
+                       n+1, idx, strtype(chunk));
+            return -1;
+        }
+        if(n >= 4096)
+        {
+            set_status_printf(status, HIMD_ERROR_STRING_CHAIN_BROKEN,
+                       _("string chain starting at %d loops"), idx);
+            return -1;
+        }
+
+        for(i = n == 0 ? 1 : 0; i < 14; i++)
+        {
+            gunichar c = chunk[i];
+            if(encoding == HIMD_ENCODING_UTF16BE)
+            {
+                if(!have_pending)
+                {
+                    pending = chunk[i];
+                    have_pending = 1;
+                    continue;
+                }
+                c = (pending << 8) | chunk[i];
+                have_pending = 0;
+                if(c >= 0xD800 && c < 0xDC00 && !highsurrogate)
+                {
+                    highsurrogate = c;
+                    continue;
+                }
+                if((c >= 0xDC00 && c < 0xE000) != (highsurrogate != 0))
+                {
+                    set_status_printf(status, HIMD_ERROR_STRING_ENCODING_ERROR,
+                               "convert string %d from UTF-16BE to UTF-8: unpaired surrogate",
+                               idx);
+                    return -1;
+                }
+                if(highsurrogate)
+                    c = 0x10000 + ((highsurrogate - 0xD800) << 10) + (c - 0xDC00);
+                highsurrogate = 0;
+            }
+            if(c == 0)
+                goto done;
+            if(put_utf8(buffer, size, &pos, c) < 0)
+            {
+                set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
+                           _("String %d does not fit into %u bytes"), idx, (unsigned int)size);
+                return -1;
+            }
+        }
+    }
+done:
+    buffer[pos] = '\0';
+    return pos;
+}
+
+/* Like himd_get_string_utf8, but stores the string in a caller supplied
+   buffer of size bytes, including the terminating NUL. Only Shift-JIS
+   strings need a temporary allocation. Returns the length of the string
+   or -1 if it can't be read or doesn't fit. */
+int himd_get_string_utf8_buf(struct himd * himd, unsigned int idx, int*type, char * buffer, size_t size, struct himderrinfo * status)
+{
+    char * str;
+    int len;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(idx >= 1, -1);
+    g_return_val_if_fail(idx < 4096, -1);
+    g_return_val_if_fail(buffer != NULL && size > 0, -1);
+
+    himd_tif_read_lock(himd);
+    len = get_string_utf8_buf(himd, idx, type, buffer, size, status);
+    himd_tif_read_unlock(himd);
+    if(len != -2)
+        return len;
+
+    /* Shift-JIS */
+    str = himd_get_string_utf8(himd, idx, type, status);
+    if(!str)
+        return -1;
+    len = strlen(str);
+    if((size_t)len >= size)
+    {
+        set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
+                   _("String %d does not fit into %u bytes"), idx, (unsigned int)size);
+        himd_free(str);
+        return -1;
+    }
+    memcpy(buffer, str, len + 1);
+    himd_free(str);
+    return len;
+}
+
+static int add_string(struct himd * himd, char *string, int type, struct himderrinfo * status)
 {
     int curidx, curtype, i, nextidx;
     int nslots;
@@ -579,3 +808,16 @@ int himd_add_string(struct himd * himd, char *string, int type, struct himderrin
 
     return idx_firstslot;
 }
+
+int himd_add_string(struct himd * himd, char *string, int type, struct himderrinfo * status)
+{
+    int idx;
+
+    g_return_val_if_fail(himd != NULL, -1);
+
+    himd_tif_write_lock(himd);
+    himd_tif_make_writable(himd);
+    idx = add_string(himd, string, type, status);
+    himd_tif_write_unlock(himd);
+    return idx;
+}
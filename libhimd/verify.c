@@ -0,0 +1,367 @@
+/*
+ * verify.c
+ *
+ * This file is part of libhimd, a library for accessing Sony HiMD devices.
+ *
+ * Copyright (C) 2009-2011 Michael Karcher
+ * Copyright (C) 2011 Mårten Cassel
+ * Copyright (C) 2011 Thomas Arp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+/* Integrity scan of all audio blocks.
+
+   The blocks of all tracks are read in physical order by the calling
+   thread, in chunks of up to VERIFY_CHUNK blocks. Each chunk is checked
+   by a thread pool while the next ones are read; the number of buffers
+   limits how far reading gets ahead of checking. Every block header
+   carries copies of its type, mcode and serial number at the end, and
+   the low 32 bits of the track's content id. MP3 blocks are also
+   de-obfuscated and their frames walked, for other codecs the fragment
+   frame numbers are checked against the frames per block. */
+
+#define VERIFY_CHUNK 64
+#define VERIFY_BUFFERS_PER_THREAD 2
+
+struct verifytrack {
+    struct himd_verify_track * result;
+    struct trackinfo info;
+    char type[4];
+    unsigned int framesperblock;
+    int mpeg;
+    int havekey;
+    mp3key key;
+};
+
+struct verifyfrag {
+    struct verifytrack * track;
+    struct fraginfo frag;
+    unsigned int trackblock;	/* index of firstblock within the track */
+};
+
+struct verifyjob {
+    const struct verifyfrag * frag;
+    unsigned int firstblock;
+    unsigned int count;
+    unsigned char readerror[VERIFY_CHUNK];
+    unsigned char * buffer;
+};
+
+struct verifyctx {
+    GAsyncQueue * freebuffers;
+    volatile gint damaged;
+};
+
+static int mp3_frame_length(const unsigned char * h)
+{
+    static const unsigned short bitrates[2][3][15] = {
+        { { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+          { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+          { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 } },
+        { { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+          { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+          { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 } } };
+    static const unsigned int samplerates[3] = { 44100, 48000, 32000 };
+    unsigned int version, layer, bitrate, samplerate, padding;
+
+    if(h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+        return -1;
+    version = (h[1] >> 3) & 3;	/* 0 MPEG 2.5, 2 MPEG 2, 3 MPEG 1 */
+    layer = 4 - ((h[1] >> 1) & 3);
+    if(version == 1 || layer == 4 || (h[2] >> 4) == 0 || (h[2] >> 4) == 15 ||
+       ((h[2] >> 2) & 3) == 3)
+        return -1;
+    bitrate = bitrates[version == 3 ? 0 : 1][layer - 1][h[2] >> 4] * 1000;
+    samplerate = samplerates[(h[2] >> 2) & 3] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    padding = (h[2] >> 1) & 1;
+
+    if(layer == 1)
+        return (12 * bitrate / samplerate + padding) * 4;
+    if(layer == 3 && version != 3)
+        return 72 * bitrate / samplerate + padding;
+    return 144 * bitrate / samplerate + padding;
+}
+
+/* De-obfuscates the block in place and walks its frames. */
+static int check_mp3_frames(unsigned char * block, const mp3key key)
+{
+    unsigned int frames = beword16(block + 4);
+    unsigned int len = beword16(block + 8);
+    unsigned int i, pos = 0;
+    unsigned char * data = block + 0x20;
+
+    if(len > HIMD_AUDIO_SIZE)
+        return -1;
+    for(i = 0; i < (len & ~7U); i++)
+        data[i] ^= key[i & 3];
+    for(i = 0; i < frames; i++)
+    {
+        int framelen;
+        if(pos + 4 > len || (framelen = mp3_frame_length(data + pos)) <= 0)
+            return -1;
+        pos += framelen;
+    }
+    return pos == len ? 0 : -1;
+}
+
+static unsigned int check_block(const struct verifyfrag * vf, unsigned int blockno, unsigned char * block)
+{
+    const struct verifytrack * t = vf->track;
+    unsigned int flags = 0;
+    unsigned int first, last;
+
+    if(memcmp(block, t->type, 4) != 0 || memcmp(block, block + 16368, 4) != 0)
+        flags |= HIMD_DAMAGE_TYPE;
+    if(memcmp(block + 6, block + 16374, 2) != 0)
+        flags |= HIMD_DAMAGE_MCODE;
+    if(memcmp(block + 12, block + 16380, 4) != 0)
+        flags |= HIMD_DAMAGE_SERIAL;
+    if(memcmp(block + 16376, t->info.contentid + 16, 4) != 0)
+        flags |= HIMD_DAMAGE_CONTENTID;
+
+    first = blockno == vf->frag.firstblock ? vf->frag.firstframe : 0;
+    if(t->mpeg)
+    {
+        /* the last frame of MPEG fragments is exclusive */
+        unsigned int frames = beword16(block + 4);
+        last = blockno == vf->frag.lastblock ? vf->frag.lastframe : frames;
+        if(first >= last || last > frames)
+            flags |= HIMD_DAMAGE_FRAME_COUNT;
+        if(t->havekey && check_mp3_frames(block, t->key) < 0)
+            flags |= HIMD_DAMAGE_MP3_FRAMES;
+    }
+    else
+    {
+        last = blockno == vf->frag.lastblock ? vf->frag.lastframe : t->framesperblock - 1;
+        if(first > last || last >= t->framesperblock)
+            flags |= HIMD_DAMAGE_FRAME_COUNT;
+    }
+    return flags;
+}
+
+static void verify_worker(gpointer data, gpointer user_data)
+{
+    struct verifyjob * job = data;
+    struct verifyctx * ctx = user_data;
+    const struct verifyfrag * vf = job->frag;
+    unsigned int i;
+
+    for(i = 0; i < job->count; i++)
+    {
+        unsigned int blockno = job->firstblock + i;
+        unsigned int flags = job->readerror[i] ? HIMD_DAMAGE_READ_ERROR :
+                             check_block(vf, blockno, job->buffer + (gsize)i * HIMD_BLOCKINFO_SIZE);
+        /* jobs cover distinct blocks, so no locking needed */
+        vf->track->result->damage[vf->trackblock + blockno - vf->frag.firstblock] = flags;
+        if(flags)
+            g_atomic_int_inc(&ctx->damaged);
+    }
+    g_async_queue_push(ctx->freebuffers, job->buffer);
+    g_free(job);
+}
+
+static gint compare_frags(gconstpointer a, gconstpointer b)
+{
+    const struct verifyfrag * fa = a, * fb = b;
+    return (gint)fa->frag.firstblock - (gint)fb->frag.firstblock;
+}
+
+static void set_track_type(struct verifytrack * t)
+{
+    const struct sony_codecinfo * ci = &t->info.codec_info;
+    const char * type = "ATX ";
+
+    if(sony_codecinfo_is_lpcm(ci))
+        type = "LPCM";
+    else if(sony_codecinfo_is_at3(ci))
+        type = "A3D ";
+    else if(sony_codecinfo_is_mpeg(ci))
+        type = "SMPA";
+    memcpy(t->type, type, 4);
+}
+
+/* Collects the fragments of all tracks and sets up the damage maps. */
+static GArray * collect_fragments(struct himd * himd, struct himd_verify_result * result,
+                                  struct verifytrack * tracks, struct himderrinfo * status)
+{
+    GArray * frags = g_array_new(FALSE, FALSE, sizeof(struct verifyfrag));
+    unsigned int i;
+
+    for(i = 0; i < result->trackcount; i++)
+    {
+        struct verifytrack * t = &tracks[i];
+        struct verifyfrag vf;
+        unsigned int fragnum, steps = 0;
+
+        t->result = &result->tracks[i];
+        t->result->slot = himd_get_trackslot(himd, i, status);
+        if(t->result->slot == 0 ||
+           himd_get_track_info(himd, t->result->slot, &t->info, status) < 0)
+            goto fail;
+        set_track_type(t);
+        t->mpeg = sony_codecinfo_is_mpeg(&t->info.codec_info);
+        t->framesperblock = himd_trackinfo_framesperblock(&t->info);
+        t->havekey = t->mpeg && himd_obtain_mp3key(himd, t->result->slot, &t->key, NULL) == 0;
+
+        vf.track = t;
+        vf.trackblock = 0;
+        for(fragnum = t->info.firstfrag; fragnum != 0; fragnum = vf.frag.nextfrag)
+        {
+            if(himd_get_fragment_info(himd, fragnum, &vf.frag, status) < 0)
+                goto fail;
+            if(vf.frag.lastblock < vf.frag.firstblock ||
+               ++steps > HIMD_LAST_FRAGMENT - HIMD_FIRST_FRAGMENT + 1)
+            {
+                set_status_printf(status, HIMD_ERROR_FRAGMENT_CHAIN_BROKEN,
+                                  _("Fragment chain of track %u is broken"), t->result->slot);
+                goto fail;
+            }
+            g_array_append_val(frags, vf);
+            vf.trackblock += vf.frag.lastblock - vf.frag.firstblock + 1;
+        }
+        t->result->blocks = vf.trackblock;
+        t->result->damage = g_new0(unsigned char, vf.trackblock);
+        result->blocks += vf.trackblock;
+    }
+    g_array_sort(frags, compare_frags);
+    return frags;
+
+fail:
+    g_array_free(frags, TRUE);
+    return NULL;
+}
+
+/* Reads one chunk, block by block if the whole chunk can't be read, so
+   that read errors are attributed to single blocks. */
+static void read_chunk(struct himd * himd, struct verifyjob * job)
+{
+    gsize len = (gsize)job->count * HIMD_BLOCKINFO_SIZE;
+    unsigned int i;
+
+    memset(job->readerror, 0, sizeof job->readerror);
+    if(himd_read_atdata(himd, job->buffer, len,
+                        (goffset)job->firstblock * HIMD_BLOCKINFO_SIZE) == (gssize)len)
+        return;
+    for(i = 0; i < job->count; i++)
+        if(himd_read_atdata(himd, job->buffer + (gsize)i * HIMD_BLOCKINFO_SIZE, HIMD_BLOCKINFO_SIZE,
+                            (goffset)(job->firstblock + i) * HIMD_BLOCKINFO_SIZE) != HIMD_BLOCKINFO_SIZE)
+            job->readerror[i] = 1;
+}
+
+/**
+ * Checks all audio blocks of a HiMD for damage, see the HIMD_DAMAGE_*
+ * flags. The result holds a damage map of every track in play order and
+ * has to be freed with himd_verify_result_free.
+ *
+ * @param himd Pointer to a descriptor of previously opened HiMD data
+ * @param threads Number of checking threads, 0 for one per processor
+ * @param result Filled with the damage maps
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if the scan ran, even if damage was found, -1 otherwise
+ */
+int himd_verify(struct himd * himd, unsigned int threads, struct himd_verify_result * result,
+                struct himderrinfo * status)
+{
+    struct verifytrack * tracks;
+    struct verifyctx ctx;
+    GThreadPool * pool;
+    GArray * frags;
+    unsigned int i, nbuffers;
+    GError * error = NULL;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(result != NULL, -1);
+
+    memset(result, 0, sizeof *result);
+    result->trackcount = himd_track_count(himd);
+    result->tracks = g_new0(struct himd_verify_track, result->trackcount);
+    tracks = g_new0(struct verifytrack, result->trackcount);
+    frags = collect_fragments(himd, result, tracks, status);
+    if(!frags)
+    {
+        g_free(tracks);
+        himd_verify_result_free(result);
+        return -1;
+    }
+
+    if(threads == 0)
+        threads = g_get_num_processors();
+    ctx.damaged = 0;
+    ctx.freebuffers = g_async_queue_new_full(g_free);
+    nbuffers = threads * VERIFY_BUFFERS_PER_THREAD;
+    for(i = 0; i < nbuffers; i++)
+        g_async_queue_push(ctx.freebuffers, g_malloc((gsize)VERIFY_CHUNK * HIMD_BLOCKINFO_SIZE));
+
+    pool = g_thread_pool_new(verify_worker, &ctx, threads, FALSE, &error);
+    if(!pool)
+    {
+        set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
+                          _("Can't start verify threads: %s"), error->message);
+        g_error_free(error);
+        g_async_queue_unref(ctx.freebuffers);
+        g_array_free(frags, TRUE);
+        g_free(tracks);
+        himd_verify_result_free(result);
+        return -1;
+    }
+
+    for(i = 0; i < frags->len; i++)
+    {
+        const struct verifyfrag * vf = &g_array_index(frags, struct verifyfrag, i);
+        unsigned int block;
+
+        for(block = vf->frag.firstblock; block <= vf->frag.lastblock; block += VERIFY_CHUNK)
+        {
+            struct verifyjob * job = g_new(struct verifyjob, 1);
+            job->frag = vf;
+            job->firstblock = block;
+            job->count = MIN(vf->frag.lastblock - block + 1, VERIFY_CHUNK);
+            /* waits while all buffers are being checked */
+            job->buffer = g_async_queue_pop(ctx.freebuffers);
+            read_chunk(himd, job);
+            g_thread_pool_push(pool, job, NULL);
+        }
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    result->damaged = ctx.damaged;
+    g_async_queue_unref(ctx.freebuffers);
+    g_array_free(frags, TRUE);
+    g_free(tracks);
+    return 0;
+}
+
+void himd_verify_result_free(struct himd_verify_result * result)
+{
+    unsigned int i;
+
+    for(i = 0; i < result->trackcount; i++)
+        g_free(result->tracks[i].damage);
+    g_free(result->tracks);
+    result->tracks = NULL;
+    result->trackcount = 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * dirsink.cpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "mdtransfer.hpp"
+
+namespace mdtransfer {
+
+static const std::size_t file_buffer_size = 256 * 1024;
+
+/* paths are UTF-8, which the narrow functions don't take on Windows */
+#ifdef _WIN32
+static std::wstring widen(const std::string & s)
+{
+    int len = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
+    std::wstring w(len > 0 ? len : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, &w[0], len);
+    return w;
+}
+
+static FILE * open_file(const std::string & path, const char * mode)
+{
+    return _wfopen(widen(path).c_str(), widen(mode).c_str());
+}
+
+static void remove_file(const std::string & path)
+{
+    _wremove(widen(path).c_str());
+}
+#else
+static FILE * open_file(const std::string & path, const char * mode)
+{
+    return fopen(path.c_str(), mode);
+}
+
+static void remove_file(const std::string & path)
+{
+    remove(path.c_str());
+}
+#endif
+
+static bool file_exists(const std::string & path)
+{
+    FILE * f = open_file(path, "rb");
+    if(f)
+        fclose(f);
+    return f != NULL;
+}
+
+static std::string base_name(const track_info & t)
+{
+    std::string name;
+    char buf[32];
+
+    if(t.title.empty())
+    {
+        snprintf(buf, sizeof buf, "Track %u", t.index + 1);
+        name = buf;
+    }
+    else if(t.artist.empty())
+        name = t.title;
+    else
+        name = t.artist + " - " + t.title;
+
+    for(std::size_t i = 0; i < name.size(); i++)
+        if(name[i] == '/' || name[i] == '\\')
+            name[i] = '_';
+    return name;
+}
+
+struct directory_sink::file {
+    FILE * f;
+    std::string path;
+    std::vector<char> buffer;
+};
+
+directory_sink::directory_sink(const std::string & dir) : dir(dir)
+{
+}
+
+directory_sink::~directory_sink()
+{
+    for(std::size_t i = 0; i < files.size(); i++)
+        if(files[i])
+            close(i, true);
+}
+
+std::string directory_sink::open(unsigned int slot, const track_info & t, std::string & name)
+{
+    std::string base = base_name(t);
+    std::string path;
+    char num[16];
+
+    name = base + t.extension;
+    path = dir + "/" + name;
+    for(int i = 2; file_exists(path); i++)
+    {
+        snprintf(num, sizeof num, " (%d)", i);
+        name = base + num + t.extension;
+        path = dir + "/" + name;
+    }
+
+    if(slot >= files.size())
+        files.resize(slot + 1, NULL);
+    file * out = new file;
+    out->path = path;
+    out->f = open_file(path, "wb");
+    if(!out->f)
+    {
+        std::string err = "cannot open file " + path + " for writing: " + strerror(errno);
+        delete out;
+        return err;
+    }
+    /* tracks arrive in blocks of 16 KiB or less */
+    out->buffer.resize(file_buffer_size);
+    setvbuf(out->f, &out->buffer[0], _IOFBF, out->buffer.size());
+    files[slot] = out;
+    return std::string();
+}
+
+std::string directory_sink::write(unsigned int slot, const unsigned char * data, std::size_t len)
+{
+    if(fwrite(data, 1, len, files[slot]->f) != len)
+        return std::string("Error writing audio data: ") + strerror(errno);
+    return std::string();
+}
+
+std::string directory_sink::rewrite(unsigned int slot, const unsigned char * data, std::size_t len)
+{
+    FILE * f = files[slot]->f;
+    long pos = ftell(f);
+
+    if(pos < 0 || fseek(f, 0, SEEK_SET) != 0 || fwrite(data, 1, len, f) != len ||
+       fseek(f, pos, SEEK_SET) != 0)
+        return std::string("Error updating the file header: ") + strerror(errno);
+    return std::string();
+}
+
+std::string directory_sink::close(unsigned int slot, bool failed)
+{
+    file * out = files[slot];
+    std::string err;
+
+    files[slot] = NULL;
+    if(fclose(out->f) != 0 && !failed)
+    {
+        err = std::string("Error writing audio data: ") + strerror(errno);
+        failed = true;
+    }
+    if(failed)
+        remove_file(out->path);
+    delete out;
+    return err;
+}
+
+}
@@ -0,0 +1,328 @@
+/*
+ * engine.cpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <cassert>
+
+#include "mdtransfer.hpp"
+
+namespace mdtransfer {
+
+static const char aborted[] = "aborted by the user";
+
+engine::engine(source & src, sink & dst, observer * obs, std::size_t depth)
+    : src(src), dst(dst), obs(obs), make_transform(default_transform),
+      progress_step(256 * 1024), all_done(0), all_total(0), ok_count(0), fail_count(0),
+      to_transform(depth), to_sink(depth), spare(2 * depth + 4),
+      stop(false), busy(false)
+{
+}
+
+engine::~engine()
+{
+    cancel();
+    wait();
+}
+
+void engine::set_transform(const transform_factory & factory)
+{
+    assert(!busy);
+    make_transform = factory;
+}
+
+void engine::set_progress_step(unsigned long long bytes)
+{
+    assert(!busy);
+    progress_step = bytes;
+}
+
+void engine::start(const std::vector<unsigned int> & list)
+{
+    assert(!busy);
+    wait();
+
+    tracks = list;
+    infos.clear();
+    all_done = all_total = 0;
+    for(std::size_t i = 0; i < tracks.size(); i++)
+    {
+        infos.push_back(src.track(tracks[i]));
+        all_total += infos.back().size;
+    }
+    states.clear();
+    states.resize(tracks.size());
+    ok_count = fail_count = 0;
+    stop = false;
+    busy = true;
+
+    threads[0] = std::thread(&engine::read_stage, this);
+    threads[1] = std::thread(&engine::transform_stage, this);
+    threads[2] = std::thread(&engine::sink_stage, this);
+}
+
+void engine::cancel()
+{
+    stop = true;
+}
+
+bool engine::cancelled() const
+{
+    return stop;
+}
+
+void engine::wait()
+{
+    std::lock_guard<std::mutex> lock(wait_lock);
+    for(int i = 0; i < 3; i++)
+        if(threads[i].joinable())
+            threads[i].join();
+}
+
+bool engine::running() const
+{
+    return busy;
+}
+
+engine::packet_ptr engine::get_packet()
+{
+    packet_ptr p;
+    if(!spare.try_pop(p))
+        p.reset(new packet);
+    return p;
+}
+
+/* keeps the buffers of a few packets around, so the data of a track
+   is not allocated block by block */
+void engine::put_packet(packet_ptr p)
+{
+    p->data.clear();
+    p->error.clear();
+    spare.try_push(p);
+}
+
+void engine::begin(unsigned int slot, const unsigned char * header, std::size_t len,
+                   unsigned long long size)
+{
+    if(slot >= states.size() || states[slot].begun || stop)
+        return;
+    states[slot].begun = true;
+
+    packet_ptr p = get_packet();
+    p->type = packet::BEGIN;
+    p->slot = slot;
+    p->data.assign(header, header + len);
+    p->size = size;
+    to_transform.push(std::move(p));
+}
+
+void engine::data(unsigned int slot, const unsigned char * data, std::size_t len)
+{
+    if(slot >= states.size() || !states[slot].begun || states[slot].ended || stop)
+        return;
+
+    packet_ptr p = get_packet();
+    p->type = packet::DATA;
+    p->slot = slot;
+    p->data.assign(data, data + len);
+    to_transform.push(std::move(p));
+}
+
+void engine::end(unsigned int slot, const std::string & error)
+{
+    if(slot >= states.size() || states[slot].ended)
+        return;
+    states[slot].ended = true;
+    /* tracks not started before cancelling are left out */
+    if(!states[slot].begun && stop)
+        return;
+
+    packet_ptr p = get_packet();
+    p->type = packet::END;
+    p->slot = slot;
+    p->error = error;
+    if(!states[slot].begun && error.empty())
+        p->error = "no data";
+    to_transform.push(std::move(p));
+}
+
+void engine::read_stage()
+{
+    src.read(tracks, *this);
+
+    for(std::size_t i = 0; i < states.size(); i++)
+        end(i, "track was not read");
+
+    packet_ptr p = get_packet();
+    p->type = packet::FINISH;
+    to_transform.push(std::move(p));
+}
+
+void engine::transform_stage()
+{
+    for(;;)
+    {
+        packet_ptr p = to_transform.pop();
+        slot_state * s = p->type == packet::FINISH ? NULL : &states[p->slot];
+
+        switch(p->type)
+        {
+        case packet::BEGIN:
+            if(make_transform)
+                s->xf = make_transform(infos[p->slot]);
+            if(s->xf)
+                s->xf->begin(p->data, p->size);
+            break;
+        case packet::DATA:
+            /* the sink drops it anyway */
+            if(stop)
+            {
+                put_packet(std::move(p));
+                continue;
+            }
+            if(s->xf)
+                s->xf->process(p->data);
+            break;
+        case packet::END:
+            if(s->xf && p->error.empty())
+                p->data = s->xf->finish();
+            s->xf.reset();
+            break;
+        case packet::FINISH:
+            to_sink.push(std::move(p));
+            return;
+        }
+        to_sink.push(std::move(p));
+    }
+}
+
+void engine::report(event::kind type, unsigned int slot, const std::string & error)
+{
+    event e;
+
+    if(!obs)
+        return;
+    e.type = type;
+    e.slot = slot;
+    e.track = type == event::FINISHED ? NULL : &infos[slot];
+    e.track_done = e.track_total = 0;
+    if(e.track)
+    {
+        e.name = states[slot].name;
+        e.track_done = states[slot].done;
+        e.track_total = states[slot].total;
+    }
+    e.error = error;
+    e.all_done = all_done;
+    e.all_total = all_total;
+    obs->notify(e);
+}
+
+void engine::sink_stage()
+{
+    for(;;)
+    {
+        packet_ptr p = to_sink.pop();
+        slot_state * s = p->type == packet::FINISH ? NULL : &states[p->slot];
+        std::string err;
+
+        switch(p->type)
+        {
+        case packet::BEGIN:
+            s->total = p->size ? p->size : infos[p->slot].size;
+            all_total += s->total - infos[p->slot].size;
+            if(stop)
+            {
+                s->failed = true;
+                break;
+            }
+            err = dst.open(p->slot, infos[p->slot], s->name);
+            if(err.empty())
+            {
+                s->opened = true;
+                report(event::TRACK_STARTED, p->slot, std::string());
+                if(!p->data.empty())
+                    err = dst.write(p->slot, p->data.data(), p->data.size());
+            }
+            if(!err.empty())
+            {
+                s->failed = true;
+                s->error = err;
+            }
+            break;
+
+        case packet::DATA:
+            if(s->failed || stop)
+                break;
+            err = dst.write(p->slot, p->data.data(), p->data.size());
+            if(!err.empty())
+            {
+                s->failed = true;
+                s->error = err;
+                break;
+            }
+            s->done += p->data.size();
+            all_done += p->data.size();
+            if(s->done - s->reported >= progress_step)
+            {
+                s->reported = s->done;
+                report(event::TRACK_PROGRESS, p->slot, std::string());
+            }
+            break;
+
+        case packet::END:
+            err = s->error;
+            if(err.empty())
+                err = p->error;
+            if(err.empty() && (s->failed || stop))
+                err = aborted;
+            if(err.empty() && !p->data.empty())
+                err = dst.rewrite(p->slot, p->data.data(), p->data.size());
+            if(s->opened)
+            {
+                std::string closeerr = dst.close(p->slot, !err.empty());
+                if(err.empty())
+                    err = closeerr;
+            }
+            /* the overall progress counts the whole track, done or not */
+            if(s->total > s->done)
+                all_done += s->total - s->done;
+            if(err.empty())
+            {
+                ok_count++;
+                report(event::TRACK_DONE, p->slot, err);
+            }
+            else
+            {
+                fail_count++;
+                report(event::TRACK_FAILED, p->slot, err);
+            }
+            break;
+
+        case packet::FINISH:
+            busy = false;
+            report(event::FINISHED, 0, std::string());
+            return;
+        }
+        put_packet(std::move(p));
+    }
+}
+
+}
@@ -0,0 +1,240 @@
+/*
+ * himdsource.cpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "himdsource.hpp"
+#include "sony_oma.h"
+
+namespace mdtransfer {
+
+/* state of himd_schedule_run, which numbers the tracks it was given */
+struct himd_source::run {
+    himd_source * self;
+    emitter * out;
+    std::vector<unsigned int> outslots;
+    std::vector<unsigned int> indices;
+};
+
+himd_source::himd_source(struct himd * himd, const struct himd_catalog * cat,
+                         const char * id3comment)
+    : himd(himd), cat(cat), comment(id3comment ? id3comment : "")
+{
+}
+
+unsigned int himd_source::track_count()
+{
+    return cat->trackcount;
+}
+
+track_info himd_source::track(unsigned int index)
+{
+    track_info t;
+    const struct sony_codecinfo * ci;
+
+    t.index = index;
+    if(index >= cat->trackcount)
+        return t;
+
+    ci = &cat->info[index].codec_info;
+    if(cat->title[index])
+        t.title = cat->title[index];
+    if(cat->artist[index])
+        t.artist = cat->artist[index];
+    if(cat->album[index])
+        t.album = cat->album[index];
+    t.codec = cat->codecname[index];
+    t.seconds = cat->seconds[index];
+    t.copyprotected = !cat->uploadable[index];
+
+    if(sony_codecinfo_is_mpeg(ci))
+    {
+        /* only the frames of LPCM and ATRAC have a fixed size */
+        t.size = (unsigned long long)cat->blocks[index] * HIMD_AUDIO_SIZE;
+        t.extension = ".mp3";
+        return t;
+    }
+    t.size = (unsigned long long)cat->frames[index] * sony_codecinfo_bytesperframe(ci);
+    if(sony_codecinfo_is_lpcm(ci))
+    {
+        t.extension = ".wav";
+        t.format = FORMAT_PCM_S16BE;
+        t.samplerate = sony_codecinfo_samplerate(ci);
+        t.channels = 2;
+    }
+    else
+        t.extension = ".oma";
+    return t;
+}
+
+std::vector<unsigned char> himd_source::header(unsigned int index)
+{
+    const struct trackinfo * ti = &cat->info[index];
+    std::vector<unsigned char> h;
+
+    if(sony_codecinfo_is_mpeg(&ti->codec_info))
+    {
+        unsigned int len;
+        unsigned char * tag = himd_track_id3v2_tag(himd, ti, comment.empty() ? NULL : comment.c_str(),
+                                                   HIMD_ID3V2_PADDING, &len, NULL);
+        if(tag)
+        {
+            h.assign(tag, tag + len);
+            himd_free(tag);
+        }
+    }
+    else if(!sony_codecinfo_is_lpcm(&ti->codec_info))
+    {
+        char ea3[EA3_FORMAT_HEADER_SIZE];
+        make_ea3_format_header(ea3, &ti->codec_info);
+        h.assign(ea3, ea3 + EA3_FORMAT_HEADER_SIZE);
+    }
+    return h;
+}
+
+int himd_source::sched_begin(void * ctx, unsigned int idx, const struct trackinfo * ti,
+                             struct himderrinfo * status)
+{
+    run * r = static_cast<run *>(ctx);
+    std::vector<unsigned char> h = r->self->header(r->indices[idx]);
+    track_info t = r->self->track(r->indices[idx]);
+
+    (void)status;
+    r->out->begin(r->outslots[idx], h.data(), h.size(),
+                  sony_codecinfo_is_mpeg(&ti->codec_info) ? 0 : t.size);
+    return 0;
+}
+
+int himd_source::sched_data(void * ctx, unsigned int idx, const unsigned char * data,
+                            unsigned int len, unsigned int frames, struct himderrinfo * status)
+{
+    run * r = static_cast<run *>(ctx);
+
+    (void)frames;
+    (void)status;
+    r->out->data(r->outslots[idx], data, len);
+    return r->out->cancelled() ? 1 : 0;
+}
+
+void himd_source::sched_end(void * ctx, unsigned int idx, const struct himderrinfo * result)
+{
+    run * r = static_cast<run *>(ctx);
+
+    if(!result)
+        r->out->end(r->outslots[idx], std::string());
+    else if(result->status == HIMD_ERROR_ABORTED)
+        r->out->end(r->outslots[idx], "aborted by the user");
+    else
+        r->out->end(r->outslots[idx], std::string("Error reading audio data: ") + result->statusmsg);
+}
+
+/* one track on its own, for discs the schedule can't be built for */
+void himd_source::read_stream(unsigned int slot, unsigned int index, emitter & out)
+{
+    const struct trackinfo * ti = &cat->info[index];
+    bool mpeg = sony_codecinfo_is_mpeg(&ti->codec_info);
+    struct himd_mp3stream mp3;
+    struct himd_nonmp3stream nonmp3;
+    struct himderrinfo status;
+    const unsigned char * data;
+    unsigned int len;
+    std::string err;
+    int res;
+
+    if(mpeg)
+        res = himd_mp3stream_open(himd, cat->slot[index], &mp3, &status);
+    else
+        res = himd_nonmp3stream_open(himd, cat->slot[index], &nonmp3, &status);
+    if(res < 0)
+    {
+        out.end(slot, std::string("Error opening track: ") + status.statusmsg);
+        return;
+    }
+
+    std::vector<unsigned char> h = header(index);
+    track_info t = track(index);
+    out.begin(slot, h.data(), h.size(), mpeg ? 0 : t.size);
+    for(;;)
+    {
+        if(mpeg)
+            res = himd_mp3stream_read_block(&mp3, &data, &len, NULL, &status);
+        else
+            res = himd_nonmp3stream_read_block(&nonmp3, &data, &len, NULL, &status);
+        if(res < 0)
+            break;
+        out.data(slot, data, len);
+        if(out.cancelled())
+        {
+            err = "aborted by the user";
+            break;
+        }
+    }
+    if(err.empty() && status.status != HIMD_STATUS_AUDIO_EOF)
+        err = std::string("Error reading audio data: ") + status.statusmsg;
+
+    if(mpeg)
+        himd_mp3stream_close(&mp3);
+    else
+        himd_nonmp3stream_close(&nonmp3);
+    out.end(slot, err);
+}
+
+void himd_source::read(const std::vector<unsigned int> & tracks, emitter & out)
+{
+    static const struct himd_extract_sink sink = { sched_begin, sched_data, sched_end };
+    std::vector<unsigned int> trackslots;
+    struct himd_schedule * sched;
+    struct himderrinfo status;
+    run r;
+
+    r.self = this;
+    r.out = &out;
+    for(unsigned int slot = 0; slot < tracks.size(); slot++)
+    {
+        unsigned int index = tracks[slot];
+        if(index >= cat->trackcount)
+            out.end(slot, "no such track");
+        else if(!cat->uploadable[index])
+            out.end(slot, "upload disabled because of DRM encryption");
+        else
+        {
+            r.outslots.push_back(slot);
+            r.indices.push_back(index);
+            trackslots.push_back(cat->slot[index]);
+        }
+    }
+    if(trackslots.empty())
+        return;
+
+    /* reading in the order of the blocks on disc saves seeking */
+    sched = himd_schedule_new(himd, trackslots.data(), trackslots.size(), &status);
+    if(sched)
+    {
+        himd_schedule_run(sched, &sink, &r, &status);
+        himd_schedule_free(sched);
+        return;
+    }
+
+    /* broken fragment chains, report each track on its own */
+    for(std::size_t i = 0; i < r.outslots.size() && !out.cancelled(); i++)
+        read_stream(r.outslots[i], r.indices[i], out);
+}
+
+}
@@ -0,0 +1,60 @@
+/*
+ * himdsource.hpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef INCLUDED_LIBMDTRANSFER_HIMDSOURCE_HPP
+#define INCLUDED_LIBMDTRANSFER_HIMDSOURCE_HPP
+
+#include "mdtransfer.hpp"
+#include "himd.h"
+
+namespace mdtransfer {
+
+/* Tracks of a HiMD as MP3 with an ID3 tag, OMA and WAV files. The disc
+   and its catalog belong to the caller. During a transfer, the disc is
+   only used on the read thread; the catalog is not changed, so it can
+   still be read elsewhere. */
+class himd_source : public source {
+public:
+    himd_source(struct himd * himd, const struct himd_catalog * cat,
+                const char * id3comment = NULL);
+    virtual unsigned int track_count();
+    virtual track_info track(unsigned int index);
+    virtual void read(const std::vector<unsigned int> & tracks, emitter & out);
+
+private:
+    struct run;
+    std::vector<unsigned char> header(unsigned int index);
+    void read_stream(unsigned int slot, unsigned int index, emitter & out);
+    static int sched_begin(void * ctx, unsigned int idx, const struct trackinfo * ti,
+                           struct himderrinfo * status);
+    static int sched_data(void * ctx, unsigned int idx, const unsigned char * data,
+                          unsigned int len, unsigned int frames, struct himderrinfo * status);
+    static void sched_end(void * ctx, unsigned int idx, const struct himderrinfo * result);
+
+    struct himd * himd;
+    const struct himd_catalog * cat;
+    std::string comment;
+};
+
+}
+
+#endif
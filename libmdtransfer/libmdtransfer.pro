@@ -0,0 +1,11 @@
+TEMPLATE=lib
+TARGET  =mdtransfer
+CONFIG -= qt
+CONFIG += staticlib link_pkgconfig create_prl console debug_and_release_target c++11 thread
+
+PKGCONFIG += glib-2.0 libusb-1.0
+INCLUDEPATH += ../libhimd ../libnetmd
+HEADERS += mdtransfer.hpp queue.hpp himdsource.hpp netmdsource.hpp
+SOURCES += engine.cpp transform.cpp dirsink.cpp himdsource.cpp netmdsource.cpp
+
+mac:INCLUDEPATH += /opt/local/include
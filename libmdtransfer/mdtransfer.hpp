@@ -0,0 +1,277 @@
+/*
+ * mdtransfer.hpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef INCLUDED_LIBMDTRANSFER_MDTRANSFER_HPP
+#define INCLUDED_LIBMDTRANSFER_MDTRANSFER_HPP
+
+/* A transfer is a pipeline of three stages, each on a thread of its own:
+
+       source --queue--> transform --queue--> sink
+
+   The source reads the tracks from the device and passes on a begin
+   packet with the file header, data packets and an end packet for each
+   of them. Sources may interleave tracks, the HiMD source reads them in
+   the order their blocks are stored on disc. The transform stage
+   converts the audio data, the sink stage writes it and reports
+   progress. Both queues are bounded, so a stage that is ahead waits for
+   the next one instead of buffering whole tracks.
+
+   Needs C++11. */
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "queue.hpp"
+
+namespace mdtransfer {
+
+enum data_format {
+    FORMAT_FILE,        /* written as it comes, after the header */
+    FORMAT_PCM_S16BE    /* 16 bit big endian samples, written as WAV */
+};
+
+struct track_info {
+    track_info() : index(0), seconds(0), size(0), copyprotected(false),
+                   format(FORMAT_FILE), samplerate(0), channels(0) {}
+    unsigned int index;         /* position in the play order, from 0 */
+    std::string title;          /* UTF-8, empty if not set */
+    std::string artist;
+    std::string album;
+    std::string codec;          /* as shown to the user */
+    std::string extension;      /* of the file written, with the dot */
+    unsigned int seconds;
+    unsigned long long size;    /* bytes of audio data, 0 if unknown */
+    bool copyprotected;
+    data_format format;
+    unsigned int samplerate;    /* FORMAT_PCM_S16BE only */
+    unsigned int channels;
+};
+
+/* What a source calls on the read thread. slot is the position of the
+   track in the list given to source::read. Each slot gets at most one
+   begin, then data, then one end. begin and data return at once after
+   the transfer was cancelled, and otherwise block while the queue to the
+   transform stage is full. */
+class emitter {
+public:
+    /* size is the number of audio bytes that follow, 0 if unknown */
+    virtual void begin(unsigned int slot, const unsigned char * header, std::size_t len,
+                       unsigned long long size) = 0;
+    virtual void data(unsigned int slot, const unsigned char * data, std::size_t len) = 0;
+    /* an empty error means the track is complete */
+    virtual void end(unsigned int slot, const std::string & error) = 0;
+    virtual bool cancelled() const = 0;
+protected:
+    ~emitter() {}
+};
+
+class source {
+public:
+    virtual ~source() {}
+    virtual unsigned int track_count() = 0;
+    virtual track_info track(unsigned int index) = 0;
+    /* Reads the tracks with the given indices. Runs on the read thread,
+       the engine reports slots that got no end as failed. */
+    virtual void read(const std::vector<unsigned int> & tracks, emitter & out) = 0;
+};
+
+/* Converts the audio data of one track on the transform thread. */
+class transform {
+public:
+    virtual ~transform() {}
+    /* may change the header written at the start of the file */
+    virtual void begin(std::vector<unsigned char> & header, unsigned long long size)
+    {
+        (void)header;
+        (void)size;
+    }
+    /* converts data in place, it may change in size */
+    virtual void process(std::vector<unsigned char> & data) = 0;
+    /* returns a header to write over the one at the start of the file,
+       or nothing if it is still right */
+    virtual std::vector<unsigned char> finish() { return std::vector<unsigned char>(); }
+};
+
+/* returns NULL to pass the data through unchanged */
+typedef std::function<std::unique_ptr<transform>(const track_info &)> transform_factory;
+
+/* WAV for FORMAT_PCM_S16BE, nothing for anything else */
+std::unique_ptr<transform> default_transform(const track_info & t);
+
+/* Writes the tracks on the sink thread. The functions return an error
+   message, empty on success. */
+class sink {
+public:
+    virtual ~sink() {}
+    /* name tells the user where the track went */
+    virtual std::string open(unsigned int slot, const track_info & t, std::string & name) = 0;
+    virtual std::string write(unsigned int slot, const unsigned char * data, std::size_t len) = 0;
+    /* overwrites the start of the file */
+    virtual std::string rewrite(unsigned int slot, const unsigned char * data, std::size_t len) = 0;
+    /* a failed track is removed */
+    virtual std::string close(unsigned int slot, bool failed) = 0;
+};
+
+/* Writes each track into a file of its own in dir, named "artist - title"
+   plus the extension of the track, with a number added to keep existing
+   files. */
+class directory_sink : public sink {
+public:
+    explicit directory_sink(const std::string & dir);
+    virtual ~directory_sink();
+    virtual std::string open(unsigned int slot, const track_info & t, std::string & name);
+    virtual std::string write(unsigned int slot, const unsigned char * data, std::size_t len);
+    virtual std::string rewrite(unsigned int slot, const unsigned char * data, std::size_t len);
+    virtual std::string close(unsigned int slot, bool failed);
+private:
+    struct file;
+    std::string dir;
+    std::vector<file *> files;
+};
+
+struct event {
+    enum kind {
+        TRACK_STARTED,
+        TRACK_PROGRESS,
+        TRACK_DONE,
+        TRACK_FAILED,
+        FINISHED        /* last event of a transfer */
+    };
+    kind type;
+    unsigned int slot;
+    const track_info * track;   /* NULL for FINISHED */
+    std::string name;           /* as given by the sink */
+    std::string error;          /* TRACK_FAILED */
+    unsigned long long track_done;
+    unsigned long long track_total;
+    unsigned long long all_done;
+    unsigned long long all_total;
+};
+
+/* Called on the sink thread, so it must not block for long. */
+class observer {
+public:
+    virtual void notify(const event & e) = 0;
+protected:
+    ~observer() {}
+};
+
+class engine : private emitter {
+public:
+    /* depth is the number of packets each queue holds */
+    engine(source & src, sink & dst, observer * obs = NULL, std::size_t depth = 32);
+    ~engine();
+
+    void set_transform(const transform_factory & factory);
+    /* progress is reported after at least this many bytes, default 256 KiB */
+    void set_progress_step(unsigned long long bytes);
+
+    /* Starts the stage threads for the tracks with the given indices and
+       returns. An engine runs one transfer at a time. */
+    void start(const std::vector<unsigned int> & tracks);
+    /* Stops reading further tracks, tracks in progress are removed. A
+       source may still read a track to its end if the device requires
+       that. Can be called from any thread. */
+    void cancel();
+    virtual bool cancelled() const;
+    /* blocks until all stages are done */
+    void wait();
+    bool running() const;
+
+    unsigned int succeeded() const { return ok_count; }
+    unsigned int failed() const { return fail_count; }
+
+private:
+    struct packet {
+        enum kind { BEGIN, DATA, END, FINISH };
+        kind type;
+        unsigned int slot;
+        std::vector<unsigned char> data;    /* header, audio or new header */
+        unsigned long long size;
+        std::string error;
+    };
+    typedef std::unique_ptr<packet> packet_ptr;
+
+    /* each field is only used by one stage */
+    struct slot_state {
+        slot_state() : begun(false), ended(false), opened(false), failed(false),
+                       done(0), total(0), reported(0) {}
+        bool begun;                     /* read */
+        bool ended;
+        std::unique_ptr<transform> xf;  /* transform */
+        bool opened;                    /* sink */
+        bool failed;
+        std::string name;
+        std::string error;
+        unsigned long long done;
+        unsigned long long total;
+        unsigned long long reported;
+    };
+
+    engine(const engine &);
+    engine & operator=(const engine &);
+
+    /* emitter, called by the source */
+    virtual void begin(unsigned int slot, const unsigned char * header, std::size_t len,
+                       unsigned long long size);
+    virtual void data(unsigned int slot, const unsigned char * data, std::size_t len);
+    virtual void end(unsigned int slot, const std::string & error);
+
+    packet_ptr get_packet();
+    void put_packet(packet_ptr p);
+    void read_stage();
+    void transform_stage();
+    void sink_stage();
+    void report(event::kind type, unsigned int slot, const std::string & error);
+
+    source & src;
+    sink & dst;
+    observer * obs;
+    transform_factory make_transform;
+    unsigned long long progress_step;
+
+    std::vector<unsigned int> tracks;
+    std::vector<track_info> infos;
+    std::vector<slot_state> states;
+    unsigned long long all_done;
+    unsigned long long all_total;
+    unsigned int ok_count;
+    unsigned int fail_count;
+
+    bounded_queue<packet_ptr> to_transform;
+    bounded_queue<packet_ptr> to_sink;
+    bounded_queue<packet_ptr> spare;
+    std::atomic<bool> stop;
+    std::atomic<bool> busy;
+    std::thread threads[3];
+    std::mutex wait_lock;
+};
+
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * netmdsource.cpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "netmdsource.hpp"
+
+namespace mdtransfer {
+
+static const std::size_t recv_chunk_size = 0x10000;
+
+netmd_source::netmd_source(netmd_device * dev, netmd_dev_handle * devh)
+    : devh(devh), can_upload(true), count(-1)
+{
+    struct libusb_device_descriptor desc;
+
+    /* the MZ-RH1 is the only recorder known to send tracks */
+    if(dev && libusb_get_device_descriptor(dev->usb_dev, &desc) == 0)
+        can_upload = desc.idVendor == 0x054c && desc.idProduct == 0x0286;
+}
+
+unsigned int netmd_source::track_count()
+{
+    char buffer[256];
+
+    if(count < 0)
+    {
+        count = 0;
+        while(netmd_request_title(devh, count, buffer, sizeof(buffer)) >= 0)
+            count++;
+    }
+    return count;
+}
+
+const netmd_source::entry & netmd_source::lookup(unsigned int index)
+{
+    struct netmd_pair const * bitrate;
+    struct netmd_track time;
+    unsigned char flags = 0x03;
+    char buffer[256];
+
+    if(index >= cache.size())
+        cache.resize(index + 1);
+    entry & e = cache[index];
+    if(e.known)
+        return e;
+    e.known = true;
+    e.info.index = index;
+
+    if(netmd_request_title(devh, index, buffer, sizeof(buffer)) < 0)
+        return e;
+    e.exists = true;
+    e.rawtitle = buffer;
+    /* the codec is shown anyway */
+    e.info.title = strncmp(buffer, "LP:", 3) ? buffer : buffer + 3;
+
+    netmd_request_track_time(devh, index, &time);
+    netmd_request_track_flags(devh, index, &flags);
+    netmd_request_track_bitrate(devh, index, &e.encoding, &e.channel);
+    bitrate = find_pair(e.encoding, bitrates);
+
+    e.info.codec = bitrate->name;
+    e.info.seconds = time.minute * 60 + time.second;
+    e.info.copyprotected = flags != 0x00;
+    e.info.extension = e.encoding == NETMD_ENCODING_SP ? ".aea" : ".wav";
+    return e;
+}
+
+track_info netmd_source::track(unsigned int index)
+{
+    return lookup(index).info;
+}
+
+std::string netmd_source::receive(unsigned int slot, const entry & e, emitter & out)
+{
+    unsigned char header[NETMD_AEA_HEADER_SIZE];
+    std::vector<unsigned char> buffer(recv_chunk_size);
+    unsigned char codec;
+    uint32_t length, done = 0;
+    size_t received;
+    netmd_error error;
+
+    error = netmd_secure_recv_track_begin(devh, (e.info.index + 1) & 0xffff, &codec, &length);
+    if(error != NETMD_NO_ERROR)
+        return netmd_strerror(error);
+
+    if(e.encoding == NETMD_ENCODING_SP)
+    {
+        netmd_make_aea_header(e.rawtitle.c_str(), codec, e.channel, header);
+        out.begin(slot, header, NETMD_AEA_HEADER_SIZE, length);
+    }
+    else
+    {
+        netmd_make_wav_header(codec, length, header);
+        out.begin(slot, header, NETMD_WAV_HEADER_SIZE, length);
+    }
+
+    /* not stopped when cancelled, the device would remain busy */
+    while(done < length)
+    {
+        error = netmd_secure_recv_track_chunk(devh, &buffer[0],
+                                              std::min<size_t>(length - done, buffer.size()),
+                                              &received);
+        if(error == NETMD_NO_ERROR && received == 0)
+            error = NETMD_USB_ERROR;
+        if(error != NETMD_NO_ERROR)
+            return netmd_strerror(error);
+        out.data(slot, &buffer[0], received);
+        done += received;
+    }
+
+    error = netmd_secure_recv_track_end(devh);
+    if(error != NETMD_NO_ERROR)
+        return netmd_strerror(error);
+    return std::string();
+}
+
+void netmd_source::read(const std::vector<unsigned int> & tracks, emitter & out)
+{
+    for(unsigned int slot = 0; slot < tracks.size() && !out.cancelled(); slot++)
+    {
+        const entry & e = lookup(tracks[slot]);
+
+        if(!can_upload)
+            out.end(slot, "upload disabled, the device does not support netmd track uploads");
+        else if(!e.exists)
+            out.end(slot, "no such track");
+        else if(e.info.copyprotected)
+            out.end(slot, "upload disabled, Track is copy protected");
+        else
+            out.end(slot, receive(slot, e, out));
+    }
+}
+
+}
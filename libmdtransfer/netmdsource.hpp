@@ -0,0 +1,66 @@
+/*
+ * netmdsource.hpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef INCLUDED_LIBMDTRANSFER_NETMDSOURCE_HPP
+#define INCLUDED_LIBMDTRANSFER_NETMDSOURCE_HPP
+
+#include "mdtransfer.hpp"
+
+extern "C" {
+#include <libnetmd.h>
+}
+
+namespace mdtransfer {
+
+/* Tracks of a NetMD as AEA (SP) and WAV (LP2, LP4) files, which only the
+   MZ-RH1 can send. The device handle belongs to the caller and must not
+   be used elsewhere during a transfer. A track that has been started is
+   always received to its end, as the device stays busy otherwise. */
+class netmd_source : public source {
+public:
+    netmd_source(netmd_device * dev, netmd_dev_handle * devh);
+    virtual unsigned int track_count();
+    virtual track_info track(unsigned int index);
+    virtual void read(const std::vector<unsigned int> & tracks, emitter & out);
+
+private:
+    struct entry {
+        entry() : known(false), exists(false), encoding(0), channel(0) {}
+        bool known;
+        bool exists;
+        track_info info;
+        std::string rawtitle;
+        unsigned char encoding;
+        unsigned char channel;
+    };
+    const entry & lookup(unsigned int index);
+    std::string receive(unsigned int slot, const entry & e, emitter & out);
+
+    netmd_dev_handle * devh;
+    bool can_upload;
+    int count;
+    std::vector<entry> cache;
+};
+
+}
+
+#endif
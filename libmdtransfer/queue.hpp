@@ -0,0 +1,99 @@
+/*
+ * queue.hpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef INCLUDED_LIBMDTRANSFER_QUEUE_HPP
+#define INCLUDED_LIBMDTRANSFER_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace mdtransfer {
+
+/* FIFO between two pipeline stages. push blocks while capacity items are
+   waiting, pop blocks while none are. */
+template<typename T>
+class bounded_queue {
+public:
+    explicit bounded_queue(std::size_t capacity) : cap(capacity ? capacity : 1) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        not_full.wait(lock, [this] { return items.size() < cap; });
+        items.push_back(std::move(item));
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    T pop()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        not_empty.wait(lock, [this] { return !items.empty(); });
+        T item(std::move(items.front()));
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return item;
+    }
+
+    /* never blocks, returns false if the queue is empty */
+    bool try_pop(T & item)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if(items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    /* never blocks, returns false if the queue is full */
+    bool try_push(T & item)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if(items.size() >= cap)
+            return false;
+        items.push_back(std::move(item));
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+private:
+    bounded_queue(const bounded_queue &);
+    bounded_queue & operator=(const bounded_queue &);
+
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    std::size_t cap;
+};
+
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * transform.cpp
+ *
+ * This file is part of libmdtransfer, a library for copying tracks from
+ * HiMD and NetMD devices.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <algorithm>
+
+#include "mdtransfer.hpp"
+#include "himd.h"
+
+namespace mdtransfer {
+
+static void put_le(unsigned char * p, unsigned long value, int bytes)
+{
+    for(int i = 0; i < bytes; i++, value >>= 8)
+        p[i] = value & 0xFF;
+}
+
+/* big endian PCM to a WAV file. The header gets the size announced by
+   the source and is rewritten at the end if that was not right. */
+class wav_transform : public transform {
+public:
+    wav_transform(unsigned int samplerate, unsigned int channels)
+        : samplerate(samplerate), channels(channels), announced(0), written(0), odd(false) {}
+
+    virtual void begin(std::vector<unsigned char> & header, unsigned long long size)
+    {
+        announced = size;
+        header = make_header(size);
+    }
+
+    virtual void process(std::vector<unsigned char> & data)
+    {
+        std::size_t len = data.size();
+
+        if(len == 0)
+            return;
+        /* keep samples whole if a packet ends in the middle of one */
+        if(odd)
+        {
+            data.insert(data.begin(), carry);
+            len++;
+        }
+        odd = len % 2 != 0;
+        if(odd)
+        {
+            carry = data[len - 1];
+            data.pop_back();
+            len--;
+        }
+        himd_swab16(data.data(), data.data(), len / 2);
+        written += len;
+    }
+
+    virtual std::vector<unsigned char> finish()
+    {
+        if(written == announced)
+            return std::vector<unsigned char>();
+        return make_header(written);
+    }
+
+private:
+    std::vector<unsigned char> make_header(unsigned long long datasize) const
+    {
+        std::vector<unsigned char> h(44);
+        unsigned int blockalign = channels * 2;
+
+        if(datasize > 0xFFFFFFFFULL - 36)
+            datasize = 0xFFFFFFFFULL - 36;
+        std::copy("RIFF", "RIFF" + 4, h.begin());
+        put_le(&h[4], 36 + datasize, 4);
+        std::copy("WAVEfmt ", "WAVEfmt " + 8, h.begin() + 8);
+        put_le(&h[16], 16, 4);
+        put_le(&h[20], 1, 2);                   /* PCM */
+        put_le(&h[22], channels, 2);
+        put_le(&h[24], samplerate, 4);
+        put_le(&h[28], samplerate * blockalign, 4);
+        put_le(&h[32], blockalign, 2);
+        put_le(&h[34], 16, 2);
+        std::copy("data", "data" + 4, h.begin() + 36);
+        put_le(&h[40], datasize, 4);
+        return h;
+    }
+
+    unsigned int samplerate;
+    unsigned int channels;
+    unsigned long long announced;
+    unsigned long long written;
+    bool odd;
+    unsigned char carry;
+};
+
+std::unique_ptr<transform> default_transform(const track_info & t)
+{
+    if(t.format == FORMAT_PCM_S16BE)
+        return std::unique_ptr<transform>(new wav_transform(t.samplerate, t.channels));
+    return std::unique_ptr<transform>();
+}
+
+}
@@ -0,0 +1,28 @@
+# the QMAKE_LIBDIR thing is a workaround for a bug in qmake on mingw:
+# it searches prl files for library dependencies only QMAKE_LIBDIR and
+# ignores "-L" parametes in LIBS.
+
+build_pass:CONFIG(debug,debug|release) {
+ QMAKE_LIBDIR += ../libmdtransfer/debug
+ LIBS += -L../libmdtransfer/debug
+}
+build_pass:CONFIG(release,debug|release) {
+ QMAKE_LIBDIR += ../libmdtransfer/release
+ LIBS += -L../libmdtransfer/release
+}
+
+# fallback if libmdtransfer was not compiled with
+# CONFIG += debug_and_release debug_and_release_target
+# while I force debug_and_release_target, it is ignored in a
+# just-one-kind build without debug_and_release
+
+QMAKE_LIBDIR += ../libmdtransfer
+LIBS += -L../libmdtransfer
+
+INCLUDEPATH += ../libmdtransfer
+CONFIG += c++11 thread
+LIBS    += -lmdtransfer
+
+# static libraries, so libmdtransfer goes before what it uses
+include(../libhimd/use_libhimd.pri)
+include(../libnetmd/use_libnetmd.prl)
@@ -22,6 +22,9 @@
  *
  */
 
+#ifndef LIBNETMD_H
+#define LIBNETMD_H
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -244,3 +247,5 @@ void netmd_clean_disc_info(minidisc* md);
 
 int netmd_cache_toc(netmd_dev_handle* dev);
 int netmd_sync_toc(netmd_dev_handle* dev);
+
+#endif
@@ -545,31 +545,43 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
     return error;
 }
 
+netmd_error netmd_secure_recv_track_chunk(netmd_dev_handle *dev, unsigned char *data,
+                                         size_t size, size_t *received)
+{
+    int status;
+    int transferred = 0;
+    int tries = 0;
+
+    /* the device may take a while to deliver the next chunk */
+    do {
+        status = libusb_bulk_transfer((libusb_device_handle*)dev, 0x81, data, (int)size, &transferred, 10000);
+    } while (status == LIBUSB_ERROR_TIMEOUT && transferred == 0 && ++tries < 3);
+
+    *received = (size_t)transferred;
+    if (status < 0 && transferred == 0) {
+        return NETMD_USB_ERROR;
+    }
+    return NETMD_NO_ERROR;
+}
+
 netmd_error netmd_secure_real_recv_track(netmd_dev_handle *dev, uint32_t length, FILE *file, size_t chunksize)
 {
     uint32_t done = 0;
     unsigned char *data;
-    int status;
+    size_t received;
     netmd_error error = NETMD_NO_ERROR;
-    int transferred = 0;
 
     data = malloc(chunksize);
-    while (done < length) {
+    while (done < length && error == NETMD_NO_ERROR) {
         if ((length - done) < chunksize) {
             chunksize = length - done;
         }
 
-        status = libusb_bulk_transfer((libusb_device_handle*)dev, 0x81, data, (int)chunksize, &transferred, 10000);
-
-        if (status >= 0) {
-            done += transferred;
-            fwrite(data, transferred, 1, file);
+        error = netmd_secure_recv_track_chunk(dev, data, chunksize, &received);
+        done += received;
+        fwrite(data, received, 1, file);
 
-            netmd_log(NETMD_LOG_DEBUG, "%.1f%%\n", (double)done/(double)length * 100);
-        }
-        else if (status != -LIBUSB_ERROR_TIMEOUT) {
-            error = NETMD_USB_ERROR;
-        }
+        netmd_log(NETMD_LOG_DEBUG, "%.1f%%\n", (double)done/(double)length * 100);
     }
     free(data);
 
@@ -589,11 +601,12 @@ uint8_t netmd_get_channel_count(unsigned char channel)
     }
 }
 
-void netmd_write_aea_header(char *name, uint32_t frames, unsigned char channel, FILE* f)
+void netmd_make_aea_header(const char *name, uint32_t frames, unsigned char channel,
+                           unsigned char *header)
 {
-    unsigned char header[2048] = { 0 };
     unsigned char *buf;
 
+    memset(header, 0, NETMD_AEA_HEADER_SIZE);
     buf = header;
     netmd_copy_doubleword_to_buffer(&buf, 2048, 1);
     strncpy((char *)buf, name, 255);
@@ -606,13 +619,19 @@ void netmd_write_aea_header(char *name, uint32_t frames, unsigned char channel,
     netmd_copy_doubleword_to_buffer(&buf, 0, 1); /* encrypted*/
     netmd_copy_doubleword_to_buffer(&buf, 0, 1); /*groupstart*/
 
-    netmd_log_hex(NETMD_LOG_DEBUG, header, sizeof(header));
+    netmd_log_hex(NETMD_LOG_DEBUG, header, NETMD_AEA_HEADER_SIZE);
+}
+
+void netmd_write_aea_header(char *name, uint32_t frames, unsigned char channel, FILE* f)
+{
+    unsigned char header[NETMD_AEA_HEADER_SIZE];
+
+    netmd_make_aea_header(name, frames, channel, header);
     fwrite(header, sizeof(header), 1, f);
 }
 
-void netmd_write_wav_header(unsigned char format, uint32_t bytes, FILE *f)
+void netmd_make_wav_header(unsigned char format, uint32_t bytes, unsigned char *header)
 {
-    unsigned char header[60] = { 0 };
     unsigned char *buf;
     unsigned char maskedformat;
     uint16_t bytespersecond;
@@ -630,6 +649,7 @@ void netmd_write_wav_header(unsigned char format, uint32_t bytes, FILE *f)
     }
     bytespersecond = ((bytesperframe * 44100U) / 512U) & 0xffff;
 
+    memset(header, 0, NETMD_WAV_HEADER_SIZE);
     buf = header;
 
     /* RIFF header */
@@ -665,23 +685,23 @@ void netmd_write_wav_header(unsigned char format, uint32_t bytes, FILE *f)
     buf += 4;
     netmd_copy_doubleword_to_buffer(&buf, bytes, 1);
 
-    netmd_log_hex(NETMD_LOG_DEBUG, header, sizeof(header));
+    netmd_log_hex(NETMD_LOG_DEBUG, header, NETMD_WAV_HEADER_SIZE);
+}
+
+void netmd_write_wav_header(unsigned char format, uint32_t bytes, FILE *f)
+{
+    unsigned char header[NETMD_WAV_HEADER_SIZE];
+
+    netmd_make_wav_header(format, bytes, header);
     fwrite(header, sizeof(header), 1, f);
 }
 
-netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
-                                    FILE* file)
+netmd_error netmd_secure_recv_track_begin(netmd_dev_handle *dev, uint16_t track,
+                                         unsigned char *codec, uint32_t *length)
 {
     unsigned char cmdhdr[] = {0x00, 0x10, 0x01};
     unsigned char cmd[sizeof(cmdhdr) + sizeof(track)] = { 0 };
     unsigned char *buf;
-    unsigned char encoding;
-    unsigned char channel;
-    char name[257] = { 0 };
-    unsigned char codec;
-    uint32_t length;
-    uint16_t track_id;
-
     netmd_response response;
     netmd_error error;
 
@@ -690,21 +710,49 @@ netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
     buf += sizeof(cmdhdr);
     netmd_copy_word_to_buffer(&buf, track, 0);
 
+    netmd_send_secure_msg(dev, 0x30, cmd, sizeof(cmd));
+    error = netmd_recv_secure_msg(dev, 0x30, &response, NETMD_STATUS_INTERIM);
+    netmd_check_response_bulk(&response, cmdhdr, sizeof(cmdhdr), &error);
+    netmd_check_response_word(&response, track, &error);
+    *codec = netmd_read(&response);
+    *length = netmd_read_doubleword(&response);
+
+    return error;
+}
+
+netmd_error netmd_secure_recv_track_end(netmd_dev_handle *dev)
+{
+    unsigned char cmdhdr[] = {0x00, 0x10, 0x01};
+    netmd_response response;
+    netmd_error error;
+
+    error = netmd_recv_secure_msg(dev, 0x30, &response, NETMD_STATUS_ACCEPTED);
+    netmd_check_response_bulk(&response, cmdhdr, sizeof(cmdhdr), &error);
+    netmd_read_response_bulk(&response, NULL, 2, &error);
+    netmd_check_response_word(&response, 0, &error);
+
+    return error;
+}
+
+netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
+                                    FILE* file)
+{
+    unsigned char encoding;
+    unsigned char channel;
+    char name[257] = { 0 };
+    unsigned char codec;
+    uint32_t length;
+    uint16_t track_id;
+    netmd_error error;
+
     track_id = (track - 1U) & 0xffff;;
     netmd_request_track_bitrate(dev, track_id, &encoding, &channel);
 
     if (encoding == NETMD_ENCODING_SP) {
         netmd_request_title(dev, track_id, name, sizeof(name) - 1);
     }
-    else {
-    }
 
-    netmd_send_secure_msg(dev, 0x30, cmd, sizeof(cmd));
-    error = netmd_recv_secure_msg(dev, 0x30, &response, NETMD_STATUS_INTERIM);
-    netmd_check_response_bulk(&response, cmdhdr, sizeof(cmdhdr), &error);
-    netmd_check_response_word(&response, track, &error);
-    codec = netmd_read(&response);
-    length = netmd_read_doubleword(&response);
+    error = netmd_secure_recv_track_begin(dev, track, &codec, &length);
 
     if (encoding == NETMD_ENCODING_SP) {
         netmd_write_aea_header(name, codec, channel, file);
@@ -718,10 +766,7 @@ netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
     }
 
     if (error == NETMD_NO_ERROR) {
-        error = netmd_recv_secure_msg(dev, 0x30, &response, NETMD_STATUS_ACCEPTED);
-        netmd_check_response_bulk(&response, cmdhdr, sizeof(cmdhdr), &error);
-        netmd_read_response_bulk(&response, NULL, 2, &error);
-        netmd_check_response_word(&response, 0, &error);
+        error = netmd_secure_recv_track_end(dev);
     }
 
     return error;
@@ -153,9 +153,69 @@ netmd_error netmd_secure_send_track(netmd_dev_handle *dev,
                                     uint16_t *track, unsigned char *uuid,
                                     unsigned char *content_id);
 
+/**
+   Receive a track from the device into a file, preceded by an AEA header for
+   SP tracks and a WAV header otherwise. Only the MZ-RH1 supports this.
+
+   @param track One based number of the track.
+   @param file File the track is written to.
+*/
 netmd_error netmd_secure_recv_track(netmd_dev_handle *dev, uint16_t track,
                                     FILE* file);
 
+/**
+   Start receiving a track. The caller then reads length bytes with
+   netmd_secure_recv_track_chunk and completes the transfer with
+   netmd_secure_recv_track_end, even if it is no longer interested in the
+   data, as the device stays busy until the whole track has been sent.
+
+   @param track One based number of the track.
+   @param codec Returns the codec byte, as taken by netmd_make_wav_header.
+   @param length Returns the number of bytes that follow.
+*/
+netmd_error netmd_secure_recv_track_begin(netmd_dev_handle *dev, uint16_t track,
+                                         unsigned char *codec, uint32_t *length);
+
+/**
+   Receive the next part of a track started by netmd_secure_recv_track_begin.
+
+   @param data Buffer of at least size bytes.
+   @param size Maximum number of bytes to receive.
+   @param received Returns the number of bytes received, which may be less
+                   than size.
+*/
+netmd_error netmd_secure_recv_track_chunk(netmd_dev_handle *dev, unsigned char *data,
+                                         size_t size, size_t *received);
+
+/**
+   Complete receiving a track after all of it has been read.
+*/
+netmd_error netmd_secure_recv_track_end(netmd_dev_handle *dev);
+
+#define NETMD_AEA_HEADER_SIZE 2048
+#define NETMD_WAV_HEADER_SIZE 60
+
+/**
+   Build the header netmd_secure_recv_track writes in front of an SP track.
+
+   @param name Title of the track.
+   @param frames Stored as the frame count.
+   @param channel Channel setting as returned by netmd_request_track_bitrate.
+   @param header Buffer of NETMD_AEA_HEADER_SIZE bytes.
+*/
+void netmd_make_aea_header(const char *name, uint32_t frames, unsigned char channel,
+                           unsigned char *header);
+
+/**
+   Build the header netmd_secure_recv_track writes in front of an LP2 or LP4
+   track.
+
+   @param format Codec byte returned by netmd_secure_recv_track_begin.
+   @param bytes Length of the track data.
+   @param header Buffer of NETMD_WAV_HEADER_SIZE bytes.
+*/
+void netmd_make_wav_header(unsigned char format, uint32_t bytes, unsigned char *header);
+
 
 /**
    Commit a track. The idea is that this command tells the device hat the license
@@ -1,11 +1,20 @@
 TEMPLATE = subdirs
 
-SUBDIRS = libnetmd libhimd netmdcli himdcli
+SUBDIRS = libnetmd libhimd libmdtransfer netmdcli himdcli himdbench himdindex mdtransfer
 
 netmdcli.depends = libnetmd
 himdcli.depends = libhimd
+himdbench.depends = libhimd
+himdindex.depends = libhimd
+libmdtransfer.depends = libhimd libnetmd
+mdtransfer.depends = libmdtransfer
+
+unix:!without_fuse: {
+  SUBDIRS += himdfs
+  himdfs.depends = libhimd
+}
 
 !without_gui: {
   SUBDIRS += qhimdtransfer
-  qhimdtransfer.depends = libhimd libnetmd
+  qhimdtransfer.depends = libhimd libnetmd libmdtransfer
 }
@@ -0,0 +1,228 @@
+/*
+ * mdtransfer.cpp
+ *
+ * Command line front end of libmdtransfer, copies tracks from a HiMD or
+ * from the first NetMD device found into a directory.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+
+#include "mdtransfer.hpp"
+#include "himdsource.hpp"
+#include "netmdsource.hpp"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+/* one line per track, with a progress line in between on a terminal */
+class progress_printer : public mdtransfer::observer {
+public:
+    explicit progress_printer(bool tty) : tty(tty), pending(false) {}
+
+    virtual void notify(const mdtransfer::event & e)
+    {
+        switch(e.type)
+        {
+        case mdtransfer::event::TRACK_STARTED:
+            clear();
+            printf("Track %u: %s\n", e.track->index + 1, e.name.c_str());
+            break;
+        case mdtransfer::event::TRACK_PROGRESS:
+            if(!tty || e.all_total == 0)
+                break;
+            fprintf(stderr, "\r%3u%% of track %u, %3u%% in total",
+                    percent(e.track_done, e.track_total), e.track->index + 1,
+                    percent(e.all_done, e.all_total));
+            pending = true;
+            break;
+        case mdtransfer::event::TRACK_DONE:
+            break;
+        case mdtransfer::event::TRACK_FAILED:
+            clear();
+            fprintf(stderr, "Track %u: %s\n", e.track->index + 1, e.error.c_str());
+            break;
+        case mdtransfer::event::FINISHED:
+            clear();
+            break;
+        }
+        fflush(stdout);
+    }
+
+private:
+    static unsigned int percent(unsigned long long done, unsigned long long total)
+    {
+        if(total == 0)
+            return 0;
+        return done >= total ? 100 : (unsigned int)(done * 100 / total);
+    }
+
+    void clear()
+    {
+        if(pending)
+            fputs("\r\033[K", stderr);
+        pending = false;
+    }
+
+    bool tty;
+    bool pending;
+};
+
+static int parse_tracks(mdtransfer::source & src, int argc, char ** argv,
+                        std::vector<unsigned int> & tracks)
+{
+    if(argc == 0)
+    {
+        for(unsigned int i = 0; i < src.track_count(); i++)
+            tracks.push_back(i);
+        return 0;
+    }
+    for(int i = 0; i < argc; i++)
+    {
+        char * end;
+        unsigned long n = strtoul(argv[i], &end, 10);
+        if(*argv[i] == '\0' || *end != '\0' || n == 0)
+        {
+            fprintf(stderr, "Invalid track number %s\n", argv[i]);
+            return -1;
+        }
+        tracks.push_back(n - 1);
+    }
+    return 0;
+}
+
+static int transfer(mdtransfer::source & src, const char * dir, int argc, char ** argv)
+{
+    std::vector<unsigned int> tracks;
+    mdtransfer::directory_sink out(dir);
+    progress_printer printer(isatty(2));
+    mdtransfer::engine eng(src, out, &printer);
+
+    if(parse_tracks(src, argc, argv, tracks) < 0)
+        return 1;
+
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+    eng.start(tracks);
+    while(eng.running())
+    {
+        if(interrupted && !eng.cancelled())
+        {
+            fputs("\nStopping, a NetMD track in progress is received to its end\n", stderr);
+            eng.cancel();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    eng.wait();
+
+    printf("%u track(s) copied, %u failed\n", eng.succeeded(), eng.failed());
+    return eng.failed() > 0 || interrupted ? 1 : 0;
+}
+
+static int transfer_himd(const char * path, const char * dir, int argc, char ** argv)
+{
+    struct himd himd;
+    struct himd_catalog * cat;
+    struct himderrinfo status;
+    int res;
+
+    if(himd_open_mode(&himd, path, HIMD_READ_ONLY, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        return 1;
+    }
+    cat = himd_catalog_load(&himd, &status);
+    if(!cat)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        himd_close(&himd);
+        return 1;
+    }
+
+    mdtransfer::himd_source src(&himd, cat, "*** imported from HiMD via mdtransfer ***");
+    res = transfer(src, dir, argc, argv);
+
+    himd_catalog_free(cat);
+    himd_close(&himd);
+    return res;
+}
+
+static int transfer_netmd(const char * dir, int argc, char ** argv)
+{
+    netmd_device * device_list;
+    netmd_dev_handle * devh;
+    netmd_error error;
+    int res;
+
+    error = netmd_init(&device_list);
+    if(error != NETMD_NO_ERROR)
+    {
+        fprintf(stderr, "Error initializing netmd\n%s\n", netmd_strerror(error));
+        return 1;
+    }
+    if(device_list == NULL)
+    {
+        fputs("Found no NetMD device(s).\n", stderr);
+        return 1;
+    }
+
+    /* pick first available device */
+    error = netmd_open(device_list, &devh);
+    if(error != NETMD_NO_ERROR)
+    {
+        fprintf(stderr, "Error opening netmd\n%s\n", netmd_strerror(error));
+        netmd_clean(&device_list);
+        return 1;
+    }
+
+    mdtransfer::netmd_source src(device_list, devh);
+    res = transfer(src, dir, argc, argv);
+
+    netmd_close(devh);
+    netmd_clean(&device_list);
+    return res;
+}
+
+static void usage(const char * cmdname)
+{
+    printf("Usage: %s himd <HiMD path> <DIR> [TRACK...]\n"
+           "       %s netmd <DIR> [TRACK...]\n\n"
+           "Copies the given tracks, numbered from 1, or all tracks into DIR.\n"
+           "HiMD tracks are written as MP3, OMA (ATRAC) and WAV (LPCM) files,\n"
+           "NetMD tracks as AEA (SP) and WAV (LP2, LP4) files. Uploading from\n"
+           "NetMD works with the MZ-RH1 only.\n", cmdname, cmdname);
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc > 3 && strcmp(argv[1], "himd") == 0)
+        return transfer_himd(argv[2], argv[3], argc - 4, argv + 4);
+    if(argc > 2 && strcmp(argv[1], "netmd") == 0)
+        return transfer_netmd(argv[2], argc - 3, argv + 3);
+    usage(argv[0]);
+    return argc == 2 && strcmp(argv[1], "help") == 0 ? 0 : 1;
+}
@@ -0,0 +1,18 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0 libusb-1.0
+SOURCES += mdtransfer.cpp
+
+include(../libmdtransfer/use_libmdtransfer.pri)
+
+unix:!macx {
+	target.path = /usr/bin
+	INSTALLS += target
+}
+
+mac:INCLUDEPATH += /opt/local/include
+
+macx {
+  CONFIG -= app_bundle
+}
@@ -63,7 +63,8 @@ HEADERS += qhimdaboutdialog.h \
     qhimddetection.h \
     qmdmodel.h \
     qmdtrack.h \
-    qmddevice.h
+    qmddevice.h \
+    qmdtransfer.h
 FORMS += qhimdaboutdialog.ui \
     qhimdformatdialog.ui \
     qhimduploaddialog.ui \
@@ -76,17 +77,14 @@ SOURCES += main.cpp \
     qhimddetection.cpp \
     qmdmodel.cpp \
     qmdtrack.cpp \
-    qmddevice.cpp
+    qmddevice.cpp \
+    qmdtransfer.cpp
 win32:SOURCES += qhimdwindetection.cpp
 else:SOURCES += qhimddummydetection.cpp
 RESOURCES += icons.qrc
-PKGCONFIG += taglib
 win32:LIBS += -lsetupapi \
     -lcfgmgr32
 
-SOURCES += wavefilewriter.cpp
-HEADERS += wavefilewriter.h
-
 win32:RC_FILE = qhimdtransfer.rc
 mac:ICON = qhimdtransfer.icns
 
@@ -94,8 +92,7 @@ mac:ICON = qhimdtransfer.icns
 # this is convention.
 win32:TARGET = QHiMDTransfer
 mac:TARGET = QHiMDTransfer
-include(../libhimd/use_libhimd.pri)
-include(../libnetmd/use_libnetmd.prl)
+include(../libmdtransfer/use_libmdtransfer.pri)
 
 # Installing stuff
 translations.files = $$bracketAll(LANGUAGES, qhimdtransfer_,.qm)
@@ -50,20 +50,36 @@ void QHiMDUploadDialog::finished()
     return;
 }
 
-void QHiMDUploadDialog::starttrack(const QMDTrack & trk, const QString & title)
+void QHiMDUploadDialog::starttrack(int tracknum, const QString & title, int blocks, int finishedblocks)
 {
-    tracknum = trk.tracknum() + 1;
+    this->tracknum = tracknum;
     m_ui->curtrack_label->setText(tr("current track: %1 - %2").arg(tracknum).arg(title));
-    thisfileblocks = trk.blockcount();
-    thisfilefinished = 0;
+    thisfileblocks = blocks;
+    thisfilefinished = finishedblocks;
     m_ui->TrkPBar->setRange(0, thisfileblocks);
-    m_ui->TrkPBar->reset();
+    if(finishedblocks)
+        m_ui->TrkPBar->setValue(finishedblocks);
+    else
+        m_ui->TrkPBar->reset();
 }
 
-void QHiMDUploadDialog::blockTransferred()
+void QHiMDUploadDialog::setProgress(int finishedblocks, int blocks, int allfinishedblocks, int totalblocks)
 {
-    m_ui->TrkPBar->setValue(++thisfilefinished);
-    m_ui->AllPBar->setValue(++allfinished);
+    /* NetMD tracks are only measured when they are received */
+    if(blocks != thisfileblocks)
+    {
+        thisfileblocks = blocks;
+        m_ui->TrkPBar->setRange(0, thisfileblocks);
+    }
+    if(totalblocks != allblocks)
+    {
+        allblocks = totalblocks;
+        m_ui->AllPBar->setRange(0, allblocks);
+    }
+    thisfilefinished = finishedblocks;
+    allfinished = allfinishedblocks;
+    m_ui->TrkPBar->setValue(thisfilefinished);
+    m_ui->AllPBar->setValue(allfinished);
 }
 
 void QHiMDUploadDialog::init(int trackcount, int totalblocks)
@@ -143,4 +159,5 @@ void QHiMDUploadDialog::on_cancel_button_clicked()
 {
     m_ui->alltrack_label->setText(tr("upload aborted by the user"));
     canceled = true;
+    emit uploadCanceled();
 }
@@ -2,7 +2,6 @@
 #define QHIMDUPLOADDIALOG_H
 
 #include <QDialog>
-#include "qmdtrack.h"
 
 namespace Ui {
     class QHiMDUploadDialog;
@@ -16,9 +15,10 @@ public:
     virtual ~QHiMDUploadDialog();
     bool upload_canceled() { return canceled; }
 
+    /* progress is counted in KiB */
     void init(int trackcount, int totalblocks);
-    void starttrack(const QMDTrack & trk, const QString & title);
-    void blockTransferred();
+    void starttrack(int tracknum, const QString & title, int blocks, int finishedblocks = 0);
+    void setProgress(int finishedblocks, int blocks, int allfinishedblocks, int totalblocks);
     void trackFailed(const QString & errmsg);
     void trackSucceeded();
     void finished();
@@ -31,6 +31,9 @@ private:
     int scount, fcount;
     bool canceled;
 
+signals:
+    void uploadCanceled();
+
 private slots:
     /* UI slots */
     void on_close_button_clicked();
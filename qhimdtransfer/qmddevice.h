@@ -6,6 +6,7 @@
 
 #include <qmdtrack.h>
 #include "qhimduploaddialog.h"
+#include "mdtransfer.hpp"
 
 enum device_type {
     NO_DEVICE,
@@ -28,6 +29,8 @@ protected:
     void * devhandle;
     void * mdChange;
     QHiMDUploadDialog uploadDialog;
+    /* NULL if the device is not open, deleted by the caller */
+    virtual mdtransfer::source * transferSource() = 0;
 public:
     explicit QMDDevice();
     virtual ~QMDDevice();
@@ -50,9 +53,7 @@ public:
     virtual void * MdChange();
     virtual int trackCount() {return trk_count;}
     virtual QStringList downloadableFileExtensions() const;
-    virtual void checkfile(QString UploadDirectory, QString &filename, QString extension);
-    virtual void batchUpload(QMDTrackIndexList tlist, QString path) = 0;
-    virtual void upload(unsigned int trackidx, QString path) = 0;
+    virtual void batchUpload(QMDTrackIndexList tlist, QString path);
 
 signals:
     void opened();
@@ -64,8 +65,8 @@ class QNetMDDevice : public QMDDevice {
     netmd_device * netmd;
     netmd_dev_handle * devh;
     minidisc current_md;
-private:
-    QString upload_track_blocks(uint32_t length, FILE *file, size_t chunksize);
+protected:
+    virtual mdtransfer::source * transferSource();
 public:
     explicit QNetMDDevice();
     virtual ~QNetMDDevice();
@@ -74,26 +75,22 @@ public:
     virtual void close();
     virtual QString discTitle();
     virtual QNetMDTrack netmdTrack(unsigned int trkindex);
-    virtual void batchUpload(QMDTrackIndexList tlist, QString path);
-    virtual void upload(unsigned int trackidx, QString path);
 
 };
 
 class QHiMDDevice : public QMDDevice {
 
     struct himd * himd;
-private:
-    QString dumpmp3(const QHiMDTrack &trk, QString file);
-    QString dumpoma(const QHiMDTrack & track, QString file);
-    QString dumppcm(const QHiMDTrack &track, QString file);
+    struct himd_catalog * cat;
+protected:
+    virtual mdtransfer::source * transferSource();
 public:
     explicit QHiMDDevice();
     virtual ~QHiMDDevice();
     virtual QString open();
     virtual void close();
     virtual QHiMDTrack himdTrack(unsigned int trkindex);
-    virtual void upload(unsigned int trackidx, QString path);
-    virtual void batchUpload(QMDTrackIndexList tlist, QString path);
+    const struct himd_catalog * catalog() const {return cat;}
 
 };
 
@@ -224,38 +224,39 @@ QVariant QHiMDTracksModel::data(const QModelIndex & index, int role) const
     if(index.row() >= rowCount())
         return QVariant();
 
-    QHiMDTrack track = hdev->himdTrack(index.row());
+    const struct himd_catalog * cat = hdev->catalog();
+    int row = index.row();
 
     if(role == Qt::CheckStateRole && index.column() == ColUploadable)
-        return track.copyprotected() ? Qt::Unchecked : Qt::Checked;
+        return cat->uploadable[row] ? Qt::Checked : Qt::Unchecked;
 
     if(role == Qt::DisplayRole)
     {
         switch((hcolumnum)index.column())
         {
             case ColId:
-                return index.row() + 1;
+                return row + 1;
             case ColTitle:
-                return track.title();
+                return QString::fromUtf8(cat->title[row]);
             case ColArtist:
-                return track.artist();
+                return QString::fromUtf8(cat->artist[row]);
             case ColAlbum:
-                return track.album();
+                return QString::fromUtf8(cat->album[row]);
             case ColLength:
             {
-                QTime t = track.duration();
+                QTime t = QTime(0,0,0).addSecs(cat->seconds[row]);
                 if(t < QTime(1,0,0))
                     return t.toString("m:ss");
                 else
                     return t.toString("h:mm:ss");
             }
             case ColCodec:
-                return track.codecname();
+                return QString(cat->codecname[row]);
             case ColUploadable:
                 return QVariant(); /* Displayed by checkbox */
             case ColRecDate:
             {
-                QDateTime dt = track.recdate();
+                QDateTime dt = hdev->himdTrack(row).recdate();
                 return dt.toString("yyyy.MM.dd hh:mm:ss");
             }
         }
@@ -1,26 +1,14 @@
 #include "qmdtrack.h"
 
-static QString get_himd_str(struct himd * himd, int idx)
+QHiMDTrack::QHiMDTrack(struct himd * himd, const struct himd_catalog * catalog, unsigned int trackindex)
+    : himd(himd), cat(catalog), trknum(trackindex)
 {
-    QString outstr;
-    char * str;
-    if(!idx)
-        return QString();
-    str = himd_get_string_utf8(himd, idx, NULL, NULL);
-    if(!str)
-        return QString();
-
-    outstr = QString::fromUtf8(str);
-    himd_free(str);
-    return outstr;
-}
-
-QHiMDTrack::QHiMDTrack(struct himd * himd, unsigned int trackindex) : himd(himd), trknum(trackindex)
-{
-    trackslot = himd_get_trackslot(himd, trackindex, NULL);
-    if(trackslot != 0)
-        if(himd_get_track_info(himd, trackslot, &ti, NULL) < 0)
-            trackslot = -1;
+    trackslot = 0;
+    if(cat && trackindex < cat->trackcount)
+    {
+        trackslot = cat->slot[trackindex];
+        ti = cat->info[trackindex];
+    }
 }
 
 QHiMDTrack::~QHiMDTrack()
@@ -36,7 +24,7 @@ unsigned int QHiMDTrack::tracknum() const
 QString QHiMDTrack::title() const
 {
     if(trackslot != 0)
-        return get_himd_str(himd, ti.title);
+        return QString::fromUtf8(cat->title[trknum]);
     else
         return QString();
 }
@@ -44,7 +32,7 @@ QString QHiMDTrack::title() const
 QString QHiMDTrack::artist() const
 {
     if(trackslot != 0)
-        return get_himd_str(himd, ti.artist);
+        return QString::fromUtf8(cat->artist[trknum]);
     else
         return QString();
 }
@@ -52,7 +40,7 @@ QString QHiMDTrack::artist() const
 QString QHiMDTrack::album() const
 {
     if(trackslot != 0)
-        return get_himd_str(himd, ti.album);
+        return QString::fromUtf8(cat->album[trknum]);
     else
         return QString();
 }
@@ -60,7 +48,7 @@ QString QHiMDTrack::album() const
 QString QHiMDTrack::codecname() const
 {
     if(trackslot != 0)
-        return himd_get_codec_name(&ti);
+        return cat->codecname[trknum];
     else
         return QString();
 }
@@ -69,7 +57,7 @@ QTime QHiMDTrack::duration() const
 {
     QTime t(0,0,0);
     if(trackslot != 0)
-        return t.addSecs(ti.seconds);
+        return t.addSecs(cat->seconds[trknum]);
     else
         return QTime();
 }
@@ -94,18 +82,23 @@ QDateTime QHiMDTrack::recdate() const
 bool QHiMDTrack::copyprotected() const
 {
     if(trackslot != 0)
-        return !himd_track_uploadable(himd, &ti);
+        return !cat->uploadable[trknum];
     return true;
 }
 
 int QHiMDTrack::blockcount() const
 {
     if(trackslot != 0)
-        return himd_track_blocks(himd, &ti, NULL);
+        return cat->blocks[trknum];
     else
         return 0;
 }
 
+unsigned int QHiMDTrack::slot() const
+{
+    return trackslot;
+}
+
 QString QHiMDTrack::openMpegStream(struct himd_mp3stream * str) const
 {
     struct himderrinfo status;
@@ -129,6 +122,22 @@ QByteArray QHiMDTrack::makeEA3Header() const
     return QByteArray(header,EA3_FORMAT_HEADER_SIZE);
 }
 
+QByteArray QHiMDTrack::makeID3Tag() const
+{
+    unsigned int len;
+    unsigned char * tag;
+    QByteArray result;
+
+    tag = himd_track_id3v2_tag(himd, &ti, "*** imported from HiMD via QHiMDTransfer ***",
+                               HIMD_ID3V2_PADDING, &len, NULL);
+    if(tag)
+    {
+        result = QByteArray((const char *)tag, len);
+        himd_free(tag);
+    }
+    return result;
+}
+
 
 QNetMDTrack::QNetMDTrack(netmd_dev_handle * deviceh, minidisc * my_md, int trackindex)
 {
@@ -37,11 +37,12 @@ public:
 
 class QHiMDTrack : public QMDTrack{
     struct himd * himd;
+    const struct himd_catalog * cat;
     unsigned int trknum;
     unsigned int trackslot;
     struct trackinfo ti;
 public:
-    QHiMDTrack(struct himd * himd, unsigned int trackindex);
+    QHiMDTrack(struct himd * himd, const struct himd_catalog * catalog, unsigned int trackindex);
     virtual ~QHiMDTrack();
     virtual unsigned int tracknum() const;
     virtual QString title() const;
@@ -52,10 +53,12 @@ public:
     QDateTime recdate() const;
     virtual bool copyprotected() const;
     virtual int blockcount() const;
+    unsigned int slot() const;
 
     QString openMpegStream(struct himd_mp3stream * str) const;
     QString openNonMpegStream(struct himd_nonmp3stream * str) const;
     QByteArray makeEA3Header() const;
+    QByteArray makeID3Tag() const;
 };
 
 class QNetMDTrack : public QMDTrack {
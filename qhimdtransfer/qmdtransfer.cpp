@@ -0,0 +1,100 @@
+#include "qmdtransfer.h"
+
+static int kib(unsigned long long bytes)
+{
+    return (int)(bytes / 1024);
+}
+
+QMDTransfer::QMDTransfer(QHiMDUploadDialog & dialog, QObject * parent)
+    : QObject(parent), dialog(dialog), engine(NULL), current(-1)
+{
+    connect(this, SIGNAL(transferEvent(int, int, int, QString, QString, int, int, int, int)),
+            this, SLOT(handleEvent(int, int, int, QString, QString, int, int, int, int)),
+            Qt::QueuedConnection);
+}
+
+/* called on the sink thread of the engine */
+void QMDTransfer::notify(const mdtransfer::event & e)
+{
+    QString title;
+    int tracknum = 0;
+
+    if(e.track)
+    {
+        tracknum = e.track->index + 1;
+        if(!e.name.empty())
+            title = QString::fromUtf8(e.name.c_str());
+        else if(!e.track->title.empty())
+            title = QString::fromUtf8(e.track->title.c_str());
+        else
+            title = tr("Track %1").arg(tracknum);
+    }
+
+    emit transferEvent(e.type, e.slot, tracknum, title, QString::fromUtf8(e.error.c_str()),
+                       kib(e.track_done), kib(e.track_total), kib(e.all_done), kib(e.all_total));
+}
+
+/* tracks may be read interleaved, the dialog shows the one last heard of */
+void QMDTransfer::selectTrack(int slot, int tracknum, const QString & title, int done, int total)
+{
+    if(current == slot)
+        return;
+    dialog.starttrack(tracknum, title, total, done);
+    current = slot;
+}
+
+void QMDTransfer::handleEvent(int type, int slot, int tracknum, QString title, QString error,
+                              int done, int total, int alldone, int alltotal)
+{
+    switch(type)
+    {
+    case mdtransfer::event::TRACK_STARTED:
+        selectTrack(slot, tracknum, title, done, total);
+        break;
+    case mdtransfer::event::TRACK_PROGRESS:
+        selectTrack(slot, tracknum, title, done, total);
+        dialog.setProgress(done, total, alldone, alltotal);
+        break;
+    case mdtransfer::event::TRACK_DONE:
+        selectTrack(slot, tracknum, title, done, total);
+        dialog.setProgress(done, total, alldone, alltotal);
+        dialog.trackSucceeded();
+        break;
+    case mdtransfer::event::TRACK_FAILED:
+        selectTrack(slot, tracknum, title, done, total);
+        dialog.trackFailed(error);
+        break;
+    case mdtransfer::event::FINISHED:
+        loop.quit();
+        break;
+    }
+}
+
+void QMDTransfer::cancel()
+{
+    if(engine)
+        engine->cancel();
+}
+
+void QMDTransfer::run(mdtransfer::source & src, const QMDTrackIndexList & tlist, const QString & path)
+{
+    std::vector<unsigned int> tracks(tlist.begin(), tlist.end());
+    mdtransfer::directory_sink out(path.toUtf8().constData());
+    mdtransfer::engine eng(src, out, this);
+
+    /* the total is known once the engine has looked at the tracks */
+    dialog.init(tlist.length(), 0);
+    if(tlist.isEmpty())
+        return;
+
+    connect(&dialog, SIGNAL(uploadCanceled()), this, SLOT(cancel()));
+    engine = &eng;
+    current = -1;
+    eng.start(tracks);
+    loop.exec();
+    eng.wait();
+    engine = NULL;
+    disconnect(&dialog, SIGNAL(uploadCanceled()), this, SLOT(cancel()));
+
+    dialog.finished();
+}
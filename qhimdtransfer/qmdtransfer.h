@@ -0,0 +1,40 @@
+#ifndef QMDTRANSFER_H
+#define QMDTRANSFER_H
+
+#include <QObject>
+#include <QEventLoop>
+
+#include "mdtransfer.hpp"
+#include "qmdtrack.h"
+#include "qhimduploaddialog.h"
+
+/* Runs a libmdtransfer engine and shows its progress in the upload
+   dialog. The engine reports on its own threads, the events are queued
+   to the GUI thread, which keeps processing events during the transfer. */
+class QMDTransfer : public QObject, private mdtransfer::observer {
+    Q_OBJECT
+    Q_DISABLE_COPY(QMDTransfer)
+
+    QHiMDUploadDialog & dialog;
+    mdtransfer::engine * engine;
+    QEventLoop loop;
+    int current;
+
+    virtual void notify(const mdtransfer::event & e);
+    void selectTrack(int slot, int tracknum, const QString & title, int done, int total);
+public:
+    explicit QMDTransfer(QHiMDUploadDialog & dialog, QObject * parent = 0);
+    void run(mdtransfer::source & src, const QMDTrackIndexList & tlist, const QString & path);
+
+signals:
+    /* progress values are in KiB */
+    void transferEvent(int type, int slot, int tracknum, QString title, QString error,
+                       int done, int total, int alldone, int alltotal);
+
+private slots:
+    void handleEvent(int type, int slot, int tracknum, QString title, QString error,
+                     int done, int total, int alldone, int alltotal);
+    void cancel();
+};
+
+#endif // QMDTRANSFER_H